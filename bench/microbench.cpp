@@ -0,0 +1,295 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Microbenchmarks for the hot kernels of libpedsim: the agent update
+// (computeNextDesiredPosition, getNextDestination), the SEQ and SIMD
+// tick, move/getNeighbors and each stage of the heatmap. Every kernel
+// runs on synthetic scenarios of fixed sizes and densities, which are
+// fully determined by a fixed seed, so runs can be compared against
+// each other to measure the effect of a change to a single kernel.
+//
+// Results are in nanoseconds per agent, or per pixel for the heatmap
+// stages that work on the whole grid.
+//
+#include "ped_model.h"
+#include "ped_agent.h"
+#include "ped_waypoint.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+	// Keeps the compiler from removing the computation of a value that is
+	// otherwise unused, without adding any instructions
+	template <class T>
+	inline void doNotOptimize(const T &value) {
+		asm volatile("" : : "r,m"(value) : "memory");
+	}
+
+	const size_t SIZES[] = { 1 << 10, 1 << 14, 1 << 18 };
+	const double DENSITIES[] = { 0.25, 0.5, 1.0 };
+	const unsigned int SEED = 42;
+
+	// move() looks at all agents (see getNeighbors), so it only runs on the
+	// smaller scenarios and for a few agents per call
+	const size_t MOVE_MAX_AGENTS = 1 << 14;
+	const size_t MOVE_AGENTS_PER_CALL = 16;
+
+	struct Options {
+		std::string filter;
+		bool csv = false;
+		double minSeconds = 0.2;
+	};
+
+	// Agents on distinct cells of a square, filled with the given density,
+	// walking around waypoints in the corners of the square
+	void makeScenario(size_t numAgents, double density, unsigned int seed,
+		std::vector<Ped::Tagent*> &agents, std::vector<Ped::Twaypoint*> &waypoints) {
+		int side = (int)ceil(sqrt(numAgents / density));
+		waypoints.clear();
+		waypoints.push_back(new Ped::Twaypoint(0, 0, 2));
+		waypoints.push_back(new Ped::Twaypoint(side, 0, 2));
+		waypoints.push_back(new Ped::Twaypoint(side, side, 2));
+		waypoints.push_back(new Ped::Twaypoint(0, side, 2));
+
+		// Selection sampling: visits every cell once and picks exactly
+		// numAgents of them
+		agents.clear();
+		agents.reserve(numAgents);
+		unsigned long long state = seed;
+		size_t cells = (size_t)side * side;
+		for (size_t cell = 0; cell < cells && agents.size() < numAgents; cell++) {
+			state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+			double r = (state >> 11) * (1.0 / 9007199254740992.0);
+			if (r * (cells - cell) < numAgents - agents.size()) {
+				Ped::Tagent *agent = new Ped::Tagent((int)(cell % side), (int)(cell / side));
+				size_t first = state >> 62;
+				for (size_t w = 0; w < waypoints.size(); w++) {
+					agent->addWaypoint(waypoints[(first + w) % waypoints.size()]);
+				}
+				agents.push_back(agent);
+			}
+		}
+	}
+
+	// Runs the kernel until minSeconds have passed, five times, and returns
+	// the median time per call in nanoseconds
+	template <class Kernel>
+	double nsPerCall(const Options &options, Kernel kernel) {
+		kernel(); // warmup
+		std::vector<double> samples;
+		for (int rep = 0; rep < 5; rep++) {
+			long calls = 0;
+			auto start = std::chrono::steady_clock::now();
+			double elapsed = 0;
+			do {
+				kernel();
+				calls++;
+				elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			} while (elapsed < options.minSeconds / 5);
+			samples.push_back(elapsed * 1e9 / calls);
+		}
+		std::sort(samples.begin(), samples.end());
+		return samples[samples.size() / 2];
+	}
+
+	bool selected(const Options &options, const char *kernel) {
+		return options.filter.empty() || strstr(kernel, options.filter.c_str()) != NULL;
+	}
+
+	void report(const Options &options, const char *kernel, size_t agents, double density, double nsPerUnit, const char *unit) {
+		if (options.csv) {
+			printf("%s,%zu,%g,%g,%s\n", kernel, agents, density, nsPerUnit, unit);
+		}
+		else {
+			printf("%-36s %10zu %8g %12.3f ns/%s\n", kernel, agents, density, nsPerUnit, unit);
+		}
+		fflush(stdout);
+	}
+
+	void benchAgents(const Options &options, size_t numAgents, double density) {
+		std::vector<Ped::Tagent*> agents;
+		std::vector<Ped::Twaypoint*> waypoints;
+		makeScenario(numAgents, density, SEED, agents, waypoints);
+
+		if (selected(options, "agent.computeNextDesiredPosition")) {
+			double ns = nsPerCall(options, [&]() {
+				for (Ped::Tagent *agent : agents) {
+					agent->computeNextDesiredPosition();
+				}
+				doNotOptimize(agents.back()->getDesiredX());
+			});
+			report(options, "agent.computeNextDesiredPosition", numAgents, density, ns / numAgents, "agent");
+		}
+		if (selected(options, "agent.getNextDestination")) {
+			double ns = nsPerCall(options, [&]() {
+				for (Ped::Tagent *agent : agents) {
+					doNotOptimize(agent->getNextDestination());
+				}
+			});
+			report(options, "agent.getNextDestination", numAgents, density, ns / numAgents, "agent");
+		}
+
+		for (auto a : agents) delete a;
+		for (auto w : waypoints) delete w;
+	}
+
+	void benchModel(const Options &options, size_t numAgents, double density, Ped::IMPLEMENTATION implementation, const char *kernel,
+		bool flowFields = false) {
+		if (!selected(options, kernel)) return;
+		std::vector<Ped::Tagent*> agents;
+		std::vector<Ped::Twaypoint*> waypoints;
+		makeScenario(numAgents, density, SEED, agents, waypoints);
+		Ped::Model model;
+		model.setFlowFields(flowFields);
+		model.setup(agents, waypoints, implementation);
+
+		double ns = nsPerCall(options, [&]() {
+			model.tick();
+			doNotOptimize(model.getAgents().back()->getX());
+		});
+		report(options, kernel, numAgents, density, ns / numAgents, "agent");
+	}
+
+	void benchMove(const Options &options, size_t numAgents, double density) {
+		if (numAgents > MOVE_MAX_AGENTS) return;
+		std::vector<Ped::Tagent*> agents;
+		std::vector<Ped::Twaypoint*> waypoints;
+		makeScenario(numAgents, density, SEED, agents, waypoints);
+		Ped::Model model;
+		model.setup(agents, waypoints, Ped::SEQ);
+		// setup() moves the agents into the model's arena
+		agents = model.getAgents();
+		for (Ped::Tagent *agent : agents) {
+			agent->computeNextDesiredPosition();
+		}
+
+		if (selected(options, "model.getNeighbors")) {
+			size_t next = 0;
+			double ns = nsPerCall(options, [&]() {
+				const Ped::Tagent *agent = agents[next++ % agents.size()];
+				doNotOptimize(model.getNeighbors(agent->getX(), agent->getY(), 2).size());
+			});
+			report(options, "model.getNeighbors", numAgents, density, ns, "call");
+		}
+		if (selected(options, "model.move")) {
+			size_t next = 0;
+			double ns = nsPerCall(options, [&]() {
+				for (size_t i = 0; i < MOVE_AGENTS_PER_CALL; i++) {
+					model.move(agents[next++ % agents.size()]);
+				}
+				doNotOptimize(agents[next % agents.size()]->getX());
+			});
+			report(options, "model.move", numAgents, density, ns / MOVE_AGENTS_PER_CALL, "agent");
+		}
+	}
+
+	void benchHeatmap(const Options &options, size_t numAgents, double density, bool gridStages) {
+		std::vector<Ped::Tagent*> agents;
+		std::vector<Ped::Twaypoint*> waypoints;
+		makeScenario(numAgents, density, SEED, agents, waypoints);
+		Ped::Model model;
+		model.setup(agents, waypoints, Ped::SEQ);
+		// setup() moves the agents into the model's arena
+		agents = model.getAgents();
+		for (Ped::Tagent *agent : agents) {
+			agent->computeNextDesiredPosition();
+		}
+		int const * const * heatmap = model.getHeatmap();
+
+		if (selected(options, "heatmap.scatter")) {
+			long calls = 0;
+			double ns = nsPerCall(options, [&]() {
+				model.scatterHeatmap();
+				// Keeps the counts from overflowing, rarely enough not to matter
+				if (++calls % (1 << 20) == 0) model.clampHeatmap();
+			});
+			report(options, "heatmap.scatter", numAgents, density, ns / numAgents, "agent");
+		}
+		if (!gridStages) return;
+
+		// The other stages don't depend on the agents
+		const double pixels = SIZE * SIZE;
+		const double scaledPixels = (double)SCALED_SIZE * SCALED_SIZE;
+		if (selected(options, "heatmap.fade")) {
+			double ns = nsPerCall(options, [&]() { model.fadeHeatmap(); });
+			report(options, "heatmap.fade", 0, 0, ns / pixels, "pixel");
+		}
+		if (selected(options, "heatmap.clamp")) {
+			double ns = nsPerCall(options, [&]() { model.clampHeatmap(); });
+			report(options, "heatmap.clamp", 0, 0, ns / pixels, "pixel");
+		}
+		if (selected(options, "heatmap.scale")) {
+			double ns = nsPerCall(options, [&]() { model.scaleHeatmap(); });
+			report(options, "heatmap.scale", 0, 0, ns / scaledPixels, "pixel");
+		}
+		if (selected(options, "heatmap.blur")) {
+			double ns = nsPerCall(options, [&]() {
+				model.blurHeatmap();
+				doNotOptimize(heatmap[SCALED_SIZE / 2][SCALED_SIZE / 2]);
+			});
+			report(options, "heatmap.blur", 0, 0, ns / scaledPixels, "pixel");
+		}
+		if (selected(options, "heatmap.update")) {
+			double ns = nsPerCall(options, [&]() { model.updateHeatmapSeq(); });
+			report(options, "heatmap.update", numAgents, density, ns / scaledPixels, "pixel");
+		}
+	}
+
+	void printUsage(const char *command) {
+		printf("Usage: %s [--filter=kernel] [--csv] [--min-time=0.2]\n", command);
+		printf("Runs the microbenchmarks whose name contains the filter (default: all), each for about --min-time seconds per input.\n");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	Options options;
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--filter=", 9) == 0) {
+			options.filter = argv[i] + 9;
+		}
+		else if (strcmp(argv[i], "--csv") == 0) {
+			options.csv = true;
+		}
+		else if (strncmp(argv[i], "--min-time=", 11) == 0) {
+			options.minSeconds = atof(argv[i] + 11);
+		}
+		else {
+			printUsage(argv[0]);
+			return strcmp(argv[i], "--help") == 0 ? 0 : 1;
+		}
+	}
+
+	// Model::setup reports on CUDA, which would mix with the results
+	std::cout.setstate(std::ios::failbit);
+
+	if (options.csv) {
+		printf("kernel,agents,density,ns,unit\n");
+	}
+	else {
+		printf("%-36s %10s %8s %15s\n", "kernel", "agents", "density", "time");
+	}
+
+	bool gridStages = true;
+	for (size_t numAgents : SIZES) {
+		for (double density : DENSITIES) {
+			benchAgents(options, numAgents, density);
+			benchModel(options, numAgents, density, Ped::SEQ, "model.tick.seq");
+			benchModel(options, numAgents, density, Ped::SEQ, "model.tick.seq.flowfields", true);
+			benchModel(options, numAgents, density, Ped::VECTOR, "model.tick.simd");
+			benchModel(options, numAgents, density, Ped::HYBRID, "model.tick.hybrid");
+			benchModel(options, numAgents, density, Ped::PSTL, "model.tick.pstl");
+			benchMove(options, numAgents, density);
+			benchHeatmap(options, numAgents, density, gridStages);
+			gridStages = false;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,401 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the benchmark harness.
+//
+#include "Benchmark.h"
+#include "BenchmarkSimulation.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <map>
+
+namespace {
+	double mean(const std::vector<double> &values) {
+		double sum = 0;
+		for (double v : values) sum += v;
+		return values.empty() ? 0 : sum / values.size();
+	}
+
+	double stddev(const std::vector<double> &values) {
+		if (values.size() < 2) return 0;
+		double m = mean(values), sum = 0;
+		for (double v : values) sum += (v - m) * (v - m);
+		return sqrt(sum / (values.size() - 1));
+	}
+
+	// Size of a cache line; every last level cache miss moves one from memory
+	const double CACHE_LINE_BYTES = 64;
+
+	// Metrics derived from the counter values of one phase
+	struct Derived {
+		double ipc = -1;
+		double bytesPerAgentTick = -1;
+		double gigabytesPerSecond = -1;
+		double instructionsPerByte = -1;
+		const char *bound = "-";
+	};
+
+	Derived derive(const PerfCounters::Values &v, size_t agents, int ticks) {
+		Derived d;
+		int64_t cycles = v.counts[PerfCounters::CYCLES];
+		int64_t instructions = v.counts[PerfCounters::INSTRUCTIONS];
+		int64_t llcMisses = v.counts[PerfCounters::LLC_MISSES];
+		if (cycles > 0 && instructions >= 0) {
+			d.ipc = (double)instructions / cycles;
+		}
+		if (llcMisses >= 0 && agents > 0 && ticks > 0) {
+			double bytes = llcMisses * CACHE_LINE_BYTES;
+			d.bytesPerAgentTick = bytes / agents / ticks;
+			if (v.seconds > 0) d.gigabytesPerSecond = bytes / v.seconds / 1e9;
+			if (bytes > 0 && instructions >= 0) d.instructionsPerByte = instructions / bytes;
+		}
+		// A rough classification: many misses per instruction means the
+		// phase waits for memory bandwidth, a low IPC without them means
+		// it waits for latency (dependencies, branches, L1/L2, TLB)
+		if (d.ipc >= 0 && llcMisses >= 0 && instructions > 0) {
+			double llcMissesPerKiloInstruction = 1000.0 * llcMisses / instructions;
+			d.bound = llcMissesPerKiloInstruction >= 5 ? "bandwidth" : d.ipc < 1 ? "latency" : "compute";
+		}
+		return d;
+	}
+
+	// Count divided by agents and ticks, or -1 if the event is not available
+	double perAgentTick(int64_t count, size_t agents, int ticks) {
+		return count >= 0 && agents > 0 && ticks > 0 ? (double)count / agents / ticks : -1;
+	}
+
+	// Parses a whole field as a number, returns false if it is empty or
+	// has anything else in it
+	bool parseNumber(const std::string &field, double &value) {
+		const char *begin = field.c_str();
+		char *end;
+		value = strtod(begin, &end);
+		return end != begin && *end == '\0';
+	}
+
+	// The string as the contents of a JSON string literal
+	std::string escapeJson(const std::string &text) {
+		std::string escaped;
+		for (char c : text) {
+			switch (c) {
+				case '"': escaped += "\\\""; break;
+				case '\\': escaped += "\\\\"; break;
+				case '\n': escaped += "\\n"; break;
+				case '\r': escaped += "\\r"; break;
+				case '\t': escaped += "\\t"; break;
+				default:
+					if ((unsigned char)c < 0x20) {
+						char code[8];
+						snprintf(code, sizeof(code), "\\u%04x", (unsigned char)c);
+						escaped += code;
+					}
+					else {
+						escaped += c;
+					}
+			}
+		}
+		return escaped;
+	}
+
+	std::vector<std::string> splitCsvLine(const std::string &line) {
+		std::vector<std::string> fields;
+		std::stringstream ss(line);
+		std::string field;
+		while (std::getline(ss, field, ',')) {
+			fields.push_back(field);
+		}
+		return fields;
+	}
+}
+
+Benchmark::Benchmark(const ScenarioSnapshot &scenario_, const Config &config_) : scenario(scenario_), config(config_)
+{
+}
+
+bool Benchmark::run()
+{
+	results.clear();
+	for (Ped::IMPLEMENTATION implementation : config.implementations) {
+		results.push_back(Result());
+		results.back().implementation = implementation;
+		runImplementation(results.back());
+	}
+
+	printSummary();
+	printScheduler();
+	if (config.perfCounters) {
+		printCounters();
+	}
+	if (!config.outputPrefix.empty()) {
+		if (!writeJson(config.outputPrefix + ".json") || !writeCsv(config.outputPrefix + ".csv")) {
+			std::cerr << "Error writing benchmark results to " << config.outputPrefix << ".{json,csv}" << std::endl;
+		}
+	}
+	if (!config.baselineFile.empty()) {
+		return compareWithBaseline();
+	}
+	return true;
+}
+
+void Benchmark::setupModel(Ped::Model &model, Ped::IMPLEMENTATION implementation) const
+{
+	model.setOptions(config.modelOptions);
+	model.setObstacles(scenario.getObstacles());
+	model.setSources(scenario.getSources());
+	model.setSinks(scenario.getSinks());
+	model.setup(scenario.getArrays(), implementation);
+}
+
+void Benchmark::runImplementation(Result &result)
+{
+	std::cout << "Benchmarking " << Ped::getImplementationName(result.implementation) << ": " << config.repetitions << " x ("
+		<< config.warmupSteps << " warmup + " << config.measuredSteps << " measured ticks)" << std::endl;
+
+	for (int rep = 0; rep < config.repetitions; rep++) {
+		// Every repetition starts from a fresh copy of the same scenario
+		Ped::Model model;
+		setupModel(model, result.implementation);
+
+		LatencyHistogram histogram;
+		BenchmarkSimulation simulation(model, config.measuredSteps, config.warmupSteps, histogram);
+		simulation.runSimulation();
+
+		result.histogram.merge(histogram);
+		result.ticksPerSecond.push_back(simulation.getTickCount() / simulation.getMeasuredSeconds());
+		result.stealsPerTick.push_back((double)model.getScheduler().getTotalSteals() / simulation.getTickCount());
+		result.idleFraction.push_back(model.getScheduler().getIdleFraction());
+	}
+
+	if (config.perfCounters) {
+		measureCounters(result);
+	}
+}
+
+void Benchmark::measureCounters(Result &result)
+{
+	Ped::Model model;
+	setupModel(model, result.implementation);
+	for (int i = 0; i < config.warmupSteps; i++) {
+		model.tick();
+	}
+
+	// Opened after the warmup, so that the worker threads of OpenMP exist
+	PerfCounters counters;
+	if (!counters.isAvailable()) {
+		result.countersError = counters.getError();
+		return;
+	}
+	model.setPhaseListener(&counters);
+	for (int i = 0; i < config.measuredSteps; i++) {
+		model.tick();
+	}
+	model.setPhaseListener(nullptr);
+	const std::map<std::string, PerfCounters::Values> &phases = counters.getPhases();
+	for (const char *stage : model.getPipeline().getStageNames()) {
+		auto phase = phases.find(stage);
+		if (phase != phases.end()) {
+			result.phases.push_back(*phase);
+		}
+	}
+}
+
+double Benchmark::speedup(const Result &result) const
+{
+	for (const Result &r : results) {
+		if (r.implementation == Ped::SEQ && result.histogram.getMean() > 0) {
+			return r.histogram.getMean() / result.histogram.getMean();
+		}
+	}
+	return 0;
+}
+
+void Benchmark::printSummary() const
+{
+	printf("\n%-10s %12s %12s %12s %12s %12s %14s %9s\n", "impl", "mean [us]", "stddev [us]", "p50 [us]", "p99 [us]", "max [us]", "ticks/s", "speedup");
+	for (const Result &r : results) {
+		const LatencyHistogram &h = r.histogram;
+		printf("%-10s %12.1f %12.1f %12.1f %12.1f %12.1f %8.1f +-%4.1f %9.2f\n", Ped::getImplementationName(r.implementation),
+			h.getMean() / 1e3, h.getStddev() / 1e3, h.getPercentile(0.5) / 1e3, h.getPercentile(0.99) / 1e3, h.getMax() / 1e3,
+			mean(r.ticksPerSecond), stddev(r.ticksPerSecond), speedup(r));
+	}
+	printf("\n");
+}
+
+void Benchmark::printScheduler() const
+{
+	printf("Work stealing scheduler (PTHREAD agents, heatmap stages, export):\n");
+	printf("%-10s %14s %10s\n", "impl", "steals/tick", "idle [%]");
+	for (const Result &r : results) {
+		printf("%-10s %14.1f %10.1f\n", Ped::getImplementationName(r.implementation), mean(r.stealsPerTick), 100 * mean(r.idleFraction));
+	}
+	printf("\n");
+}
+
+void Benchmark::printCounters() const
+{
+	size_t agents = scenario.getNumAgents();
+	int ticks = config.measuredSteps;
+	printf("Hardware counters per agent and tick, per stage of the pipeline (bytes: LLC misses x %.0f):\n", CACHE_LINE_BYTES);
+	printf("%-10s %-16s %8s %8s %10s %10s %10s %10s %10s %8s %11s %10s\n", "impl", "stage", "IPC", "cycles", "L1D miss", "LLC miss",
+		"br miss", "dTLB miss", "bytes", "GB/s", "instr/byte", "bound");
+	for (const Result &r : results) {
+		const char *name = Ped::getImplementationName(r.implementation);
+		if (!r.countersError.empty()) {
+			printf("%-10s not available: %s\n", name, r.countersError.c_str());
+			continue;
+		}
+		for (const auto &phase : r.phases) {
+			const PerfCounters::Values &v = phase.second;
+			Derived d = derive(v, agents, ticks);
+			printf("%-10s %-16s %8.2f %8.1f %10.3f %10.3f %10.3f %10.3f %10.1f %8.2f %11.2f %10s\n", name, phase.first.c_str(), d.ipc,
+				perAgentTick(v.counts[PerfCounters::CYCLES], agents, ticks), perAgentTick(v.counts[PerfCounters::L1D_MISSES], agents, ticks),
+				perAgentTick(v.counts[PerfCounters::LLC_MISSES], agents, ticks), perAgentTick(v.counts[PerfCounters::BRANCH_MISSES], agents, ticks),
+				perAgentTick(v.counts[PerfCounters::DTLB_MISSES], agents, ticks), d.bytesPerAgentTick, d.gigabytesPerSecond,
+				d.instructionsPerByte, d.bound);
+		}
+	}
+	printf("(-1: event not available)\n\n");
+}
+
+bool Benchmark::writeJson(const std::string &filename) const
+{
+	std::ofstream file(filename.c_str());
+	file << "{\n";
+	file << "  \"scenario\": \"" << escapeJson(config.scenarioName) << "\",\n";
+	file << "  \"agents\": " << scenario.getNumAgents() << ",\n";
+	file << "  \"warmup_ticks\": " << config.warmupSteps << ",\n";
+	file << "  \"measured_ticks\": " << config.measuredSteps << ",\n";
+	file << "  \"repetitions\": " << config.repetitions << ",\n";
+	file << "  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result &r = results[i];
+		const LatencyHistogram &h = r.histogram;
+		file << "    {\"implementation\": \"" << escapeJson(Ped::getImplementationName(r.implementation)) << "\""
+			<< ", \"ticks\": " << h.getCount()
+			<< ", \"mean_ns\": " << h.getMean()
+			<< ", \"stddev_ns\": " << h.getStddev()
+			<< ", \"min_ns\": " << h.getMin()
+			<< ", \"p50_ns\": " << h.getPercentile(0.5)
+			<< ", \"p90_ns\": " << h.getPercentile(0.9)
+			<< ", \"p99_ns\": " << h.getPercentile(0.99)
+			<< ", \"max_ns\": " << h.getMax()
+			<< ", \"ticks_per_second\": " << mean(r.ticksPerSecond)
+			<< ", \"ticks_per_second_stddev\": " << stddev(r.ticksPerSecond)
+			<< ", \"speedup\": " << speedup(r)
+			<< ", \"steals_per_tick\": " << mean(r.stealsPerTick)
+			<< ", \"idle_fraction\": " << mean(r.idleFraction);
+		if (config.perfCounters) {
+			writeJsonCounters(file, r);
+		}
+		file << "}"
+			<< (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	file << "  ]\n";
+	file << "}\n";
+	return (bool)file;
+}
+
+void Benchmark::writeJsonCounters(std::ostream &file, const Result &r) const
+{
+	if (!r.countersError.empty()) {
+		file << ", \"counters_error\": \"" << escapeJson(r.countersError) << "\"";
+		return;
+	}
+	file << ", \"counters\": {";
+	bool first = true;
+	for (const auto &phase : r.phases) {
+		const PerfCounters::Values &v = phase.second;
+		Derived d = derive(v, scenario.getNumAgents(), config.measuredSteps);
+		file << (first ? "" : ", ") << "\"" << escapeJson(phase.first) << "\": {\"seconds\": " << v.seconds;
+		for (int e = 0; e < PerfCounters::NUM_EVENTS; e++) {
+			file << ", \"" << escapeJson(PerfCounters::getEventName((PerfCounters::Event)e)) << "\": " << v.counts[e];
+		}
+		file << ", \"ipc\": " << d.ipc
+			<< ", \"bytes_per_agent_tick\": " << d.bytesPerAgentTick
+			<< ", \"gb_per_second\": " << d.gigabytesPerSecond
+			<< ", \"instructions_per_byte\": " << d.instructionsPerByte
+			<< ", \"bound\": \"" << escapeJson(d.bound) << "\"}";
+		first = false;
+	}
+	file << "}";
+}
+
+bool Benchmark::writeCsv(const std::string &filename) const
+{
+	std::ofstream file(filename.c_str());
+	file << "implementation,agents,ticks,mean_ns,stddev_ns,min_ns,p50_ns,p90_ns,p99_ns,max_ns,ticks_per_second,ticks_per_second_stddev,speedup\n";
+	for (const Result &r : results) {
+		const LatencyHistogram &h = r.histogram;
+		file << Ped::getImplementationName(r.implementation) << "," << scenario.getNumAgents() << "," << h.getCount() << ","
+			<< h.getMean() << "," << h.getStddev() << "," << h.getMin() << "," << h.getPercentile(0.5) << ","
+			<< h.getPercentile(0.9) << "," << h.getPercentile(0.99) << "," << h.getMax() << ","
+			<< mean(r.ticksPerSecond) << "," << stddev(r.ticksPerSecond) << "," << speedup(r) << "\n";
+	}
+	return (bool)file;
+}
+
+bool Benchmark::compareWithBaseline() const
+{
+	std::ifstream file(config.baselineFile.c_str());
+	std::string line;
+	if (!file || !std::getline(file, line)) {
+		std::cerr << "Error reading baseline " << config.baselineFile << std::endl;
+		return false;
+	}
+
+	// Look up the columns by name, so older baselines with fewer columns still work
+	std::vector<std::string> columns = splitCsvLine(line);
+	int implColumn = -1, p50Column = -1, agentsColumn = -1;
+	for (size_t c = 0; c < columns.size(); c++) {
+		if (columns[c] == "implementation") implColumn = c;
+		if (columns[c] == "p50_ns") p50Column = c;
+		if (columns[c] == "agents") agentsColumn = c;
+	}
+	if (implColumn < 0 || p50Column < 0) {
+		std::cerr << "Baseline " << config.baselineFile << " has no implementation/p50_ns columns" << std::endl;
+		return false;
+	}
+	std::map<std::string, double> baseline;
+	for (int row = 2; std::getline(file, line); row++) {
+		std::vector<std::string> fields = splitCsvLine(line);
+		if ((int)fields.size() <= std::max(implColumn, p50Column)) {
+			continue;
+		}
+		double p50, agents;
+		if (!parseNumber(fields[p50Column], p50)) {
+			std::cerr << "Baseline " << config.baselineFile << ", line " << row << ": invalid p50_ns \"" << fields[p50Column] << "\", skipped" << std::endl;
+			continue;
+		}
+		// Older baselines have no agents column; rows of another scenario
+		// cannot be compared
+		if (agentsColumn >= 0 && (int)fields.size() > agentsColumn) {
+			if (!parseNumber(fields[agentsColumn], agents) || agents != (double)scenario.getNumAgents()) {
+				std::cerr << "Baseline " << config.baselineFile << ", line " << row << ": " << fields[agentsColumn]
+					<< " agents instead of " << scenario.getNumAgents() << ", skipped" << std::endl;
+				continue;
+			}
+		}
+		baseline[fields[implColumn]] = p50;
+	}
+
+	bool ok = true;
+	std::cout << "Comparison with baseline " << config.baselineFile << " (p50 tick latency, threshold " << config.regressionThreshold << "%):" << std::endl;
+	for (const Result &r : results) {
+		const char *name = Ped::getImplementationName(r.implementation);
+		auto it = baseline.find(name);
+		if (it == baseline.end() || it->second <= 0) {
+			printf("  %-10s not in baseline\n", name);
+			continue;
+		}
+		double change = 100.0 * (r.histogram.getPercentile(0.5) - it->second) / it->second;
+		bool regression = change > config.regressionThreshold;
+		printf("  %-10s %+7.1f%% %s\n", name, change, regression ? "REGRESSION" : "ok");
+		ok = ok && !regression;
+	}
+	return ok;
+}
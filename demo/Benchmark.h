@@ -0,0 +1,102 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Benchmark runs a set of implementations on the same scenario, each
+// for a number of repetitions with warmup ticks in front, and records
+// the latency of every tick. The results are printed, written as JSON
+// and CSV, and can be compared against a baseline CSV file from an
+// earlier run to spot performance regressions.
+//
+// With perfCounters set, one extra repetition per implementation reads
+// the hardware performance counters around each stage of the tick
+// pipeline (desired, move, heatmap.blur, ...), which run one after the
+// other then (so this does not disturb the latency numbers), and
+// derives IPC, the memory traffic per agent and the achieved bandwidth.
+//
+
+#ifndef _benchmark_h_
+#define _benchmark_h_
+
+#include "ped_model.h"
+#include "ScenarioSnapshot.h"
+#include "LatencyHistogram.h"
+#include "PerfCounters.h"
+
+#include <vector>
+#include <string>
+#include <map>
+#include <iosfwd>
+
+class Benchmark
+{
+public:
+	struct Config {
+		std::vector<Ped::IMPLEMENTATION> implementations;
+		int warmupSteps = 10;
+		int measuredSteps = 100;
+		int repetitions = 5;
+
+		// Threads, pinning, huge pages, heatmap, collisions etc. of every
+		// model; with an empty tuning cache, the auto implementation
+		// calibrates in every repetition
+		Ped::ModelOptions modelOptions;
+
+		// Results are written to <outputPrefix>.json and <outputPrefix>.csv
+		std::string outputPrefix;
+
+		// CSV file of an earlier run; a p50 tick latency more than
+		// regressionThreshold percent above it counts as a regression
+		std::string baselineFile;
+		double regressionThreshold = 5.0;
+
+		// Read hardware performance counters in an extra repetition
+		bool perfCounters = false;
+
+		// Only used to label the output
+		std::string scenarioName;
+	};
+
+	Benchmark(const ScenarioSnapshot &scenario, const Config &config);
+
+	// Runs all implementations. Returns false if a regression against
+	// the baseline was found.
+	bool run();
+
+private:
+	struct Result {
+		Ped::IMPLEMENTATION implementation;
+		LatencyHistogram histogram;
+		std::vector<double> ticksPerSecond; // one entry per repetition
+
+		// Of the work stealing scheduler, one entry per repetition
+		std::vector<double> stealsPerTick;
+		std::vector<double> idleFraction;
+
+		// Counter values per stage, in the order of the pipeline, or why
+		// there are none
+		std::vector<std::pair<std::string, PerfCounters::Values> > phases;
+		std::string countersError;
+	};
+
+	const ScenarioSnapshot &scenario;
+	Config config;
+	std::vector<Result> results;
+
+	// Sets up the model with the options and a fresh copy of the scenario
+	void setupModel(Ped::Model &model, Ped::IMPLEMENTATION implementation) const;
+
+	void runImplementation(Result &result);
+	void measureCounters(Result &result);
+	void printSummary() const;
+	void printScheduler() const;
+	void printCounters() const;
+	bool writeJson(const std::string &filename) const;
+	void writeJsonCounters(std::ostream &file, const Result &result) const;
+	bool writeCsv(const std::string &filename) const;
+	bool compareWithBaseline() const;
+
+	// Mean tick latency of SEQ divided by the one of the result (0 without SEQ)
+	double speedup(const Result &result) const;
+};
+
+#endif
@@ -0,0 +1,29 @@
+#include "BenchmarkSimulation.h"
+
+#include <chrono>
+
+using namespace std;
+
+BenchmarkSimulation::BenchmarkSimulation(Ped::Model &model_, int maxSteps, int warmupSteps_, LatencyHistogram &histogram_)
+    : Simulation(model_, maxSteps), warmupSteps(warmupSteps_), histogram(histogram_)
+{
+}
+
+void BenchmarkSimulation::runSimulation()
+{
+    for (int i = 0; i < warmupSteps; i++) {
+        model.tick();
+    }
+    model.getScheduler().resetStats();
+
+    auto start = std::chrono::steady_clock::now();
+    auto last = start;
+    for (int i = 0; i < maxSimulationSteps; i++) {
+        tickCounter++;
+        model.tick();
+        auto now = std::chrono::steady_clock::now();
+        histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count());
+        last = now;
+    }
+    measuredSeconds = std::chrono::duration<double>(last - start).count();
+}
@@ -0,0 +1,25 @@
+#ifndef _benchmark_simulation_h_
+#define _benchmark_simulation_h_
+
+#include "Simulation.h"
+#include "LatencyHistogram.h"
+
+// Runs the model without any output, like TimingSimulation, but first
+// runs a number of warmup ticks and records the latency of every tick.
+// The counters of the scheduler of the model only cover measured ticks.
+class BenchmarkSimulation : public Simulation {
+    public:
+        BenchmarkSimulation(Ped::Model &model, int maxSteps, int warmupSteps, LatencyHistogram &histogram);
+        BenchmarkSimulation() = delete;
+        ~BenchmarkSimulation() {};
+
+        void runSimulation();
+
+        // Wall clock time of the measured (non-warmup) ticks
+        double getMeasuredSeconds() const { return measuredSeconds; }
+    protected:
+        int warmupSteps;
+        LatencyHistogram &histogram;
+        double measuredSeconds = 0;
+};
+#endif
@@ -1,60 +1,145 @@
 #include "ExportSimulation.h"
+#include "ped_trace.h"
 
 #include <cstdint> // for int16_t and int32_t
 
 using namespace std;
 
+const int16_t ExportSimulation::MISSING;
+
 ExportSimulation::ExportSimulation(Ped::Model &model_, int maxSteps,
-        std::string outputFilename_) : Simulation(model_, maxSteps), outputFilename(outputFilename_)
+        std::string outputFilename_) : Simulation(model_, maxSteps), outputFilename(outputFilename_), firstTick(tickCounter)
 {
     file = std::ofstream(outputFilename.c_str(), std::ios::binary);
     file.write(reinterpret_cast<const char*>(&maxSimulationSteps), sizeof(maxSimulationSteps));
+
+    for (Frame &frame : frames) {
+        frame.alpha.resize(HEATMAP_HEIGHT * HEATMAP_WIDTH);
+    }
+
+    // The frame is sized once the agents of the tick were added and removed
+    Ped::TickPipeline &pipeline = model.getPipeline();
+    pipeline.addSerialStage("export.frame", [this](int) { prepareFrame(); });
+    pipeline.addStage("export.agents", [this]() { return model.getAgents().size(); },
+        [this](size_t begin, size_t end, int) { packAgents(begin, end); },
+        { { "move", Ped::TickPipeline::SAME_BLOCK }, { "export.frame", Ped::TickPipeline::ALL_BLOCKS } });
+
+    // Without the heatmap stages, the heatmap stays as it is
+    std::vector<Ped::TickPipeline::Input> heatmapInputs;
+    if (pipeline.hasStage("heatmap.blur")) {
+        heatmapInputs.push_back({ "heatmap.blur", Ped::TickPipeline::SAME_BLOCK });
+    }
+    pipeline.addStage("export.heatmap", [this]() { return (size_t)model.getHeatmapSize(); },
+        [this](size_t begin, size_t end, int) { packHeatmap(begin, end); },
+        heatmapInputs);
 }
 
 ExportSimulation::~ExportSimulation() {
+    if (writer.joinable()) {
+        writer.join();
+    }
+    model.getPipeline().removeStage("export.agents");
+    model.getPipeline().removeStage("export.frame");
+    model.getPipeline().removeStage("export.heatmap");
+
+    // A resumed simulation only contains the frames after the checkpoint
+    int frames = tickCounter - firstTick;
     file.seekp(0, std::ios::beg);
-    file.write(reinterpret_cast<const char*>(&tickCounter), sizeof(tickCounter));
+    file.write(reinterpret_cast<const char*>(&frames), sizeof(frames));
     file.close();
 }
 
-void ExportSimulation::serialize()
+void ExportSimulation::prepareFrame()
+{
+    Frame &frame = frames[packing];
+    size_t ids = model.getAgentIdCount();
+    frame.sparse = model.getLiveAgentCount() != ids;
+    if (frame.sparse) {
+        frame.positions.assign(2 * ids, MISSING);
+    }
+    else {
+        frame.positions.resize(2 * ids);
+    }
+}
+
+void ExportSimulation::packAgents(size_t begin, size_t end)
 {
+    // Each agent goes to its place in the scenario, which stays the same
+    // when the model reorders the agents
     const std::vector<Ped::Tagent*>& agents = model.getAgents();
-    size_t num_agents = agents.size();
-    file.write(reinterpret_cast<const char*>(&num_agents), sizeof(num_agents));
+    const std::vector<size_t>& ids = model.getAgentIds();
+    std::vector<int16_t> &positions = frames[packing].positions;
+    for (size_t i = begin; i < end; i++) {
+        if (ids[i] == Ped::Model::NO_AGENT) {
+            continue;
+        }
+        positions[2 * ids[i]] = static_cast<int16_t>(agents[i]->getX());
+        positions[2 * ids[i] + 1] = static_cast<int16_t>(agents[i]->getY());
+    }
+}
 
-    for (const auto &agent : agents) {
-        int16_t x = static_cast<int16_t>(agent->getX());
-        int16_t y = static_cast<int16_t>(agent->getY());
+// The rows [begin, end) of the heatmap, those of the export are packed
+void ExportSimulation::packHeatmap(size_t begin, size_t end)
+{
+    const int* const* heatmap = model.getHeatmap();
+    std::vector<int8_t> &alpha = frames[packing].alpha;
+    for (size_t i = begin; i < end && i < HEATMAP_HEIGHT; i++) {
+        for (int j = 0; j < HEATMAP_WIDTH; j++) {
+            int ARGBvalue = heatmap[i][j];
+            alpha[i * HEATMAP_WIDTH + j] = (ARGBvalue >> 24) & ((1 << 8)-1);
+        }
+    }
+}
+
+void ExportSimulation::writeFrame(const Frame &frame)
+{
+    PED_TRACE_SCOPE("serialize.write");
 
-        file.write(reinterpret_cast<const char *>(&x), sizeof(x));
-        file.write(reinterpret_cast<const char *>(&y), sizeof(y));
+    const std::vector<int16_t> *positions = &frame.positions;
+    std::vector<int16_t> live;
+    if (frame.sparse) {
+        for (size_t k = 0; k < frame.positions.size(); k += 2) {
+            if (frame.positions[k] != MISSING || frame.positions[k + 1] != MISSING) {
+                live.push_back(frame.positions[k]);
+                live.push_back(frame.positions[k + 1]);
+            }
+        }
+        positions = &live;
     }
+    size_t num_agents = positions->size() / 2;
+    file.write(reinterpret_cast<const char*>(&num_agents), sizeof(num_agents));
+    file.write(reinterpret_cast<const char*>(positions->data()), positions->size() * sizeof(int16_t));
 
     //size_t heatmap_elements = model.getHeatmapSize();
     //file.write(reinterpret_cast<const char*>(&heatmap_elements), sizeof(heatmap_elements));
-    int16_t height = HEATMAP_HEIGHT;
-    int16_t width = HEATMAP_WIDTH;
-    const int* const* heatmap = model.getHeatmap();
-
     unsigned long heatmap_start = 0xFFFF0000FFFF0000;
     file.write(reinterpret_cast<const char*>(&heatmap_start), sizeof(heatmap_start));
 
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            int ARGBvalue = heatmap[i][j];
-            int8_t Avalue = (ARGBvalue >> 24) & ((1 << 8)-1);
-            file.write(reinterpret_cast<const char*>(&Avalue), sizeof(Avalue));
-        }
-    }
+    file.write(reinterpret_cast<const char*>(frame.alpha.data()), frame.alpha.size());
     file.flush();
 }
 
+// Writes the frame the tick has packed, while the next tick packs the other one
+void ExportSimulation::serialize()
+{
+    PED_TRACE_SCOPE("serialize");
+
+    // The previous frame must be written before its buffers are packed again
+    if (writer.joinable()) {
+        writer.join();
+    }
+    writer = std::thread(&ExportSimulation::writeFrame, this, std::cref(frames[packing]));
+    packing = 1 - packing;
+}
+
 void ExportSimulation::runSimulation()
 {
-    for (int i = 0; i < maxSimulationSteps; i++) {
-        tickCounter++;
-        model.tick();
-        serialize();
+    // Each frame is handed to the writer between two ticks of the batch
+    while (tickCounter < maxSimulationSteps) {
+        model.tick(ticksUntilCheckpoint(), [this]() {
+            tickCounter++;
+            serialize();
+        });
+        checkpointIfDue();
     }
 }
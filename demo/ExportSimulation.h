@@ -4,11 +4,20 @@
 #include "Simulation.h"
 #include <string>
 #include <fstream>
+#include <vector>
+#include <thread>
+#include <cstdint>
 
 #define HEATMAP_WIDTH 160 * 5
 #define HEATMAP_HEIGHT 120 * 5
 #define HEATMAP_SKIP 5
 
+// Writes every tick to a file. The frames are packed by stages added to
+// the pipeline of the model ("export.agents" and "export.heatmap"), which
+// run as soon as the agents have moved and the rows of the heatmap are
+// blurred, and written in the background while the next tick runs. When
+// agents were removed, a frame only has the agents that are left, in the
+// order of their ids.
 class ExportSimulation : public Simulation {
     public:
         ExportSimulation(Ped::Model &model, int maxSteps,
@@ -20,7 +29,27 @@ class ExportSimulation : public Simulation {
     protected:
         std::string outputFilename;
         std::ofstream file;
+        int firstTick;
 
+        // A frame: x, y of each agent and the heatmap alpha. One is packed
+        // while the other one is written. Sparse when some ids have no
+        // agent, whose positions stay MISSING.
+        struct Frame {
+            std::vector<int16_t> positions;
+            std::vector<int8_t> alpha;
+            bool sparse = false;
+        };
+        static const int16_t MISSING = INT16_MIN;
+        Frame frames[2];
+        int packing = 0;
+
+        // Writes the last frame
+        std::thread writer;
+
+        void prepareFrame();
+        void packAgents(size_t begin, size_t end);
+        void packHeatmap(size_t begin, size_t end);
+        void writeFrame(const Frame &frame);
         void serialize();
 };
 #endif
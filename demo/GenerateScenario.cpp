@@ -0,0 +1,252 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the procedural scenario generator.
+//
+#include "GenerateScenario.h"
+
+#include <cmath>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+// Distance of the scenario to the origin
+#define MARGIN 10
+
+namespace {
+	// A group of agents placed in a rectangle, each walking along one
+	// of the routes firstRoute .. firstRoute + numRoutes - 1
+	struct Group {
+		int x0, y0, w, h;
+		size_t count;
+		uint32_t firstRoute;
+		uint32_t numRoutes;
+	};
+
+	void addWaypoint(std::vector<double> &wps, double x, double y, double r) {
+		wps.push_back(x);
+		wps.push_back(y);
+		wps.push_back(r);
+	}
+
+	// Places the agents of a group on distinct, randomly chosen cells of
+	// its rectangle (selection sampling: every cell is picked with the
+	// probability of still needed agents over remaining cells).
+	void placeGroup(ScenarioSnapshot &snapshot, const Group &g, size_t firstAgent, unsigned int seed) {
+		std::mt19937_64 rng(seed);
+		std::uniform_real_distribution<double> uniform(0.0, 1.0);
+		size_t cells = (size_t)g.w * g.h;
+		size_t placed = 0;
+		for (size_t cell = 0; cell < cells && placed < g.count; cell++) {
+			if (uniform(rng) * (cells - cell) < g.count - placed) {
+				uint32_t route = g.firstRoute + (g.numRoutes > 1 ? rng() % g.numRoutes : 0);
+				snapshot.setAgent(firstAgent + placed, g.x0 + cell % g.w, g.y0 + cell / g.w, route);
+				placed++;
+			}
+		}
+	}
+}
+
+bool GenerateScenario::parseLayout(const std::string &name, Layout &layout)
+{
+	if (name == "corridor") layout = CORRIDOR;
+	else if (name == "crossing") layout = CROSSING;
+	else if (name == "ring") layout = RING;
+	else if (name == "box") layout = BOX;
+	else return false;
+	return true;
+}
+
+ScenarioSnapshot GenerateScenario::generate(Layout layout, size_t numAgents, unsigned int seed, double density)
+{
+	density = std::min(1.0, std::max(density, 1e-3));
+	double area = numAgents / density;
+
+	std::vector<double> wps;
+	std::vector<std::vector<uint32_t> > routes;
+	std::vector<Group> groups;
+
+	switch (layout) {
+		case CORRIDOR:
+		{
+			// Two groups facing each other in a corridor that is four times as long as it is wide
+			int h = std::max(4, (int)ceil(sqrt(area / 4)));
+			int w = std::max(1, (int)ceil(area / 2 / h));
+			double r = std::max(5.0, h / 4.0);
+			addWaypoint(wps, MARGIN, MARGIN + h / 2.0, r);
+			addWaypoint(wps, MARGIN + 2 * w, MARGIN + h / 2.0, r);
+			routes = { { 1, 0 }, { 0, 1 } };
+			groups.push_back({ MARGIN, MARGIN, w, h, numAgents / 2, 0, 1 });
+			groups.push_back({ MARGIN + w, MARGIN, w, h, numAgents - numAgents / 2, 1, 1 });
+		}
+		break;
+
+		case CROSSING:
+		{
+			// A west-east and a north-south flow, crossing in the middle square
+			int s = std::max(2, (int)ceil(sqrt(area / 2)));
+			double r = std::max(5.0, s / 4.0);
+			addWaypoint(wps, MARGIN, MARGIN + 1.5 * s, r);			// west
+			addWaypoint(wps, MARGIN + 3 * s, MARGIN + 1.5 * s, r);	// east
+			addWaypoint(wps, MARGIN + 1.5 * s, MARGIN, r);			// north
+			addWaypoint(wps, MARGIN + 1.5 * s, MARGIN + 3 * s, r);	// south
+			routes = { { 1, 0 }, { 3, 2 } };
+			groups.push_back({ MARGIN, MARGIN + s, s, s, numAgents / 2, 0, 1 });
+			groups.push_back({ MARGIN + s, MARGIN, s, s, numAgents - numAgents / 2, 1, 1 });
+		}
+		break;
+
+		case RING:
+		{
+			// Agents start in a square in the middle, and walk around a ring
+			// of waypoints, each starting at a random one
+			const int numWaypoints = 8;
+			int s = std::max(2, (int)ceil(sqrt(area)));
+			double center = MARGIN + 0.75 * s;
+			double r = std::max(3.0, s / 8.0);
+			for (int i = 0; i < numWaypoints; i++) {
+				double angle = 2 * M_PI * i / numWaypoints;
+				addWaypoint(wps, center + 0.75 * s * cos(angle), center + 0.75 * s * sin(angle), r);
+			}
+			for (int i = 0; i < numWaypoints; i++) {
+				std::vector<uint32_t> route;
+				for (int j = 0; j < numWaypoints; j++) {
+					route.push_back((i + j) % numWaypoints);
+				}
+				routes.push_back(route);
+			}
+			groups.push_back({ (int)(center - s / 2.0), (int)(center - s / 2.0), s, s, numAgents, 0, numWaypoints });
+		}
+		break;
+
+		case BOX:
+		{
+			// A densely filled box, agents walk around its corners
+			int s = std::max(2, (int)ceil(sqrt(area)));
+			double r = std::max(3.0, s / 16.0);
+			addWaypoint(wps, MARGIN, MARGIN, r);
+			addWaypoint(wps, MARGIN + s, MARGIN, r);
+			addWaypoint(wps, MARGIN + s, MARGIN + s, r);
+			addWaypoint(wps, MARGIN, MARGIN + s, r);
+			routes = { { 0, 1, 2, 3 }, { 1, 2, 3, 0 }, { 2, 3, 0, 1 }, { 3, 0, 1, 2 } };
+			groups.push_back({ MARGIN, MARGIN, s, s, numAgents, 0, 4 });
+		}
+		break;
+	}
+
+	ScenarioSnapshot snapshot(wps, routes, numAgents);
+
+	std::vector<size_t> firstAgent(groups.size(), 0);
+	for (size_t g = 1; g < groups.size(); g++) {
+		firstAgent[g] = firstAgent[g - 1] + groups[g - 1].count;
+	}
+	#pragma omp parallel for
+	for (size_t g = 0; g < groups.size(); g++) {
+		placeGroup(snapshot, groups[g], firstAgent[g], seed * 31 + g);
+	}
+	return snapshot;
+}
+
+ScenarioSnapshot GenerateScenario::replicate(const ScenarioSnapshot &scenario, int copies)
+{
+	size_t numAgents = scenario.getNumAgents();
+	size_t numWaypoints = scenario.getNumWaypoints();
+	size_t numRoutes = scenario.getNumRoutes();
+	const double *wpData = scenario.getWaypointData();
+	const int32_t *xs = scenario.getAgentX();
+	const int32_t *ys = scenario.getAgentY();
+	const uint32_t *rs = scenario.getAgentRoute();
+	std::vector<Ped::Tobstacle> obstacles = scenario.getObstacles();
+	std::vector<Ped::Tsource> sources = scenario.getSources();
+	std::vector<Ped::Tsink> sinks = scenario.getSinks();
+
+	// Bounding box of everything in the scenario, including the waypoint,
+	// source and sink areas
+	double minX = 1e300, maxX = -1e300, minY = 1e300, maxY = -1e300;
+	for (size_t i = 0; i < numAgents; i++) {
+		minX = std::min(minX, (double)xs[i]);
+		maxX = std::max(maxX, (double)xs[i]);
+		minY = std::min(minY, (double)ys[i]);
+		maxY = std::max(maxY, (double)ys[i]);
+	}
+	for (size_t w = 0; w < numWaypoints; w++) {
+		double x = wpData[3 * w], y = wpData[3 * w + 1], r = wpData[3 * w + 2];
+		minX = std::min(minX, x - r);
+		maxX = std::max(maxX, x + r);
+		minY = std::min(minY, y - r);
+		maxY = std::max(maxY, y + r);
+	}
+	for (const Ped::Tobstacle &obstacle : obstacles) {
+		for (size_t i = 0; i < obstacle.getCornerCount(); i++) {
+			minX = std::min(minX, obstacle.getCornerX(i));
+			maxX = std::max(maxX, obstacle.getCornerX(i));
+			minY = std::min(minY, obstacle.getCornerY(i));
+			maxY = std::max(maxY, obstacle.getCornerY(i));
+		}
+	}
+	for (const Ped::Tsource &source : sources) {
+		minX = std::min(minX, source.getx() - source.getdx() / 2);
+		maxX = std::max(maxX, source.getx() + source.getdx() / 2);
+		minY = std::min(minY, source.gety() - source.getdy() / 2);
+		maxY = std::max(maxY, source.gety() + source.getdy() / 2);
+	}
+	for (const Ped::Tsink &sink : sinks) {
+		minX = std::min(minX, sink.getx() - sink.getr());
+		maxX = std::max(maxX, sink.getx() + sink.getr());
+		minY = std::min(minY, sink.gety() - sink.getr());
+		maxY = std::max(maxY, sink.gety() + sink.getr());
+	}
+	int tileWidth = (int)ceil(maxX - minX) + MARGIN;
+	int tileHeight = (int)ceil(maxY - minY) + MARGIN;
+	int columns = (int)ceil(sqrt((double)copies));
+
+	std::vector<double> wps;
+	std::vector<std::vector<uint32_t> > routes;
+	std::vector<Ped::Tobstacle> obstacleCopies;
+	std::vector<Ped::Tsource> sourceCopies;
+	std::vector<Ped::Tsink> sinkCopies;
+	for (int c = 0; c < copies; c++) {
+		int dx = (c % columns) * tileWidth;
+		int dy = (c / columns) * tileHeight;
+		for (size_t w = 0; w < numWaypoints; w++) {
+			addWaypoint(wps, wpData[3 * w] + dx, wpData[3 * w + 1] + dy, wpData[3 * w + 2]);
+		}
+		for (size_t r = 0; r < numRoutes; r++) {
+			std::vector<uint32_t> route;
+			for (uint32_t e = scenario.getRouteOffsets()[r]; e < scenario.getRouteOffsets()[r + 1]; e++) {
+				route.push_back(scenario.getRouteEntries()[e] + c * numWaypoints);
+			}
+			routes.push_back(route);
+		}
+		for (const Ped::Tobstacle &obstacle : obstacles) {
+			Ped::Tobstacle copy;
+			for (size_t i = 0; i < obstacle.getCornerCount(); i++) {
+				copy.addCorner(obstacle.getCornerX(i) + dx, obstacle.getCornerY(i) + dy);
+			}
+			obstacleCopies.push_back(copy);
+		}
+		for (const Ped::Tsource &source : sources) {
+			std::vector<size_t> route = source.getRoute();
+			for (size_t &w : route) {
+				w += c * numWaypoints;
+			}
+			sourceCopies.push_back(Ped::Tsource(source.getx() + dx, source.gety() + dy, source.getdx(), source.getdy(),
+				source.getRate(), source.getLimit(), route));
+		}
+		for (const Ped::Tsink &sink : sinks) {
+			sinkCopies.push_back(Ped::Tsink(sink.getx() + dx, sink.gety() + dy, sink.getr()));
+		}
+	}
+
+	ScenarioSnapshot snapshot(wps, routes, numAgents * copies, obstacleCopies, sourceCopies, sinkCopies);
+	#pragma omp parallel for
+	for (int c = 0; c < copies; c++) {
+		int dx = (c % columns) * tileWidth;
+		int dy = (c / columns) * tileHeight;
+		for (size_t i = 0; i < numAgents; i++) {
+			snapshot.setAgent(c * numAgents + i, xs[i] + dx, ys[i] + dy, rs[i] + c * numRoutes);
+		}
+	}
+	return snapshot;
+}
@@ -0,0 +1,41 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// GenerateScenario builds large scenarios directly in memory, without
+// going through XML. It is meant for scale testing: the bundled scenarios
+// only have a few thousand agents, while the generator handles anything
+// from 10^5 to 10^8 agents in a couple of parameterized layouts.
+//
+// All layouts place the agents on distinct cells (no duplicates have to
+// be removed afterwards) and are fully determined by the seed.
+//
+
+#ifndef _generatescenario_h_
+#define _generatescenario_h_
+
+#include "ScenarioSnapshot.h"
+#include <string>
+
+class GenerateScenario
+{
+public:
+	enum Layout {
+		CORRIDOR,	// two groups walking in opposite directions through a corridor
+		CROSSING,	// two perpendicular flows crossing in the middle
+		RING,		// agents in the middle, visiting a ring of waypoints
+		BOX			// a densely packed box, agents walking around its corners
+	};
+
+	// Translates the layout name used on the command line, returns false if unknown
+	static bool parseLayout(const std::string &name, Layout &layout);
+
+	// Generates a scenario with numAgents agents. density is the fraction
+	// of occupied cells in the areas where agents are placed, in (0, 1].
+	static ScenarioSnapshot generate(Layout layout, size_t numAgents, unsigned int seed, double density = 0.5);
+
+	// Tiles copies of a scenario side by side. Each copy gets its own
+	// waypoints and obstacles, so the copies don't interact.
+	static ScenarioSnapshot replicate(const ScenarioSnapshot &scenario, int copies);
+};
+
+#endif
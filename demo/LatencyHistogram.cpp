@@ -0,0 +1,87 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the latency histogram.
+//
+#include "LatencyHistogram.h"
+
+#include <cmath>
+#include <algorithm>
+
+LatencyHistogram::LatencyHistogram()
+{
+	// Enough buckets for any 64 bit value
+	buckets.assign(indexOf(UINT64_MAX) + 1, 0);
+}
+
+// Values below 2^SUB_BUCKET_BITS get a bucket each. Above that, every power
+// of two is split into 2^(SUB_BUCKET_BITS-1) buckets of equal width.
+size_t LatencyHistogram::indexOf(uint64_t value)
+{
+	int magnitude = 63 - __builtin_clzll(value | 1);
+	int shift = std::max(0, magnitude - SUB_BUCKET_BITS + 1);
+	uint64_t subBucket = value >> shift;
+	return ((size_t)shift << (SUB_BUCKET_BITS - 1)) + subBucket;
+}
+
+uint64_t LatencyHistogram::highestValueOf(size_t index)
+{
+	int shift = 0;
+	if (index >= ((size_t)1 << SUB_BUCKET_BITS)) {
+		shift = (index >> (SUB_BUCKET_BITS - 1)) - 1;
+	}
+	uint64_t subBucket = index - ((size_t)shift << (SUB_BUCKET_BITS - 1));
+	return ((subBucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds)
+{
+	buckets[indexOf(nanoseconds)]++;
+	count++;
+	min = std::min(min, nanoseconds);
+	max = std::max(max, nanoseconds);
+	sum += nanoseconds;
+	sumOfSquares += (double)nanoseconds * nanoseconds;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+	for (size_t i = 0; i < buckets.size(); i++) {
+		buckets[i] += other.buckets[i];
+	}
+	count += other.count;
+	min = std::min(min, other.min);
+	max = std::max(max, other.max);
+	sum += other.sum;
+	sumOfSquares += other.sumOfSquares;
+}
+
+double LatencyHistogram::getMean() const
+{
+	return count ? sum / count : 0;
+}
+
+double LatencyHistogram::getStddev() const
+{
+	if (count < 2) {
+		return 0;
+	}
+	double mean = getMean();
+	return sqrt(std::max(0.0, (sumOfSquares - count * mean * mean) / (count - 1)));
+}
+
+uint64_t LatencyHistogram::getPercentile(double fraction) const
+{
+	if (count == 0) {
+		return 0;
+	}
+	uint64_t target = std::max<uint64_t>(1, (uint64_t)ceil(fraction * count));
+	uint64_t seen = 0;
+	for (size_t i = 0; i < buckets.size(); i++) {
+		seen += buckets[i];
+		if (seen >= target) {
+			return std::min(highestValueOf(i), max);
+		}
+	}
+	return max;
+}
@@ -0,0 +1,52 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// LatencyHistogram records latencies (in nanoseconds) in the style of an
+// HDR histogram: buckets are linear within each power of two, so every
+// recorded value is kept with a relative error below 1%, no matter if it
+// is a few microseconds or several seconds. Recording is O(1) and the
+// memory footprint is fixed, so every single tick can be recorded.
+//
+
+#ifndef _latencyhistogram_h_
+#define _latencyhistogram_h_
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+
+	void record(uint64_t nanoseconds);
+
+	// Adds all values recorded by another histogram
+	void merge(const LatencyHistogram &other);
+
+	uint64_t getCount() const { return count; }
+	uint64_t getMin() const { return count ? min : 0; }
+	uint64_t getMax() const { return max; }
+	double getMean() const;
+	double getStddev() const;
+
+	// Value below which the given fraction (0..1) of all recorded values lie
+	uint64_t getPercentile(double fraction) const;
+
+private:
+	// Number of bits of precision within each power of two
+	static const int SUB_BUCKET_BITS = 7;
+
+	std::vector<uint64_t> buckets;
+	uint64_t count = 0;
+	uint64_t min = UINT64_MAX;
+	uint64_t max = 0;
+	double sum = 0;
+	double sumOfSquares = 0;
+
+	static size_t indexOf(uint64_t value);
+	static uint64_t highestValueOf(size_t index);
+};
+
+#endif
@@ -0,0 +1,218 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the lockstep verification.
+//
+#include "LockstepVerifier.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+const int LockstepVerifier::MISSING;
+
+namespace {
+	uint8_t alphaOf(int ARGBvalue) {
+		return (ARGBvalue >> 24) & ((1 << 8) - 1);
+	}
+}
+
+double LockstepVerifier::Divergence::distance() const
+{
+	double dx = targetX - referenceX, dy = targetY - referenceY;
+	return sqrt(dx * dx + dy * dy);
+}
+
+LockstepVerifier::LockstepVerifier(Ped::Model &reference_, Ped::Model &target_, const Config &config_)
+	: reference(reference_), target(target_), config(config_)
+{
+	size_t numAgents = reference.getAgents().size();
+	if (target.getAgents().size() != numAgents) {
+		std::cerr << "The reference has " << numAgents << " agents and the target " << target.getAgents().size() << std::endl;
+		exit(1);
+	}
+	results.resize(target.getScheduler().getNumWorkers());
+
+	// The positions are sized once the agents of the tick were added and removed
+	Ped::TickPipeline &referencePipeline = reference.getPipeline();
+	Ped::TickPipeline &targetPipeline = target.getPipeline();
+	referencePipeline.addSerialStage("verify.ids", [this](int) { prepareAgents(); });
+	referencePipeline.addStage("verify.record", [this]() { return reference.getAgents().size(); },
+		[this](size_t begin, size_t end, int) { recordAgents(begin, end); },
+		{ { "move", Ped::TickPipeline::SAME_BLOCK }, { "verify.ids", Ped::TickPipeline::ALL_BLOCKS } });
+	targetPipeline.addStage("verify.agents", [this]() { return target.getAgents().size(); },
+		[this](size_t begin, size_t end, int worker) { compareAgents(begin, end, worker); },
+		{ { "move", Ped::TickPipeline::SAME_BLOCK } });
+
+	// Both must update the heatmap for it to be compared
+	heatmap = referencePipeline.hasStage("heatmap.blur") && targetPipeline.hasStage("heatmap.blur");
+	if (heatmap) {
+		size_t size = reference.getHeatmapSize();
+		referenceAlpha.resize(size * size);
+		referencePipeline.addStage("verify.heatmap", [this]() { return (size_t)reference.getHeatmapSize(); },
+			[this](size_t begin, size_t end, int) { recordHeatmap(begin, end); },
+			{ { "heatmap.blur", Ped::TickPipeline::SAME_BLOCK } });
+		targetPipeline.addStage("verify.heatmap", [this]() { return (size_t)target.getHeatmapSize(); },
+			[this](size_t begin, size_t end, int worker) { compareHeatmap(begin, end, worker); },
+			{ { "heatmap.blur", Ped::TickPipeline::SAME_BLOCK } });
+	}
+	else if (reference.isHeatmapEnabled() || target.isHeatmapEnabled()) {
+		std::cout << "Only one of the models updates the heatmap, it is not compared" << std::endl;
+	}
+}
+
+LockstepVerifier::~LockstepVerifier()
+{
+	reference.getPipeline().removeStage("verify.record");
+	reference.getPipeline().removeStage("verify.ids");
+	target.getPipeline().removeStage("verify.agents");
+	if (heatmap) {
+		reference.getPipeline().removeStage("verify.heatmap");
+		target.getPipeline().removeStage("verify.heatmap");
+	}
+}
+
+bool LockstepVerifier::run()
+{
+	double referenceSeconds = 0, targetSeconds = 0;
+	bool same = true;
+	while (same && tickCounter < config.maxSteps) {
+		tickCounter++;
+		auto start = std::chrono::steady_clock::now();
+		reference.tick();
+		auto middle = std::chrono::steady_clock::now();
+		target.tick();
+		auto end = std::chrono::steady_clock::now();
+		referenceSeconds += std::chrono::duration<double>(middle - start).count();
+		targetSeconds += std::chrono::duration<double>(end - middle).count();
+		same = report();
+	}
+	if (same) {
+		std::cout << "Verified " << tickCounter << " ticks: " << Ped::getImplementationName(target.getTuning().implementation)
+			<< " is the same as " << Ped::getImplementationName(reference.getTuning().implementation)
+			<< (heatmap ? ", agents and heatmap" : "") << std::endl;
+	}
+	std::cout << "Reference time: " << (int)(referenceSeconds * 1000) << " milliseconds, target time (with the comparison): "
+		<< (int)(targetSeconds * 1000) << " milliseconds" << std::endl;
+	return same;
+}
+
+void LockstepVerifier::prepareAgents()
+{
+	size_t ids = reference.getAgentIdCount();
+	if (reference.getLiveAgentCount() != ids) {
+		referenceX.assign(ids, MISSING);
+		referenceY.assign(ids, MISSING);
+	}
+	else {
+		referenceX.resize(ids);
+		referenceY.resize(ids);
+	}
+}
+
+void LockstepVerifier::recordAgents(size_t begin, size_t end)
+{
+	const std::vector<Ped::Tagent*>& agents = reference.getAgents();
+	const std::vector<size_t>& ids = reference.getAgentIds();
+	for (size_t i = begin; i < end; i++) {
+		if (ids[i] == Ped::Model::NO_AGENT) {
+			continue;
+		}
+		referenceX[ids[i]] = agents[i]->getX();
+		referenceY[ids[i]] = agents[i]->getY();
+	}
+}
+
+void LockstepVerifier::recordHeatmap(size_t begin, size_t end)
+{
+	const int* const* blurred = reference.getHeatmap();
+	size_t size = reference.getHeatmapSize();
+	for (size_t i = begin; i < end; i++) {
+		for (size_t j = 0; j < size; j++) {
+			referenceAlpha[i * size + j] = alphaOf(blurred[i][j]);
+		}
+	}
+}
+
+void LockstepVerifier::compareAgents(size_t begin, size_t end, int worker)
+{
+	const std::vector<Ped::Tagent*>& agents = target.getAgents();
+	const std::vector<size_t>& ids = target.getAgentIds();
+	for (size_t i = begin; i < end; i++) {
+		size_t id = ids[i];
+		if (id == Ped::Model::NO_AGENT) {
+			continue;
+		}
+		int x = agents[i]->getX(), y = agents[i]->getY();
+		if (id >= referenceX.size()) {
+			// Only the target added it
+			results[worker].agents.push_back({ id, MISSING, MISSING, x, y });
+		}
+		else if (x != referenceX[id] || y != referenceY[id]) {
+			results[worker].agents.push_back({ id, referenceX[id], referenceY[id], x, y });
+		}
+	}
+}
+
+void LockstepVerifier::compareHeatmap(size_t begin, size_t end, int worker)
+{
+	const int* const* blurred = target.getHeatmap();
+	size_t size = target.getHeatmapSize();
+	WorkerResult &result = results[worker];
+	for (size_t i = begin; i < end; i++) {
+		for (size_t j = 0; j < size; j++) {
+			int difference = abs((int)alphaOf(blurred[i][j]) - (int)referenceAlpha[i * size + j]);
+			if (difference != 0) {
+				result.heatmapCells++;
+				result.heatmapMaxDifference = std::max(result.heatmapMaxDifference, difference);
+			}
+		}
+	}
+}
+
+bool LockstepVerifier::report()
+{
+	std::vector<Divergence> agents;
+	long heatmapCells = 0;
+	int heatmapMaxDifference = 0;
+	for (WorkerResult &result : results) {
+		agents.insert(agents.end(), result.agents.begin(), result.agents.end());
+		heatmapCells += result.heatmapCells;
+		heatmapMaxDifference = std::max(heatmapMaxDifference, result.heatmapMaxDifference);
+		result = WorkerResult();
+	}
+	size_t live = reference.getLiveAgentCount();
+	if (agents.empty() && heatmapCells == 0 && target.getLiveAgentCount() == live) {
+		return true;
+	}
+
+	std::cout << "Diverged in tick " << tickCounter << ": " << agents.size() << " of " << live << " agents";
+	if (heatmap) {
+		std::cout << " and " << heatmapCells << " heatmap pixels (alpha up to " << heatmapMaxDifference << " apart)";
+	}
+	std::cout << " differ from the reference" << std::endl;
+	if (target.getLiveAgentCount() != live) {
+		std::cout << "\tthe target has " << target.getLiveAgentCount() << " agents" << std::endl;
+	}
+
+	// The farthest first, then by index
+	std::sort(agents.begin(), agents.end(), [](const Divergence &a, const Divergence &b) {
+		return a.distance() > b.distance() || (a.distance() == b.distance() && a.id < b.id);
+	});
+	size_t listed = std::min(agents.size(), (size_t)config.maxReported);
+	for (size_t k = 0; k < listed; k++) {
+		const Divergence &d = agents[k];
+		if (d.referenceX == MISSING) {
+			std::cout << "\tagent " << d.id << ": not in the reference, (" << d.targetX << ", " << d.targetY << ") in the target" << std::endl;
+			continue;
+		}
+		std::cout << "\tagent " << d.id << ": (" << d.referenceX << ", " << d.referenceY << ") in the reference, ("
+			<< d.targetX << ", " << d.targetY << ") in the target, " << d.distance() << " cells apart" << std::endl;
+	}
+	if (listed < agents.size()) {
+		std::cout << "\t... and " << agents.size() - listed << " more" << std::endl;
+	}
+	return false;
+}
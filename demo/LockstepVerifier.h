@@ -0,0 +1,91 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// LockstepVerifier runs a target model in lockstep with a reference
+// model of the same scenario, e.g. simd against seq, and checks after
+// every tick that every agent is on the same cell in both, and with the
+// heatmap that its density is the same. It stops at the first tick where
+// they diverge and reports the agents that do, by their index in the
+// scenario, with how far apart they are. With sources and sinks, both
+// must also add and remove the same agents.
+//
+// The comparison runs in stages added to the pipelines of the models:
+// the reference records the positions and the heatmap as its agents
+// move and its rows are blurred, and the target compares its own against
+// them as soon as they are ready, in parallel and overlapping with the
+// rest of its tick. Apart from the reference ticks, the check costs a
+// pass over the agents and the heatmap.
+//
+
+#ifndef _lockstepverifier_h_
+#define _lockstepverifier_h_
+
+#include "ped_model.h"
+
+#include <cstdint>
+#include <vector>
+
+class LockstepVerifier
+{
+public:
+	struct Config {
+		int maxSteps = 100;
+
+		// How many of the divergent agents are listed, farthest first
+		int maxReported = 10;
+	};
+
+	// The models must be set up from the same scenario; the pipeline
+	// stages are removed again by the destructor
+	LockstepVerifier(Ped::Model &reference, Ped::Model &target, const Config &config);
+	~LockstepVerifier();
+
+	// Runs the models until they diverge or for maxSteps ticks, and reports
+	// the result; returns true if they never diverged
+	bool run();
+
+	int getTickCount() const { return tickCounter; }
+
+private:
+	// An agent on different cells in the two models
+	struct Divergence {
+		size_t id;
+		int referenceX, referenceY;
+		int targetX, targetY;
+
+		double distance() const;
+	};
+
+	// Found by one worker of the target in the current tick
+	struct WorkerResult {
+		std::vector<Divergence> agents;
+		long heatmapCells = 0;
+		int heatmapMaxDifference = 0;
+	};
+
+	Ped::Model &reference;
+	Ped::Model &target;
+	Config config;
+	int tickCounter = 0;
+	bool heatmap;
+
+	// The positions of the reference by the id of the agent (see
+	// Ped::Model::getAgentIds()), MISSING for those it does not have, and
+	// the alpha of its heatmap
+	static const int MISSING = INT32_MIN;
+	std::vector<int> referenceX, referenceY;
+	std::vector<uint8_t> referenceAlpha;
+
+	std::vector<WorkerResult> results;
+
+	void prepareAgents();
+	void recordAgents(size_t begin, size_t end);
+	void recordHeatmap(size_t begin, size_t end);
+	void compareAgents(size_t begin, size_t end, int worker);
+	void compareHeatmap(size_t begin, size_t end, int worker);
+
+	// Reports the divergence of the current tick, returns false if there was one
+	bool report();
+};
+
+#endif
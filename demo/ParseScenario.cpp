@@ -9,6 +9,8 @@
 #include "ParseScenario.h"
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <iterator>
 
 #include <stdlib.h>
 
@@ -52,6 +54,30 @@ ParseScenario::ParseScenario(std::string filename, bool verbose)
 		waypoints[id] = w;
 	}
 
+	// Parse obstacles
+	if (verbose) std::cout << "\nObstacles:" << std::endl;
+	for (XMLElement* obstacle = root->FirstChildElement("obstacle"); obstacle; obstacle = obstacle->NextSiblingElement("obstacle")) {
+		Ped::Tobstacle o;
+		if (obstacle->FirstChildElement("corner")) {
+			for (XMLElement* corner = obstacle->FirstChildElement("corner"); corner; corner = corner->NextSiblingElement("corner")) {
+				o.addCorner(corner->DoubleAttribute("x"), corner->DoubleAttribute("y"));
+			}
+		}
+		else {
+			o = Ped::Tobstacle::rectangle(obstacle->DoubleAttribute("x"), obstacle->DoubleAttribute("y"),
+				obstacle->DoubleAttribute("width"), obstacle->DoubleAttribute("height"));
+		}
+
+		if (verbose) {
+			std::cout << "  Obstacle:";
+			for (size_t i = 0; i < o.getCornerCount(); i++) {
+				std::cout << " (" << o.getCornerX(i) << ", " << o.getCornerY(i) << ")";
+			}
+			std::cout << std::endl;
+		}
+		obstacles.push_back(o);
+	}
+
 	// Parse agents
 	if (verbose) std::cout << "\nAgents:" << std::endl;
 	for (XMLElement* agent = root->FirstChildElement("agent"); agent; agent = agent->NextSiblingElement("agent")) {
@@ -87,6 +113,45 @@ ParseScenario::ParseScenario(std::string filename, bool verbose)
 	}
 	tempAgents.clear();
 
+	// Parse sources, whose routes refer to the waypoints by their index in getWaypoints()
+	if (verbose) std::cout << "\nSources:" << std::endl;
+	for (XMLElement* source = root->FirstChildElement("source"); source; source = source->NextSiblingElement("source")) {
+		double x = source->DoubleAttribute("x");
+		double y = source->DoubleAttribute("y");
+		double dx = source->DoubleAttribute("dx");
+		double dy = source->DoubleAttribute("dy");
+		double rate = source->DoubleAttribute("rate");
+		int limit = std::max(source->IntAttribute("limit"), 0);
+
+		if (verbose) {
+			std::cout << "  Source: x: " << x << ", y: " << y << ", dx: " << dx << ", dy: " << dy
+				<< ", rate: " << rate << ", limit: " << limit << std::endl;
+		}
+
+		std::vector<size_t> route;
+		for (XMLElement* addwaypoint = source->FirstChildElement("addwaypoint"); addwaypoint; addwaypoint = addwaypoint->NextSiblingElement("addwaypoint")) {
+			std::string id = addwaypoint->Attribute("id");
+			if (verbose) std::cout << "    AddWaypoint ID: " << id << std::endl;
+			auto waypoint = waypoints.find(id);
+			if (waypoint == waypoints.end()) {
+				std::cerr << "Error: source with the unknown waypoint " << id << std::endl;
+				exit(1);
+			}
+			route.push_back(std::distance(waypoints.begin(), waypoint));
+		}
+		sources.push_back(Ped::Tsource(x, y, dx, dy, rate, limit, route));
+	}
+
+	// Parse sinks
+	if (verbose) std::cout << "\nSinks:" << std::endl;
+	for (XMLElement* sink = root->FirstChildElement("sink"); sink; sink = sink->NextSiblingElement("sink")) {
+		double x = sink->DoubleAttribute("x");
+		double y = sink->DoubleAttribute("y");
+		double r = sink->DoubleAttribute("r");
+		if (verbose) std::cout << "  Sink: x: " << x << ", y: " << y << ", r: " << r << std::endl;
+		sinks.push_back(Ped::Tsink(x, y, r));
+	}
+
 	// Hack! Do not allow agents to be on the same position. Remove duplicates from scenario and free the memory.
 	bool(*fn_pt)(Ped::Tagent*, Ped::Tagent*) = positionComparator;
 	std::set<Ped::Tagent*, bool(*)(Ped::Tagent*, Ped::Tagent*)> agentsWithUniquePosition(fn_pt);
@@ -11,6 +11,8 @@
 
 #include "ped_agent.h"
 #include "ped_waypoint.h"
+#include "ped_obstacle.h"
+#include "ped_population.h"
 #include <tinyxml2.h>
 #include <map>
 #include <vector>
@@ -34,6 +36,15 @@ public:
 	// contains all defined waypoints
 	vector<Ped::Twaypoint*> getWaypoints();
 
+	// the obstacles: rectangles (x, y, width, height) or
+	// polygons given by their <corner x y> elements
+	const vector<Ped::Tobstacle>& getObstacles() const { return obstacles; }
+
+	// the sources, <source x y dx dy rate limit> with <addwaypoint id>
+	// elements like those of <agent>, and the sinks, <sink x y r>
+	const vector<Ped::Tsource>& getSources() const { return sources; }
+	const vector<Ped::Tsink>& getSinks() const { return sinks; }
+
 private:
 	XMLDocument doc;
 
@@ -47,6 +58,11 @@ private:
 
 	// contains all defined waypoints
 	map<string, Ped::Twaypoint*> waypoints;
+
+	vector<Ped::Tobstacle> obstacles;
+
+	vector<Ped::Tsource> sources;
+	vector<Ped::Tsink> sinks;
 };
 
 #endif
@@ -0,0 +1,192 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the hardware performance counters.
+//
+#include "PerfCounters.h"
+
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cstdlib>
+#endif
+
+namespace {
+	double now() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+#ifdef __linux__
+	struct EventConfig {
+		uint32_t type;
+		uint64_t config;
+	};
+
+	const uint64_t CACHE_READ_MISS = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+	const EventConfig eventConfigs[PerfCounters::NUM_EVENTS] = {
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | CACHE_READ_MISS },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+		{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | CACHE_READ_MISS },
+	};
+
+	int openEvent(const EventConfig &event, pid_t tid) {
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = event.type;
+		attr.config = event.config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = 1;
+		// Inherited counters cannot be read as a group, so every event is a
+		// counter of its own; the times tell how long it was scheduled
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		return syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0);
+	}
+
+	std::vector<pid_t> threadsOfProcess() {
+		std::vector<pid_t> tids;
+		DIR *dir = opendir("/proc/self/task");
+		if (dir) {
+			while (struct dirent *entry = readdir(dir)) {
+				if (entry->d_name[0] != '.') {
+					tids.push_back(atoi(entry->d_name));
+				}
+			}
+			closedir(dir);
+		}
+		if (tids.empty()) {
+			tids.push_back(0);
+		}
+		return tids;
+	}
+#endif
+}
+
+PerfCounters::Values::Values()
+{
+	for (int e = 0; e < NUM_EVENTS; e++) {
+		counts[e] = -1;
+	}
+}
+
+PerfCounters::Values& PerfCounters::Values::operator+=(const Values &other)
+{
+	for (int e = 0; e < NUM_EVENTS; e++) {
+		if (other.counts[e] >= 0) {
+			counts[e] = (counts[e] >= 0 ? counts[e] : 0) + other.counts[e];
+		}
+	}
+	seconds += other.seconds;
+	return *this;
+}
+
+PerfCounters::Values PerfCounters::Values::operator-(const Values &other) const
+{
+	Values result;
+	for (int e = 0; e < NUM_EVENTS; e++) {
+		if (counts[e] >= 0 && other.counts[e] >= 0) {
+			result.counts[e] = counts[e] - other.counts[e];
+		}
+	}
+	result.seconds = seconds - other.seconds;
+	return result;
+}
+
+const char* PerfCounters::getEventName(Event event)
+{
+	switch (event) {
+		case CYCLES: return "cycles";
+		case INSTRUCTIONS: return "instructions";
+		case L1D_MISSES: return "l1d_misses";
+		case LLC_MISSES: return "llc_misses";
+		case BRANCH_MISSES: return "branch_misses";
+		case DTLB_MISSES: return "dtlb_misses";
+		default: return "unknown";
+	}
+}
+
+PerfCounters::PerfCounters()
+{
+#ifdef __linux__
+	std::vector<pid_t> tids = threadsOfProcess();
+	for (int e = 0; e < NUM_EVENTS; e++) {
+		for (pid_t tid : tids) {
+			int fd = openEvent(eventConfigs[e], tid);
+			if (fd < 0) {
+				// Threads may exit while we go through the list
+				if (errno == ESRCH) continue;
+				if (errno == EACCES || errno == EPERM) {
+					error = "not permitted, see /proc/sys/kernel/perf_event_paranoid";
+				}
+				else if ((errno == ENOENT || errno == EOPNOTSUPP) && error.empty()) {
+					error = std::string(getEventName((Event)e)) + ": no such hardware counter (virtual machine?)";
+				}
+				else if (error.empty()) {
+					error = std::string(getEventName((Event)e)) + ": " + strerror(errno);
+				}
+				for (int other : fds[e]) close(other);
+				fds[e].clear();
+				break;
+			}
+			fds[e].push_back(fd);
+		}
+		available = available || !fds[e].empty();
+	}
+	// Counting cycles and instructions is the least we need
+	if (fds[CYCLES].empty() || fds[INSTRUCTIONS].empty()) {
+		available = false;
+	}
+#else
+	error = "perf_event_open is only available on Linux";
+#endif
+}
+
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+	for (int e = 0; e < NUM_EVENTS; e++) {
+		for (int fd : fds[e]) close(fd);
+	}
+#endif
+}
+
+PerfCounters::Values PerfCounters::read() const
+{
+	Values values;
+	values.seconds = now();
+#ifdef __linux__
+	for (int e = 0; e < NUM_EVENTS; e++) {
+		if (fds[e].empty()) continue;
+		double sum = 0;
+		for (int fd : fds[e]) {
+			uint64_t data[3]; // value, time enabled, time running
+			if (::read(fd, data, sizeof(data)) != sizeof(data) || data[2] == 0) continue;
+			// Scale up if the kernel multiplexed the counter
+			sum += (double)data[0] * data[1] / data[2];
+		}
+		values.counts[e] = (int64_t)sum;
+	}
+#endif
+	return values;
+}
+
+void PerfCounters::phaseBegin(const char *phase)
+{
+	phaseStart[phase] = read();
+}
+
+void PerfCounters::phaseEnd(const char *phase)
+{
+	phases[phase] += read() - phaseStart[phase];
+}
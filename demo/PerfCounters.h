@@ -0,0 +1,76 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// PerfCounters reads the hardware performance counters of the whole
+// process through perf_event_open: cycles, instructions, L1 data and
+// last level cache misses, branch misses and dTLB misses. One counter
+// per event is opened for every thread that exists when the counters
+// are opened, with inherit set so that threads started later (the
+// PTHREAD workers) are counted as well.
+//
+// Counters may not be permitted (perf_event_paranoid, containers) or
+// not exist (virtual machines, macOS). isAvailable() is false then,
+// and getError() tells why; single events that are missing read as -1.
+//
+// PerfCounters also implements the phase listener of the model, and
+// sums up the counter deltas of every phase of the tick.
+//
+
+#ifndef _perfcounters_h_
+#define _perfcounters_h_
+
+#include "ped_model.h"
+
+#include <vector>
+#include <string>
+#include <map>
+#include <cstdint>
+
+class PerfCounters : public Ped::Model::PhaseListener
+{
+public:
+	enum Event { CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, DTLB_MISSES, NUM_EVENTS };
+
+	struct Values {
+		// Event counts (scaled if the kernel had to multiplex), -1 if not available
+		int64_t counts[NUM_EVENTS];
+		double seconds = 0;
+
+		Values();
+		Values& operator+=(const Values &other);
+		Values operator-(const Values &other) const;
+	};
+
+	PerfCounters();
+	~PerfCounters();
+
+	bool isAvailable() const { return available; }
+	const std::string& getError() const { return error; }
+
+	static const char* getEventName(Event event);
+
+	// Current totals of all threads since the counters were opened
+	Values read() const;
+
+	// Sums of the deltas between phaseBegin and phaseEnd, per phase
+	const std::map<std::string, Values>& getPhases() const { return phases; }
+	void clearPhases() { phases.clear(); }
+
+	void phaseBegin(const char *phase);
+	void phaseEnd(const char *phase);
+
+private:
+	bool available = false;
+	std::string error;
+
+	// One file descriptor per event and thread, -1 if the event is not available
+	std::vector<int> fds[NUM_EVENTS];
+
+	std::map<std::string, Values> phases;
+	std::map<std::string, Values> phaseStart;
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+};
+
+#endif
@@ -0,0 +1,174 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the scaling sweep.
+//
+#include "ScalingSweep.h"
+#include "GenerateScenario.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+namespace {
+	bool isThreaded(Ped::IMPLEMENTATION implementation) {
+		return implementation == Ped::OMP || implementation == Ped::PTHREAD || implementation == Ped::HYBRID
+			|| implementation == Ped::PSTL || implementation == Ped::SOCIAL;
+	}
+
+	std::vector<int> defaultThreadCounts() {
+		int hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+		std::vector<int> counts;
+		for (int t = 1; t < hardwareThreads; t *= 2) {
+			counts.push_back(t);
+		}
+		counts.push_back(hardwareThreads);
+		return counts;
+	}
+}
+
+ScalingSweep::ScalingSweep(const ScenarioSnapshot &scenario_, const Config &config_) : scenario(scenario_), config(config_)
+{
+	if (config.threadCounts.empty()) {
+		config.threadCounts = defaultThreadCounts();
+	}
+}
+
+bool ScalingSweep::run()
+{
+	results.clear();
+	for (int copies : config.copies) {
+		ScenarioSnapshot replicated;
+		if (copies > 1) {
+			replicated = GenerateScenario::replicate(scenario, copies);
+		}
+		const ScenarioSnapshot &current = copies > 1 ? replicated : scenario;
+
+		for (Ped::IMPLEMENTATION implementation : config.implementations) {
+			if (!isThreaded(implementation)) {
+				runOne(current, implementation, 1);
+				continue;
+			}
+			for (int threads : config.threadCounts) {
+				runOne(current, implementation, threads);
+			}
+		}
+	}
+
+	printf("\n%-10s %8s %10s %16s %9s %11s %11s %10s\n", "impl", "threads", "agents", "updates/s", "speedup", "efficiency", "weak eff.", "imbalance");
+	for (const Result &r : results) {
+		const Result *reference = singleThreaded(r.implementation, r.agents);
+		const Result *weakReference = r.agents % r.threads == 0 ? singleThreaded(r.implementation, r.agents / r.threads) : nullptr;
+		double speedup = reference ? reference->seconds / r.seconds : 0;
+		char weakEfficiency[16] = "-";
+		if (weakReference) {
+			snprintf(weakEfficiency, sizeof(weakEfficiency), "%.2f", r.updatesPerSecond(config.measuredSteps) / (r.threads * weakReference->updatesPerSecond(config.measuredSteps)));
+		}
+		printf("%-10s %8d %10zu %16.4g %9.2f %11.2f %11s %10.2f\n", Ped::getImplementationName(r.implementation), r.threads, r.agents,
+			r.updatesPerSecond(config.measuredSteps), speedup, speedup / r.threads, weakEfficiency, r.imbalance);
+	}
+	printf("\n");
+
+	if (!writeCsv()) {
+		std::cerr << "Error writing scaling results to " << config.outputFile << std::endl;
+		return false;
+	}
+	std::cout << "Wrote " << config.outputFile << std::endl;
+	return true;
+}
+
+void ScalingSweep::runOne(const ScenarioSnapshot &current, Ped::IMPLEMENTATION implementation, int threads)
+{
+	std::cout << "Running " << Ped::getImplementationName(implementation) << " with " << threads << " threads on "
+		<< current.getNumAgents() << " agents" << std::endl;
+
+	Ped::ModelOptions options = config.modelOptions;
+	options.numThreads = threads;
+
+	std::vector<double> seconds, imbalances, stealsPerTick, idleFractions;
+	for (int rep = 0; rep < config.repetitions; rep++) {
+		Ped::Model model;
+		model.setOptions(options);
+		model.setObstacles(current.getObstacles());
+		model.setSources(current.getSources());
+		model.setSinks(current.getSinks());
+		model.setup(current.getArrays(), implementation);
+
+		for (int i = 0; i < config.warmupSteps; i++) {
+			model.tick();
+		}
+		model.resetThreadBusySeconds();
+		model.getScheduler().resetStats();
+
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < config.measuredSteps; i++) {
+			model.tick();
+		}
+		seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+		const std::vector<double> &busy = model.getThreadBusySeconds();
+		double sum = 0, max = 0;
+		for (double b : busy) {
+			sum += b;
+			max = std::max(max, b);
+		}
+		imbalances.push_back(sum > 0 ? max / (sum / busy.size()) : 1);
+		stealsPerTick.push_back((double)model.getScheduler().getTotalSteals() / config.measuredSteps);
+		idleFractions.push_back(model.getScheduler().getIdleFraction());
+	}
+
+	// The median repetition, its imbalance and scheduler counters go with it
+	std::vector<size_t> order(seconds.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = i;
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return seconds[a] < seconds[b]; });
+	size_t median = order[order.size() / 2];
+
+	Result result;
+	result.implementation = implementation;
+	result.threads = threads;
+	result.agents = current.getNumAgents();
+	result.seconds = seconds[median];
+	result.imbalance = imbalances[median];
+	result.stealsPerTick = stealsPerTick[median];
+	result.idleFraction = idleFractions[median];
+	results.push_back(result);
+}
+
+const ScalingSweep::Result* ScalingSweep::singleThreaded(Ped::IMPLEMENTATION implementation, size_t agents) const
+{
+	for (const Result &r : results) {
+		if (r.implementation == implementation && r.threads == 1 && r.agents == agents) {
+			return &r;
+		}
+	}
+	return nullptr;
+}
+
+bool ScalingSweep::writeCsv() const
+{
+	std::ofstream file(config.outputFile.c_str());
+	file << "implementation,threads,agents,ticks,seconds,agent_updates_per_second,speedup,parallel_efficiency,weak_efficiency,imbalance,steals_per_tick,idle_fraction\n";
+	for (const Result &r : results) {
+		const Result *reference = singleThreaded(r.implementation, r.agents);
+		const Result *weakReference = r.agents % r.threads == 0 ? singleThreaded(r.implementation, r.agents / r.threads) : nullptr;
+		file << Ped::getImplementationName(r.implementation) << "," << r.threads << "," << r.agents << "," << config.measuredSteps << ","
+			<< r.seconds << "," << r.updatesPerSecond(config.measuredSteps) << ",";
+		// Without a single threaded reference the efficiencies stay empty
+		if (reference) {
+			double speedup = reference->seconds / r.seconds;
+			file << speedup << "," << speedup / r.threads;
+		}
+		else {
+			file << ",";
+		}
+		file << ",";
+		if (weakReference) {
+			file << r.updatesPerSecond(config.measuredSteps) / (r.threads * weakReference->updatesPerSecond(config.measuredSteps));
+		}
+		file << "," << r.imbalance << "," << r.stealsPerTick << "," << r.idleFraction << "\n";
+	}
+	return (bool)file;
+}
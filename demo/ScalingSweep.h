@@ -0,0 +1,84 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// ScalingSweep measures how the implementations scale with the number
+// of threads and the number of agents. For every number of copies of
+// the scenario (see GenerateScenario::replicate) and every thread count
+// each implementation is run, all in the same process and from the same
+// scenario. The results are written as CSV with the throughput in agent
+// updates per second, the parallel efficiency and the load imbalance
+// between the threads.
+//
+// Strong scaling is read off the rows with the same number of agents.
+// For weak scaling, use the same list for the copies and the threads:
+// the weak efficiency compares N threads on N copies against one thread
+// on one copy.
+//
+
+#ifndef _scalingsweep_h_
+#define _scalingsweep_h_
+
+#include "ped_model.h"
+#include "ScenarioSnapshot.h"
+
+#include <vector>
+#include <string>
+
+class ScalingSweep
+{
+public:
+	struct Config {
+		std::vector<Ped::IMPLEMENTATION> implementations;
+
+		// Thread counts to try; empty means 1, 2, 4, ... up to the number
+		// of hardware threads (SMT siblings included)
+		std::vector<int> threadCounts;
+
+		// Numbers of copies of the scenario to try
+		std::vector<int> copies = { 1 };
+
+		// Pinning, huge pages, heatmap, collisions etc. of every model; the
+		// thread count comes from threadCounts instead
+		Ped::ModelOptions modelOptions;
+
+		int warmupSteps = 10;
+		int measuredSteps = 100;
+		int repetitions = 3;
+
+		std::string outputFile = "scaling.csv";
+	};
+
+	ScalingSweep(const ScenarioSnapshot &scenario, const Config &config);
+
+	// Runs the sweep and writes the CSV file, returns false if writing failed
+	bool run();
+
+private:
+	struct Result {
+		Ped::IMPLEMENTATION implementation;
+		int threads;
+		size_t agents;
+		double seconds;   // median over the repetitions
+		double imbalance; // busiest thread divided by the average thread, 1 is perfect
+
+		// Of the work stealing scheduler, which only PTHREAD uses for the agents
+		double stealsPerTick;
+		double idleFraction;
+
+		double updatesPerSecond(int ticks) const { return agents * ticks / seconds; }
+	};
+
+	const ScenarioSnapshot &scenario;
+	Config config;
+	std::vector<Result> results;
+
+	void runOne(const ScenarioSnapshot &scenario, Ped::IMPLEMENTATION implementation, int threads);
+
+	// The result of the same implementation with one thread on the given
+	// number of agents, nullptr if there is none
+	const Result* singleThreaded(Ped::IMPLEMENTATION implementation, size_t agents) const;
+
+	bool writeCsv() const;
+};
+
+#endif
@@ -0,0 +1,392 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the binary scenario snapshots.
+//
+#include "ScenarioSnapshot.h"
+
+#include <algorithm>
+#include <map>
+#include <fstream>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char SNAPSHOT_MAGIC[8] = { 'P', 'E', 'D', 'S', 'N', 'A', 'P', '\0' };
+
+// Every section starts on its own cache line
+static size_t alignSection(size_t offset) {
+	return (offset + 63) & ~(size_t)63;
+}
+
+// Byte offsets of all sections, derived from the element counts
+struct SnapshotLayout {
+	size_t waypoints, routeOffsets, routeEntries, agentX, agentY, agentRoute, obstacleOffsets, obstacleCorners,
+		sourceData, sourceLimit, sourceRoute, sinkData, total;
+
+	SnapshotLayout(size_t headerSize, uint64_t numAgents, uint64_t numWaypoints, uint64_t numRoutes, uint64_t numRouteEntries,
+		uint64_t numObstacles, uint64_t numObstacleCorners, uint64_t numSources, uint64_t numSinks) {
+		waypoints = alignSection(headerSize);
+		routeOffsets = alignSection(waypoints + numWaypoints * 3 * sizeof(double));
+		routeEntries = alignSection(routeOffsets + (numRoutes + 1) * sizeof(uint32_t));
+		agentX = alignSection(routeEntries + numRouteEntries * sizeof(uint32_t));
+		agentY = alignSection(agentX + numAgents * sizeof(int32_t));
+		agentRoute = alignSection(agentY + numAgents * sizeof(int32_t));
+		obstacleOffsets = alignSection(agentRoute + numAgents * sizeof(uint32_t));
+		obstacleCorners = alignSection(obstacleOffsets + (numObstacles + 1) * sizeof(uint32_t));
+		sourceData = alignSection(obstacleCorners + numObstacleCorners * 2 * sizeof(double));
+		sourceLimit = alignSection(sourceData + numSources * 5 * sizeof(double));
+		sourceRoute = alignSection(sourceLimit + numSources * sizeof(uint64_t));
+		sinkData = alignSection(sourceRoute + numSources * sizeof(uint32_t));
+		total = alignSection(sinkData + numSinks * 3 * sizeof(double));
+	}
+};
+
+ScenarioSnapshot::ScenarioSnapshot(const std::vector<Ped::Tagent*> &agents, const std::vector<Ped::Twaypoint*> &waypoints,
+	const std::vector<Ped::Tobstacle> &obstacles, const std::vector<Ped::Tsource> &sources, const std::vector<Ped::Tsink> &sinks)
+{
+	std::map<const Ped::Twaypoint*, uint32_t> waypointIndex;
+	std::vector<double> wps;
+	for (size_t i = 0; i < waypoints.size(); i++) {
+		waypointIndex[waypoints[i]] = i;
+		wps.push_back(waypoints[i]->getx());
+		wps.push_back(waypoints[i]->gety());
+		wps.push_back(waypoints[i]->getr());
+	}
+
+	// Agents created from the same <agent> tag share their route, so only
+	// the distinct routes are stored and each agent refers to one of them.
+	std::map<std::vector<uint32_t>, uint32_t> routeIndex;
+	std::vector<std::vector<uint32_t> > routes;
+	std::vector<uint32_t> agentRoutes(agents.size());
+	for (size_t i = 0; i < agents.size(); i++) {
+		std::vector<uint32_t> route;
+		for (auto wp : agents[i]->getWaypoints()) {
+			route.push_back(waypointIndex.at(wp));
+		}
+		auto it = routeIndex.find(route);
+		if (it == routeIndex.end()) {
+			it = routeIndex.insert(std::make_pair(route, (uint32_t)routes.size())).first;
+			routes.push_back(route);
+		}
+		agentRoutes[i] = it->second;
+	}
+
+	allocate(wps, routes, agents.size(), obstacles, sources, sinks);
+	for (size_t i = 0; i < agents.size(); i++) {
+		setAgent(i, agents[i]->getX(), agents[i]->getY(), agentRoutes[i]);
+	}
+}
+
+ScenarioSnapshot::ScenarioSnapshot(const std::vector<double> &waypointData, const std::vector<std::vector<uint32_t> > &routes, size_t numAgents,
+	const std::vector<Ped::Tobstacle> &obstacles, const std::vector<Ped::Tsource> &sources, const std::vector<Ped::Tsink> &sinks)
+{
+	allocate(waypointData, routes, numAgents, obstacles, sources, sinks);
+}
+
+void ScenarioSnapshot::allocate(const std::vector<double> &wps, const std::vector<std::vector<uint32_t> > &agentRoutes, size_t numAgents,
+	const std::vector<Ped::Tobstacle> &obstacles, const std::vector<Ped::Tsource> &sources, const std::vector<Ped::Tsink> &sinks)
+{
+	// The routes of the sources go into the same table, usually they are
+	// those of agents already
+	std::vector<std::vector<uint32_t> > routes = agentRoutes;
+	std::vector<uint32_t> sourceRoutes;
+	for (const Ped::Tsource &source : sources) {
+		std::vector<uint32_t> route(source.getRoute().begin(), source.getRoute().end());
+		sourceRoutes.push_back(std::find(routes.begin(), routes.end(), route) - routes.begin());
+		if (sourceRoutes.back() == routes.size()) {
+			routes.push_back(route);
+		}
+	}
+
+	size_t numWaypoints = wps.size() / 3;
+	size_t numRouteEntries = 0;
+	for (auto &route : routes) {
+		numRouteEntries += route.size();
+	}
+	size_t numObstacleCorners = 0;
+	for (auto &obstacle : obstacles) {
+		numObstacleCorners += obstacle.getCornerCount();
+	}
+
+	SnapshotLayout layout(sizeof(Header), numAgents, numWaypoints, routes.size(), numRouteEntries, obstacles.size(), numObstacleCorners,
+		sources.size(), sinks.size());
+	buffer.assign(layout.total, 0);
+	char *base = buffer.data();
+
+	Header *h = reinterpret_cast<Header*>(base);
+	memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+	h->version = VERSION;
+	h->headerSize = sizeof(Header);
+	h->sourceChecksum = 0;
+	h->totalSize = layout.total;
+	h->numAgents = numAgents;
+	h->numWaypoints = numWaypoints;
+	h->numRoutes = routes.size();
+	h->numRouteEntries = numRouteEntries;
+	h->numObstacles = obstacles.size();
+	h->numObstacleCorners = numObstacleCorners;
+	h->numSources = sources.size();
+	h->numSinks = sinks.size();
+	bind(base, buffer.size());
+
+	std::copy(wps.begin(), wps.end(), waypointData);
+	routeOffsets[0] = 0;
+	for (size_t r = 0; r < routes.size(); r++) {
+		std::copy(routes[r].begin(), routes[r].end(), routeEntries + routeOffsets[r]);
+		routeOffsets[r + 1] = routeOffsets[r] + routes[r].size();
+	}
+	obstacleOffsets[0] = 0;
+	for (size_t o = 0; o < obstacles.size(); o++) {
+		obstacleOffsets[o + 1] = obstacleOffsets[o] + obstacles[o].getCornerCount();
+		for (size_t i = 0; i < obstacles[o].getCornerCount(); i++) {
+			obstacleCorners[2 * (obstacleOffsets[o] + i)] = obstacles[o].getCornerX(i);
+			obstacleCorners[2 * (obstacleOffsets[o] + i) + 1] = obstacles[o].getCornerY(i);
+		}
+	}
+	for (size_t s = 0; s < sources.size(); s++) {
+		const Ped::Tsource &source = sources[s];
+		double data[5] = { source.getx(), source.gety(), source.getdx(), source.getdy(), source.getRate() };
+		std::copy(data, data + 5, sourceData + 5 * s);
+		sourceLimit[s] = source.getLimit();
+		sourceRoute[s] = sourceRoutes[s];
+	}
+	for (size_t s = 0; s < sinks.size(); s++) {
+		sinkData[3 * s] = sinks[s].getx();
+		sinkData[3 * s + 1] = sinks[s].gety();
+		sinkData[3 * s + 2] = sinks[s].getr();
+	}
+}
+
+ScenarioSnapshot::ScenarioSnapshot(ScenarioSnapshot &&other)
+{
+	*this = std::move(other);
+}
+
+ScenarioSnapshot& ScenarioSnapshot::operator=(ScenarioSnapshot &&other)
+{
+	if (this != &other) {
+		release();
+		buffer = std::move(other.buffer);
+		mapping = other.mapping;
+		mappingSize = other.mappingSize;
+		other.mapping = nullptr;
+		other.mappingSize = 0;
+		other.header = nullptr;
+
+		char *base = mapping ? (char*)mapping : buffer.data();
+		size_t size = mapping ? mappingSize : buffer.size();
+		if (size > 0) {
+			bind(base, size);
+		}
+	}
+	return *this;
+}
+
+ScenarioSnapshot::~ScenarioSnapshot()
+{
+	release();
+}
+
+void ScenarioSnapshot::release()
+{
+	if (mapping) {
+		munmap(mapping, mappingSize);
+		mapping = nullptr;
+		mappingSize = 0;
+	}
+	buffer.clear();
+	header = nullptr;
+}
+
+bool ScenarioSnapshot::bind(char *base, size_t size)
+{
+	header = nullptr;
+	if (size < sizeof(Header)) {
+		return false;
+	}
+	const Header *h = reinterpret_cast<const Header*>(base);
+	if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 || h->version != VERSION || h->headerSize != sizeof(Header)) {
+		return false;
+	}
+	SnapshotLayout layout(h->headerSize, h->numAgents, h->numWaypoints, h->numRoutes, h->numRouteEntries,
+		h->numObstacles, h->numObstacleCorners, h->numSources, h->numSinks);
+	if (h->totalSize != layout.total || size < layout.total) {
+		return false;
+	}
+
+	waypointData = reinterpret_cast<double*>(base + layout.waypoints);
+	routeOffsets = reinterpret_cast<uint32_t*>(base + layout.routeOffsets);
+	routeEntries = reinterpret_cast<uint32_t*>(base + layout.routeEntries);
+	agentX = reinterpret_cast<int32_t*>(base + layout.agentX);
+	agentY = reinterpret_cast<int32_t*>(base + layout.agentY);
+	agentRoute = reinterpret_cast<uint32_t*>(base + layout.agentRoute);
+	obstacleOffsets = reinterpret_cast<uint32_t*>(base + layout.obstacleOffsets);
+	obstacleCorners = reinterpret_cast<double*>(base + layout.obstacleCorners);
+	sourceData = reinterpret_cast<double*>(base + layout.sourceData);
+	sourceLimit = reinterpret_cast<uint64_t*>(base + layout.sourceLimit);
+	sourceRoute = reinterpret_cast<uint32_t*>(base + layout.sourceRoute);
+	sinkData = reinterpret_cast<double*>(base + layout.sinkData);
+	header = h;
+	return true;
+}
+
+bool ScenarioSnapshot::save(const std::string &filename, uint64_t sourceChecksum) const
+{
+	if (!header) {
+		return false;
+	}
+
+	// Write to a temporary file first, so that a crash never leaves a
+	// truncated snapshot behind that looks valid.
+	std::string tmpname = filename + ".tmp";
+	std::ofstream file(tmpname.c_str(), std::ios::binary | std::ios::trunc);
+	if (!file) {
+		return false;
+	}
+	Header h = *header;
+	h.sourceChecksum = sourceChecksum;
+	file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+	file.write(reinterpret_cast<const char*>(header) + sizeof(h), h.totalSize - sizeof(h));
+	file.close();
+	if (!file) {
+		unlink(tmpname.c_str());
+		return false;
+	}
+	return rename(tmpname.c_str(), filename.c_str()) == 0;
+}
+
+bool ScenarioSnapshot::load(const std::string &filename, uint64_t sourceChecksum)
+{
+	release();
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+		close(fd);
+		return false;
+	}
+	void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return false;
+	}
+	// The whole file is consumed front to back right away
+	madvise(addr, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+	mapping = addr;
+	mappingSize = st.st_size;
+	if (!bind((char*)mapping, mappingSize) || header->sourceChecksum != sourceChecksum || !validate()) {
+		release();
+		return false;
+	}
+	return true;
+}
+
+bool ScenarioSnapshot::validate() const
+{
+	// Each table of offsets starts at 0, never decreases and ends with its section
+	auto validOffsets = [](const uint32_t *offsets, uint64_t count, uint64_t entries) {
+		if (offsets[0] != 0 || offsets[count] != entries) {
+			return false;
+		}
+		for (uint64_t i = 0; i < count; i++) {
+			if (offsets[i] > offsets[i + 1]) {
+				return false;
+			}
+		}
+		return true;
+	};
+	if (!validOffsets(routeOffsets, header->numRoutes, header->numRouteEntries)
+		|| !validOffsets(obstacleOffsets, header->numObstacles, header->numObstacleCorners)) {
+		return false;
+	}
+	for (uint64_t e = 0; e < header->numRouteEntries; e++) {
+		if (routeEntries[e] >= header->numWaypoints) {
+			return false;
+		}
+	}
+	for (uint64_t i = 0; i < header->numAgents; i++) {
+		if (agentRoute[i] >= header->numRoutes) {
+			return false;
+		}
+	}
+	for (uint64_t s = 0; s < header->numSources; s++) {
+		if (sourceRoute[s] >= header->numRoutes) {
+			return false;
+		}
+	}
+	return true;
+}
+
+Ped::Model::ScenarioArrays ScenarioSnapshot::getArrays() const
+{
+	Ped::Model::ScenarioArrays arrays;
+	arrays.numWaypoints = getNumWaypoints();
+	arrays.waypoints = waypointData;
+	arrays.numRoutes = getNumRoutes();
+	arrays.routeOffsets = routeOffsets;
+	arrays.routeEntries = routeEntries;
+	arrays.numAgents = getNumAgents();
+	arrays.agentX = agentX;
+	arrays.agentY = agentY;
+	arrays.agentRoute = agentRoute;
+	return arrays;
+}
+
+std::vector<Ped::Tobstacle> ScenarioSnapshot::getObstacles() const
+{
+	std::vector<Ped::Tobstacle> obstacles(getNumObstacles());
+	for (size_t o = 0; o < obstacles.size(); o++) {
+		for (uint32_t c = obstacleOffsets[o]; c < obstacleOffsets[o + 1]; c++) {
+			obstacles[o].addCorner(obstacleCorners[2 * c], obstacleCorners[2 * c + 1]);
+		}
+	}
+	return obstacles;
+}
+
+std::vector<Ped::Tsource> ScenarioSnapshot::getSources() const
+{
+	std::vector<Ped::Tsource> sources;
+	for (size_t s = 0; s < getNumSources(); s++) {
+		const double *d = sourceData + 5 * s;
+		std::vector<size_t> route(routeEntries + routeOffsets[sourceRoute[s]], routeEntries + routeOffsets[sourceRoute[s] + 1]);
+		sources.push_back(Ped::Tsource(d[0], d[1], d[2], d[3], d[4], sourceLimit[s], route));
+	}
+	return sources;
+}
+
+std::vector<Ped::Tsink> ScenarioSnapshot::getSinks() const
+{
+	std::vector<Ped::Tsink> sinks;
+	for (size_t s = 0; s < getNumSinks(); s++) {
+		sinks.push_back(Ped::Tsink(sinkData[3 * s], sinkData[3 * s + 1], sinkData[3 * s + 2]));
+	}
+	return sinks;
+}
+
+uint64_t ScenarioSnapshot::checksumFile(const std::string &filename)
+{
+	std::ifstream file(filename.c_str(), std::ios::binary);
+	if (!file) {
+		return 0;
+	}
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	char chunk[1 << 16];
+	while (file) {
+		file.read(chunk, sizeof(chunk));
+		std::streamsize n = file.gcount();
+		for (std::streamsize i = 0; i < n; i++) {
+			hash ^= (unsigned char)chunk[i];
+			hash *= 0x100000001b3ULL;
+		}
+	}
+	return hash;
+}
@@ -0,0 +1,149 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// ScenarioSnapshot is a pre-compiled, binary version of a scenario.
+// It stores the agent positions, the table of distinct routes, the
+// waypoints, the corners of the obstacles, and the sources and sinks
+// as flat arrays, so that loading a scenario is a single mmap instead
+// of parsing XML and generating random agents, and the model places
+// the agents straight from the mapping into its arena. The checksum
+// of the source XML file is stored in the snapshot, which allows us
+// to detect (and rebuild) stale snapshots.
+//
+
+#ifndef _scenariosnapshot_h_
+#define _scenariosnapshot_h_
+
+#include "ped_model.h"
+#include "ped_agent.h"
+#include "ped_waypoint.h"
+#include "ped_obstacle.h"
+#include "ped_population.h"
+#include <vector>
+#include <string>
+#include <cstdint>
+
+class ScenarioSnapshot
+{
+public:
+	ScenarioSnapshot() {}
+
+	// Flattens an already created scenario into a snapshot
+	ScenarioSnapshot(const std::vector<Ped::Tagent*> &agents, const std::vector<Ped::Twaypoint*> &waypoints,
+		const std::vector<Ped::Tobstacle> &obstacles = std::vector<Ped::Tobstacle>(),
+		const std::vector<Ped::Tsource> &sources = std::vector<Ped::Tsource>(), const std::vector<Ped::Tsink> &sinks = std::vector<Ped::Tsink>());
+
+	// Creates a snapshot for numAgents agents, given the waypoints (as x, y, r
+	// triples), the routes (as waypoint indices), the obstacles, the
+	// sources and the sinks. The agents themselves are filled in
+	// afterwards with setAgent().
+	ScenarioSnapshot(const std::vector<double> &waypointData, const std::vector<std::vector<uint32_t> > &routes, size_t numAgents,
+		const std::vector<Ped::Tobstacle> &obstacles = std::vector<Ped::Tobstacle>(),
+		const std::vector<Ped::Tsource> &sources = std::vector<Ped::Tsource>(), const std::vector<Ped::Tsink> &sinks = std::vector<Ped::Tsink>());
+
+	ScenarioSnapshot(const ScenarioSnapshot&) = delete;
+	ScenarioSnapshot& operator=(const ScenarioSnapshot&) = delete;
+	ScenarioSnapshot(ScenarioSnapshot &&other);
+	ScenarioSnapshot& operator=(ScenarioSnapshot &&other);
+	~ScenarioSnapshot();
+
+	// Writes the snapshot to disk, tagged with the checksum of its source
+	bool save(const std::string &filename, uint64_t sourceChecksum) const;
+
+	// Maps a snapshot from disk. Fails if the file is missing, has
+	// another format version, was compiled from a different source or
+	// refers to routes or waypoints it does not have.
+	bool load(const std::string &filename, uint64_t sourceChecksum);
+
+	// The agents, routes and waypoints, for Ped::Model::setup(), which
+	// places them straight into its arena
+	Ped::Model::ScenarioArrays getArrays() const;
+
+	// The obstacles of the scenario, for Ped::Model::setObstacles()
+	std::vector<Ped::Tobstacle> getObstacles() const;
+
+	// The sources and sinks, for Ped::Model::setSources() and setSinks()
+	std::vector<Ped::Tsource> getSources() const;
+	std::vector<Ped::Tsink> getSinks() const;
+
+	size_t getNumAgents() const { return header ? header->numAgents : 0; }
+	size_t getNumWaypoints() const { return header ? header->numWaypoints : 0; }
+	size_t getNumRoutes() const { return header ? header->numRoutes : 0; }
+	size_t getNumObstacles() const { return header ? header->numObstacles : 0; }
+	size_t getNumSources() const { return header ? header->numSources : 0; }
+	size_t getNumSinks() const { return header ? header->numSinks : 0; }
+
+	// Read access to the flat arrays
+	const double* getWaypointData() const { return waypointData; }
+	const uint32_t* getRouteOffsets() const { return routeOffsets; }
+	const uint32_t* getRouteEntries() const { return routeEntries; }
+	const int32_t* getAgentX() const { return agentX; }
+	const int32_t* getAgentY() const { return agentY; }
+	const uint32_t* getAgentRoute() const { return agentRoute; }
+
+	// Places agent i. Only valid for snapshots built in memory.
+	void setAgent(size_t i, int32_t x, int32_t y, uint32_t route) {
+		agentX[i] = x;
+		agentY[i] = y;
+		agentRoute[i] = route;
+	}
+
+	// Checksum (64 bit FNV-1a) over the contents of a file, 0 if it can't be read
+	static uint64_t checksumFile(const std::string &filename);
+
+	// The snapshot that belongs to a scenario file
+	static std::string snapshotFilename(const std::string &scenefile) { return scenefile + ".snap"; }
+
+	// Bump whenever the layout below changes
+	static const uint32_t VERSION = 3;
+
+private:
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t headerSize;
+		uint64_t sourceChecksum;
+		uint64_t totalSize;
+		uint64_t numAgents;
+		uint64_t numWaypoints;
+		uint64_t numRoutes;
+		uint64_t numRouteEntries;
+		uint64_t numObstacles;
+		uint64_t numObstacleCorners;
+		uint64_t numSources;
+		uint64_t numSinks;
+	};
+
+	// Views into either the mapped file (read only) or the owned buffer
+	const Header *header = nullptr;
+	double *waypointData = nullptr;   // x, y, r per waypoint
+	uint32_t *routeOffsets = nullptr; // numRoutes + 1 entries
+	uint32_t *routeEntries = nullptr; // waypoint indices
+	int32_t *agentX = nullptr;
+	int32_t *agentY = nullptr;
+	uint32_t *agentRoute = nullptr;
+	uint32_t *obstacleOffsets = nullptr; // numObstacles + 1 entries
+	double *obstacleCorners = nullptr;   // x, y per corner
+	double *sourceData = nullptr;        // x, y, dx, dy, rate per source
+	uint64_t *sourceLimit = nullptr;
+	uint32_t *sourceRoute = nullptr;     // index into the routes
+	double *sinkData = nullptr;          // x, y, r per sink
+
+	std::vector<char> buffer;
+	void *mapping = nullptr;
+	size_t mappingSize = 0;
+
+	// Creates the owned buffer and fills in everything but the agents
+	void allocate(const std::vector<double> &waypointData, const std::vector<std::vector<uint32_t> > &routes, size_t numAgents,
+		const std::vector<Ped::Tobstacle> &obstacles, const std::vector<Ped::Tsource> &sources, const std::vector<Ped::Tsink> &sinks);
+
+	// Computes the section pointers from the start of a snapshot
+	bool bind(char *base, size_t size);
+
+	// Checks that the offsets and indices of a mapped file stay within
+	// their sections
+	bool validate() const;
+	void release();
+};
+
+#endif
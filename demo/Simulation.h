@@ -2,21 +2,51 @@
 #define _abs_simulation_h_
 
 #include "ped_model.h"
+#include <algorithm>
+#include <string>
 
 class Simulation {
     public:
+        // A simulation continues from the tick the model is at, which is
+        // not 0 if the model was restored from a checkpoint.
         Simulation(Ped::Model &model_, int maxSteps)
-            : model(model_), maxSimulationSteps(maxSteps), tickCounter(0)
+            : model(model_), maxSimulationSteps(maxSteps), tickCounter(model_.getTickCount())
             {}
         Simulation() = delete;
         virtual ~Simulation() {}
 
         virtual int getTickCount() const { return tickCounter; };
         virtual void runSimulation() = 0;
+
+        // Saves a checkpoint of the model every checkpointEvery ticks
+        void setCheckpointing(int checkpointEvery, std::string checkpointFilename) {
+            checkpointInterval = checkpointEvery;
+            checkpointFile = checkpointFilename;
+        }
     protected:
         Ped::Model &model;
         int maxSimulationSteps;
         int tickCounter;
+
+        int checkpointInterval = 0;
+        std::string checkpointFile;
+
+        // Called after each tick
+        void checkpointIfDue() {
+            if (checkpointInterval > 0 && tickCounter % checkpointInterval == 0) {
+                model.saveCheckpoint(checkpointFile);
+            }
+        }
+
+        // The ticks until the next checkpoint or the end, which can run in
+        // one call of Ped::Model::tick(int)
+        int ticksUntilCheckpoint() const {
+            int ticks = maxSimulationSteps - tickCounter;
+            if (checkpointInterval > 0) {
+                ticks = std::min(ticks, checkpointInterval - tickCounter % checkpointInterval);
+            }
+            return ticks;
+        }
 };
 
 #endif
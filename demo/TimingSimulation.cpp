@@ -8,8 +8,12 @@ TimingSimulation::TimingSimulation(Ped::Model &model_, int maxSteps) : Simulatio
 
 void TimingSimulation::runSimulation()
 {
-    for (int i = 0; i < maxSimulationSteps; i++) {
-        tickCounter++;
-        model.tick();
+    // The ticks between two checkpoints in one batch, without going back
+    // to the workers for each of them
+    while (tickCounter < maxSimulationSteps) {
+        int ticks = ticksUntilCheckpoint();
+        model.tick(ticks);
+        tickCounter += ticks;
+        checkpointIfDue();
     }
 }
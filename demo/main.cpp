@@ -11,12 +11,18 @@
 #undef max
 #include "ped_model.h"
 #include "ParseScenario.h"
+#include "ScenarioSnapshot.h"
+#include "GenerateScenario.h"
 
 #include <thread>
 
 #include "Simulation.h"
 #include "TimingSimulation.h"
 #include "ExportSimulation.h"
+#include "Benchmark.h"
+#include "ScalingSweep.h"
+#include "LockstepVerifier.h"
+#include "ped_trace.h"
 #ifndef NOQT
 #include "QTSimulation.h"
 #include <QGraphicsView>
@@ -29,6 +35,7 @@
 #include <chrono>
 #include <ctime>
 #include <cstring>
+#include <sstream>
 
 #pragma comment(lib, "libpedsim.lib")
 
@@ -38,20 +45,177 @@
 
 
 void print_usage(char *command) {
-    printf("Usage: %s [--timing-mode|--export-trace[=export_trace.bin]] [--max-steps=100] [--help] [--cuda|--simd|--omp|--pthread|--seq] [scenario filename]\n", command);
+    printf("Usage: %s [--timing-mode|--benchmark|--scaling-sweep[=scaling.csv]|--verify[=seq]|--export-trace[=export_trace.bin]|--compile-scenario[=scenario.xml.snap]] [--max-steps=100] [--checkpoint-every=N] [--resume[=checkpoint.bin]] [--trace=trace.json] [--generate=corridor|crossing|ring|box [--agents=100000] [--seed=1] [--density=0.5]] [--replicate=N] [--threads=N] [--pin=compact|scatter|cpu list] [--numa-report] [--huge-pages=none|thp|hugetlb] [--memory-report] [--heatmap] [--reorder] [--collisions [--lod|--verify-lod]] [--flow-fields[=64]] [--fast-math|--validate-fast-math] [--compact-every=16] [--help] [--cuda|--simd|--omp|--pthread|--seq|--hybrid|--pstl|--social|--auto [--autotune-cache=autotune.cache]] [scenario filename]\n", command);
     printf("There are three modes of execution:\n");
 #ifndef NOQT
     printf("\t the QT window mode (default if no argument is provided. But this is also deprecated. Please opt to use the --export-trace mode instead)\n");
 #endif
     printf("\t the --export-trace mode: where the agent movement are stored in a trace file and can be visualized by a separate python tool.\n");
     printf("\t the --timing-mode: the mode where no visualization is done and can be used to measure the performance of your implementation/optimization\n");
+    printf("\t the --benchmark mode: runs each implementation given by --implementations=seq,omp,pthread,simd,hybrid,pstl (default: all of them) for --repetitions=5 times, with --warmup=10 warmup ticks and --max-steps measured ticks each, and reports tick latency percentiles and the steals per tick and idle time of the work stealing scheduler that runs the pthread implementation and the heatmap. --bench-output=prefix writes prefix.json and prefix.csv; --baseline=file.csv flags implementations whose median tick latency regressed by more than --regression-threshold=5 percent (exit code 2). --perf-counters adds one repetition that reads the hardware performance counters per stage of the tick (desired, move, heatmap.blur, ..., run one after the other) and reports IPC, cache/branch/TLB misses, memory traffic per agent and GB/s.\n");
+    printf("\t the --scaling-sweep mode: runs each implementation given by --implementations with every thread count of --threads=1,2,4 (default: powers of two up to the number of hardware threads) on every number of copies of the scenario given by --copies=1,2,4 (default: 1), and writes the throughput in agent updates per second, the parallel efficiency the load imbalance between threads and the steals per tick and idle fraction of the work stealing scheduler as CSV. The models run with all other options given (--heatmap, --collisions, --flow-fields, --fast-math, --reorder, ...). --threads=N also sets the number of threads of the omp, hybrid, pthread and pstl implementations in the other modes.\n");
+    printf("\t the --verify mode: runs the implementation to test in lockstep with the given reference implementation (default: seq) on the same scenario, with the same --collisions and --heatmap, and compares the positions of all agents and the heatmap after every tick. It stops at the first tick where they differ and lists the agents that do, farthest apart first (exit code 1).\n");
+    printf("\n--pin=compact|scatter|0,2,4-7 pins the threads of the omp, hybrid and pthread implementations to cores: compact fills a core and a socket before moving on, scatter spreads consecutive threads over the sockets, or the given list of CPUs is used in order. --numa-report prints where the threads run and on which NUMA nodes the memory of the agents and the heatmap is.\n");
+    printf("\n--huge-pages=thp backs the memory of the model (agents, routes, heatmaps) with transparent huge pages, --huge-pages=hugetlb with reserved huge pages (see /proc/sys/vm/nr_hugepages). --memory-report prints how much memory each part of the model takes and how much of it is on huge pages.\n");
+    printf("\n--heatmap also updates the heatmap of the agent density on every tick (in the timing, benchmark, export and graphics modes), in stages that overlap with the update of the agents and the export.\n");
+    printf("\n--reorder keeps the agents sorted in memory along a Morton curve (in the timing, export and benchmark modes), so that agents close in space are close in memory. They are sorted again whenever the order decayed as they walked. The export still writes the agents in the order of the scenario.\n");
+    printf("\n--collisions makes the agents avoid each other: each one moves to the first free cell of its desired position and the two next to it, or stays. Agents that are stuck sleep until a cell next to them is freed, so jammed agents cost nothing. The agents move one after the other with every implementation.\n");
+    printf("\n--lod lets the agents that are far from all others skip the collision avoidance: they step straight ahead in parallel for a few ticks in which nobody can get in their way. --verify-lod checks every such step against the collision avoidance and fails if one differs.\n");
+    printf("\n--flow-fields makes the seq, pthread and omp implementations and the collision avoidance look up the step of each agent towards its destination in precomputed per waypoint tables instead of computing it. The tables are built in tiles as the agents need them; at most the given number of MB (default 64) is kept, the tiles used least recently are dropped.\n");
+    printf("\nA scenario can have <obstacle> elements, either rectangles (x, y, width, height) or polygons of <corner x=\"..\" y=\"..\"/> elements (two corners make a wall). The agents then follow the shortest paths around them to their waypoints, which are computed once for the whole grid; they use the flow fields (as with --flow-fields), with every implementation: vector runs as seq, hybrid as omp and pstl as pthread. See scenario_walls.xml.\n");
+    printf("\nA scenario can also have <source x y dx dy rate limit> elements with <addwaypoint id> elements, which emit rate agents per tick (e.g. 0.5 for one every other tick), limit in total (0 for no limit), onto random free cells of the dx x dy area around x/y with the given route, and <sink x y r> elements, which remove the agents within r of x/y (in the timing, export, verify and benchmark modes). The slots of removed agents are reused by new agents, and those left are compacted away every --compact-every=16 ticks. See scenario_sources.xml.\n");
+    printf("\n--hybrid runs the SIMD kernel (AVX-512, AVX or SSE, whichever the library is compiled for) on OpenMP threads, each over its own share of the agents. --pstl runs per agent kernels with the C++17 parallel algorithms (std::execution::par_unseq), which is also what --cuda runs when the library is built without CUDA.\n");
+    printf("\n--fast-math makes the seq, pthread, omp and simd implementations compute the steps with approximate math: a reciprocal square root estimate refined by one Newton step instead of a square root and a division, the arrival test on squared distances and fused multiply-adds. --validate-fast-math also computes each step with the exact math and reports how many agents would have moved differently, per tick.\n");
+    printf("\n--social moves the agents continuously instead of one cell per tick: each accelerates towards its destination (around the obstacles along the flow fields) and is pushed away by the agents and obstacles within 1.5 cells, found through cell lists. The forces are summed up with SIMD over the neighbors and the rows of cells are spread over OpenMP threads (--threads). The export and the heatmap see the positions rounded to cells; --collisions has no effect. social is not part of the default --implementations.\n");
+    printf("\n--auto times each implementation with each thread count (or the one given by --threads) on the scenario for a few ticks and runs the fastest. The choice is kept in --autotune-cache=autotune.cache (--autotune-cache= for none) per scenario, CPU model and heatmap setting, so later runs skip the calibration. auto can also be benchmarked with --implementations.\n");
+    printf("\nThe --compile-scenario option writes a binary snapshot of the scenario next to the XML file (or to the given filename) and exits. Later runs load the snapshot instead of parsing the XML, as long as the XML file did not change.\n");
+    printf("\nWith --checkpoint-every=N the state of the simulation is saved to checkpoint.bin every N ticks (in timing mode only for the target version). A stopped run continues from the last checkpoint with --resume, until --max-steps ticks are simulated in total.\n");
+    printf("\nInstead of reading a scenario file, --generate builds a scenario with --agents agents in one of the given layouts. --replicate=N tiles N copies of the scenario (read or generated) side by side. Both are meant for scale testing; note that the export trace only stores coordinates up to 32767.\n");
+    printf("\n--trace writes the time spent in each phase of the tick, per thread, as Chrome trace JSON (open in chrome://tracing or ui.perfetto.dev). Requires a build with make TRACE=1.\n");
     printf("\nIf you need visualization, please try using the --export-trace mode. You can even copy the trace file to your computer and locally run the python visualizer. (You'll need to fork the assignment repository on your local machine too.)\n");
 }
 
 
+// Parses the XML scenario and flattens it into a snapshot
+ScenarioSnapshot compileScenario(const std::string &scenefile) {
+    ParseScenario parser(scenefile);
+    std::vector<Ped::Tagent*> agents = parser.getAgents();
+    std::vector<Ped::Twaypoint*> waypoints = parser.getWaypoints();
+    ScenarioSnapshot snapshot(agents, waypoints, parser.getObstacles(), parser.getSources(), parser.getSinks());
+    for (auto a : agents) delete a;
+    for (auto w : waypoints) delete w;
+    return snapshot;
+}
+
+// Loads the scenario, preferring an up-to-date compiled snapshot over the XML
+// file. A snapshot that was compiled from an older version of the XML file is
+// rebuilt on the fly.
+ScenarioSnapshot loadScenario(const std::string &scenefile) {
+    std::string snapfile = ScenarioSnapshot::snapshotFilename(scenefile);
+    uint64_t checksum = ScenarioSnapshot::checksumFile(scenefile);
+
+    ScenarioSnapshot snapshot;
+    if (access(snapfile.c_str(), F_OK) == 0) {
+        if (snapshot.load(snapfile, checksum)) {
+            std::cout << "Loaded compiled scenario " << snapfile << " (" << snapshot.getNumAgents() << " agents)" << std::endl;
+            return snapshot;
+        }
+        std::cout << "Compiled scenario " << snapfile << " is stale, rebuilding it." << std::endl;
+    }
+
+    snapshot = compileScenario(scenefile);
+    if (access(snapfile.c_str(), F_OK) == 0 && !snapshot.save(snapfile, checksum)) {
+        std::cerr << "Could not rebuild " << snapfile << std::endl;
+    }
+    return snapshot;
+}
+
+// Parses a comma separated list of positive numbers
+std::vector<int> parseNumberList(const char *text) {
+    std::vector<int> numbers;
+    std::stringstream list(text);
+    std::string number;
+    while (std::getline(list, number, ',')) {
+        int n = std::stoi(number);
+        if (n < 1) {
+            std::cerr << "Expected a positive number instead of " << number << std::endl;
+            exit(1);
+        }
+        numbers.push_back(n);
+    }
+    return numbers;
+}
+
+// Sets up the model with the scenario, which it copies into its arena
+void setupModel(Ped::Model &model, const ScenarioSnapshot &scenario, Ped::IMPLEMENTATION implementation, const Ped::ModelOptions &options,
+                bool numa_report = false, bool memory_report = false, bool dynamic_population = true) {
+    model.setObstacles(scenario.getObstacles());
+    if (dynamic_population) {
+        model.setSources(scenario.getSources());
+        model.setSinks(scenario.getSinks());
+    }
+    model.setOptions(options);
+    model.setup(scenario.getArrays(), implementation);
+    if (numa_report) {
+        std::cout << model.getPlacementReport();
+    }
+    if (memory_report) {
+        std::cout << model.getMemoryReport();
+    }
+}
+
+// The options of the sequential reference of the timing and verify
+// modes: only those that change what the simulation computes
+Ped::ModelOptions referenceOptions(const Ped::ModelOptions &options) {
+    Ped::ModelOptions reference;
+    reference.pageMode = options.pageMode;
+    reference.heatmap = options.heatmap;
+    reference.collisions = options.collisions;
+    reference.compactionInterval = options.compactionInterval;
+    return reference;
+}
+
+// Reports the steps of the isolated agents, returns false if some of
+// them differ from the collision avoidance
+bool reportLod(const Ped::Model &model, bool verify_lod) {
+    std::cout << "Steps of isolated agents: " << model.getLodStepCount() << std::endl;
+    if (!verify_lod) {
+        return true;
+    }
+    std::cout << "Level of detail verification: " << model.getLodViolationCount() << " steps differ from the collision avoidance" << std::endl;
+    return model.getLodViolationCount() == 0;
+}
+
+// Reports how many agents the sources and sinks added and removed
+void reportPopulation(const Ped::Model &model) {
+    if (model.hasDynamicPopulation()) {
+        std::cout << "Agents spawned: " << model.getSpawnCount() << " (" << model.getRejectedSpawnCount() << " rejected), removed: "
+                  << model.getRemovalCount() << ", live: " << model.getLiveAgentCount() << ", compactions: " << model.getCompactionCount() << std::endl;
+    }
+}
+
+// Reports how many tiles of the flow fields were built and dropped
+void reportFlowFields(const Ped::Model &model) {
+    const Ped::FlowFields *fields = model.getFlowFields();
+    if (fields) {
+        std::cout << "Flow field tiles built: " << fields->getBuiltTileCount() << ", evicted: " << fields->getEvictedTileCount()
+                  << ", resident: " << fields->getResidentTileCount() << std::endl;
+    }
+}
+
+// Reports how many desired cells of the fast math differed from the exact
+// math, with validation
+void reportFastMath(const Ped::Model &model) {
+    const std::vector<long> &mismatches = model.getFastMathMismatches();
+    if (mismatches.empty()) {
+        return;
+    }
+    long total = 0;
+    size_t worst = 0;
+    for (size_t t = 0; t < mismatches.size(); t++) {
+        total += mismatches[t];
+        if (mismatches[t] > mismatches[worst]) {
+            worst = t;
+        }
+    }
+    std::cout << "Fast math validation: " << total << " of " << mismatches.size() * model.getAgents().size()
+              << " agent moves differ from the exact math, " << (double)total / mismatches.size() << " per tick on average, at most "
+              << mismatches[worst] << " (in tick " << worst + 1 << ")" << std::endl;
+}
 
 int main(int argc, char*argv[]) {
     bool timing_mode = false;
+    bool benchmark_mode = false;
+    Benchmark::Config benchmark_config;
+    bool scaling_sweep = false;
+    bool verify = false;
+    Ped::IMPLEMENTATION verify_reference = Ped::SEQ;
+    // Filled from the options below and shared by all modes
+    Ped::ModelOptions model_options;
+    model_options.tuningCache = "autotune.cache";
+    bool numa_report = false;
+    bool memory_report = false;
+    ScalingSweep::Config sweep_config;
 #ifndef NOQT
     bool export_trace = false; // If no QT, export_trace is default
 #else
@@ -61,6 +225,17 @@ int main(int argc, char*argv[]) {
     int max_steps = 100;
     Ped::IMPLEMENTATION implementation_to_test = Ped::SEQ;
     std::string export_trace_file = "";
+    bool compile_scenario = false;
+    std::string compiled_scenario_file = "";
+    int checkpoint_every = 0;
+    std::string generate_layout = "";
+    size_t generate_agents = 100000;
+    unsigned int generate_seed = 1;
+    double generate_density = 0.5;
+    int replicate = 1;
+    std::string trace_file = "";
+    bool resume = false;
+    std::string checkpoint_file = "checkpoint.bin";
 
     // Parsing the command line arguments. Feel free to add your own
     // configurations.
@@ -69,6 +244,28 @@ int main(int argc, char*argv[]) {
     while (1) {
         static struct option long_options[] = {
             {"timing-mode", no_argument, NULL, 't'},
+            {"benchmark", no_argument, NULL, 'b'},
+            {"implementations", required_argument, NULL, 'I'},
+            {"warmup", required_argument, NULL, 'w'},
+            {"repetitions", required_argument, NULL, 'N'},
+            {"bench-output", required_argument, NULL, 'O'},
+            {"baseline", required_argument, NULL, 'B'},
+            {"regression-threshold", required_argument, NULL, 'T'},
+            {"perf-counters", no_argument, NULL, 'P'},
+            {"scaling-sweep", optional_argument, NULL, 'W'},
+            {"verify", optional_argument, NULL, 'E'},
+            {"threads", required_argument, NULL, 'j'},
+            {"copies", required_argument, NULL, 'K'},
+            {"pin", required_argument, NULL, 'A'},
+            {"numa-report", no_argument, NULL, 'U'},
+            {"huge-pages", required_argument, NULL, 'H'},
+            {"memory-report", no_argument, NULL, 'M'},
+            {"heatmap", no_argument, NULL, 'Y'},
+            {"reorder", no_argument, NULL, 'z'},
+            {"collisions", no_argument, NULL, 'G'},
+            {"lod", no_argument, NULL, 'l'},
+            {"verify-lod", no_argument, NULL, 'v'},
+            {"flow-fields", optional_argument, NULL, 'f'},
             {"export-trace", optional_argument, NULL, 'e'},
             {"max-steps", required_argument, NULL, 'm'},
             {"help", no_argument, NULL, 'h'},
@@ -77,6 +274,23 @@ int main(int argc, char*argv[]) {
             {"omp", no_argument, NULL, 'o'},
             {"pthread", no_argument, NULL, 'p'},
             {"seq", no_argument, NULL, 'q'},
+            {"hybrid", no_argument, NULL, 'y'},
+            {"pstl", no_argument, NULL, 'L'},
+            {"social", no_argument, NULL, 'X'},
+            {"fast-math", no_argument, NULL, 'F'},
+            {"validate-fast-math", no_argument, NULL, 'V'},
+            {"compact-every", required_argument, NULL, 'J'},
+            {"auto", no_argument, NULL, 'a'},
+            {"autotune-cache", required_argument, NULL, 'Q'},
+            {"compile-scenario", optional_argument, NULL, 'C'},
+            {"checkpoint-every", required_argument, NULL, 'k'},
+            {"resume", optional_argument, NULL, 'r'},
+            {"generate", required_argument, NULL, 'g'},
+            {"agents", required_argument, NULL, 'n'},
+            {"seed", required_argument, NULL, 'S'},
+            {"density", required_argument, NULL, 'd'},
+            {"replicate", required_argument, NULL, 'R'},
+            {"trace", required_argument, NULL, 'x'},
             {0, 0, 0, 0}  // End of options
         };
 
@@ -94,6 +308,139 @@ int main(int argc, char*argv[]) {
                 timing_mode = true;
                 export_trace = false;
                 break;
+            case 'b':
+                // Handle --benchmark
+                std::cout << "Option --benchmark activated\n";
+                benchmark_mode = true;
+                export_trace = false;
+                break;
+            case 'I':
+                // Handle --implementations with a comma separated list
+                {
+                    std::stringstream list(optarg);
+                    std::string name;
+                    while (std::getline(list, name, ',')) {
+                        Ped::IMPLEMENTATION implementation;
+                        if (!Ped::parseImplementation(name, implementation)) {
+                            std::cerr << "Unknown implementation " << name << std::endl;
+                            exit(1);
+                        }
+                        benchmark_config.implementations.push_back(implementation);
+                    }
+                }
+                break;
+            case 'w':
+                benchmark_config.warmupSteps = std::stoi(optarg);
+                sweep_config.warmupSteps = benchmark_config.warmupSteps;
+                break;
+            case 'N':
+                benchmark_config.repetitions = std::stoi(optarg);
+                sweep_config.repetitions = benchmark_config.repetitions;
+                break;
+            case 'O':
+                benchmark_config.outputPrefix = optarg;
+                break;
+            case 'B':
+                benchmark_config.baselineFile = optarg;
+                break;
+            case 'T':
+                benchmark_config.regressionThreshold = std::stod(optarg);
+                break;
+            case 'P':
+                benchmark_config.perfCounters = true;
+                break;
+            case 'W':
+                // Handle --scaling-sweep
+                std::cout << "Option --scaling-sweep activated\n";
+                scaling_sweep = true;
+                export_trace = false;
+                if (optarg) {
+                    sweep_config.outputFile = optarg;
+                }
+                break;
+            case 'E':
+                // Handle --verify, with the reference implementation
+                std::cout << "Option --verify activated\n";
+                verify = true;
+                export_trace = false;
+                if (optarg != NULL && !Ped::parseImplementation(optarg, verify_reference)) {
+                    std::cerr << "Unknown implementation " << optarg << std::endl;
+                    exit(1);
+                }
+                break;
+            case 'j':
+                sweep_config.threadCounts = parseNumberList(optarg);
+                break;
+            case 'K':
+                sweep_config.copies = parseNumberList(optarg);
+                break;
+            case 'A':
+                // Handle --pin
+                if (!Ped::ThreadPinning::parse(optarg, model_options.pinning)) {
+                    std::cerr << "Invalid pinning " << optarg << ", expected compact, scatter or a list of allowed CPUs" << std::endl;
+                    exit(1);
+                }
+                std::cout << "Option --pin set to: " << optarg << std::endl;
+                break;
+            case 'U':
+                numa_report = true;
+                break;
+            case 'H':
+                // Handle --huge-pages
+                if (!Ped::Arena::parsePageMode(optarg, model_options.pageMode)) {
+                    std::cerr << "Invalid huge pages " << optarg << ", expected none, thp or hugetlb" << std::endl;
+                    exit(1);
+                }
+                std::cout << "Option --huge-pages set to: " << optarg << std::endl;
+                break;
+            case 'M':
+                memory_report = true;
+                break;
+            case 'Y':
+                model_options.heatmap = true;
+                break;
+            case 'z':
+                model_options.reorder = true;
+                break;
+            case 'G':
+                model_options.collisions = true;
+                break;
+            case 'l':
+                // Handle --lod, which is part of the collision avoidance
+                model_options.collisions = true;
+                model_options.lod = true;
+                break;
+            case 'v':
+                model_options.collisions = true;
+                model_options.lod = true;
+                model_options.verifyLod = true;
+                break;
+            case 'f':
+                // Handle --flow-fields, with the budget in MB
+                model_options.flowFields = true;
+                if (optarg != NULL) {
+                    if (atoi(optarg) <= 0) {
+                        std::cerr << "Invalid flow field budget " << optarg << ", expected a number of MB" << std::endl;
+                        exit(1);
+                    }
+                    model_options.flowFieldBudget = (size_t)atoi(optarg) << 20;
+                }
+                break;
+            case 'F':
+                model_options.fastMath = true;
+                break;
+            case 'V':
+                model_options.fastMath = true;
+                model_options.validateFastMath = true;
+                break;
+            case 'J':
+                // Handle --compact-every with a numerical argument
+                model_options.compactionInterval = std::stoi(optarg);
+                if (model_options.compactionInterval < 1) {
+                    std::cerr << "Invalid compaction interval " << optarg << ", expected a number of ticks" << std::endl;
+                    exit(1);
+                }
+                break;
             case 'e':
                 // Handle --export-trace
                 export_trace = true;
@@ -136,6 +483,83 @@ int main(int argc, char*argv[]) {
                 std::cout << "Option --seq activated\n";
                 implementation_to_test = Ped::SEQ;
                 break;
+            case 'y':
+                // Handle --hybrid
+                std::cout << "Option --hybrid activated\n";
+                implementation_to_test = Ped::HYBRID;
+                break;
+            case 'L':
+                // Handle --pstl
+                std::cout << "Option --pstl activated\n";
+                implementation_to_test = Ped::PSTL;
+                break;
+            case 'X':
+                // Handle --social
+                std::cout << "Option --social activated\n";
+                implementation_to_test = Ped::SOCIAL;
+                break;
+            case 'a':
+                // Handle --auto
+                std::cout << "Option --auto activated\n";
+                implementation_to_test = Ped::AUTO;
+                break;
+            case 'Q':
+                model_options.tuningCache = optarg;
+                break;
+            case 'C':
+                // Handle --compile-scenario
+                compile_scenario = true;
+                if (optarg != NULL) {
+                    compiled_scenario_file = optarg;
+                }
+                break;
+            case 'k':
+                // Handle --checkpoint-every with a numerical argument
+                checkpoint_every = std::stoi(optarg);
+                std::cout << "Option --checkpoint-every set to: " << checkpoint_every << std::endl;
+                break;
+            case 'r':
+                // Handle --resume
+                resume = true;
+                if (optarg != NULL) {
+                    checkpoint_file = optarg;
+                }
+                std::cout << "Option --resume from: " << checkpoint_file << std::endl;
+                break;
+            case 'g':
+                // Handle --generate
+                generate_layout = optarg;
+                std::cout << "Option --generate set to: " << generate_layout << std::endl;
+                break;
+            case 'n':
+                // Handle --agents with a numerical argument
+                generate_agents = std::stoul(optarg);
+                std::cout << "Option --agents set to: " << generate_agents << std::endl;
+                break;
+            case 'S':
+                // Handle --seed with a numerical argument
+                generate_seed = std::stoul(optarg);
+                std::cout << "Option --seed set to: " << generate_seed << std::endl;
+                break;
+            case 'd':
+                // Handle --density with a numerical argument
+                generate_density = std::stod(optarg);
+                std::cout << "Option --density set to: " << generate_density << std::endl;
+                break;
+            case 'R':
+                // Handle --replicate with a numerical argument
+                replicate = std::stoi(optarg);
+                std::cout << "Option --replicate set to: " << replicate << std::endl;
+                break;
+            case 'x':
+                // Handle --trace
+                trace_file = optarg;
+                if (!Ped::Trace::isCompiledIn()) {
+                    std::cerr << "Tracing is not compiled in, rebuild with make TRACE=1" << std::endl;
+                    exit(1);
+                }
+                std::cout << "Option --trace set to: " << trace_file << std::endl;
+                break;
             case 'm':
                 // Handle --max-steps with a numerical argument
                 max_steps = std::stoi(optarg);  // Convert the argument to an integer
@@ -161,18 +585,90 @@ int main(int argc, char*argv[]) {
         }
     }
 
+    if (compile_scenario) {
+        if (compiled_scenario_file.empty()) {
+            compiled_scenario_file = ScenarioSnapshot::snapshotFilename(scenefile);
+        }
+        auto start = std::chrono::steady_clock::now();
+        ScenarioSnapshot snapshot = compileScenario(scenefile);
+        if (!snapshot.save(compiled_scenario_file, ScenarioSnapshot::checksumFile(scenefile))) {
+            std::cerr << "Error writing compiled scenario " << compiled_scenario_file << std::endl;
+            return 1;
+        }
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now() - start);
+        std::cout << "Compiled " << scenefile << " into " << compiled_scenario_file << ": " << snapshot.getNumAgents() << " agents, "
+            << snapshot.getNumWaypoints() << " waypoints, " << snapshot.getNumRoutes() << " routes (" << duration.count() << " milliseconds)" << std::endl;
+        return 0;
+    }
+
     int retval = 0;
     { // This scope is for the purpose of removing false memory leak positives
+        ScenarioSnapshot scenario;
+        if (generate_layout.empty()) {
+            scenario = loadScenario(scenefile);
+        } else {
+            GenerateScenario::Layout layout;
+            if (!GenerateScenario::parseLayout(generate_layout, layout)) {
+                std::cerr << "Unknown layout " << generate_layout << std::endl;
+                print_usage(argv[0]);
+                exit(1);
+            }
+            auto start = std::chrono::steady_clock::now();
+            scenario = GenerateScenario::generate(layout, generate_agents, generate_seed, generate_density);
+            auto duration = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now() - start);
+            std::cout << "Generated " << generate_layout << " scenario with " << scenario.getNumAgents() << " agents in " << duration.count() << " milliseconds" << std::endl;
+        }
+        if (replicate > 1) {
+            scenario = GenerateScenario::replicate(scenario, replicate);
+            std::cout << "Replicated scenario " << replicate << " times, " << scenario.getNumAgents() << " agents" << std::endl;
+        }
+
+        // Outside of the sweep, the first thread count is used
+        model_options.numThreads = sweep_config.threadCounts.empty() ? 0 : sweep_config.threadCounts[0];
 
+        if (scaling_sweep) {
+            sweep_config.implementations = benchmark_config.implementations;
+            if (sweep_config.implementations.empty()) {
+                sweep_config.implementations = { Ped::SEQ, Ped::OMP, Ped::PTHREAD, Ped::VECTOR, Ped::HYBRID, Ped::PSTL };
+            }
+            sweep_config.measuredSteps = max_steps;
+            sweep_config.modelOptions = model_options;
+            ScalingSweep sweep(scenario, sweep_config);
+            if (!sweep.run()) {
+                retval = 1;
+            }
+        }
+        else if (benchmark_mode) {
+            if (benchmark_config.implementations.empty()) {
+                benchmark_config.implementations = { Ped::SEQ, Ped::OMP, Ped::PTHREAD, Ped::VECTOR, Ped::HYBRID, Ped::PSTL };
+            }
+            benchmark_config.measuredSteps = max_steps;
+            benchmark_config.modelOptions = model_options;
+            benchmark_config.scenarioName = generate_layout.empty() ? scenefile : generate_layout;
+            Benchmark benchmark(scenario, benchmark_config);
+            if (!benchmark.run()) {
+                retval = 2;
+            }
+        }
+        else if (verify) {
+            Ped::Model reference, target;
+            setupModel(reference, scenario, verify_reference, referenceOptions(model_options));
+            setupModel(target, scenario, implementation_to_test, model_options, numa_report, memory_report);
+            LockstepVerifier::Config verify_config;
+            verify_config.maxSteps = max_steps;
+            LockstepVerifier verifier(reference, target, verify_config);
+            if (!verifier.run()) {
+                retval = 1;
+            }
+        }
         // Timing version
         // Run twice, without the gui, to compare the runtimes.
-        if (timing_mode) {
+        else if (timing_mode) {
             // Run sequentially
             double fps_seq, fps_target;
             {
                 Ped::Model model;
-                ParseScenario parser(scenefile);
-                model.setup(parser.getAgents(), parser.getWaypoints(), Ped::SEQ);
+                setupModel(model, scenario, Ped::SEQ, referenceOptions(model_options));
                 Simulation *simulation = new TimingSimulation(model, max_steps);
 
                 // Simulation mode to use when profiling (without any GUI)
@@ -188,9 +684,12 @@ int main(int argc, char*argv[]) {
 
             {
                 Ped::Model model;
-                ParseScenario parser(scenefile);
-                model.setup(parser.getAgents(), parser.getWaypoints(), implementation_to_test);
+                setupModel(model, scenario, implementation_to_test, model_options, numa_report, memory_report);
+                if (resume && !model.loadCheckpoint(checkpoint_file)) {
+                    exit(1);
+                }
                 Simulation *simulation = new TimingSimulation(model, max_steps);
+                simulation->setCheckpointing(checkpoint_every, checkpoint_file);
                 // Simulation mode to use when profiling (without any GUI)
                 std::cout << "Running target version...\n";
                 auto start = std::chrono::steady_clock::now();
@@ -198,16 +697,28 @@ int main(int argc, char*argv[]) {
                 auto duration_target = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now() - start);
                 fps_target = ((float)simulation->getTickCount()) / ((float)duration_target.count())*1000.0;
                 cout << "Target time: " << duration_target.count() << " milliseconds, " << fps_target << " Frames Per Second." << std::endl;
+                if (model_options.collisions) {
+                    cout << "Active agents after the last tick: " << model.getActiveAgentCount() << " of " << model.getLiveAgentCount() << std::endl;
+                }
+                reportPopulation(model);
+                if (model_options.lod && !reportLod(model, model_options.verifyLod)) {
+                    retval = 1;
+                }
+                reportFlowFields(model);
+                reportFastMath(model);
 
                 delete simulation;
             }
             std::cout << "\n\nSpeedup: " << fps_target / fps_seq << std::endl;
         } else if (export_trace) {
                 Ped::Model model;
-                ParseScenario parser(scenefile);
-                model.setup(parser.getAgents(), parser.getWaypoints(), implementation_to_test);
+                setupModel(model, scenario, implementation_to_test, model_options, numa_report, memory_report);
+                if (resume && !model.loadCheckpoint(checkpoint_file)) {
+                    exit(1);
+                }
 
                 Simulation *simulation = new ExportSimulation(model, max_steps, export_trace_file);
+                simulation->setCheckpointing(checkpoint_every, checkpoint_file);
 
                 std::cout << "Running Export Tracer...\n";
                 auto start = std::chrono::steady_clock::now();
@@ -215,6 +726,12 @@ int main(int argc, char*argv[]) {
                 auto duration_target = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now() - start);
                 float fps = ((float)simulation->getTickCount()) / ((float)duration_target.count())*1000.0;
                 cout << "Time: " << duration_target.count() << " milliseconds, " << fps << " Frames Per Second." << std::endl;
+                reportPopulation(model);
+                if (model_options.lod && !reportLod(model, model_options.verifyLod)) {
+                    retval = 1;
+                }
+                reportFlowFields(model);
+                reportFastMath(model);
 
                 delete simulation;
 #ifndef NOQT
@@ -223,8 +740,17 @@ int main(int argc, char*argv[]) {
             printf("graphics mode");
             // Graphics version
             Ped::Model model;
-            ParseScenario parser(scenefile);
-            model.setup(parser.getAgents(), parser.getWaypoints(), implementation_to_test);
+            // The view holds on to the agents, which must not move, come or go
+            if (model_options.reorder) {
+                std::cout << "--reorder is ignored in graphics mode" << std::endl;
+            }
+            if (scenario.getNumSources() > 0 || scenario.getNumSinks() > 0) {
+                std::cout << "The sources and sinks are ignored in graphics mode" << std::endl;
+            }
+            Ped::ModelOptions graphics_options = model_options;
+            graphics_options.reorder = false;
+            graphics_options.verifyLod = false;
+            setupModel(model, scenario, implementation_to_test, graphics_options, numa_report, memory_report, false);
 
             QApplication app(argc, argv);
             MainWindow mainwindow(model);
@@ -247,6 +773,10 @@ int main(int argc, char*argv[]) {
         }
     }
 
+    if (!trace_file.empty() && !Ped::Trace::exportChromeTrace(trace_file)) {
+        std::cerr << "Error writing trace " << trace_file << std::endl;
+    }
+
     cout << "Done" << endl;
     return retval;
 }
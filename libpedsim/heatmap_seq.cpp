@@ -3,10 +3,12 @@
 // Implements the heatmap functionality. 
 //
 #include "ped_model.h"
+#include "ped_trace.h"
 
 #include <cstdlib>
 #include <iostream>
 #include <cmath>
+#include <cstring>
 using namespace std;
 
 // Memory leak check with msvc++
@@ -15,14 +17,30 @@ using namespace std;
 // Sets up the heatmap
 void Ped::Model::setupHeatmapSeq()
 {
-	int *hm = (int*)calloc(SIZE*SIZE, sizeof(int));
-	int *shm = (int*)malloc(SCALED_SIZE*SCALED_SIZE*sizeof(int));
-	int *bhm = (int*)malloc(SCALED_SIZE*SCALED_SIZE*sizeof(int));
+	int *hm = arena.allocateArray<int>(SIZE*SIZE, Arena::HEATMAP);
+	int *shm = arena.allocateArray<int>(SCALED_SIZE*SCALED_SIZE, Arena::HEATMAP);
+	int *bhm = arena.allocateArray<int>(SCALED_SIZE*SCALED_SIZE, Arena::HEATMAP);
+
+	// The rows are cleared by the workers that start out with them in
+	// the stages below (the static split of the scheduler), which places
+	// them on the NUMA nodes of these workers
+	int workers = scheduler->getNumWorkers();
+	scheduler->runOnEachWorker([&](int worker) {
+		for (size_t y = Numa::blockBegin(SIZE, worker, workers); y < Numa::blockEnd(SIZE, worker, workers); y++)
+		{
+			memset(hm + SIZE*y, 0, SIZE*sizeof(int));
+		}
+		for (size_t y = Numa::blockBegin(SCALED_SIZE, worker, workers); y < Numa::blockEnd(SCALED_SIZE, worker, workers); y++)
+		{
+			memset(shm + SCALED_SIZE*y, 0, SCALED_SIZE*sizeof(int));
+			memset(bhm + SCALED_SIZE*y, 0, SCALED_SIZE*sizeof(int));
+		}
+	});
 
-	heatmap = (int**)malloc(SIZE*sizeof(int*));
+	heatmap = arena.allocateArray<int*>(SIZE, Arena::HEATMAP);
 
-	scaled_heatmap = (int**)malloc(SCALED_SIZE*sizeof(int*));
-	blurred_heatmap = (int**)malloc(SCALED_SIZE*sizeof(int*));
+	scaled_heatmap = arena.allocateArray<int*>(SCALED_SIZE, Arena::HEATMAP);
+	blurred_heatmap = arena.allocateArray<int*>(SCALED_SIZE, Arena::HEATMAP);
 
 	for (int i = 0; i < SIZE; i++)
 	{
@@ -38,16 +56,68 @@ void Ped::Model::setupHeatmapSeq()
 // Updates the heatmap according to the agent positions
 void Ped::Model::updateHeatmapSeq()
 {
-	for (int x = 0; x < SIZE; x++)
+	PED_TRACE_SCOPE("heatmap");
+
+	fadeHeatmap();
+	scatterHeatmap();
+	clampHeatmap();
+	scaleHeatmap();
+	blurHeatmap();
+}
+
+// The same stages in the pipeline of tick(), where the stages of each
+// block of rows wait only for the rows they read
+void Ped::Model::addHeatmapStages()
+{
+	auto rows = []() { return (size_t)SIZE; };
+	auto scaledRows = []() { return (size_t)SCALED_SIZE; };
+
+	// Fading does not depend on the agents, it runs while they are updated
+	pipeline.addStage("heatmap.fade", rows, [this](size_t begin, size_t end, int) {
+		fadeHeatmapRows(begin, end);
+	});
+	// Every agent can end up in every row, scattering waits for all of them.
+	// The move stage also sets the desired positions of VECTOR.
+	pipeline.addSerialStage("heatmap.scatter", [this](int) {
+		scatterHeatmap();
+	}, { { "heatmap.fade", TickPipeline::ALL_BLOCKS }, { "move", TickPipeline::ALL_BLOCKS } });
+	pipeline.addStage("heatmap.clamp", rows, [this](size_t begin, size_t end, int) {
+		clampHeatmapRows(begin, end);
+	}, { { "heatmap.scatter", TickPipeline::ALL_BLOCKS } });
+	pipeline.addStage("heatmap.scale", rows, [this](size_t begin, size_t end, int) {
+		scaleHeatmapRows(begin, end);
+	}, { { "heatmap.clamp", TickPipeline::SAME_BLOCK } });
+	// A block of the scaled heatmap reads two rows beyond its own, which the
+	// neighboring blocks scale as long as the blocks span several rows
+	pipeline.addStage("heatmap.blur", scaledRows, [this](size_t begin, size_t end, int) {
+		blurHeatmapRows(begin < 2 ? 2 : begin, end > SCALED_SIZE - 2 ? SCALED_SIZE - 2 : end);
+	}, { { "heatmap.scale", TickPipeline::NEIGHBOR_BLOCKS } });
+}
+
+void Ped::Model::fadeHeatmap()
+{
+	PED_TRACE_SCOPE("heatmap.fade");
+	scheduler->parallelFor(0, SIZE, 0, [&](size_t begin, size_t end, int) {
+		fadeHeatmapRows(begin, end);
+	});
+}
+
+void Ped::Model::fadeHeatmapRows(int begin, int end)
+{
+	for (int y = begin; y < end; y++)
 	{
-		for (int y = 0; y < SIZE; y++)
+		for (int x = 0; x < SIZE; x++)
 		{
 			// heat fades
 			heatmap[y][x] = (int)round(heatmap[y][x] * 0.80);
 		}
 	}
+}
 
-	// Count how many agents want to go to each location
+// Count how many agents want to go to each location
+void Ped::Model::scatterHeatmap()
+{
+	PED_TRACE_SCOPE("heatmap.scatter");
 	for (int i = 0; i < agents.size(); i++)
 	{
 		Ped::Tagent* agent = agents[i];
@@ -63,17 +133,39 @@ void Ped::Model::updateHeatmapSeq()
 		heatmap[y][x] += 40;
 
 	}
+}
+
+void Ped::Model::clampHeatmap()
+{
+	PED_TRACE_SCOPE("heatmap.clamp");
+	scheduler->parallelFor(0, SIZE, 0, [&](size_t begin, size_t end, int) {
+		clampHeatmapRows(begin, end);
+	});
+}
 
-	for (int x = 0; x < SIZE; x++)
+void Ped::Model::clampHeatmapRows(int begin, int end)
+{
+	for (int y = begin; y < end; y++)
 	{
-		for (int y = 0; y < SIZE; y++)
+		for (int x = 0; x < SIZE; x++)
 		{
 			heatmap[y][x] = heatmap[y][x] < 255 ? heatmap[y][x] : 255;
 		}
 	}
+}
+
+// Scale the data for visual representation
+void Ped::Model::scaleHeatmap()
+{
+	PED_TRACE_SCOPE("heatmap.scale");
+	scheduler->parallelFor(0, SIZE, 0, [&](size_t begin, size_t end, int) {
+		scaleHeatmapRows(begin, end);
+	});
+}
 
-	// Scale the data for visual representation
-	for (int y = 0; y < SIZE; y++)
+void Ped::Model::scaleHeatmapRows(int begin, int end)
+{
+	for (int y = begin; y < end; y++)
 	{
 		for (int x = 0; x < SIZE; x++)
 		{
@@ -87,19 +179,30 @@ void Ped::Model::updateHeatmapSeq()
 			}
 		}
 	}
+}
 
-	// Weights for blur filter
-	const int w[5][5] = {
-		{ 1, 4, 7, 4, 1 },
-		{ 4, 16, 26, 16, 4 },
-		{ 7, 26, 41, 26, 7 },
-		{ 4, 16, 26, 16, 4 },
-		{ 1, 4, 7, 4, 1 }
-	};
+// Weights for blur filter
+static const int blurWeights[5][5] = {
+	{ 1, 4, 7, 4, 1 },
+	{ 4, 16, 26, 16, 4 },
+	{ 7, 26, 41, 26, 7 },
+	{ 4, 16, 26, 16, 4 },
+	{ 1, 4, 7, 4, 1 }
+};
 
 #define WEIGHTSUM 273
-	// Apply gaussian blurfilter		       
-	for (int i = 2; i < SCALED_SIZE - 2; i++)
+// Apply gaussian blurfilter
+void Ped::Model::blurHeatmap()
+{
+	PED_TRACE_SCOPE("heatmap.blur");
+	scheduler->parallelFor(2, SCALED_SIZE - 2, 0, [&](size_t begin, size_t end, int) {
+		blurHeatmapRows(begin, end);
+	});
+}
+
+void Ped::Model::blurHeatmapRows(int begin, int end)
+{
+	for (int i = begin; i < end; i++)
 	{
 		for (int j = 2; j < SCALED_SIZE - 2; j++)
 		{
@@ -108,7 +211,7 @@ void Ped::Model::updateHeatmapSeq()
 			{
 				for (int l = -2; l < 3; l++)
 				{
-					sum += w[2 + k][2 + l] * scaled_heatmap[i + k][j + l];
+					sum += blurWeights[2 + k][2 + l] * scaled_heatmap[i + k][j + l];
 				}
 			}
 			int value = sum / WEIGHTSUM;
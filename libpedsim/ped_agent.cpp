@@ -7,6 +7,8 @@
 //
 #include "ped_agent.h"
 #include "ped_waypoint.h"
+#include "ped_flowfield.h"
+#include "ped_fastmath.h"
 #include <math.h>
 
 #include <stdlib.h>
@@ -26,13 +28,13 @@ float Ped::Tagent::getRadius() {
 }
 
 void Ped::Tagent::destInit() { 
-	destination = waypoints.front(); 
+	routeCursor = 0;
+	destination = route[0]; 
 }
 
 void Ped::Tagent::updateDestinationList() {
-    waypoints.pop_front();
-	waypoints.push_back(destination);
-	destination = waypoints.front();
+	routeCursor = (routeCursor + 1) % routeLength;
+	destination = route[routeCursor];
 } 
 
 void Ped::Tagent::changeDesiredDestination(int desiredx, int desiredy) {
@@ -50,11 +52,36 @@ Ped::Tagent::Tagent(double posX, double posY) {
 	Ped::Tagent::init((int)round(posX), (int)round(posY));
 }
 
+Ped::Tagent::Tagent(int posX, int posY, Twaypoint* const* sharedRoute, size_t routeLength) {
+	Ped::Tagent::init(posX, posY);
+	route = sharedRoute;
+	this->routeLength = routeLength;
+	// in the empty slot, as if the waypoints had been added one by one
+	routeCursor = routeLength;
+}
+
+Ped::Tagent::Tagent(const Tagent &other) :
+	x(other.x), y(other.y),
+	desiredPositionX(other.desiredPositionX), desiredPositionY(other.desiredPositionY),
+	destination(other.destination), lastDestination(other.lastDestination),
+	route(other.route), routeLength(other.routeLength),
+	waypoints(other.waypoints), routeCursor(other.routeCursor) {
+	// A shared route is shared by the copy too, an own one is copied
+	if (!waypoints.empty()) {
+		route = waypoints.data();
+	}
+}
+
 void Ped::Tagent::init(int posX, int posY) {
 	x = posX;
 	y = posY;
+	desiredPositionX = posX;
+	desiredPositionY = posY;
 	destination = NULL;
 	lastDestination = NULL;
+	route = NULL;
+	routeLength = 0;
+	routeCursor = 0;
 }
 
 void Ped::Tagent::computeNextDesiredPosition() {
@@ -65,7 +92,63 @@ void Ped::Tagent::computeNextDesiredPosition() {
 		// compute where to move to
 		return;
 	}
+	stepTowardsDestination();
+}
+
+void Ped::Tagent::computeNextDesiredPosition(FlowFields &fields) {
+	uint8_t step = FlowFields::EXACT;
+	if (destination != NULL) {
+		step = fields.lookup(destination, x, y);
+		if (step == FlowFields::EXACT) {
+			computeNextDesiredPosition();
+			return;
+		}
+	}
+
+	// As in getNextDestination(), with the arrival looked up too
+	if ((destination == NULL || (step & FlowFields::ARRIVED)) && routeLength > 0) {
+		routeCursor = (routeCursor + 1) % (routeLength + 1);
+		destination = routeCursor < routeLength ? route[routeCursor] : NULL;
+		if (destination != NULL) {
+			step = fields.lookup(destination, x, y);
+		}
+	}
+	if (destination == NULL) {
+		return;
+	}
+	if (step == FlowFields::EXACT) {
+		stepTowardsDestination();
+		return;
+	}
+	desiredPositionX = x + FlowFields::stepX(step);
+	desiredPositionY = y + FlowFields::stepY(step);
+}
+
+void Ped::Tagent::computeNextDesiredPositionFast() {
+	// As in getNextDestination(), without the square root
+	bool agentReachedDestination = false;
+	if (destination != NULL) {
+		double diffX = destination->getx() - x;
+		double diffY = destination->gety() - y;
+		double radius = destination->getr();
+		agentReachedDestination = diffX * diffX + diffY * diffY < radius * radius;
+	}
+	if ((agentReachedDestination || destination == NULL) && routeLength > 0) {
+		routeCursor = (routeCursor + 1) % (routeLength + 1);
+		destination = routeCursor < routeLength ? route[routeCursor] : NULL;
+	}
+	if (destination == NULL) {
+		return;
+	}
 
+	double diffX = destination->getx() - x;
+	double diffY = destination->gety() - y;
+	double inverseLength = FastMath::inverseSqrt(FastMath::multiplyAdd(diffX, diffX, diffY * diffY));
+	desiredPositionX = FastMath::roundHalfUp(FastMath::multiplyAdd(diffX, inverseLength, (double)x));
+	desiredPositionY = FastMath::roundHalfUp(FastMath::multiplyAdd(diffY, inverseLength, (double)y));
+}
+
+void Ped::Tagent::stepTowardsDestination() {
 	double diffX = destination->getx() - x;
 	double diffY = destination->gety() - y;
 	double len = sqrt(diffX * diffX + diffY * diffY);
@@ -74,7 +157,30 @@ void Ped::Tagent::computeNextDesiredPosition() {
 }
 
 void Ped::Tagent::addWaypoint(Twaypoint* wp) {
+	if (destination == NULL && routeCursor == routeLength) {
+		// keep pointing at the empty slot, which moves back by one
+		routeCursor++;
+	}
+	if (waypoints.size() != routeLength) {
+		// the route was shared, take back a copy of it
+		waypoints.assign(route, route + routeLength);
+	}
 	waypoints.push_back(wp);
+	route = waypoints.data();
+	routeLength = waypoints.size();
+}
+
+void Ped::Tagent::shareRoute(Twaypoint* const* sharedRoute) {
+	if (destination != NULL && routeCursor < routeLength) {
+		destination = sharedRoute[routeCursor];
+	}
+	route = sharedRoute;
+	vector<Twaypoint*>().swap(waypoints);
+}
+
+void Ped::Tagent::setRouteCursor(size_t cursor) {
+	routeCursor = cursor;
+	destination = cursor < routeLength ? route[cursor] : NULL;
 }
 
 
@@ -90,13 +196,11 @@ Ped::Twaypoint* Ped::Tagent::getNextDestination() {
 		agentReachedDestination = length < destination->getr();
 	}
 
-	if ((agentReachedDestination || destination == NULL) && !waypoints.empty()) {
+	if ((agentReachedDestination || destination == NULL) && routeLength > 0) {
 		// Case 1: agent has reached destination (or has no current destination);
 		// get next destination if available
-		waypoints.push_back(destination);
-		nextDestination = waypoints.front();
-		waypoints.pop_front();
-		
+		routeCursor = (routeCursor + 1) % (routeLength + 1);
+		nextDestination = routeCursor < routeLength ? route[routeCursor] : NULL;
 	}
 	else {
 		// Case 2: agent has not yet reached destination, continue to move towards
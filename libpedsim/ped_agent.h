@@ -17,13 +17,29 @@
 #define _ped_agent_h_ 1
 
 #include <vector>
-#include <deque>
 #include "ped_waypoint.h"
 
 using namespace std;
 
 namespace Ped {
 	class Twaypoint;
+	class FlowFields;
+
+	// The waypoints of a route, in the order they are visited
+	class Troute {
+	public:
+		Troute(Twaypoint* const* first, size_t length) : first(first), length(length) {}
+
+		size_t size() const { return length; }
+		bool empty() const { return length == 0; }
+		Twaypoint* operator[](size_t i) const { return first[i]; }
+		Twaypoint* const* begin() const { return first; }
+		Twaypoint* const* end() const { return first + length; }
+
+	private:
+		Twaypoint* const* first;
+		size_t length;
+	};
 
 	class Tagent {
 	public:
@@ -42,6 +58,11 @@ namespace Ped {
 		Tagent(int posX, int posY);
 		Tagent(double posX, double posY);
 
+		// An agent on a route that outlives it, as after shareRoute()
+		Tagent(int posX, int posY, Twaypoint* const* sharedRoute, size_t routeLength);
+		Tagent(const Tagent &other);
+		Tagent& operator=(const Tagent&) = delete;
+
 		// Returns the coordinates of the desired position
 		int getDesiredX() const { return desiredPositionX; }
 		int getDesiredY() const { return desiredPositionY; }
@@ -50,10 +71,25 @@ namespace Ped {
 		void setX(int newX) { x = newX; }
 		void setY(int newY) { y = newY; }
 
+		// Sets the desired position, for implementations that compute it
+		// outside of the agent (VECTOR)
+		void setDesiredPosition(int desiredX, int desiredY) { desiredPositionX = desiredX; desiredPositionY = desiredY; }
+
+		// Moves the agent to its desired position
+		void moveToDesiredPosition() { x = desiredPositionX; y = desiredPositionY; }
+
 		// Update the position according to get closer
 		// to the current destination
 		void computeNextDesiredPosition();
 
+		// The same, with the steps looked up in the flow fields
+		void computeNextDesiredPosition(FlowFields &fields);
+
+		// The same, with the approximate math of ped_fastmath.h: the
+		// radius test on squared distances and the step from a reciprocal
+		// square root estimate
+		void computeNextDesiredPositionFast();
+
 		// Position of agent defined by x and y
 		int getX() const { return x; };
 		int getY() const { return y; };
@@ -61,6 +97,25 @@ namespace Ped {
 		// Adds a new waypoint to reach for this agent
 		void addWaypoint(Twaypoint* wp);
 
+		// Returns the route of this agent, in the order the waypoints were added
+		Troute getWaypoints() const { return Troute(route, routeLength); }
+
+		// Replaces the route by an array of the same length that outlives
+		// the agent, e.g. the same waypoints moved elsewhere, and frees the
+		// agent's own copy. Agents with the same route can share one array.
+		void shareRoute(Twaypoint* const* sharedRoute);
+
+		// Position of the agent along its route (used for checkpoints).
+		// Setting it also restores the current destination.
+		size_t getRouteCursor() const { return routeCursor; }
+		void setRouteCursor(size_t cursor);
+
+		// Returns the current destination, NULL if there is none
+		const Twaypoint* getDestination() const { return destination; }
+
+		// Returns the next destination to visit (public for the benchmarks in bench/)
+		Twaypoint* getNextDestination();
+
 	private:
 		Tagent() {};
 
@@ -78,14 +133,25 @@ namespace Ped {
 		// The last destination
 		Twaypoint* lastDestination;
 
-		// The queue of all destinations that this agent still has to visit
-		deque<Twaypoint*> waypoints;
+		// The route of this agent. It is visited cyclically, and the slot
+		// after the last waypoint means "no destination", which is what
+		// the agent starts out with. It points into waypoints while the
+		// route is built with addWaypoint(), or to a shared array.
+		Twaypoint* const* route;
+		size_t routeLength;
+
+		// The agent's own copy of the route, empty once it is shared
+		vector<Twaypoint*> waypoints;
+
+		// Index of the current destination in the route, routeLength for
+		// the empty slot
+		size_t routeCursor;
 
 		// Internal init function 
 		void init(int posX, int posY);
 
-		// Returns the next destination to visit
-		Twaypoint* getNextDestination();
+		// Sets the desired position one step towards the destination
+		void stepTowardsDestination();
 	};
 }
 
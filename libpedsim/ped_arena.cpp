@@ -0,0 +1,199 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the arena: chunks mapped with mmap, optionally backed by
+// huge pages, and bump allocation within them.
+//
+#include "ped_arena.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#include <sys/mman.h>
+
+namespace {
+	// Huge pages on x86-64 and (usually) aarch64
+	const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+	size_t roundUp(size_t value, size_t multiple) {
+		return (value + multiple - 1) / multiple * multiple;
+	}
+
+	const char* SUBSYSTEM_NAMES[Ped::Arena::NUM_SUBSYSTEMS] = {
+		"agents", "routes", "waypoints", "SIMD arrays", "heatmaps"
+	};
+
+	std::string megabytes(size_t bytes) {
+		std::ostringstream text;
+		text << std::fixed << std::setprecision(1) << bytes / 1048576.0 << " MB";
+		return text.str();
+	}
+
+	// Bytes of the range [begin, end) that the kernel backs with transparent
+	// huge pages, from /proc/self/smaps. Returns false if not available.
+	bool transparentHugeBytes(uintptr_t begin, uintptr_t end, size_t &hugeBytes) {
+		std::ifstream smaps("/proc/self/smaps");
+		if (!smaps) return false;
+		hugeBytes = 0;
+		bool inside = false;
+		std::string line;
+		while (std::getline(smaps, line)) {
+			unsigned long long first, last;
+			if (sscanf(line.c_str(), "%llx-%llx ", &first, &last) == 2) {
+				inside = first < end && last > begin;
+			}
+			else if (inside && line.compare(0, 14, "AnonHugePages:") == 0) {
+				hugeBytes += strtoull(line.c_str() + 14, NULL, 10) * 1024;
+			}
+		}
+		return true;
+	}
+}
+
+bool Ped::Arena::parsePageMode(const std::string &name, PageMode &mode)
+{
+	const PageMode all[] = { SMALL_PAGES, TRANSPARENT_HUGE_PAGES, HUGETLB };
+	for (PageMode candidate : all) {
+		if (name == getPageModeName(candidate)) {
+			mode = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char* Ped::Arena::getPageModeName(PageMode mode)
+{
+	switch (mode) {
+		case SMALL_PAGES: return "none";
+		case TRANSPARENT_HUGE_PAGES: return "thp";
+		case HUGETLB: return "hugetlb";
+	}
+	return "unknown";
+}
+
+Ped::Arena::Chunk Ped::Arena::map(size_t size)
+{
+	Chunk chunk = { NULL, roundUp(size, HUGE_PAGE_SIZE), 0 };
+
+#ifdef MAP_HUGETLB
+	if (pageMode == HUGETLB) {
+		void *base = mmap(NULL, chunk.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (base != MAP_FAILED) {
+			chunk.base = (char*)base;
+			hugetlbBytes += chunk.size;
+			return chunk;
+		}
+		static bool warned = false;
+		if (!warned) {
+			fprintf(stderr, "Arena: no huge pages reserved (see /proc/sys/vm/nr_hugepages), using small pages\n");
+			warned = true;
+		}
+	}
+#endif
+
+	// Maps one huge page more than needed and trims both ends, so that the
+	// chunk starts on a huge page boundary and can be backed by huge pages
+	size_t mapped = chunk.size + HUGE_PAGE_SIZE;
+	char *base = (char*)mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Arena: out of memory mapping %zu bytes\n", chunk.size);
+		exit(EXIT_FAILURE);
+	}
+	char *aligned = (char*)roundUp((uintptr_t)base, HUGE_PAGE_SIZE);
+	if (aligned > base) {
+		munmap(base, aligned - base);
+	}
+	munmap(aligned + chunk.size, base + mapped - (aligned + chunk.size));
+	chunk.base = aligned;
+
+#ifdef MADV_HUGEPAGE
+	if (pageMode == TRANSPARENT_HUGE_PAGES) {
+		madvise(chunk.base, chunk.size, MADV_HUGEPAGE);
+	}
+#endif
+	return chunk;
+}
+
+void* Ped::Arena::allocate(size_t size, Subsystem subsystem, size_t alignment)
+{
+	bytes[subsystem] += size;
+
+	// The newest chunks are the most likely to have room left
+	for (size_t i = chunks.size(); i-- > 0;) {
+		Chunk &chunk = chunks[i];
+		size_t offset = roundUp(chunk.used, alignment);
+		if (offset + size <= chunk.size) {
+			chunk.used = offset + size;
+			return chunk.base + offset;
+		}
+	}
+
+	chunks.push_back(map(size > CHUNK_SIZE ? size : CHUNK_SIZE));
+	chunks.back().used = size;
+	return chunks.back().base;
+}
+
+void Ped::Arena::release()
+{
+	for (const Chunk &chunk : chunks) {
+		munmap(chunk.base, chunk.size);
+	}
+	chunks.clear();
+	hugetlbBytes = 0;
+	for (size_t &b : bytes) {
+		b = 0;
+	}
+}
+
+size_t Ped::Arena::getTotalBytes() const
+{
+	size_t total = 0;
+	for (size_t b : bytes) {
+		total += b;
+	}
+	return total;
+}
+
+size_t Ped::Arena::getMappedBytes() const
+{
+	size_t total = 0;
+	for (const Chunk &chunk : chunks) {
+		total += chunk.size;
+	}
+	return total;
+}
+
+std::string Ped::Arena::describe() const
+{
+	std::ostringstream text;
+	text << "Model memory: " << megabytes(getTotalBytes()) << " in " << chunks.size() << " chunks of "
+		<< megabytes(getMappedBytes()) << ", huge pages: " << getPageModeName(pageMode) << "\n";
+	for (int s = 0; s < NUM_SUBSYSTEMS; s++) {
+		text << "  " << SUBSYSTEM_NAMES[s] << ": " << megabytes(bytes[s]) << "\n";
+	}
+
+	// Reserved huge pages don't count as AnonHugePages
+	size_t thpBytes = 0;
+	bool thpKnown = true;
+	for (const Chunk &chunk : chunks) {
+		size_t hugeBytes;
+		if (transparentHugeBytes((uintptr_t)chunk.base, (uintptr_t)chunk.base + chunk.size, hugeBytes)) {
+			thpBytes += hugeBytes;
+		}
+		else {
+			thpKnown = false;
+		}
+	}
+	if (pageMode == HUGETLB) {
+		text << "  reserved huge pages: " << megabytes(hugetlbBytes) << "\n";
+	}
+	if (thpKnown) {
+		text << "  transparent huge pages: " << megabytes(thpBytes) << "\n";
+	}
+	return text.str();
+}
@@ -0,0 +1,104 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Arena owns the memory of a model: the agents, their routes, the
+// waypoints, the SIMD arrays and the heatmaps. Memory is taken from
+// large chunks mapped with mmap and handed out with cache line (or
+// larger) alignment; nothing is freed on its own, all of it is released
+// at once when the arena is destroyed.
+//
+// The chunks can be backed by huge pages, either explicitly reserved
+// ones (MAP_HUGETLB, see /proc/sys/vm/nr_hugepages) or transparent huge
+// pages (madvise(MADV_HUGEPAGE)), to reduce TLB misses with many agents.
+//
+// The arena does not call destructors, so it is meant for objects that
+// own no other memory.
+//
+
+#ifndef _ped_arena_h_
+#define _ped_arena_h_ 1
+
+#include <cstddef>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Ped {
+	class Arena {
+	public:
+		// What the memory is used for, to report the bytes per subsystem
+		enum Subsystem { AGENTS, ROUTES, WAYPOINTS, SIMD, HEATMAP, NUM_SUBSYSTEMS };
+
+		// How the chunks are backed
+		enum PageMode { SMALL_PAGES, TRANSPARENT_HUGE_PAGES, HUGETLB };
+
+		static const size_t CACHE_LINE = 64;
+
+		Arena() {}
+		~Arena() { release(); }
+
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+
+		// Sets how new chunks are backed
+		void setPageMode(PageMode mode) { pageMode = mode; }
+		PageMode getPageMode() const { return pageMode; }
+
+		// Parses "none", "thp" or "hugetlb", returns false if unknown
+		static bool parsePageMode(const std::string &name, PageMode &mode);
+		static const char* getPageModeName(PageMode mode);
+
+		// Returns uninitialized memory of the given size and alignment (a
+		// power of two up to the page size). Exits if out of memory.
+		void* allocate(size_t size, Subsystem subsystem, size_t alignment = CACHE_LINE);
+
+		// Uninitialized memory for count objects of type T
+		template <class T>
+		T* allocateArray(size_t count, Subsystem subsystem, size_t alignment = CACHE_LINE) {
+			return static_cast<T*>(allocate(count * sizeof(T), subsystem, alignment < alignof(T) ? alignof(T) : alignment));
+		}
+
+		// Constructs an object in the arena
+		template <class T, class... Args>
+		T* create(Subsystem subsystem, Args&&... args) {
+			return new (allocateArray<T>(1, subsystem, alignof(T))) T(std::forward<Args>(args)...);
+		}
+
+		// Unmaps all chunks, which invalidates all memory handed out
+		void release();
+
+		// Bytes handed out for a subsystem, and in total
+		size_t getBytes(Subsystem subsystem) const { return bytes[subsystem]; }
+		size_t getTotalBytes() const;
+
+		// Bytes mapped, including what is not handed out yet
+		size_t getMappedBytes() const;
+
+		// The bytes per subsystem and how the chunks are backed, one line each
+		std::string describe() const;
+
+	private:
+		// Kept below 32 bytes, so that copying it does not leave the upper
+		// halves of the AVX registers dirty (see ped_scheduler.cpp)
+		struct Chunk {
+			char *base;
+			size_t size;
+			size_t used;
+		};
+
+		// Chunks are at least this large, larger allocations get their own
+		static const size_t CHUNK_SIZE = 32 << 20;
+
+		PageMode pageMode = SMALL_PAGES;
+		std::vector<Chunk> chunks;
+		size_t bytes[NUM_SUBSYSTEMS] = {};
+
+		// Bytes of the chunks mapped with MAP_HUGETLB
+		size_t hugetlbBytes = 0;
+
+		Chunk map(size_t size);
+	};
+}
+
+#endif
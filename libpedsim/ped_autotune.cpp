@@ -0,0 +1,235 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements AUTO: every candidate implementation, with each thread
+// count and, for PTHREAD, each granularity of the work stealing, is set
+// up with a copy of the scenario and timed for a few ticks. The fastest
+// one wins. The choice is cached per scenario (a hash of the agents,
+// their routes and the obstacles), CPU model, heatmap setting and
+// requested thread count.
+//
+// The heatmap is updated in the calibration if it is enabled, but how
+// often it is updated is not tuned: that changes the result, not only
+// the time it takes.
+//
+#include "ped_model.h"
+#include "ped_waypoint.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+
+namespace {
+	// Ticks run before a candidate is timed, then at least MIN_TICKS and
+	// at most MAX_TICKS are timed, or until SECONDS_PER_CANDIDATE passed
+	const int WARMUP_TICKS = 2;
+	const int MIN_TICKS = 3;
+	const int MAX_TICKS = 20;
+	const double SECONDS_PER_CANDIDATE = 0.5;
+
+	// Candidates slower than this many times the best so far are dropped
+	// after their first timed tick
+	const double GIVE_UP_FACTOR = 3;
+
+	const int BLOCKS_PER_THREAD[] = { 2, 8, 32 };
+
+	double now() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// FNV-1a
+	void hashBytes(uint64_t &hash, const void *data, size_t size) {
+		const unsigned char *bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; i++) {
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+	}
+
+	uint64_t hashScenario(const std::vector<Ped::Tagent*> &agents, const std::vector<Ped::Tobstacle> &obstacles) {
+		uint64_t hash = 14695981039346656037ull;
+		for (const Ped::Tagent *agent : agents) {
+			int position[2] = { agent->getX(), agent->getY() };
+			hashBytes(hash, position, sizeof(position));
+			Ped::Troute route = agent->getWaypoints();
+			size_t length = route.size();
+			hashBytes(hash, &length, sizeof(length));
+			for (const Ped::Twaypoint *waypoint : route) {
+				double circle[3] = { waypoint->getx(), waypoint->gety(), waypoint->getr() };
+				hashBytes(hash, circle, sizeof(circle));
+			}
+		}
+		for (const Ped::Tobstacle &obstacle : obstacles) {
+			size_t corners = obstacle.getCornerCount();
+			hashBytes(hash, &corners, sizeof(corners));
+			for (size_t i = 0; i < corners; i++) {
+				double corner[2] = { obstacle.getCornerX(i), obstacle.getCornerY(i) };
+				hashBytes(hash, corner, sizeof(corner));
+			}
+		}
+		return hash;
+	}
+
+	std::string getCpuModel() {
+		std::ifstream cpuinfo("/proc/cpuinfo");
+		std::string line;
+		while (std::getline(cpuinfo, line)) {
+			if (line.compare(0, 10, "model name") == 0 && line.find(':') != std::string::npos) {
+				return line.substr(line.find(':') + 2);
+			}
+		}
+		return "unknown CPU";
+	}
+
+	// A fresh copy of the scenario, which a model can take over
+	void copyScenario(const std::vector<Ped::Tagent*> &agents, const std::vector<Ped::Twaypoint*> &waypoints,
+		std::vector<Ped::Tagent*> &agentCopies, std::vector<Ped::Twaypoint*> &waypointCopies) {
+		std::map<const Ped::Twaypoint*, Ped::Twaypoint*> copied;
+		for (Ped::Twaypoint *waypoint : waypoints) {
+			waypointCopies.push_back(new Ped::Twaypoint(*waypoint));
+			copied[waypoint] = waypointCopies.back();
+		}
+		for (const Ped::Tagent *agent : agents) {
+			Ped::Tagent *copy = new Ped::Tagent(agent->getX(), agent->getY());
+			for (Ped::Twaypoint *waypoint : agent->getWaypoints()) {
+				auto found = copied.find(waypoint);
+				copy->addWaypoint(found != copied.end() ? found->second : waypoint);
+			}
+			agentCopies.push_back(copy);
+		}
+	}
+
+	std::string describe(const Ped::Model::Tuning &tuning) {
+		std::ostringstream text;
+		text << Ped::getImplementationName(tuning.implementation);
+		if (tuning.numThreads > 0) {
+			text << ", " << tuning.numThreads << " threads";
+		}
+		if (tuning.blocksPerThread > 0) {
+			text << ", " << tuning.blocksPerThread << " blocks per thread";
+		}
+		return text.str();
+	}
+
+	// Each line of the cache is the key, the implementation, the number of
+	// threads and the blocks per thread, separated by tabs
+	bool readCache(const std::string &filename, const std::string &key, Ped::Model::Tuning &tuning) {
+		std::ifstream cache(filename);
+		std::string line;
+		bool found = false;
+		while (std::getline(cache, line)) {
+			std::istringstream fields(line);
+			std::string lineKey, name, threads, blocks;
+			if (!std::getline(fields, lineKey, '\t') || lineKey != key || !std::getline(fields, name, '\t')
+				|| !std::getline(fields, threads, '\t') || !std::getline(fields, blocks)) {
+				continue;
+			}
+			// The last entry of a key counts
+			found = Ped::parseImplementation(name, tuning.implementation) && tuning.implementation != Ped::AUTO;
+			tuning.numThreads = atoi(threads.c_str());
+			tuning.blocksPerThread = atoi(blocks.c_str());
+		}
+		return found;
+	}
+
+	bool appendCache(const std::string &filename, const std::string &key, const Ped::Model::Tuning &tuning) {
+		std::ofstream cache(filename, std::ios::app);
+		cache << key << '\t' << Ped::getImplementationName(tuning.implementation) << '\t'
+			<< tuning.numThreads << '\t' << tuning.blocksPerThread << '\n';
+		return (bool)cache;
+	}
+}
+
+Ped::Model::Tuning Ped::Model::autotune(const std::vector<Tagent*> &agentsInScenario, const std::vector<Twaypoint*> &destinationsInScenario)
+{
+	char hash[17];
+	snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)hashScenario(agentsInScenario, obstacles));
+	std::ostringstream key;
+	key << hash << " " << agentsInScenario.size() << " agents, heatmap " << (heatmapEnabled ? "on" : "off")
+		<< ", threads " << numThreads << ", " << getCpuModel();
+
+	Tuning best = { SEQ, 0, 0 };
+	if (!tuningCache.empty() && readCache(tuningCache, key.str(), best)) {
+		std::cout << "Autotuning: " << describe(best) << " (from " << tuningCache << ")" << std::endl;
+		return best;
+	}
+
+	// The thread counts: the requested one, or powers of two up to the
+	// number of hardware threads
+	std::vector<int> threadCounts;
+	int hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+	if (numThreads > 0) {
+		threadCounts.push_back(numThreads);
+	}
+	else {
+		for (int t = 1; t < hardwareThreads; t *= 2) {
+			threadCounts.push_back(t);
+		}
+		threadCounts.push_back(hardwareThreads);
+	}
+
+	std::vector<Tuning> candidates = { { SEQ, 0, 0 }, { VECTOR, 0, 0 }, { PSTL, 0, 0 } };
+	for (int threads : threadCounts) {
+		candidates.push_back(Tuning{ OMP, threads, 0 });
+		candidates.push_back(Tuning{ HYBRID, threads, 0 });
+		for (int blocks : BLOCKS_PER_THREAD) {
+			candidates.push_back(Tuning{ PTHREAD, threads, blocks });
+		}
+	}
+
+	std::cout << "Autotuning " << candidates.size() << " candidates on " << agentsInScenario.size() << " agents" << std::endl;
+	double bestSeconds = std::numeric_limits<double>::infinity();
+	for (const Tuning &candidate : candidates) {
+		std::vector<Tagent*> agentCopies;
+		std::vector<Twaypoint*> waypointCopies;
+		copyScenario(agentsInScenario, destinationsInScenario, agentCopies, waypointCopies);
+
+		// The options of this model, without the checks that would distort
+		// the timing
+		ModelOptions options = getOptions();
+		options.numThreads = candidate.numThreads;
+		options.blocksPerThread = candidate.blocksPerThread;
+		options.verifyLod = false;
+		options.validateFastMath = false;
+
+		Model model;
+		model.setOptions(options);
+		model.setObstacles(obstacles);
+		model.setSources(sources);
+		model.setSinks(sinks);
+		model.setup(agentCopies, waypointCopies, candidate.implementation);
+		for (int i = 0; i < WARMUP_TICKS; i++) {
+			model.tick();
+		}
+
+		// The fastest tick, which is the least disturbed by other processes
+		double fastest = std::numeric_limits<double>::infinity(), spent = 0;
+		for (int ticks = 0; ticks < MAX_TICKS && (ticks < MIN_TICKS || spent < SECONDS_PER_CANDIDATE); ticks++) {
+			double start = now();
+			model.tick();
+			double seconds = now() - start;
+			fastest = std::min(fastest, seconds);
+			spent += seconds;
+			if (seconds > GIVE_UP_FACTOR * bestSeconds) {
+				break;
+			}
+		}
+		std::cout << "  " << describe(candidate) << ": " << fastest * 1e3 << " ms per tick" << std::endl;
+		if (fastest < bestSeconds) {
+			bestSeconds = fastest;
+			best = candidate;
+		}
+	}
+
+	std::cout << "Autotuning: " << describe(best) << std::endl;
+	if (!tuningCache.empty() && !appendCache(tuningCache, key.str(), best)) {
+		std::cerr << "Could not write the autotuning cache " << tuningCache << std::endl;
+	}
+	return best;
+}
@@ -0,0 +1,321 @@
+// Created for Low Level Parallel Programming 2025
+//
+// Implements checkpointing of the model state, so that long
+// running simulations can be resumed after they were stopped.
+//
+// A checkpoint contains everything that a tick reads: agent
+// positions, desired positions, the position of each agent on its
+// route, the SIMD arrays (if used), the continuous positions and
+// velocities of SOCIAL (in the order of its arrays) and the heatmap.
+// The cell lists of SOCIAL are rebuilt at the start of every tick, the
+// scaled and blurred heatmaps on every update, so they are not stored.
+//
+#include "ped_model.h"
+#include "ped_agent.h"
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+	const char CHECKPOINT_MAGIC[8] = { 'P', 'E', 'D', 'C', 'K', 'P', 'T', '\0' };
+	const uint32_t CHECKPOINT_VERSION = 2;
+
+	struct CheckpointHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t headerSize;
+		uint64_t tick;
+		uint64_t numAgents;
+		uint64_t numDestinations;
+		uint64_t heatmapCells;
+		uint32_t hasSimdArrays;
+		uint32_t hasSocialArrays;
+	};
+
+	size_t payloadSize(uint64_t numAgents, bool hasSimdArrays, bool hasSocialArrays, uint64_t heatmapCells) {
+		size_t perAgent = 6 * sizeof(int32_t) + (hasSimdArrays ? 5 * sizeof(float) : 0)
+			+ (hasSocialArrays ? sizeof(uint32_t) + 4 * sizeof(float) : 0);
+		return sizeof(CheckpointHeader) + numAgents * perAgent + heatmapCells * sizeof(int);
+	}
+
+	// Appends n elements to the buffer, returns the new write position
+	template <typename T>
+	char* put(char *out, const T *values, size_t n) {
+		memcpy(out, values, n * sizeof(T));
+		return out + n * sizeof(T);
+	}
+
+	template <typename T>
+	const char* get(const char *in, T *values, size_t n) {
+		memcpy(values, in, n * sizeof(T));
+		return in + n * sizeof(T);
+	}
+
+	// Writes the whole buffer with a few large sequential writes. The
+	// checkpoint only replaces the previous one once it is complete.
+	bool writeFile(const std::string &filename, const std::vector<char> &buffer) {
+		std::string tmpname = filename + ".tmp";
+		int fd = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			return false;
+		}
+		const char *data = buffer.data();
+		size_t remaining = buffer.size();
+		while (remaining > 0) {
+			ssize_t n = write(fd, data, remaining);
+			if (n <= 0) {
+				close(fd);
+				unlink(tmpname.c_str());
+				return false;
+			}
+			data += n;
+			remaining -= n;
+		}
+		if (fsync(fd) != 0 || close(fd) != 0) {
+			unlink(tmpname.c_str());
+			return false;
+		}
+		return rename(tmpname.c_str(), filename.c_str()) == 0;
+	}
+
+	bool readFile(const std::string &filename, std::vector<char> &buffer) {
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		off_t size = lseek(fd, 0, SEEK_END);
+		lseek(fd, 0, SEEK_SET);
+		buffer.resize(size > 0 ? size : 0);
+		char *data = buffer.data();
+		size_t remaining = buffer.size();
+		while (remaining > 0) {
+			ssize_t n = read(fd, data, remaining);
+			if (n <= 0) {
+				close(fd);
+				return false;
+			}
+			data += n;
+			remaining -= n;
+		}
+		close(fd);
+		return true;
+	}
+}
+
+bool Ped::Model::saveCheckpoint(const std::string &filename)
+{
+	// Only one checkpoint is written at a time
+	waitForCheckpoint();
+
+	// The agents of a checkpoint are those of the scenario, one per slot
+	if (hasDynamicPopulation()) {
+		std::cerr << "Checkpoints need a fixed population, without sources, sinks or added and removed agents" << std::endl;
+		return false;
+	}
+
+	size_t n = agents.size();
+	bool hasSimdArrays = xPos != nullptr;
+	bool hasSocialArrays = social.x != nullptr;
+	std::vector<char> buffer(payloadSize(n, hasSimdArrays, hasSocialArrays, SIZE*SIZE));
+
+	CheckpointHeader header;
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.version = CHECKPOINT_VERSION;
+	header.headerSize = sizeof(CheckpointHeader);
+	header.tick = tickCount;
+	header.numAgents = n;
+	header.numDestinations = destinations.size();
+	header.heatmapCells = SIZE*SIZE;
+	header.hasSimdArrays = hasSimdArrays;
+	header.hasSocialArrays = hasSocialArrays;
+
+	// Per agent state is stored as one array per field, in the order of
+	// the scenario, whichever order the agents are in now
+	std::vector<int32_t> field(n);
+	char *out = put(buffer.data(), &header, 1);
+	for (size_t i = 0; i < n; i++) field[agentIds[i]] = agents[i]->getX();
+	out = put(out, field.data(), n);
+	for (size_t i = 0; i < n; i++) field[agentIds[i]] = agents[i]->getY();
+	out = put(out, field.data(), n);
+	for (size_t i = 0; i < n; i++) field[agentIds[i]] = agents[i]->getDesiredX();
+	out = put(out, field.data(), n);
+	for (size_t i = 0; i < n; i++) field[agentIds[i]] = agents[i]->getDesiredY();
+	out = put(out, field.data(), n);
+	for (size_t i = 0; i < n; i++) field[agentIds[i]] = agents[i]->getWaypoints().size();
+	out = put(out, field.data(), n);
+	for (size_t i = 0; i < n; i++) field[agentIds[i]] = agents[i]->getRouteCursor();
+	out = put(out, field.data(), n);
+
+	if (hasSimdArrays) {
+		std::vector<float> simdField(n);
+		const float *arrays[] = { xPos, yPos, xDestPos, yDestPos, destR };
+		for (const float *array : arrays) {
+			for (size_t i = 0; i < n; i++) simdField[agentIds[i]] = array[i];
+			out = put(out, simdField.data(), n);
+		}
+	}
+	if (hasSocialArrays) {
+		// In the order of the arrays, which the forces are summed up in
+		std::vector<uint32_t> ids(n);
+		for (size_t k = 0; k < n; k++) ids[k] = (uint32_t)agentIds[social.agent[k]];
+		out = put(out, ids.data(), n);
+		const float *arrays[] = { social.x, social.y, social.vx, social.vy };
+		for (const float *array : arrays) {
+			out = put(out, array, n);
+		}
+	}
+	out = put(out, heatmap[0], SIZE*SIZE);
+
+	checkpointWriter = std::thread([this, filename](std::vector<char> data) {
+		checkpointWritten = writeFile(filename, data);
+	}, std::move(buffer));
+	return true;
+}
+
+bool Ped::Model::waitForCheckpoint()
+{
+	if (checkpointWriter.joinable()) {
+		checkpointWriter.join();
+		if (!checkpointWritten) {
+			std::cerr << "Error writing checkpoint" << std::endl;
+		}
+	}
+	return checkpointWritten;
+}
+
+bool Ped::Model::loadCheckpoint(const std::string &filename)
+{
+	if (hasDynamicPopulation()) {
+		std::cerr << "Checkpoints need a fixed population, without sources, sinks or added and removed agents" << std::endl;
+		return false;
+	}
+
+	std::vector<char> buffer;
+	if (!readFile(filename, buffer)) {
+		std::cerr << "Error reading checkpoint " << filename << std::endl;
+		return false;
+	}
+
+	CheckpointHeader header;
+	if (buffer.size() < sizeof(header)) {
+		std::cerr << "Checkpoint " << filename << " is truncated" << std::endl;
+		return false;
+	}
+	const char *in = get(buffer.data(), &header, 1);
+	if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 || header.version != CHECKPOINT_VERSION
+		|| header.headerSize != sizeof(CheckpointHeader)) {
+		std::cerr << "Checkpoint " << filename << " has an unknown format" << std::endl;
+		return false;
+	}
+	size_t n = header.numAgents;
+	if (n != agents.size() || header.numDestinations != destinations.size() || header.heatmapCells != SIZE*SIZE) {
+		std::cerr << "Checkpoint " << filename << " does not belong to this scenario" << std::endl;
+		return false;
+	}
+	if (buffer.size() != payloadSize(n, header.hasSimdArrays, header.hasSocialArrays, header.heatmapCells)) {
+		std::cerr << "Checkpoint " << filename << " is truncated" << std::endl;
+		return false;
+	}
+
+	std::vector<int32_t> x(n), y(n), desiredX(n), desiredY(n), routeLength(n), routeCursor(n);
+	in = get(in, x.data(), n);
+	in = get(in, y.data(), n);
+	in = get(in, desiredX.data(), n);
+	in = get(in, desiredY.data(), n);
+	in = get(in, routeLength.data(), n);
+	in = get(in, routeCursor.data(), n);
+	// The fields are in the order of the scenario, see saveCheckpoint()
+	for (size_t i = 0; i < n; i++) {
+		if ((size_t)routeLength[agentIds[i]] != agents[i]->getWaypoints().size()) {
+			std::cerr << "Checkpoint " << filename << " does not belong to this scenario" << std::endl;
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		size_t id = agentIds[i];
+		agents[i]->setX(x[id]);
+		agents[i]->setY(y[id]);
+		agents[i]->changeDesiredDestination(desiredX[id], desiredY[id]);
+		agents[i]->setRouteCursor(routeCursor[id]);
+	}
+
+	if (header.hasSimdArrays && xPos) {
+		std::vector<float> simdField(n);
+		float *arrays[] = { xPos, yPos, xDestPos, yDestPos, destR };
+		for (float *array : arrays) {
+			in = get(in, simdField.data(), n);
+			for (size_t i = 0; i < n; i++) array[i] = simdField[agentIds[i]];
+		}
+	}
+	else {
+		if (header.hasSimdArrays) {
+			in += 5 * n * sizeof(float);
+		}
+		if (xPos) {
+			// Written by a non-SIMD model, rebuild the arrays from the agents
+			for (size_t i = 0; i < n; i++) {
+				xPos[i] = agents[i]->getX();
+				yPos[i] = agents[i]->getY();
+				if (agents[i]->getRouteCursor() >= agents[i]->getWaypoints().size()) {
+					agents[i]->destInit();
+				}
+				xDestPos[i] = agents[i]->getDestX();
+				yDestPos[i] = agents[i]->getDestY();
+				destR[i] = agents[i]->getRadius();
+			}
+		}
+	}
+	if (agentArrays.x) {
+		// The arrays of HYBRID and PSTL only mirror the agents
+		copyAgentsToArrays(0, numChunks * HYBRID_CHUNK);
+	}
+	if (header.hasSocialArrays && social.x) {
+		std::vector<uint32_t> ids(n);
+		in = get(in, ids.data(), n);
+		std::vector<uint32_t> slotOf(n, (uint32_t)n);
+		for (size_t i = 0; i < n; i++) slotOf[agentIds[i]] = (uint32_t)i;
+		std::vector<bool> seen(n, false);
+		for (size_t k = 0; k < n; k++) {
+			if (ids[k] >= n || seen[ids[k]]) {
+				std::cerr << "Checkpoint " << filename << " is corrupt" << std::endl;
+				return false;
+			}
+			seen[ids[k]] = true;
+		}
+		for (size_t k = 0; k < n; k++) {
+			social.agent[k] = slotOf[ids[k]];
+		}
+		float *arrays[] = { social.x, social.y, social.vx, social.vy };
+		for (float *array : arrays) {
+			in = get(in, array, n);
+		}
+		numSocialAgents = n;
+		for (size_t k = 0; k < n; k++) {
+			copySocialDestination(k);
+		}
+	}
+	else {
+		if (header.hasSocialArrays) {
+			in += n * (sizeof(uint32_t) + 4 * sizeof(float));
+		}
+		if (social.x) {
+			// Written by another implementation, which only has the cells of
+			// the agents: they start from there at rest
+			copyAgentsToSocial();
+		}
+	}
+	if (collisionsEnabled) {
+		// Agents that are stuck fall asleep again after a few ticks
+		resetActiveSet();
+	}
+	in = get(in, heatmap[0], SIZE*SIZE);
+
+	tickCount = header.tick;
+	return true;
+}
@@ -0,0 +1,332 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the collision avoidance of tick() and its active set. The
+// agents move one after the other, like with move(): each takes the
+// first free one of its desired position and the two alternatives next
+// to it, or stays where it is. Instead of looking at all other agents,
+// an occupancy grid tells which cells are taken. It spans the agents,
+// the waypoints and the obstacles with a margin; cells outside of it and
+// those covered by obstacles count as taken.
+//
+// In a jam most agents stay where they are, tick after tick. An agent
+// that stayed put and kept its destination for SLEEP_AFTER_TICKS ticks
+// goes to sleep: its next tick would compute the same desired position
+// and find the same cells taken, so it is left out of both stages until
+// one of these cells is freed. Every cell the agent could move to is
+// within two cells of it, so a freed cell wakes the sleepers up to two
+// cells away. Those after the agent that freed it move in the same
+// tick, as they would have if they had been awake, the others from the
+// next tick on. The simulation is thereby the same as without the
+// active set. Sleepers also wake up after SLEEP_TIMEOUT_TICKS, so that
+// nobody sleeps forever because of a missed wakeup.
+//
+// The desired positions are computed for the active agents on the
+// workers, which go through the compacted array of their indices.
+//
+#include "ped_model.h"
+#include "ped_waypoint.h"
+#include "ped_trace.h"
+
+#include <algorithm>
+#include <omp.h>
+#include <queue>
+
+namespace {
+	// Ticks an agent stays put before it goes to sleep
+	const int SLEEP_AFTER_TICKS = 4;
+
+	// Ticks after which a sleeping agent wakes up anyway
+	const long SLEEP_TIMEOUT_TICKS = 64;
+
+	// Cells around the agents and waypoints that the grid spans in addition
+	const int GRID_MARGIN = 16;
+
+	// How far from an agent the cells are that it may move to
+	const int REACH = 2;
+
+	const int32_t NONE = -1;
+}
+
+void Ped::Model::setupCollisions()
+{
+	getScenarioBounds(GRID_MARGIN, grid.minX, grid.minY, grid.width, grid.height);
+	grid.blocksWide = (grid.width + LOD_BLOCK - 1) / LOD_BLOCK;
+	grid.blocksHigh = (grid.height + LOD_BLOCK - 1) / LOD_BLOCK;
+	grid.blockCounts.reset(new std::atomic<uint32_t>[(size_t)grid.blocksWide * grid.blocksHigh]);
+	resetActiveSet();
+}
+
+void Ped::Model::resetActiveSet()
+{
+	grid.occupancy.assign((size_t)grid.width * grid.height, 0);
+	grid.sleepers.assign((size_t)grid.width * grid.height, NONE);
+	for (size_t b = 0; b < (size_t)grid.blocksWide * grid.blocksHigh; b++) {
+		grid.blockCounts[b].store(0, std::memory_order_relaxed);
+	}
+	if (flowFields && flowFields->hasObstacles()) {
+		// Taken for good, but not counted in the blocks, which only tell
+		// where the agents are
+		for (int y = grid.minY; y < grid.minY + grid.height; y++) {
+			for (int x = grid.minX; x < grid.minX + grid.width; x++) {
+				grid.occupancy[grid.cell(x, y)] = flowFields->isBlocked(x, y);
+			}
+		}
+	}
+	activity.assign(agents.size(), AgentActivity());
+	activeAgents.clear();
+	for (size_t i = 0; i < agents.size(); i++) {
+		if (agentIds[i] == NO_AGENT) {
+			// Removed, off the grid
+			continue;
+		}
+		const Tagent *agent = agents[i];
+		grid.occupancy[grid.cell(agent->getX(), agent->getY())]++;
+		grid.blockCounts[grid.block(agent->getX(), agent->getY())].fetch_add(1, std::memory_order_relaxed);
+		activeAgents.push_back((uint32_t)i);
+		activity[i].routeCursor = agent->getRouteCursor();
+	}
+	wokenAgents.clear();
+	sleepQueue.clear();
+}
+
+void Ped::Model::addCollisionStages()
+{
+	pipeline.addStage("desired", [this]() { return activeAgents.size(); }, [this](size_t begin, size_t end, int worker) {
+		double start = omp_get_wtime();
+		const uint32_t *active = activeAgents.data();
+		Ped::Tagent *const *agentData = agents.data();
+		FlowFields *fields = flowFields.get();
+		for (size_t k = begin; k < end; ++k) {
+			if (fields) {
+				agentData[active[k]]->computeNextDesiredPosition(*fields);
+			}
+			else {
+				agentData[active[k]]->computeNextDesiredPosition();
+			}
+			if (lodEnabled) {
+				stepIfIsolated(active[k]);
+			}
+		}
+		threadBusySeconds[worker] += omp_get_wtime() - start;
+	});
+	pipeline.addSerialStage("move", [this](int) {
+		moveActiveAgents();
+	}, { { "desired", TickPipeline::ALL_BLOCKS } });
+}
+
+bool Ped::Model::moveWithCollisions(Tagent *agent)
+{
+	int x = agent->getX(), y = agent->getY();
+	int desiredX = agent->getDesiredX(), desiredY = agent->getDesiredY();
+
+	// The same alternatives as in move()
+	int diffX = desiredX - x, diffY = desiredY - y;
+	int alternatives[3][2] = { { desiredX, desiredY }, { 0, 0 }, { 0, 0 } };
+	if (diffX == 0 || diffY == 0) {
+		alternatives[1][0] = desiredX + diffY;
+		alternatives[1][1] = desiredY + diffX;
+		alternatives[2][0] = desiredX - diffY;
+		alternatives[2][1] = desiredY - diffX;
+	}
+	else {
+		alternatives[1][0] = desiredX;
+		alternatives[1][1] = y;
+		alternatives[2][0] = x;
+		alternatives[2][1] = desiredY;
+	}
+
+	for (const int *alternative : alternatives) {
+		if (grid.contains(alternative[0], alternative[1]) && grid.occupancy[grid.cell(alternative[0], alternative[1])] == 0) {
+			grid.move(x, y, alternative[0], alternative[1]);
+			agent->setX(alternative[0]);
+			agent->setY(alternative[1]);
+			return true;
+		}
+	}
+	return false;
+}
+
+void Ped::Model::moveActiveAgents()
+{
+	PED_TRACE_SCOPE("move.collisions");
+
+	// The agents woken up behind the one that moves, which move in this tick
+	std::priority_queue<uint32_t, std::vector<uint32_t>, std::greater<uint32_t> > wokenAhead;
+	size_t next = 0;
+	while (next < activeAgents.size() || !wokenAhead.empty()) {
+		uint32_t i;
+		if (wokenAhead.empty() || (next < activeAgents.size() && activeAgents[next] < wokenAhead.top())) {
+			i = activeAgents[next++];
+		}
+		else {
+			i = wokenAhead.top();
+			wokenAhead.pop();
+		}
+
+		Tagent *agent = agents[i];
+		AgentActivity &a = activity[i];
+		if (a.steppedAhead) {
+			// Isolated, it moved in the desired stage and freed a cell
+			// that no other agent is close to
+			if (lodVerification) {
+				verifyIsolatedStep(i);
+			}
+			a.steppedAhead = false;
+			a.blockedTicks = 0;
+			a.routeCursor = agent->getRouteCursor();
+			lodSteps++;
+			continue;
+		}
+		int x = agent->getX(), y = agent->getY();
+		bool moved = moveWithCollisions(agent);
+		if (moved && grid.occupancy[grid.cell(x, y)] == 0) {
+			// Freed a cell, which the sleepers around it may move to
+			size_t first = wokenAgents.size();
+			wakeSleepersAround(x, y);
+			for (size_t k = first; k < wokenAgents.size(); k++) {
+				if (wokenAgents[k] > i) {
+					wokenAhead.push(wokenAgents[k]);
+				}
+			}
+		}
+
+		if (moved || agent->getRouteCursor() != a.routeCursor) {
+			a.blockedTicks = 0;
+			a.routeCursor = agent->getRouteCursor();
+		}
+		else if (++a.blockedTicks >= SLEEP_AFTER_TICKS) {
+			sleep(i);
+		}
+	}
+
+	// The sleepers whose time is up, in the order they fell asleep
+	while (!sleepQueue.empty() && sleepQueue.front().second <= tickCount + 1) {
+		uint32_t s = sleepQueue.front().first;
+		if (activity[s].asleep && activity[s].wakeTick == sleepQueue.front().second) {
+			wake(s);
+			wokenAgents.push_back(s);
+		}
+		sleepQueue.pop_front();
+	}
+
+	// The active agents of the next tick, in order
+	size_t kept = 0;
+	for (uint32_t i : activeAgents) {
+		if (!activity[i].asleep) {
+			activeAgents[kept++] = i;
+		}
+	}
+	activeAgents.resize(kept);
+	activateWokenAgents();
+}
+
+void Ped::Model::wakeSleepersAround(int x, int y)
+{
+	for (int cy = std::max(y - REACH, grid.minY); cy <= std::min(y + REACH, grid.minY + grid.height - 1); cy++) {
+		for (int cx = std::max(x - REACH, grid.minX); cx <= std::min(x + REACH, grid.minX + grid.width - 1); cx++) {
+			int32_t &sleeper = grid.sleepers[grid.cell(cx, cy)];
+			while (sleeper != NONE) {
+				uint32_t s = (uint32_t)sleeper;
+				wake(s);
+				wokenAgents.push_back(s);
+			}
+		}
+	}
+}
+
+void Ped::Model::activateWokenAgents()
+{
+	if (wokenAgents.empty()) {
+		return;
+	}
+	size_t kept = activeAgents.size();
+	std::sort(wokenAgents.begin(), wokenAgents.end());
+	for (uint32_t i : wokenAgents) {
+		if (!activity[i].asleep) {
+			activeAgents.push_back(i);
+		}
+	}
+	std::inplace_merge(activeAgents.begin(), activeAgents.begin() + kept, activeAgents.end());
+	activeAgents.erase(std::unique(activeAgents.begin(), activeAgents.end()), activeAgents.end());
+	wokenAgents.clear();
+}
+
+void Ped::Model::remapCollisionAgents(const std::vector<int32_t> &moved, size_t count)
+{
+	std::vector<AgentActivity> remapped(count);
+	for (size_t i = 0; i < moved.size(); i++) {
+		if (moved[i] != NONE) {
+			remapped[moved[i]] = activity[i];
+		}
+	}
+	activity.swap(remapped);
+	for (AgentActivity &a : activity) {
+		a.previous = a.previous != NONE ? moved[a.previous] : NONE;
+		a.next = a.next != NONE ? moved[a.next] : NONE;
+	}
+	for (int32_t &sleeper : grid.sleepers) {
+		if (sleeper != NONE) {
+			sleeper = moved[sleeper];
+		}
+	}
+
+	// Removed agents are neither active nor asleep
+	size_t kept = 0;
+	for (uint32_t i : activeAgents) {
+		if (moved[i] != NONE) {
+			activeAgents[kept++] = (uint32_t)moved[i];
+		}
+	}
+	activeAgents.resize(kept);
+	std::sort(activeAgents.begin(), activeAgents.end());
+	std::deque<std::pair<uint32_t, long> > queue;
+	for (const std::pair<uint32_t, long> &entry : sleepQueue) {
+		if (moved[entry.first] != NONE) {
+			queue.push_back(std::make_pair((uint32_t)moved[entry.first], entry.second));
+		}
+	}
+	sleepQueue.swap(queue);
+}
+
+void Ped::Model::OccupancyGrid::move(int fromX, int fromY, int toX, int toY)
+{
+	occupancy[cell(fromX, fromY)]--;
+	occupancy[cell(toX, toY)]++;
+	size_t from = block(fromX, fromY), to = block(toX, toY);
+	if (from != to) {
+		blockCounts[from].fetch_sub(1, std::memory_order_relaxed);
+		blockCounts[to].fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void Ped::Model::sleep(uint32_t i)
+{
+	AgentActivity &a = activity[i];
+	int32_t &head = grid.sleepers[grid.cell(agents[i]->getX(), agents[i]->getY())];
+	a.asleep = true;
+	a.wakeTick = tickCount + SLEEP_TIMEOUT_TICKS;
+	a.previous = NONE;
+	a.next = head;
+	if (head != NONE) {
+		activity[head].previous = (int32_t)i;
+	}
+	head = (int32_t)i;
+	sleepQueue.push_back(std::make_pair(i, a.wakeTick));
+}
+
+void Ped::Model::wake(uint32_t i)
+{
+	AgentActivity &a = activity[i];
+	if (a.previous != NONE) {
+		activity[a.previous].next = a.next;
+	}
+	else {
+		grid.sleepers[grid.cell(agents[i]->getX(), agents[i]->getY())] = a.next;
+	}
+	if (a.next != NONE) {
+		activity[a.next].previous = a.previous;
+	}
+	a.asleep = false;
+	a.blockedTicks = 0;
+}
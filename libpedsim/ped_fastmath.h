@@ -0,0 +1,81 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// The approximate math of the fast mode (see Model::setFastMath()), for
+// one double and for the four lanes of the SSE kernel. The length of the
+// step towards a destination is 1 / sqrt of the squared distance, which
+// rsqrtss estimates to 12 bits and one Newton step refines to about 23,
+// instead of a square root and a division. Products that are added go
+// through fused multiply-adds where the CPU has them. Positions are
+// rounded half up, as by the SSE kernel.
+//
+// The results can differ from those of the exact math by a rounding of
+// the desired position, e.g. when a step ends right between two cells;
+// Model::setFastMathValidation() counts how often they do.
+//
+
+#ifndef _ped_fastmath_h_
+#define _ped_fastmath_h_ 1
+
+#include <cmath>
+#include <immintrin.h>
+
+#ifndef PED_ALWAYS_INLINE
+#define PED_ALWAYS_INLINE inline __attribute__((always_inline))
+#endif
+
+namespace Ped {
+	namespace FastMath {
+		// a * b + c
+		static PED_ALWAYS_INLINE double multiplyAdd(double a, double b, double c) {
+#ifdef __FMA__
+			return __builtin_fma(a, b, c);
+#else
+			return a * b + c;
+#endif
+		}
+
+		static PED_ALWAYS_INLINE __m128 multiplyAdd(__m128 a, __m128 b, __m128 c) {
+#ifdef __FMA__
+			return _mm_fmadd_ps(a, b, c);
+#else
+			return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+		}
+
+		// 1 / sqrt(v): r' = r * (1.5 - 0.5 * v * r * r) from the estimate r.
+		// The scalar one only goes through the SSE registers for the
+		// estimate and refines it in double: without optimization, every
+		// intrinsic passes its lanes through memory, and the float
+		// conversions cost more than the square root saves.
+		static PED_ALWAYS_INLINE double inverseSqrt(double v) {
+			double r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss((float)v)));
+			return r * (1.5 - 0.5 * v * r * r);
+		}
+
+		static PED_ALWAYS_INLINE __m128 inverseSqrt(__m128 v) {
+			__m128 r = _mm_rsqrt_ps(v);
+			__m128 halfVrr = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), v), _mm_mul_ps(r, r));
+			return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), halfVrr));
+		}
+
+		// Truncated, and one less where that rounded up (below zero)
+		static PED_ALWAYS_INLINE int roundHalfUp(double v) {
+			double half = v + 0.5;
+			int truncated = (int)half;
+			return truncated - (truncated > half);
+		}
+
+		// floor(v + 0.5)
+		static PED_ALWAYS_INLINE __m128 roundHalfUp(__m128 v) {
+#ifdef __SSE4_1__
+			return _mm_floor_ps(_mm_add_ps(v, _mm_set1_ps(0.5f)));
+#else
+			return _mm_set_ps(floorf(_mm_cvtss_f32(_mm_shuffle_ps(v, v, 3)) + 0.5f), floorf(_mm_cvtss_f32(_mm_shuffle_ps(v, v, 2)) + 0.5f),
+				floorf(_mm_cvtss_f32(_mm_shuffle_ps(v, v, 1)) + 0.5f), floorf(_mm_cvtss_f32(v) + 0.5f));
+#endif
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,128 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the flow fields. A tile is built by the first worker that
+// looks up one of its cells and then published with a compare and swap;
+// if two workers build the same tile at once, the one that loses throws
+// its copy away. The cells are computed with the same arithmetic as
+// Tagent::computeNextDesiredPosition, so the agents move exactly as
+// without the fields. With obstacles they follow the distances instead.
+//
+// Each lookup stamps its tile with the current tick. Eviction only
+// happens in beginTick(), before the stages of a tick run, so no tile is
+// freed while a worker reads it. Tiles used in the last tick are never
+// evicted, as they would be built again right away: if the agents need
+// more tiles than the budget, the budget is exceeded instead.
+//
+#include "ped_flowfield.h"
+#include "ped_trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+Ped::FlowFields::FlowFields() : built(0), resident(0)
+{
+}
+
+Ped::FlowFields::~FlowFields()
+{
+	for (size_t i = 0; i < numTiles; i++) {
+		delete tiles[i];
+	}
+	delete[] tiles;
+}
+
+void Ped::FlowFields::setup(const Twaypoint *waypoints, size_t numWaypoints, int minX, int minY, int width, int height, size_t maxTiles)
+{
+	this->waypoints = waypoints;
+	this->numWaypoints = numWaypoints;
+	this->minX = minX;
+	this->minY = minY;
+	this->width = width;
+	this->height = height;
+	this->maxTiles = maxTiles;
+	tilesWide = (width + TILE - 1) / TILE;
+	tilesHigh = (height + TILE - 1) / TILE;
+	numTiles = numWaypoints * tilesWide * tilesHigh;
+	tiles = new Tile*[numTiles]();
+}
+
+Ped::FlowFields::Tile* Ped::FlowFields::buildTile(size_t index)
+{
+	PED_TRACE_SCOPE("flowfield.build");
+	size_t waypointIndex = index / (tilesWide * tilesHigh);
+	const Twaypoint &waypoint = waypoints[waypointIndex];
+	int firstX = minX + (int)(index % tilesWide) * TILE;
+	int firstY = minY + (int)(index / tilesWide % tilesHigh) * TILE;
+
+	Tile *tile = new Tile;
+	tile->lastUsed = tick;
+	for (int cy = 0; cy < TILE; cy++) {
+		for (int cx = 0; cx < TILE; cx++) {
+			int x = firstX + cx, y = firstY + cy;
+			if (hasObstacles()) {
+				tile->steps[cy * TILE + cx] = followDistances(waypointIndex, x, y);
+				continue;
+			}
+			double diffX = waypoint.getx() - x;
+			double diffY = waypoint.gety() - y;
+			double len = sqrt(diffX * diffX + diffY * diffY);
+			uint8_t step = EXACT;
+			if (len > 0 && std::isfinite(len)) {
+				int stepX = (int)round(x + diffX / len) - x;
+				int stepY = (int)round(y + diffY / len) - y;
+				step = (uint8_t)((stepX + 1) * 3 + (stepY + 1));
+				if (len < waypoint.getr()) {
+					step |= ARRIVED;
+				}
+			}
+			tile->steps[cy * TILE + cx] = step;
+		}
+	}
+
+	Tile *expected = nullptr;
+	if (!__atomic_compare_exchange_n(&tiles[index], &expected, tile, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		delete tile;
+		return expected;
+	}
+	built.fetch_add(1, std::memory_order_relaxed);
+	resident.fetch_add(1, std::memory_order_relaxed);
+	return tile;
+}
+
+void Ped::FlowFields::beginTick(long tick)
+{
+	this->tick = tick;
+	if (resident.load(std::memory_order_relaxed) <= maxTiles) {
+		return;
+	}
+
+	// The tiles by when they were used last, those of the last tick excluded
+	PED_TRACE_SCOPE("flowfield.evict");
+	std::vector<std::pair<long, size_t> > evictable;
+	size_t kept = 0;
+	for (size_t i = 0; i < numTiles; i++) {
+		Tile *tile = tiles[i];
+		if (!tile) {
+			continue;
+		}
+		long lastUsed = tile->lastUsed;
+		if (lastUsed >= tick - 1) {
+			kept++;
+		}
+		else {
+			evictable.push_back(std::make_pair(lastUsed, i));
+		}
+	}
+	size_t excess = std::min(evictable.size(), kept + evictable.size() - maxTiles);
+	std::nth_element(evictable.begin(), evictable.begin() + excess, evictable.end());
+	for (size_t k = 0; k < excess; k++) {
+		size_t i = evictable[k].second;
+		delete tiles[i];
+		tiles[i] = nullptr;
+	}
+	resident.fetch_sub(excess, std::memory_order_relaxed);
+	evicted += excess;
+}
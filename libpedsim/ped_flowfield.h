@@ -0,0 +1,159 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// FlowFields holds the step an agent takes from each cell towards each
+// waypoint, so that computing the desired position is a table lookup
+// instead of a square root, two divisions and two roundings. The agents
+// stand on integer cells and head for the centers of a few waypoints, so
+// the step is a function of the cell and the waypoint alone: one byte
+// per cell tells which of the 9 moves it is, and whether the cell is
+// within the waypoint, i.e. the agent arrived there.
+//
+// The fields are split into tiles of TILE x TILE cells, which are built
+// when an agent first looks one up, by the worker that does, in the same
+// stage as the lookups. Once more than the budget of tiles is resident,
+// those used least recently are evicted between ticks, so that scenarios
+// with many waypoints only keep the tiles around the agents.
+//
+// With obstacles, the step is the one along the shortest path around
+// them instead of the straight line. The distances of the cells to each
+// waypoint are computed once, up front, and the tiles are built from them.
+//
+
+#ifndef _ped_flowfield_h_
+#define _ped_flowfield_h_ 1
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "ped_waypoint.h"
+#include "ped_obstacle.h"
+
+// Without optimization the lookup would be a call, and so would each of
+// its loads through std::atomic: the hot path uses the __atomic builtins
+// on plain pointers instead, which are always inlined
+#define PED_ALWAYS_INLINE inline __attribute__((always_inline))
+
+namespace Ped {
+	class TaskScheduler;
+
+	class FlowFields {
+	public:
+		// The size of a tile in cells along each axis
+		static const int TILE = 64;
+
+		// A step is (dx + 1) * 3 + (dy + 1), or'ed with ARRIVED if the cell
+		// is within the waypoint. EXACT means the step is not in the
+		// fields (outside of them, or on the center of the waypoint, where
+		// the direction is undefined), and must be computed.
+		static const uint8_t ARRIVED = 0x10;
+		static const uint8_t EXACT = 0xFF;
+		static PED_ALWAYS_INLINE int stepX(uint8_t step) { return (step & 0xF) / 3 - 1; }
+		static PED_ALWAYS_INLINE int stepY(uint8_t step) { return (step & 0xF) % 3 - 1; }
+
+		FlowFields();
+		~FlowFields();
+		FlowFields(const FlowFields&) = delete;
+		FlowFields& operator=(const FlowFields&) = delete;
+
+		// Sets up empty fields over the given cells, for the numWaypoints
+		// waypoints of the array. At most maxTiles tiles are kept between
+		// ticks.
+		void setup(const Twaypoint *waypoints, size_t numWaypoints, int minX, int minY, int width, int height, size_t maxTiles);
+
+		// A box of cells
+		struct Window {
+			int minX, minY, width, height;
+		};
+
+		// Makes the steps go around the obstacles, called after setup(): marks
+		// the cells they cover as blocked and computes the distance of the
+		// cells to each waypoint on the workers of the scheduler (see
+		// ped_obstacle.cpp), those of its window (one per waypoint) only. The
+		// steps from blocked cells, from outside of the window and from where
+		// the waypoint cannot be reached are EXACT.
+		void setObstacles(const std::vector<Tobstacle> &obstacles, const std::vector<Window> &windows, TaskScheduler &scheduler);
+		bool hasObstacles() const { return !blocked.empty(); }
+
+		// Whether an obstacle covers the cell
+		bool isBlocked(int x, int y) const {
+			size_t cellX = (size_t)((int64_t)x - minX), cellY = (size_t)((int64_t)y - minY);
+			return hasObstacles() && cellX < (size_t)width && cellY < (size_t)height && blocked[cellY * width + cellX];
+		}
+
+		// Evicts the least recently used tiles beyond the budget, called
+		// between ticks when nobody looks up steps
+		void beginTick(long tick);
+
+		// Returns the step from the cell towards the waypoint, building its
+		// tile if needed. Can be called by several threads at once.
+		PED_ALWAYS_INLINE uint8_t lookup(const Twaypoint *waypoint, int x, int y) {
+			// Waypoints outside of the array are not in the fields
+			size_t offset = (uintptr_t)waypoint - (uintptr_t)waypoints;
+			size_t cellX = (size_t)((int64_t)x - minX), cellY = (size_t)((int64_t)y - minY);
+			if (offset >= numWaypoints * sizeof(Twaypoint) || cellX >= (size_t)width || cellY >= (size_t)height) {
+				return EXACT;
+			}
+			size_t index = (offset / sizeof(Twaypoint) * tilesHigh + cellY / TILE) * tilesWide + cellX / TILE;
+			Tile *tile = __atomic_load_n(&tiles[index], __ATOMIC_ACQUIRE);
+			if (!tile) {
+				tile = buildTile(index);
+			}
+			if (__atomic_load_n(&tile->lastUsed, __ATOMIC_RELAXED) != tick) {
+				__atomic_store_n(&tile->lastUsed, tick, __ATOMIC_RELAXED);
+			}
+			return tile->steps[(cellY % TILE) * TILE + cellX % TILE];
+		}
+
+		// Tiles built and evicted so far, and those resident now
+		long getBuiltTileCount() const { return built.load(std::memory_order_relaxed); }
+		long getEvictedTileCount() const { return evicted; }
+		size_t getResidentTileCount() const { return resident.load(std::memory_order_relaxed); }
+
+	private:
+		struct Tile {
+			long lastUsed;
+			uint8_t steps[TILE * TILE];
+		};
+
+		const Twaypoint *waypoints = nullptr;
+		size_t numWaypoints = 0;
+		int minX = 0, minY = 0, width = 0, height = 0;
+		size_t tilesWide = 0, tilesHigh = 0;
+		size_t maxTiles = 0;
+		long tick = 0;
+
+		// The tiles of all waypoints, by waypoint, then row, then column
+		Tile **tiles = nullptr;
+		size_t numTiles = 0;
+
+		std::atomic<long> built;
+		std::atomic<size_t> resident;
+		long evicted = 0;
+
+		// With obstacles: per cell whether it is blocked, and per waypoint
+		// its window and the length of the shortest path to the waypoint
+		// from each cell of it
+		std::vector<uint8_t> blocked;
+		std::vector<Window> windows;
+		std::vector<std::vector<uint32_t> > distances;
+
+		// Marks the cells covered by the obstacles in blocked
+		void rasterize(const std::vector<Tobstacle> &obstacles, TaskScheduler &scheduler);
+
+		// Computes the distances to a waypoint, from the cells within it outwards
+		void computeDistances(size_t waypoint);
+
+		// The step from a cell along the shortest path to the waypoint
+		uint8_t followDistances(size_t waypoint, int x, int y) const;
+
+		// Builds the tile at the index, or returns the one another thread
+		// built meanwhile
+		Tile* buildTile(size_t index);
+	};
+}
+
+#endif
@@ -0,0 +1,210 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the agent stages of HYBRID: each OpenMP thread updates a
+// contiguous share of chunks of the agent arrays with the widest SIMD
+// kernel the library is compiled for (AVX-512, AVX or SSE4.1 on doubles).
+// The kernel computes the same operations in the same order as
+// Tagent::computeNextDesiredPosition, so HYBRID moves the agents exactly
+// like SEQ. Agents that reached their destination (or have none) are
+// handed to the agent itself, which moves on along its route.
+//
+#include "ped_model.h"
+#include "ped_trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <immintrin.h>
+
+// Without optimization the helpers would be calls that pass the lanes
+// through memory
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+namespace {
+#if defined(__AVX512F__)
+	typedef __m512d Lanes;
+	const int LANES = 8;
+
+	ALWAYS_INLINE Lanes load(const double *p) { return _mm512_load_pd(p); }
+	ALWAYS_INLINE void store(double *p, Lanes v) { _mm512_store_pd(p, v); }
+	ALWAYS_INLINE Lanes add(Lanes a, Lanes b) { return _mm512_add_pd(a, b); }
+	ALWAYS_INLINE Lanes sub(Lanes a, Lanes b) { return _mm512_sub_pd(a, b); }
+	ALWAYS_INLINE Lanes mul(Lanes a, Lanes b) { return _mm512_mul_pd(a, b); }
+	ALWAYS_INLINE Lanes divide(Lanes a, Lanes b) { return _mm512_div_pd(a, b); }
+	ALWAYS_INLINE Lanes root(Lanes a) { return _mm512_sqrt_pd(a); }
+
+	// Bit j is set if a < b in lane j
+	ALWAYS_INLINE int lessMask(Lanes a, Lanes b) { return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); }
+
+	// Rounds half away from zero, like round()
+	ALWAYS_INLINE Lanes roundHalfAway(Lanes v) {
+		Lanes truncated = _mm512_roundscale_pd(v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+		__mmask8 up = _mm512_cmp_pd_mask(_mm512_abs_pd(_mm512_sub_pd(v, truncated)), _mm512_set1_pd(0.5), _CMP_GE_OQ);
+		__m512i sign = _mm512_and_si512(_mm512_castpd_si512(v), _mm512_set1_epi64(0x8000000000000000LL));
+		Lanes one = _mm512_castsi512_pd(_mm512_or_si512(sign, _mm512_castpd_si512(_mm512_set1_pd(1.0))));
+		return _mm512_mask_add_pd(truncated, up, truncated, one);
+	}
+#elif defined(__AVX__)
+	typedef __m256d Lanes;
+	const int LANES = 4;
+
+	ALWAYS_INLINE Lanes load(const double *p) { return _mm256_load_pd(p); }
+	ALWAYS_INLINE void store(double *p, Lanes v) { _mm256_store_pd(p, v); }
+	ALWAYS_INLINE Lanes add(Lanes a, Lanes b) { return _mm256_add_pd(a, b); }
+	ALWAYS_INLINE Lanes sub(Lanes a, Lanes b) { return _mm256_sub_pd(a, b); }
+	ALWAYS_INLINE Lanes mul(Lanes a, Lanes b) { return _mm256_mul_pd(a, b); }
+	ALWAYS_INLINE Lanes divide(Lanes a, Lanes b) { return _mm256_div_pd(a, b); }
+	ALWAYS_INLINE Lanes root(Lanes a) { return _mm256_sqrt_pd(a); }
+	ALWAYS_INLINE int lessMask(Lanes a, Lanes b) { return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ)); }
+
+	ALWAYS_INLINE Lanes roundHalfAway(Lanes v) {
+		Lanes truncated = _mm256_round_pd(v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+		Lanes signBit = _mm256_set1_pd(-0.0);
+		Lanes up = _mm256_cmp_pd(_mm256_andnot_pd(signBit, _mm256_sub_pd(v, truncated)), _mm256_set1_pd(0.5), _CMP_GE_OQ);
+		Lanes one = _mm256_or_pd(_mm256_and_pd(signBit, v), _mm256_set1_pd(1.0));
+		return _mm256_add_pd(truncated, _mm256_and_pd(up, one));
+	}
+#elif defined(__SSE4_1__)
+	typedef __m128d Lanes;
+	const int LANES = 2;
+
+	ALWAYS_INLINE Lanes load(const double *p) { return _mm_load_pd(p); }
+	ALWAYS_INLINE void store(double *p, Lanes v) { _mm_store_pd(p, v); }
+	ALWAYS_INLINE Lanes add(Lanes a, Lanes b) { return _mm_add_pd(a, b); }
+	ALWAYS_INLINE Lanes sub(Lanes a, Lanes b) { return _mm_sub_pd(a, b); }
+	ALWAYS_INLINE Lanes mul(Lanes a, Lanes b) { return _mm_mul_pd(a, b); }
+	ALWAYS_INLINE Lanes divide(Lanes a, Lanes b) { return _mm_div_pd(a, b); }
+	ALWAYS_INLINE Lanes root(Lanes a) { return _mm_sqrt_pd(a); }
+	ALWAYS_INLINE int lessMask(Lanes a, Lanes b) { return _mm_movemask_pd(_mm_cmplt_pd(a, b)); }
+
+	ALWAYS_INLINE Lanes roundHalfAway(Lanes v) {
+		Lanes truncated = _mm_round_pd(v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+		Lanes signBit = _mm_set1_pd(-0.0);
+		Lanes up = _mm_cmpge_pd(_mm_andnot_pd(signBit, _mm_sub_pd(v, truncated)), _mm_set1_pd(0.5));
+		Lanes one = _mm_or_pd(_mm_and_pd(signBit, v), _mm_set1_pd(1.0));
+		return _mm_add_pd(truncated, _mm_and_pd(up, one));
+	}
+#else
+	typedef double Lanes;
+	const int LANES = 1;
+
+	ALWAYS_INLINE Lanes load(const double *p) { return *p; }
+	ALWAYS_INLINE void store(double *p, Lanes v) { *p = v; }
+	ALWAYS_INLINE Lanes add(Lanes a, Lanes b) { return a + b; }
+	ALWAYS_INLINE Lanes sub(Lanes a, Lanes b) { return a - b; }
+	ALWAYS_INLINE Lanes mul(Lanes a, Lanes b) { return a * b; }
+	ALWAYS_INLINE Lanes divide(Lanes a, Lanes b) { return a / b; }
+	ALWAYS_INLINE Lanes root(Lanes a) { return std::sqrt(a); }
+	ALWAYS_INLINE int lessMask(Lanes a, Lanes b) { return a < b; }
+	ALWAYS_INLINE Lanes roundHalfAway(Lanes v) { return std::round(v); }
+#endif
+
+	// The kernel leaves the upper halves of the AVX registers dirty, which
+	// slows down the SSE code of libm that the agents call (see
+	// ped_scheduler.cpp)
+	ALWAYS_INLINE void clearUpperAvx() {
+#ifdef __AVX__
+		_mm256_zeroupper();
+#endif
+	}
+}
+
+void Ped::Model::setupAgentArrays()
+{
+	numChunks = (agents.size() + HYBRID_CHUNK - 1) / HYBRID_CHUNK;
+	if (numChunks == 0) {
+		return;
+	}
+	double **arrays[] = { &agentArrays.x, &agentArrays.y, &agentArrays.desiredX, &agentArrays.desiredY,
+		&agentArrays.destX, &agentArrays.destY, &agentArrays.destR };
+	for (double **array : arrays) {
+		*array = arena.allocateArray<double>(numChunks * HYBRID_CHUNK, Arena::SIMD);
+	}
+
+	// Filled by the workers, which run on the same CPUs as the OpenMP
+	// threads that update the same chunks later (first touch)
+	int workers = scheduler->getNumWorkers();
+	scheduler->runOnEachWorker([&](int worker) {
+		copyAgentsToArrays(HYBRID_CHUNK * Numa::blockBegin(numChunks, worker, workers),
+			HYBRID_CHUNK * Numa::blockEnd(numChunks, worker, workers));
+	});
+}
+
+void Ped::Model::copyAgentsToArrays(size_t begin, size_t end)
+{
+	AgentArrays &a = agentArrays;
+	for (size_t i = begin; i < end; i++) {
+		if (i >= agents.size()) {
+			// Padding, one step away from its destination so that it never
+			// arrives and never moves (see moveAgentsHybrid)
+			a.x[i] = a.y[i] = a.desiredX[i] = a.desiredY[i] = 0;
+			a.destX[i] = 1;
+			a.destY[i] = 0;
+			a.destR[i] = 0;
+			continue;
+		}
+		const Tagent *agent = agents[i];
+		a.x[i] = agent->getX();
+		a.y[i] = agent->getY();
+		a.desiredX[i] = agent->getDesiredX();
+		a.desiredY[i] = agent->getDesiredY();
+		const Twaypoint *destination = agent->getDestination();
+		if (destination) {
+			a.destX[i] = destination->getx();
+			a.destY[i] = destination->gety();
+			a.destR[i] = destination->getr();
+		}
+		else {
+			// Counts as arrived, so that the agent looks for its next destination
+			a.destX[i] = a.destY[i] = 0;
+			a.destR[i] = INFINITY;
+		}
+	}
+}
+
+void Ped::Model::computeDesiredPositionsHybrid(size_t begin, size_t end)
+{
+	PED_TRACE_SCOPE("tick.hybrid");
+	AgentArrays &a = agentArrays;
+	Ped::Tagent *const *agentData = agents.data();
+	size_t n = agents.size();
+	for (size_t i = begin * HYBRID_CHUNK; i < end * HYBRID_CHUNK; i += LANES) {
+		Lanes x = load(&a.x[i]);
+		Lanes y = load(&a.y[i]);
+		Lanes diffX = sub(load(&a.destX[i]), x);
+		Lanes diffY = sub(load(&a.destY[i]), y);
+		Lanes len = root(add(mul(diffX, diffX), mul(diffY, diffY)));
+		int arrived = lessMask(len, load(&a.destR[i]));
+		store(&a.desiredX[i], roundHalfAway(add(x, divide(diffX, len))));
+		store(&a.desiredY[i], roundHalfAway(add(y, divide(diffY, len))));
+		if (arrived) {
+			clearUpperAvx();
+		}
+
+		// The agents that arrived switch to their next waypoint and head
+		// there. The others get their desired position in moveAgentsHybrid.
+		while (arrived) {
+			int j = __builtin_ctz(arrived);
+			arrived &= arrived - 1;
+			if (i + j < n) {
+				agentData[i + j]->computeNextDesiredPosition();
+				copyAgentsToArrays(i + j, i + j + 1);
+			}
+		}
+	}
+	clearUpperAvx();
+}
+
+void Ped::Model::moveAgentsHybrid(size_t begin, size_t end)
+{
+	AgentArrays &a = agentArrays;
+	Ped::Tagent *const *agentData = agents.data();
+	size_t last = std::min(end * HYBRID_CHUNK, agents.size());
+	for (size_t i = begin * HYBRID_CHUNK; i < last; i++) {
+		Ped::Tagent *agent = agentData[i];
+		agent->setDesiredPosition((int)a.desiredX[i], (int)a.desiredY[i]);
+		agent->moveToDesiredPosition();
+		a.x[i] = a.desiredX[i];
+		a.y[i] = a.desiredY[i];
+	}
+}
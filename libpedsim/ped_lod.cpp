@@ -0,0 +1,99 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the level of detail of the collision avoidance: agents far
+// from all others step straight to their desired position, in parallel
+// in the desired stage, instead of one after the other in the move stage.
+//
+// An agent is isolated if no other agent is within ISOLATION_DISTANCE
+// cells, as far as the counts of the blocks around it tell. Every agent
+// moves at most one cell per tick, so for the next LOD_HORIZON ticks the
+// others stay at least three cells away from it. None of them can then
+// want its cells, or see a difference between it moving before or after
+// them: the steps are exactly those of the collision avoidance, which
+// setLodVerification() checks. The agent is only checked again once the
+// horizon is over, or when it does not step (e.g. it has no destination),
+// in which case the move stage handles it as usual.
+//
+#include "ped_model.h"
+#include "ped_trace.h"
+
+#include <cstdlib>
+
+namespace {
+	// Ticks an isolated agent steps on its own before it is checked again
+	const int LOD_HORIZON = 4;
+
+	// Two agents approach each other by at most two cells per tick. One more
+	// cell covers agents that step while the isolation is checked.
+	const int ISOLATION_DISTANCE = 2 * LOD_HORIZON + 3;
+}
+
+bool Ped::Model::isIsolated(const Tagent *agent) const
+{
+	// Far enough from the edges of the grid, whose outside counts as taken
+	int x = agent->getX(), y = agent->getY();
+	if (x - ISOLATION_DISTANCE < grid.minX || x + ISOLATION_DISTANCE >= grid.minX + grid.width
+		|| y - ISOLATION_DISTANCE < grid.minY || y + ISOLATION_DISTANCE >= grid.minY + grid.height) {
+		return false;
+	}
+
+	// The blocks around the agent hold only the agent itself
+	int firstX = (x - ISOLATION_DISTANCE - grid.minX) / LOD_BLOCK, lastX = (x + ISOLATION_DISTANCE - grid.minX) / LOD_BLOCK;
+	int firstY = (y - ISOLATION_DISTANCE - grid.minY) / LOD_BLOCK, lastY = (y + ISOLATION_DISTANCE - grid.minY) / LOD_BLOCK;
+	uint32_t count = 0;
+	for (int by = firstY; by <= lastY; by++) {
+		for (int bx = firstX; bx <= lastX; bx++) {
+			count += grid.blockCounts[(size_t)by * grid.blocksWide + bx].load(std::memory_order_relaxed);
+		}
+	}
+	return count == 1;
+}
+
+bool Ped::Model::stepIfIsolated(uint32_t i)
+{
+	AgentActivity &a = activity[i];
+	Tagent *agent = agents[i];
+	if (a.lodTicks == 0 && isIsolated(agent)) {
+		a.lodTicks = LOD_HORIZON;
+	}
+	if (a.lodTicks == 0) {
+		return false;
+	}
+
+	// Only a step to a neighboring cell is covered by the horizon, and
+	// only to one that no obstacle takes
+	int x = agent->getX(), y = agent->getY();
+	int desiredX = agent->getDesiredX(), desiredY = agent->getDesiredY();
+	if ((desiredX == x && desiredY == y) || abs(desiredX - x) > 1 || abs(desiredY - y) > 1
+		|| grid.occupancy[grid.cell(desiredX, desiredY)] != 0) {
+		a.lodTicks = 0;
+		return false;
+	}
+
+	a.lodTicks--;
+	grid.move(x, y, desiredX, desiredY);
+	agent->moveToDesiredPosition();
+	a.steppedAhead = true;
+	a.fromX = x;
+	a.fromY = y;
+	return true;
+}
+
+void Ped::Model::verifyIsolatedStep(uint32_t i)
+{
+	// In its turn, the collision avoidance would have found the desired
+	// position free, which the agent took, no one else would have moved to
+	// the cell it left, and there is no sleeper that leaving it wakes up
+	const AgentActivity &a = activity[i];
+	const Tagent *agent = agents[i];
+	bool same = grid.occupancy[grid.cell(agent->getX(), agent->getY())] == 1 && grid.occupancy[grid.cell(a.fromX, a.fromY)] == 0;
+	for (int y = a.fromY - 2; y <= a.fromY + 2; y++) {
+		for (int x = a.fromX - 2; x <= a.fromX + 2; x++) {
+			same = same && (!grid.contains(x, y) || grid.sleepers[grid.cell(x, y)] < 0);
+		}
+	}
+	if (!same) {
+		lodViolations++;
+	}
+}
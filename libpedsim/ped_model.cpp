@@ -8,6 +8,8 @@
 #include "ped_model.h"
 #include "ped_waypoint.h"
 #include "ped_model.h"
+#include "ped_trace.h"
+#include "ped_fastmath.h"
 #include <stdlib.h>
 #include <iostream>
 #include <stack>
@@ -15,29 +17,134 @@
 #include <omp.h>
 #include <thread>
 #include <immintrin.h>  // For SIMD intrinsics (AVX, SSE)
+#include <sstream>
+#include <climits>
+#include <cmath>
 
 #ifndef NOCDUA
 #include "cuda_testkernel.h"
 #endif
 
+const char* Ped::getImplementationName(IMPLEMENTATION implementation)
+{
+    switch (implementation) {
+        case CUDA: return "cuda";
+        case VECTOR: return "simd";
+        case OMP: return "omp";
+        case PTHREAD: return "pthread";
+        case SEQ: return "seq";
+        case HYBRID: return "hybrid";
+        case PSTL: return "pstl";
+        case SOCIAL: return "social";
+        case AUTO: return "auto";
+    }
+    return "unknown";
+}
+
+bool Ped::parseImplementation(const std::string &name, IMPLEMENTATION &implementation)
+{
+    const IMPLEMENTATION all[] = { CUDA, VECTOR, OMP, PTHREAD, SEQ, HYBRID, PSTL, SOCIAL, AUTO };
+    for (IMPLEMENTATION candidate : all) {
+        if (name == getImplementationName(candidate)) {
+            implementation = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
 void Ped::Model::setup(std::vector<Ped::Tagent*> agentsInScenario, std::vector<Twaypoint*> destinationsInScenario, IMPLEMENTATION implementation)
+{
+	beginSetup(implementation, agentsInScenario, destinationsInScenario);
+
+	// Set 
+	agents = std::vector<Ped::Tagent*>(agentsInScenario.begin(), agentsInScenario.end());
+
+	// Set up destinations
+	destinations = std::vector<Ped::Twaypoint*>(destinationsInScenario.begin(), destinationsInScenario.end());
+
+	moveIntoArena();
+	finishSetup();
+}
+
+void Ped::Model::setup(const ScenarioArrays &scenario, IMPLEMENTATION implementation)
+{
+	if (implementation == AUTO) {
+		// The candidates are timed on copies of the agents anyway
+		std::vector<Tagent*> agentsInScenario;
+		std::vector<Twaypoint*> destinationsInScenario;
+		for (size_t i = 0; i < scenario.numWaypoints; i++) {
+			const double *w = scenario.waypoints + 3 * i;
+			destinationsInScenario.push_back(new Twaypoint(w[0], w[1], w[2]));
+		}
+		for (size_t i = 0; i < scenario.numAgents; i++) {
+			Tagent *agent = new Tagent((int)scenario.agentX[i], (int)scenario.agentY[i]);
+			uint32_t route = scenario.agentRoute[i];
+			for (uint32_t e = scenario.routeOffsets[route]; e < scenario.routeOffsets[route + 1]; e++) {
+				agent->addWaypoint(destinationsInScenario[scenario.routeEntries[e]]);
+			}
+			agentsInScenario.push_back(agent);
+		}
+		setup(agentsInScenario, destinationsInScenario, implementation);
+		return;
+	}
+
+	beginSetup(implementation, std::vector<Tagent*>(), std::vector<Twaypoint*>());
+	placeIntoArena(scenario);
+	finishSetup();
+}
+
+void Ped::Model::beginSetup(IMPLEMENTATION implementation, const std::vector<Tagent*> &agentsInScenario,
+	const std::vector<Twaypoint*> &destinationsInScenario)
 {
 #ifndef NOCUDA
 	// Convenience test: does CUDA work on this machine?
 	cuda_test();
 #else
     std::cout << "Not compiled for CUDA" << std::endl;
+    if (implementation == CUDA) {
+        // Without CUDA, the per agent kernels of PSTL run on the CPU instead
+        std::cout << "Running the parallel algorithms backend (pstl) instead" << std::endl;
+        implementation = PSTL;
+    }
 #endif
 
-	// Set 
-	agents = std::vector<Ped::Tagent*>(agentsInScenario.begin(), agentsInScenario.end());
-
-	// Set up destinations
-	destinations = std::vector<Ped::Twaypoint*>(destinationsInScenario.begin(), destinationsInScenario.end());
+	if (implementation == AUTO) {
+		tuning = autotune(agentsInScenario, destinationsInScenario);
+		implementation = tuning.implementation;
+		numThreads = tuning.numThreads;
+		blocksPerThread = tuning.blocksPerThread;
+	}
+	else {
+		tuning = Tuning{ implementation, numThreads, blocksPerThread };
+	}
+	if (!obstacles.empty() && (implementation == VECTOR || implementation == HYBRID || implementation == PSTL)) {
+		// The SIMD kernels head straight for the waypoints, the agents have
+		// to look up their steps around the obstacles instead
+		IMPLEMENTATION lookups = implementation == VECTOR ? SEQ : implementation == HYBRID ? OMP : PTHREAD;
+		std::cout << "With obstacles, " << getImplementationName(implementation) << " runs as "
+			<< getImplementationName(lookups) << std::endl;
+		implementation = lookups;
+		tuning.implementation = lookups;
+	}
+	if (implementation == SOCIAL && collisionsEnabled) {
+		std::cout << "social keeps the agents apart by its forces, without the collision avoidance" << std::endl;
+		collisionsEnabled = false;
+		lodEnabled = false;
+	}
 
 	// Sets the chosen implemenation. Standard in the given code is SEQ
 	this->implementation = implementation;
-	
+
+	// The calling thread is worker 0 (and the only one of SEQ and VECTOR),
+	// it allocates and touches the buffers below
+	pinning.pinCurrentThread(0);
+	scheduler.reset(new TaskScheduler(getNumThreads(), pinning));
+}
+
+void Ped::Model::finishSetup()
+{
+	setupPopulation();
 
 	// Set up heatmap (relevant for Assignment 4)
 	setupHeatmapSeq();
@@ -50,21 +157,14 @@ void Ped::Model::setup(std::vector<Ped::Tagent*> agentsInScenario, std::vector<T
         numAgents   = agents.size();
         
         //
-        // Allocate aligned memory (Linux/macOS: posix_memalign)
+        // Allocate aligned memory (cache line aligned, enough for SSE and AVX)
         //
-        // Choose the no. of bytes
-        size_t fourAgents   = 16; // SSE 128bits
-        size_t eightAgents  = 32; // AVX
-    
         if (numAgents > 0) {
-
-            if (posix_memalign((void**)&xPos,       fourAgents, numAgents   * sizeof(float)) != 0 ||
-                posix_memalign((void**)&yPos,       fourAgents, numAgents   * sizeof(float)) != 0 ||
-                posix_memalign((void**)&xDestPos,   fourAgents, numAgents   * sizeof(float)) != 0 ||
-                posix_memalign((void**)&yDestPos,   fourAgents, numAgents   * sizeof(float)) != 0 ||
-                posix_memalign((void**)&destR,      fourAgents, numAgents   * sizeof(float)) != 0 ) {
-                exit(EXIT_FAILURE);
-            }
+            xPos        = arena.allocateArray<float>(numAgents, Arena::SIMD);
+            yPos        = arena.allocateArray<float>(numAgents, Arena::SIMD);
+            xDestPos    = arena.allocateArray<float>(numAgents, Arena::SIMD);
+            yDestPos    = arena.allocateArray<float>(numAgents, Arena::SIMD);
+            destR       = arena.allocateArray<float>(numAgents, Arena::SIMD);
         }
 
         for (size_t i = 0; i < numAgents; i++) {
@@ -79,161 +179,689 @@ void Ped::Model::setup(std::vector<Ped::Tagent*> agentsInScenario, std::vector<T
             
         }
     }
+
+    if (implementation == HYBRID || implementation == PSTL) {
+        setupAgentArrays();
+    }
+    if (implementation == PSTL) {
+        setupPstlBlocks();
+    }
+    if ((flowFieldsEnabled || !obstacles.empty()) && !destinations.empty()) {
+        // The agents head for the waypoints, so they stay within the box
+        // around them and the waypoints
+        int minX, minY, width, height;
+        getScenarioBounds(FlowFields::TILE, minX, minY, width, height);
+        flowFields.reset(new FlowFields());
+        flowFields->setup(destinations[0], destinations.size(), minX, minY, width, height,
+            flowFieldBudget / (FlowFields::TILE * FlowFields::TILE));
+        if (!obstacles.empty()) {
+            flowFields->setObstacles(obstacles, getWaypointWindows(FlowFields::TILE), *scheduler);
+        }
+    }
+    if (collisionsEnabled) {
+        // After the flow fields, whose obstacles take cells of the grid
+        setupCollisions();
+    }
+    if (implementation == SOCIAL) {
+        setupSocial();
+    }
+    if (fastMathEnabled && (flowFields || collisionsEnabled || (implementation != SEQ && implementation != PTHREAD
+            && implementation != OMP && implementation != VECTOR))) {
+        std::cout << "The fast math is only used by seq, pthread, omp and simd, without flow fields and collision avoidance" << std::endl;
+    }
+
+    // The blocks of the heatmap stages must span several rows, see addHeatmapStages()
+    int blocks = blocksPerThread > 0 ? blocksPerThread : 8;
+    pipeline.setNumBlocks(std::min(blocks * scheduler->getNumWorkers(), SIZE / 8));
+    setupPipeline();
 }
 
-void updateAgentPosition(Ped::Tagent* agent) {
-    if(agent) {
-        agent->computeNextDesiredPosition();
-        agent->setX(agent->getDesiredX());
-        agent->setY(agent->getDesiredY());
+int Ped::Model::getNumThreads() const
+{
+    switch (implementation) {
+        case OMP:
+        case HYBRID:
+        case SOCIAL: return numThreads > 0 ? numThreads : omp_get_max_threads();
+        case PTHREAD: return numThreads > 0 ? numThreads : 4;
+        default: return 1;
     }
 }
 
-void Ped::Model::tick()
+void Ped::Model::moveIntoArena()
 {
+    // Waypoints, remembering where each one went
+    std::map<const Twaypoint*, Twaypoint*> movedWaypoints;
+    Twaypoint *waypointStorage = arena.allocateArray<Twaypoint>(destinations.size(), Arena::WAYPOINTS);
+    for (size_t i = 0; i < destinations.size(); ++i) {
+        movedWaypoints[destinations[i]] = new (&waypointStorage[i]) Twaypoint(*destinations[i]);
+    }
 
-    switch (implementation)
-    {
-        case SEQ:
-        { // Sequential update of all agents
-            for (int i = 0; i < agents.size(); ++i)
-            {
-                updateAgentPosition(agents[i]);
+    // Routes, each distinct one stored once. Agents of generated and
+    // replicated scenarios mostly share a handful of routes.
+    std::vector<Twaypoint*> route;
+    for (Tagent *agent : agents) {
+        route.clear();
+        for (Twaypoint *waypoint : agent->getWaypoints()) {
+            auto moved = movedWaypoints.find(waypoint);
+            route.push_back(moved != movedWaypoints.end() ? moved->second : waypoint);
+        }
+        agent->shareRoute(shareRoute(route));
+    }
+
+    // Agents, copied by the workers that update them, in the same
+    // contiguous blocks as the static split of tick(). The OpenMP threads
+    // of OMP run on the same CPUs as the workers.
+    std::vector<Tagent*> originals = agents;
+    agentCapacity = agents.size();
+    agentStorage = arena.allocateArray<Tagent>(agentCapacity, Arena::AGENTS);
+    int workers = scheduler->getNumWorkers();
+    scheduler->runOnEachWorker([&](int worker) {
+        size_t end = Numa::blockEnd(agents.size(), worker, workers);
+        for (size_t i = Numa::blockBegin(agents.size(), worker, workers); i < end; ++i) {
+            agents[i] = new (&agentStorage[i]) Tagent(*originals[i]);
+        }
+    });
+
+    for (size_t i = 0; i < destinations.size(); ++i) {
+        delete destinations[i];
+        destinations[i] = &waypointStorage[i];
+    }
+    std::for_each(originals.begin(), originals.end(), [](Ped::Tagent *agent){delete agent;});
+
+    agentIds.resize(agents.size());
+    for (size_t i = 0; i < agents.size(); ++i) {
+        agentIds[i] = i;
+    }
+}
+
+void Ped::Model::placeIntoArena(const ScenarioArrays &scenario)
+{
+    Twaypoint *waypointStorage = arena.allocateArray<Twaypoint>(scenario.numWaypoints, Arena::WAYPOINTS);
+    destinations.resize(scenario.numWaypoints);
+    for (size_t i = 0; i < scenario.numWaypoints; ++i) {
+        const double *w = scenario.waypoints + 3 * i;
+        destinations[i] = new (&waypointStorage[i]) Twaypoint(w[0], w[1], w[2]);
+    }
+
+    std::vector<Twaypoint**> routes(scenario.numRoutes);
+    std::vector<Twaypoint*> route;
+    for (size_t r = 0; r < scenario.numRoutes; ++r) {
+        route.clear();
+        for (uint32_t e = scenario.routeOffsets[r]; e < scenario.routeOffsets[r + 1]; ++e) {
+            route.push_back(destinations[scenario.routeEntries[e]]);
+        }
+        routes[r] = shareRoute(route);
+    }
+
+    // The agents are created by the workers that update them, as in moveIntoArena()
+    agentCapacity = scenario.numAgents;
+    agentStorage = arena.allocateArray<Tagent>(agentCapacity, Arena::AGENTS);
+    agents.resize(scenario.numAgents);
+    int workers = scheduler->getNumWorkers();
+    scheduler->runOnEachWorker([&](int worker) {
+        size_t end = Numa::blockEnd(agents.size(), worker, workers);
+        for (size_t i = Numa::blockBegin(agents.size(), worker, workers); i < end; ++i) {
+            uint32_t r = scenario.agentRoute[i];
+            agents[i] = new (&agentStorage[i]) Tagent((int)scenario.agentX[i], (int)scenario.agentY[i], routes[r],
+                scenario.routeOffsets[r + 1] - scenario.routeOffsets[r]);
+        }
+    });
+
+    agentIds.resize(agents.size());
+    for (size_t i = 0; i < agents.size(); ++i) {
+        agentIds[i] = i;
+    }
+}
+
+void Ped::Model::getScenarioBounds(int margin, int &minX, int &minY, int &width, int &height) const
+{
+    int maxX = INT_MIN, maxY = INT_MIN;
+    minX = minY = INT_MAX;
+    for (const Tagent *agent : agents) {
+        minX = std::min(minX, agent->getX());
+        maxX = std::max(maxX, agent->getX());
+        minY = std::min(minY, agent->getY());
+        maxY = std::max(maxY, agent->getY());
+    }
+    for (const Twaypoint *waypoint : destinations) {
+        minX = std::min(minX, (int)waypoint->getx());
+        maxX = std::max(maxX, (int)waypoint->getx() + 1);
+        minY = std::min(minY, (int)waypoint->gety());
+        maxY = std::max(maxY, (int)waypoint->gety() + 1);
+    }
+    for (const Tobstacle &obstacle : obstacles) {
+        for (size_t i = 0; i < obstacle.getCornerCount(); i++) {
+            minX = std::min(minX, (int)floor(obstacle.getCornerX(i)));
+            maxX = std::max(maxX, (int)ceil(obstacle.getCornerX(i)));
+            minY = std::min(minY, (int)floor(obstacle.getCornerY(i)));
+            maxY = std::max(maxY, (int)ceil(obstacle.getCornerY(i)));
+        }
+    }
+    // And where agents are yet to come or go
+    for (const Tsource &source : sources) {
+        minX = std::min(minX, (int)floor(source.getx() - source.getdx() / 2));
+        maxX = std::max(maxX, (int)ceil(source.getx() + source.getdx() / 2));
+        minY = std::min(minY, (int)floor(source.gety() - source.getdy() / 2));
+        maxY = std::max(maxY, (int)ceil(source.gety() + source.getdy() / 2));
+    }
+    for (const Tsink &sink : sinks) {
+        minX = std::min(minX, (int)floor(sink.getx() - sink.getr()));
+        maxX = std::max(maxX, (int)ceil(sink.getx() + sink.getr()));
+        minY = std::min(minY, (int)floor(sink.gety() - sink.getr()));
+        maxY = std::max(maxY, (int)ceil(sink.gety() + sink.getr()));
+    }
+    if (minX > maxX) {
+        minX = maxX = minY = maxY = 0;
+    }
+    width = maxX - minX + 1 + 2 * margin;
+    height = maxY - minY + 1 + 2 * margin;
+    minX -= margin;
+    minY -= margin;
+}
+
+std::vector<Ped::FlowFields::Window> Ped::Model::getWaypointWindows(int margin) const
+{
+    // The boxes as first and last cells, empty at first
+    std::vector<int> boxes;
+    for (size_t w = 0; w < destinations.size(); w++) {
+        boxes.insert(boxes.end(), { INT_MAX, INT_MAX, INT_MIN, INT_MIN });
+    }
+    for (const Tagent *agent : agents) {
+        Troute route = agent->getWaypoints();
+        int box[4] = { agent->getX(), agent->getY(), agent->getX(), agent->getY() };
+        for (const Twaypoint *waypoint : route) {
+            box[0] = std::min(box[0], (int)floor(waypoint->getx()));
+            box[1] = std::min(box[1], (int)floor(waypoint->gety()));
+            box[2] = std::max(box[2], (int)ceil(waypoint->getx()));
+            box[3] = std::max(box[3], (int)ceil(waypoint->gety()));
+        }
+        for (const Twaypoint *waypoint : route) {
+            // The waypoints are in one array, see moveIntoArena()
+            size_t w = waypoint - destinations[0];
+            if (w >= destinations.size()) {
+                continue;
             }
+            boxes[4 * w] = std::min(boxes[4 * w], box[0]);
+            boxes[4 * w + 1] = std::min(boxes[4 * w + 1], box[1]);
+            boxes[4 * w + 2] = std::max(boxes[4 * w + 2], box[2]);
+            boxes[4 * w + 3] = std::max(boxes[4 * w + 3], box[3]);
         }
-        break;
+    }
 
-        case OMP:
-        { // Parallel update using OpenMP
-            #pragma omp parallel for
-            for (int i = 0; i < agents.size(); ++i)
-            {
-                updateAgentPosition(agents[i]);
+    // The same for the agents the sources will emit, from anywhere in their area
+    for (const Tsource &source : sources) {
+        int box[4] = { (int)floor(source.getx() - source.getdx() / 2), (int)floor(source.gety() - source.getdy() / 2),
+            (int)ceil(source.getx() + source.getdx() / 2), (int)ceil(source.gety() + source.getdy() / 2) };
+        for (size_t w : source.getRoute()) {
+            if (w < destinations.size()) {
+                box[0] = std::min(box[0], (int)floor(destinations[w]->getx()));
+                box[1] = std::min(box[1], (int)floor(destinations[w]->gety()));
+                box[2] = std::max(box[2], (int)ceil(destinations[w]->getx()));
+                box[3] = std::max(box[3], (int)ceil(destinations[w]->gety()));
             }
         }
-        break;
+        for (size_t w : source.getRoute()) {
+            if (w < destinations.size()) {
+                boxes[4 * w] = std::min(boxes[4 * w], box[0]);
+                boxes[4 * w + 1] = std::min(boxes[4 * w + 1], box[1]);
+                boxes[4 * w + 2] = std::max(boxes[4 * w + 2], box[2]);
+                boxes[4 * w + 3] = std::max(boxes[4 * w + 3], box[3]);
+            }
+        }
+    }
+
+    std::vector<FlowFields::Window> windows(destinations.size(), FlowFields::Window{ 0, 0, 0, 0 });
+    for (size_t w = 0; w < destinations.size(); w++) {
+        if (boxes[4 * w] <= boxes[4 * w + 2]) {
+            windows[w].minX = boxes[4 * w] - margin;
+            windows[w].minY = boxes[4 * w + 1] - margin;
+            windows[w].width = boxes[4 * w + 2] - boxes[4 * w] + 1 + 2 * margin;
+            windows[w].height = boxes[4 * w + 3] - boxes[4 * w + 1] + 1 + 2 * margin;
+        }
+    }
+    return windows;
+}
+
+std::string Ped::Model::getPlacementReport() const
+{
+    std::ostringstream report;
+    int threads = getNumThreads();
+    report << "NUMA nodes: " << Numa::getNumNodes() << ", threads: " << threads << "\n";
+    report << pinning.describe(threads);
+
+    std::vector<size_t> pagesPerNode;
+    size_t untouched;
+    std::vector<const void*> agentAddresses(agents.begin(), agents.end());
+    if (!Numa::getPagesPerNode(agentAddresses, pagesPerNode, untouched)) {
+        report << "  page placement not available (no move_pages)\n";
+        return report.str();
+    }
+    report << "  agents: " << Numa::describePages(pagesPerNode, untouched) << "\n";
+
+    // Pages of each thread's block of agents, to see if they are local
+    if (threads > 1) {
+        for (int t = 0; t < threads; ++t) {
+            std::vector<const void*> block(agents.begin() + Numa::blockBegin(agents.size(), t, threads),
+                agents.begin() + Numa::blockEnd(agents.size(), t, threads));
+            Numa::getPagesPerNode(block, pagesPerNode, untouched);
+            report << "    agents of thread " << t << ": " << Numa::describePages(pagesPerNode, untouched) << "\n";
+        }
+    }
+
+    if (xPos) {
+        Numa::getPagesPerNode(xPos, numAgents * sizeof(float), pagesPerNode, untouched);
+        report << "  SIMD arrays: " << Numa::describePages(pagesPerNode, untouched) << "\n";
+    }
+    Numa::getPagesPerNode(heatmap[0], SIZE * SIZE * sizeof(int), pagesPerNode, untouched);
+    report << "  heatmap: " << Numa::describePages(pagesPerNode, untouched) << "\n";
+    Numa::getPagesPerNode(blurred_heatmap[0], SCALED_SIZE * SCALED_SIZE * sizeof(int), pagesPerNode, untouched);
+    report << "  blurred heatmap: " << Numa::describePages(pagesPerNode, untouched) << "\n";
+    return report.str();
+}
+
+void Ped::Model::setupPipeline()
+{
+    if (implementation == SOCIAL) {
+        addSocialStages();
+        if (heatmapEnabled) {
+            addHeatmapStages();
+        }
+        return;
+    }
+    if (collisionsEnabled) {
+        addCollisionStages();
+        if (heatmapEnabled) {
+            addHeatmapStages();
+        }
+        return;
+    }
 
-        case PTHREAD:
-        { // Multi-threaded update using C++ threads
-            std::vector<std::thread> threads;
+    // The agent stages of SEQ, PTHREAD and OMP over the agents [begin, end)
+    auto computeDesired = [this](size_t begin, size_t end) { computeDesiredPositions(begin, end); };
+    auto moveAgents = [this](size_t begin, size_t end) {
+        Ped::Tagent *const *agentData = agents.data();
+        for (size_t i = begin; i < end; ++i) {
+            agentData[i]->moveToDesiredPosition();
+        }
+    };
 
-            for (int i = 0; i < 4; ++i) {
-                threads.emplace_back([&, i]() {
-                    for (int j = i; j < agents.size(); j += 4) {
-                        updateAgentPosition(agents[j]);
+    switch (implementation)
+    {
+        case OMP:
+        case HYBRID:
+        { // Parallel update using OpenMP, the regions start from the calling thread.
+          // Each thread updates its share of the items, in the same split as
+          // the first touch of the agents and the arrays of HYBRID.
+            auto ompStage = [this](std::function<size_t()> numItems, std::function<void(size_t, size_t)> update) {
+                return [this, numItems, update](int) {
+                    int threads = getNumThreads();
+                    size_t items = numItems();
+                    #pragma omp parallel num_threads(threads)
+                    {
+                        {
+                            PED_TRACE_SCOPE("tick.omp");
+                            int thread = omp_get_thread_num();
+                            pinning.pinCurrentThread(thread);
+                            double start = omp_get_wtime();
+                            update(Numa::blockBegin(items, thread, threads), Numa::blockEnd(items, thread, threads));
+                            threadBusySeconds[thread] += omp_get_wtime() - start;
+                        }
+                        // Time spent waiting for the slowest thread
+                        PED_TRACE_SCOPE("tick.omp.barrier");
+                        #pragma omp barrier
                     }
-                });
+                };
+            };
+            if (implementation == HYBRID) {
+                auto chunks = [this]() { return numChunks; };
+                pipeline.addSerialStage("desired", ompStage(chunks, [this](size_t begin, size_t end) {
+                    computeDesiredPositionsHybrid(begin, end);
+                }), {}, true);
+                pipeline.addSerialStage("move", ompStage(chunks, [this](size_t begin, size_t end) {
+                    moveAgentsHybrid(begin, end);
+                }), { { "desired", TickPipeline::ALL_BLOCKS } }, true);
             }
-
-            for (auto& t : threads) {
-                t.join();
+            else {
+                auto agentCount = [this]() { return agents.size(); };
+                pipeline.addSerialStage("desired", ompStage(agentCount, computeDesired), {}, true);
+                pipeline.addSerialStage("move", ompStage(agentCount, moveAgents), { { "desired", TickPipeline::ALL_BLOCKS } }, true);
             }
         }
         break;
 
+        case PSTL:
+        { // Parallel algorithms, which bring their own threads
+            pipeline.addSerialStage("desired", [this](int) { computeDesiredPositionsPstl(); });
+            pipeline.addSerialStage("move", [this](int) { moveAgentsPstl(); }, { { "desired", TickPipeline::ALL_BLOCKS } });
+        }
+        break;
+
+        case VECTOR:
+        { // SSE-based processing
+            pipeline.addSerialStage("desired", [this](int) { computeDesiredPositionsSimd(); });
+            pipeline.addSerialStage("move", [this](int) { moveAgentsSimd(); }, { { "desired", TickPipeline::ALL_BLOCKS } });
+        }
+        break;
+
+        default:
+        { // SEQ on its only worker, PTHREAD with work stealing (and CUDA, where compiled in)
+            auto blockStage = [this](std::function<void(size_t, size_t)> update) {
+                return [this, update](size_t begin, size_t end, int worker) {
+                    double start = omp_get_wtime();
+                    update(begin, end);
+                    threadBusySeconds[worker] += omp_get_wtime() - start;
+                };
+            };
+            auto agentCount = [this]() { return agents.size(); };
+            pipeline.addStage("desired", agentCount, blockStage(computeDesired));
+            pipeline.addStage("move", agentCount, blockStage(moveAgents), { { "desired", TickPipeline::SAME_BLOCK } });
+        }
+        break;
+    }
+
+    if (heatmapEnabled) {
+        addHeatmapStages();
+    }
+}
+
+void Ped::Model::computeDesiredPositions(size_t begin, size_t end)
+{
+    Ped::Tagent *const *agentData = agents.data();
+    if (flowFields) {
+        FlowFields &fields = *flowFields;
+        for (size_t i = begin; i < end; ++i) {
+            agentData[i]->computeNextDesiredPosition(fields);
+        }
+        return;
+    }
+    if (fastMathEnabled) {
+        long mismatches = 0;
+        for (size_t i = begin; i < end; ++i) {
+            computeDesiredPositionFast(agentData[i], mismatches);
+        }
+        if (mismatches > 0) {
+            tickMismatches.fetch_add(mismatches, std::memory_order_relaxed);
+        }
+        return;
+    }
+    for (size_t i = begin; i < end; ++i) {
+        agentData[i]->computeNextDesiredPosition();
+    }
+}
+
+void Ped::Model::computeDesiredPositionFast(Tagent *agent, long &mismatches)
+{
+    if (fastMathValidation) {
+        Tagent exact(*agent);
+        exact.computeNextDesiredPosition();
+        agent->computeNextDesiredPositionFast();
+        mismatches += exact.getDesiredX() != agent->getDesiredX() || exact.getDesiredY() != agent->getDesiredY();
+        return;
+    }
+    agent->computeNextDesiredPositionFast();
+}
+
+void Ped::Model::setOptions(const ModelOptions &options)
+{
+    setNumThreads(options.numThreads);
+    setBlocksPerThread(options.blocksPerThread);
+    setThreadPinning(options.pinning);
+    setPageMode(options.pageMode);
+    setTuningCache(options.tuningCache);
+    setHeatmapEnabled(options.heatmap);
+    setAgentReordering(options.reorder);
+    setCollisionAvoidance(options.collisions);
+    setLevelOfDetail(options.lod);
+    setLodVerification(options.verifyLod);
+    setFlowFields(options.flowFields, options.flowFieldBudget);
+    setFastMath(options.fastMath);
+    setFastMathValidation(options.validateFastMath);
+    setCompactionInterval(options.compactionInterval);
+}
+
+Ped::ModelOptions Ped::Model::getOptions() const
+{
+    ModelOptions options;
+    options.numThreads = numThreads;
+    options.blocksPerThread = blocksPerThread;
+    options.pinning = pinning;
+    options.pageMode = arena.getPageMode();
+    options.tuningCache = tuningCache;
+    options.heatmap = heatmapEnabled;
+    options.reorder = reorderingEnabled;
+    options.collisions = collisionsEnabled;
+    options.lod = lodEnabled;
+    options.verifyLod = lodVerification;
+    options.flowFields = flowFieldsEnabled;
+    options.flowFieldBudget = flowFieldBudget;
+    options.fastMath = fastMathEnabled;
+    options.validateFastMath = fastMathValidation;
+    options.compactionInterval = compactionInterval;
+    return options;
+}
+
+void Ped::Model::tick()
+{
+    tick(1);
+}
+
+void Ped::Model::tick(int ticks, const TickCallback &callback, int every)
+{
+    PED_TRACE_SCOPE("tick");
+
+    int threads = getNumThreads();
+    if (threadBusySeconds.size() < (size_t)threads) threadBusySeconds.resize(threads, 0);
+
+    every = std::max(every, 1);
+    int done = 0;
+    while (done < ticks) {
+        prepareTick();
+
+        // The following ticks run in the same job, as long as they need
+        // nothing from the workers before they start
+        pipeline.run(*scheduler, ticks - done, [&]() {
+            finishTick();
+            done++;
+            if (callback && (done % every == 0 || done == ticks)) {
+                callback();
+            }
+            if (done == ticks || needsWorkersBeforeTick()) {
+                return false;
+            }
+            prepareTick();
+            return true;
+        });
+    }
+}
+
+void Ped::Model::prepareTick()
+{
+    // Agents come and go between the ticks
+    updatePopulation();
+
+    // With collision avoidance the agents move in the order of memory,
+    // reordering them would change who gets to move first. SOCIAL sorts
+    // its own arrays by cell anyway.
+    if (reorderingEnabled && !collisionsEnabled && implementation != SOCIAL) {
+        keepAgentsOrdered();
+    }
+    if (flowFields) {
+        flowFields->beginTick(tickCount);
+    }
+}
+
+bool Ped::Model::needsWorkersBeforeTick() const
+{
+    bool reorders = reorderingEnabled && !collisionsEnabled && implementation != SOCIAL
+        && (reorderCount == 0 || tickCount >= nextLocalityCheck);
+    return populationChanges() || reorders;
+}
+
+void Ped::Model::finishTick()
+{
+    if (fastMathEnabled && fastMathValidation) {
+        fastMathMismatches.push_back(tickMismatches.exchange(0));
+    }
+    tickCount++;
+}
+
 //////////////////
 /// Assignment 2
 //////////////////
 
-		case VECTOR: // SSE-based processing 
-        { 
-            size_t i = 0;
-            for (; i + 4 <= numAgents; i += 4) {         
-
-                // Load data into SIMD registers
-                __m128 agent_xs = _mm_load_ps(&xPos[i]); 
-                __m128 agent_ys = _mm_load_ps(&yPos[i]); 
-                __m128 dest_x   = _mm_load_ps(&xDestPos[i]); 
-                __m128 dest_y   = _mm_load_ps(&yDestPos[i]); 
-                __m128 radius   = _mm_load_ps(&destR[i]);
-
-                // Get next destination function med simd
-       		    __m128 diffx    = _mm_sub_ps(dest_x, agent_xs); 
-        	    __m128 diffy    = _mm_sub_ps(dest_y, agent_ys); 
-                 
-                diffx           = _mm_mul_ps(diffx, diffx);  
-                diffy           = _mm_mul_ps(diffy, diffy); 
-
-                __m128 sum      = _mm_add_ps(diffx, diffy);  
-                __m128 length   = _mm_sqrt_ps(sum); // Euclidean distance
-
-                // Prevent division by zero
-                __m128 epsilon  = _mm_set1_ps(1e-6f);
-                length          = _mm_add_ps(length, epsilon);
-                
-                // Check if agent has reached it's destination 
-        	    __m128 agentReachedDestination = _mm_cmplt_ps(length, radius); // 0 = not reached, 1 = reached
-                
-        	    alignas(16) int results[4];
-        	    _mm_store_ps(reinterpret_cast<float*>(results), agentReachedDestination);
-                
-    	        // Update destination this is still done sequentially
-                //#pragma omp simd
-                for (int j = 0; j < 4; j++) {
-
-                    if (results[j] != 0) { 
-                        
-                        if (i + j < agents.size()){
-                            
-                            agents[i+j]->updateDestinationList();
-                            // agents[i+j]->destInit();
-                            // xDestPos[i+j] = (float)agents[i + j]->getDestX();     
-                            // yDestPos[i+j] = (float)agents[i + j]->getDestY();
-                            // destR[i+j]    = (float)agents[i + j]->getRadius();
-                        }  
-                    } 
-                }
-
-                // Compute next desired position function with simd
-                diffx = _mm_sub_ps(dest_x, agent_xs); 
-                diffy = _mm_sub_ps(dest_y, agent_ys); 
-
-                __m128 xmul = _mm_mul_ps(diffx, diffx);  
-                __m128 ymul = _mm_mul_ps(diffy, diffy); 
-                sum         = _mm_add_ps(xmul, ymul);  
-                length      = _mm_sqrt_ps(sum); 
-
-                __m128 diffX_div_len = _mm_div_ps(diffx, length);
-                __m128 diffY_div_len = _mm_div_ps(diffy, length);
-
-                __m128 add_x_diffx = _mm_add_ps(agent_xs, diffX_div_len); 
-                __m128 add_y_diffy = _mm_add_ps(agent_ys, diffY_div_len);
+void Ped::Model::computeDesiredPositionsSimd()
+{
+    PED_TRACE_SCOPE("tick.simd");
+    if (fastMathEnabled) {
+        computeDesiredPositionsSimdFast();
+        return;
+    }
+    size_t i = 0;
+    for (; i + 4 <= numAgents; i += 4) {         
+
+        // Load data into SIMD registers
+        __m128 agent_xs = _mm_load_ps(&xPos[i]); 
+        __m128 agent_ys = _mm_load_ps(&yPos[i]); 
+        __m128 dest_x   = _mm_load_ps(&xDestPos[i]); 
+        __m128 dest_y   = _mm_load_ps(&yDestPos[i]); 
+        __m128 radius   = _mm_load_ps(&destR[i]);
+
+        // Get next destination function med simd
+        __m128 diffx    = _mm_sub_ps(dest_x, agent_xs); 
+        __m128 diffy    = _mm_sub_ps(dest_y, agent_ys); 
+         
+        diffx           = _mm_mul_ps(diffx, diffx);  
+        diffy           = _mm_mul_ps(diffy, diffy); 
+
+        __m128 sum      = _mm_add_ps(diffx, diffy);  
+        __m128 length   = _mm_sqrt_ps(sum); // Euclidean distance
+
+        // Prevent division by zero
+        __m128 epsilon  = _mm_set1_ps(1e-6f);
+        length          = _mm_add_ps(length, epsilon);
+        
+        // Check if agent has reached it's destination 
+        __m128 agentReachedDestination = _mm_cmplt_ps(length, radius); // 0 = not reached, 1 = reached
+        
+        alignas(16) int results[4];
+        _mm_store_ps(reinterpret_cast<float*>(results), agentReachedDestination);
+        
+        // Update destination this is still done sequentially
+        //#pragma omp simd
+        for (int j = 0; j < 4; j++) {
+
+            if (results[j] != 0) { 
                 
-                __m128 p5 = _mm_set1_ps(0.5);
+                if (i + j < agents.size()){
+                    
+                    agents[i+j]->updateDestinationList();
+                    // agents[i+j]->destInit();
+                    // xDestPos[i+j] = (float)agents[i + j]->getDestX();     
+                    // yDestPos[i+j] = (float)agents[i + j]->getDestY();
+                    // destR[i+j]    = (float)agents[i + j]->getRadius();
+                }  
+            } 
+        }
 
-                add_x_diffx= _mm_add_ps(add_x_diffx, p5);
-                add_y_diffy= _mm_add_ps(add_y_diffy, p5);
+        // Compute next desired position function with simd
+        diffx = _mm_sub_ps(dest_x, agent_xs); 
+        diffy = _mm_sub_ps(dest_y, agent_ys); 
 
-                __m128 desiredPosX = _mm_floor_ps(add_x_diffx);
-                __m128 desiredPosY = _mm_floor_ps(add_y_diffy);
+        __m128 xmul = _mm_mul_ps(diffx, diffx);  
+        __m128 ymul = _mm_mul_ps(diffy, diffy); 
+        sum         = _mm_add_ps(xmul, ymul);  
+        length      = _mm_sqrt_ps(sum); 
 
-                // Store
-                _mm_store_ps(&xPos[i], desiredPosX);
-                _mm_store_ps(&yPos[i], desiredPosY);
+        __m128 diffX_div_len = _mm_div_ps(diffx, length);
+        __m128 diffY_div_len = _mm_div_ps(diffy, length);
 
-            }
-            
-            //
-            // Last Seq. parts
-            //
+        __m128 add_x_diffx = _mm_add_ps(agent_xs, diffX_div_len); 
+        __m128 add_y_diffy = _mm_add_ps(agent_ys, diffY_div_len);
+        
+        __m128 p5 = _mm_set1_ps(0.5);
 
-            // Copy updated positions back to agents
-            //#pragma omp simd
-            for (size_t j = 0; j < i; j++) {
-                
-                agents[j]->setX(xPos[j]);
-                agents[j]->setY(yPos[j]);
-            }
-            
-            // Handle the remaining agents
-            
-            for (; i < numAgents; i++) {
-                updateAgentPosition(agents[i]);
+        add_x_diffx= _mm_add_ps(add_x_diffx, p5);
+        add_y_diffy= _mm_add_ps(add_y_diffy, p5);
+
+        __m128 desiredPosX = _mm_floor_ps(add_x_diffx);
+        __m128 desiredPosY = _mm_floor_ps(add_y_diffy);
+
+        // Store
+        _mm_store_ps(&xPos[i], desiredPosX);
+        _mm_store_ps(&yPos[i], desiredPosY);
+
+    }
+    
+    // Handle the remaining agents
+    for (; i < numAgents; i++) {
+        agents[i]->computeNextDesiredPosition();
+    }
+}
+
+// The same with the fast math: the radius test on squared distances and
+// the step from the reciprocal square root. The validation runs the
+// exact kernel from the same positions.
+void Ped::Model::computeDesiredPositionsSimdFast()
+{
+    long mismatches = 0;
+    size_t i = 0;
+    for (; i + 4 <= numAgents; i += 4) {
+        __m128 x = _mm_load_ps(&xPos[i]);
+        __m128 y = _mm_load_ps(&yPos[i]);
+        __m128 radius = _mm_load_ps(&destR[i]);
+        __m128 diffX = _mm_sub_ps(_mm_load_ps(&xDestPos[i]), x);
+        __m128 diffY = _mm_sub_ps(_mm_load_ps(&yDestPos[i]), y);
+        __m128 length2 = FastMath::multiplyAdd(diffX, diffX, _mm_mul_ps(diffY, diffY));
+
+        int reached = _mm_movemask_ps(_mm_cmplt_ps(length2, _mm_mul_ps(radius, radius)));
+        for (int j = 0; j < 4; j++) {
+            if ((reached & (1 << j)) && i + j < agents.size()) {
+                agents[i + j]->updateDestinationList();
             }
         }
-        break;
 
-    } // end of switch
+        __m128 inverseLength = FastMath::inverseSqrt(length2);
+        __m128 desiredX = FastMath::roundHalfUp(FastMath::multiplyAdd(diffX, inverseLength, x));
+        __m128 desiredY = FastMath::roundHalfUp(FastMath::multiplyAdd(diffY, inverseLength, y));
+        if (fastMathValidation) {
+            __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(diffX, diffX), _mm_mul_ps(diffY, diffY)));
+            __m128 exactX = _mm_floor_ps(_mm_add_ps(_mm_add_ps(x, _mm_div_ps(diffX, length)), _mm_set1_ps(0.5f)));
+            __m128 exactY = _mm_floor_ps(_mm_add_ps(_mm_add_ps(y, _mm_div_ps(diffY, length)), _mm_set1_ps(0.5f)));
+            // Agents on the center of their destination get no number with both
+            __m128 sameX = _mm_or_ps(_mm_cmpeq_ps(desiredX, exactX), _mm_and_ps(_mm_cmpunord_ps(desiredX, desiredX), _mm_cmpunord_ps(exactX, exactX)));
+            __m128 sameY = _mm_or_ps(_mm_cmpeq_ps(desiredY, exactY), _mm_and_ps(_mm_cmpunord_ps(desiredY, desiredY), _mm_cmpunord_ps(exactY, exactY)));
+            mismatches += 4 - __builtin_popcount(_mm_movemask_ps(_mm_and_ps(sameX, sameY)));
+        }
+        _mm_store_ps(&xPos[i], desiredX);
+        _mm_store_ps(&yPos[i], desiredY);
+    }
+
+    // The remaining agents update themselves
+    for (; i < numAgents; i++) {
+        computeDesiredPositionFast(agents[i], mismatches);
+    }
+    tickMismatches.fetch_add(mismatches, std::memory_order_relaxed);
+}
+
+void Ped::Model::moveAgentsSimd()
+{
+    size_t i = numAgents - numAgents % 4;
+
+    // Copy updated positions back to agents, they are also the
+    // desired positions (read by the heatmap)
+    //#pragma omp simd
+    for (size_t j = 0; j < i; j++) {
+        
+        Ped::Tagent *agent = agents[j];
+        agent->setDesiredPosition(xPos[j], yPos[j]);
+        agent->moveToDesiredPosition();
+    }
+    
+    // Handle the remaining agents
+    
+    for (; i < numAgents; i++) {
+        agents[i]->moveToDesiredPosition();
+    }
 }
 
 ////////////
@@ -245,6 +873,8 @@ void Ped::Model::tick()
 // be moved to a location close to it.
 void Ped::Model::move(Ped::Tagent *agent)
 {
+	PED_TRACE_SCOPE("move");
+
 	// Search for neighboring agents
 	set<const Ped::Tagent *> neighbors = getNeighbors(agent->getX(), agent->getY(), 2);
 
@@ -313,34 +943,8 @@ void Ped::Model::cleanup() {
 
 Ped::Model::~Model()
 {
-	std::for_each(agents.begin(), agents.end(), [](Ped::Tagent *agent){delete agent;});
-	std::for_each(destinations.begin(), destinations.end(), [](Ped::Twaypoint *destination){delete destination; });
+	waitForCheckpoint();
 
-    // A2
-
-    if (xPos) {
-        //std::cout << "Freeing xPos in destructor: " << (void*)xPos << std::endl;
-        free(xPos);
-        xPos = nullptr;
-    }
-    if (yPos) {
-        //std::cout << "Freeing yPos in destructor: " << (void*)yPos << std::endl;
-        free(yPos);
-        yPos = nullptr;
-    }
-    if (xDestPos) {
-        //std::cout << "Freeing xDestPos in destructor: " << (void*)xDestPos << std::endl;
-        free(xDestPos);
-        xDestPos = nullptr;
-    }
-    if (yDestPos) {
-        //std::cout << "Freeing yDestPos in destructor: " << (void*)yDestPos << std::endl;
-        free(yDestPos);
-        yDestPos = nullptr;
-    }
-    if (destR) {
-        //std::cout << "Freeing destR in destructor: " << (void*)destR << std::endl;
-        free(destR);
-        destR = nullptr;
-    }
+	// The agents, the waypoints and all buffers are in the arena and own no
+	// other memory (see Tagent::shareRoute), they are released as a whole
 }
@@ -12,22 +12,64 @@
 #define _ped_model_h_
 
 #include <vector>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <map>
 #include <set>
+#include <string>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <cstdint>
 
 #include "ped_agent.h"
+#include "ped_numa.h"
+#include "ped_arena.h"
+#include "ped_scheduler.h"
+#include "ped_pipeline.h"
+#include "ped_flowfield.h"
+#include "ped_population.h"
 
 namespace Ped{
 	class Tagent;
 
 	// The implementation modes for Assignment 1 + 2:
-	// chooses which implementation to use for tick()
-	enum IMPLEMENTATION { CUDA, VECTOR, OMP, PTHREAD, SEQ };
+	// chooses which implementation to use for tick().
+	// HYBRID runs the widest available SIMD kernel on OpenMP threads, PSTL
+	// the C++17 parallel algorithms (also instead of CUDA where it is not
+	// compiled in). AUTO times the others on the scenario in setup() and
+	// runs the fastest (see Model::Tuning). SOCIAL moves the agents
+	// continuously by social forces instead of one cell per tick (see
+	// ped_social.cpp); it is never chosen by AUTO.
+	enum IMPLEMENTATION { CUDA, VECTOR, OMP, PTHREAD, SEQ, HYBRID, PSTL, SOCIAL, AUTO };
+
+	// Short name of an implementation, as used on the command line ("seq", "omp", ...)
+	const char* getImplementationName(IMPLEMENTATION implementation);
+
+	// Looks up an implementation by its short name, returns false if unknown
+	bool parseImplementation(const std::string &name, IMPLEMENTATION &implementation);
+
+	struct ModelOptions;
 
 	class Model
 	{
 	public:
 
+		// Gets notified at the beginning and the end of each phase of a
+		// tick, e.g. to read performance counters per phase
+		typedef TickPipeline::PhaseListener PhaseListener;
+
+		// The implementation and parameters a model runs with. For AUTO,
+		// setup() sets up the scenario with each candidate, times a few ticks
+		// and keeps the fastest.
+		struct Tuning {
+			IMPLEMENTATION implementation;
+			int numThreads;       // 0: the default of the implementation
+			int blocksPerThread;  // see setBlocksPerThread()
+		};
+
 		// A2
 
 		float* xPos			= nullptr;  // Stores X positions
@@ -42,13 +84,268 @@ namespace Ped{
 
 		// Sets everything up
 		void setup(std::vector<Tagent*> agentsInScenario, std::vector<Twaypoint*> destinationsInScenario,IMPLEMENTATION implementation);
+
+		// A scenario as flat arrays, e.g. those of a mapped snapshot: the
+		// waypoints as x, y, r, the distinct routes as waypoint indices
+		// (route r is routeEntries[routeOffsets[r]] up to
+		// routeOffsets[r + 1]) and each agent's position and route. The
+		// indices must be valid.
+		struct ScenarioArrays {
+			size_t numWaypoints;
+			const double *waypoints;
+			size_t numRoutes;
+			const uint32_t *routeOffsets;
+			const uint32_t *routeEntries;
+			size_t numAgents;
+			const int32_t *agentX;
+			const int32_t *agentY;
+			const uint32_t *agentRoute;
+		};
+
+		// Sets everything up with the agents and routes placed straight
+		// into the arena, without creating them one by one first
+		void setup(const ScenarioArrays &scenario, IMPLEMENTATION implementation);
 		
 		// Coordinates a time step in the scenario: move all agents by one step (if applicable).
+		// Runs the stages of getPipeline().
 		void tick();
 
+		// Called between the ticks of tick(int), see there
+		typedef std::function<void()> TickCallback;
+
+		// Runs the given number of ticks in as few jobs of the scheduler as
+		// possible: the workers go on from one tick to the next without a
+		// barrier on the calling thread, unless the agents must be added,
+		// removed or reordered before the next tick. With a callback, it is
+		// called after every `every` ticks and after the last one, on the
+		// calling thread while the workers spin shortly and then sleep until
+		// the next tick (a long callback costs their wakeup); it may read
+		// the agents and the heatmap and queue spawnAgent()/removeAgent(),
+		// but must not tick the model or use its scheduler.
+		void tick(int ticks, const TickCallback &callback = TickCallback(), int every = 1);
+
 		// Returns the agents of this scenario
 		const std::vector<Tagent*>& getAgents() const { return agents; };
 
+		// Sets whether tick() keeps the agents sorted along a Morton curve,
+		// so that agents that are close in space are close in memory (see
+		// ped_reorder.cpp). The agents are then moved between ticks: the
+		// pointers of getAgents() only stay valid until the next tick.
+		void setAgentReordering(bool enabled) { reorderingEnabled = enabled; }
+		bool isAgentReorderingEnabled() const { return reorderingEnabled; }
+
+		// The index in the scenario given to setup() of each agent of
+		// getAgents(), which stays the same when the agents are reordered.
+		// Agents added later get the next ids, see spawnAgent().
+		const std::vector<size_t>& getAgentIds() const { return agentIds; }
+
+		// Sorts the agents along the Morton curve right away
+		void reorderAgents();
+
+		// Returns how often the agents were reordered so far
+		long getReorderCount() const { return reorderCount; }
+
+		// Sets whether the agents avoid each other: like with move(), they
+		// take the first free one of their desired position and the two
+		// next to it, or stay where they are (see ped_collision.cpp). Agents
+		// that are stuck are left out of the ticks until a cell next to them
+		// is freed. Must be set before setup(); the agent stages are then the
+		// same for all implementations, which only decide the threads.
+		void setCollisionAvoidance(bool enabled) { collisionsEnabled = enabled; }
+		bool isCollisionAvoidanceEnabled() const { return collisionsEnabled; }
+
+		// The number of agents that are not asleep, with collision avoidance
+		size_t getActiveAgentCount() const { return collisionsEnabled ? activeAgents.size() : agents.size(); }
+
+		// Sets whether agents that are far from all others skip the
+		// collision avoidance: they step straight ahead, in parallel, for a
+		// few ticks in which nobody can get in their way (see ped_lod.cpp).
+		// Only with collision avoidance. Must be set before setup().
+		void setLevelOfDetail(bool enabled) { lodEnabled = enabled; }
+
+		// Sets whether each step of an isolated agent is checked against the
+		// collision avoidance it skipped. Must be set before setup().
+		void setLodVerification(bool enabled) { lodVerification = enabled; }
+
+		// Steps of isolated agents so far, and those that the collision
+		// avoidance would not have made (with setLodVerification())
+		long getLodStepCount() const { return lodSteps; }
+		long getLodViolationCount() const { return lodViolations; }
+
+		// Sets whether the agents look up their steps in flow fields, which
+		// are built as the agents need them (see ped_flowfield.h), instead of
+		// computing them. At most budgetBytes of them are kept between ticks.
+		// Used by SEQ, PTHREAD, OMP and the collision avoidance; the SIMD
+		// kernels of the others compute the steps of many agents at once
+		// anyway. Must be set before setup().
+		static const size_t DEFAULT_FLOW_FIELD_BUDGET = (size_t)64 << 20;
+		void setFlowFields(bool enabled, size_t budgetBytes = DEFAULT_FLOW_FIELD_BUDGET) { flowFieldsEnabled = enabled; flowFieldBudget = budgetBytes; }
+		bool isFlowFieldsEnabled() const { return flowFieldsEnabled; }
+
+		// Sets whether the agents compute their steps with approximate math
+		// (see ped_fastmath.h): a reciprocal square root estimate refined by
+		// one Newton step instead of sqrt and a division, the waypoint
+		// radius test on squared distances, and fused multiply-adds. Used by
+		// SEQ, PTHREAD and OMP without flow fields, and by VECTOR. Must be
+		// set before setup().
+		void setFastMath(bool enabled) { fastMathEnabled = enabled; }
+		bool isFastMathEnabled() const { return fastMathEnabled; }
+
+		// Sets whether each tick of the fast math also computes the steps
+		// with the exact math, from the same state, and counts the agents
+		// whose desired cells differ. Must be set before setup().
+		void setFastMathValidation(bool enabled) { fastMathValidation = enabled; }
+
+		// The agents whose desired cells differed per tick, with validation
+		const std::vector<long>& getFastMathMismatches() const { return fastMathMismatches; }
+
+		// The flow fields, nullptr without them
+		const FlowFields* getFlowFields() const { return flowFields.get(); }
+
+		// Sets the obstacles of the scenario. The agents then follow the
+		// shortest paths around them, which the flow fields hold (see
+		// ped_obstacle.cpp), and never step onto the cells they cover. The
+		// flow fields are used with all implementations: VECTOR runs as SEQ,
+		// HYBRID as OMP and PSTL as PTHREAD, whose per agent lookups replace
+		// the SIMD kernels. Must be set before setup().
+		void setObstacles(const std::vector<Tobstacle> &obstacles) { this->obstacles = obstacles; }
+		const std::vector<Tobstacle>& getObstacles() const { return obstacles; }
+
+		// Sets the sources that emit agents and the sinks that remove them
+		// while the scenario runs (see ped_population.cpp). Must be set
+		// before setup().
+		void setSources(const std::vector<Tsource> &sources) { this->sources = sources; }
+		void setSinks(const std::vector<Tsink> &sinks) { this->sinks = sinks; }
+		const std::vector<Tsource>& getSources() const { return sources; }
+		const std::vector<Tsink>& getSinks() const { return sinks; }
+
+		// Queues an agent on x/y with the route given by the indices of its
+		// waypoints among those given to setup(), which is added at the
+		// beginning of the next tick. Returns the id it will have in
+		// getAgentIds(). With collision avoidance it is not added if its
+		// cell is taken or outside of the grid, and with VECTOR not
+		// without a route. Can be called from any thread, also during a tick.
+		size_t spawnAgent(int x, int y, const std::vector<size_t> &route);
+
+		// Queues the removal of the agent with the given id, at the
+		// beginning of the next tick. Can be called from any thread.
+		void removeAgent(size_t id);
+
+		// The id in getAgentIds() of the slots whose agent was removed: the
+		// slots stay in getAgents(), with an agent that never moves off the
+		// grid, until spawned agents reuse them or they are compacted away.
+		// The pointers of getAgents() then only stay valid until the next tick.
+		static const size_t NO_AGENT = SIZE_MAX;
+
+		// Sets every how many ticks the slots of removed agents are
+		// compacted away (default 16)
+		void setCompactionInterval(int ticks) { compactionInterval = ticks > 0 ? ticks : 1; }
+
+		// The agents in getAgents() that were not removed
+		size_t getLiveAgentCount() const { return agents.size() - freeSlots.size(); }
+
+		// One more than the largest id handed out so far; the ids of removed
+		// agents are not reused
+		size_t getAgentIdCount() const { return nextAgentId.load(std::memory_order_relaxed); }
+
+		// Whether agents can be added or removed, or already were
+		bool hasDynamicPopulation() const;
+
+		// Agents added and removed, spawns that were rejected, and how often
+		// the slots were compacted, so far
+		long getSpawnCount() const { return spawnCount; }
+		long getRemovalCount() const { return removalCount; }
+		long getRejectedSpawnCount() const { return rejectedSpawnCount; }
+		long getCompactionCount() const { return compactionCount; }
+
+		// Sets the listener notified about the phases of each tick (nullptr
+		// for none): the stages of the pipeline, see getPipeline(). They
+		// run one after the other while a listener is set.
+		void setPhaseListener(PhaseListener *listener) { pipeline.setPhaseListener(listener); }
+
+		// Sets all options of ModelOptions at once, before setup(), and
+		// returns them as they are set
+		void setOptions(const ModelOptions &options);
+		ModelOptions getOptions() const;
+
+		// Sets the number of threads used by the OMP, HYBRID, PTHREAD and PSTL
+		// implementations (0: the default, i.e. the OpenMP default for OMP and
+		// HYBRID, 4 for PTHREAD and all threads of TBB for PSTL)
+		void setNumThreads(int threads) { numThreads = threads; }
+
+		// Returns the number of threads the current implementation uses
+		int getNumThreads() const;
+
+		// Sets how many blocks the share of each thread is split into in the
+		// stages of the pipeline (0: the default, 8), i.e. how fine grained
+		// the work stealing is. Must be set before setup().
+		void setBlocksPerThread(int blocks) { blocksPerThread = blocks; }
+
+		// Sets the file where AUTO remembers its choice per scenario, CPU
+		// model and heatmap setting, so that later runs skip the calibration
+		// ("": none, the default). Must be set before setup().
+		void setTuningCache(const std::string &filename) { tuningCache = filename; }
+
+		// The implementation and parameters setup() chose, for AUTO, or was given
+		const Tuning& getTuning() const { return tuning; }
+
+		// Pins the threads of the OMP, HYBRID and PTHREAD implementations to cores.
+		// Must be set before setup(), which then allocates the memory of
+		// each agent on the thread that updates it, so that it ends up on
+		// the NUMA node of that thread.
+		void setThreadPinning(const ThreadPinning &pinning) { this->pinning = pinning; }
+
+		// Describes where the threads run and on which NUMA nodes the
+		// memory of the agents and buffers is
+		std::string getPlacementReport() const;
+
+		// Sets whether the memory of the model is backed by huge pages.
+		// Must be set before setup().
+		void setPageMode(Arena::PageMode mode) { arena.setPageMode(mode); }
+
+		// Describes the memory of the model: the bytes of the agents, the
+		// routes, the heatmaps etc. and how much of it is on huge pages
+		std::string getMemoryReport() const { return arena.describe(); }
+
+		// The work stealing scheduler with getNumThreads() workers, pinned as
+		// set with setThreadPinning(). Created by setup(); runs the PTHREAD
+		// tick and the heatmap stages, and can run other per-agent work,
+		// e.g. of the export, on the same threads.
+		TaskScheduler& getScheduler() { return *scheduler; }
+		const TaskScheduler& getScheduler() const { return *scheduler; }
+
+		// Whether tick() also updates the heatmap. Must be set before setup().
+		void setHeatmapEnabled(bool enabled) { heatmapEnabled = enabled; }
+		bool isHeatmapEnabled() const { return heatmapEnabled; }
+
+		// The stages of tick(), built by setup(): "desired" and "move" for
+		// the agents and, with the heatmap, "heatmap.fade", "heatmap.scatter",
+		// "heatmap.clamp", "heatmap.scale" and "heatmap.blur". The blocks of
+		// the agent stages are agents, the ones of the heatmap stages rows
+		// (of the scaled heatmap for the blur). More stages can be added
+		// after setup(), e.g. to export each tick.
+		TickPipeline& getPipeline() { return pipeline; }
+
+		// Returns the time each thread spent updating agents (so without
+		// waiting for the others), summed up over all ticks
+		const std::vector<double>& getThreadBusySeconds() const { return threadBusySeconds; }
+		void resetThreadBusySeconds() { threadBusySeconds.clear(); }
+
+		// Returns the number of ticks simulated so far
+		long getTickCount() const { return tickCount; }
+
+		// Writes the state of the simulation to a checkpoint file. The state
+		// is copied right away, while the file is written in the background
+		// so that the simulation can continue. Returns false on failure.
+		bool saveCheckpoint(const std::string &filename);
+
+		// Restores a checkpoint. The model must have been set up with the same
+		// scenario as the model that wrote the checkpoint.
+		bool loadCheckpoint(const std::string &filename);
+
+		// Blocks until the last checkpoint is on disk, returns whether it succeeded
+		bool waitForCheckpoint();
+
 		// Adds an agent to the tree structure
 		void placeAgent(const Ped::Tagent *a);
 
@@ -60,6 +357,25 @@ namespace Ped{
 		int const * const * getHeatmap() const { return blurred_heatmap; };
 		int getHeatmapSize() const;
 
+		// The kernels below are public so that they can be benchmarked
+		// one by one (see bench/)
+
+		// Moves an agent towards its next position
+		void move(Ped::Tagent *agent);
+
+		// Returns the set of neighboring agents for the specified position
+		set<const Ped::Tagent*> getNeighbors(int x, int y, int dist) const;
+
+		// Updates the heatmap, by running all of its stages in order
+		void updateHeatmapSeq();
+
+		// The stages of the heatmap update, each over all rows
+		void fadeHeatmap();
+		void scatterHeatmap();
+		void clampHeatmap();
+		void scaleHeatmap();
+		void blurHeatmap();
+
 	private:
 
 		// Denotes which implementation (sequential, parallel implementations..)
@@ -73,15 +389,399 @@ namespace Ped{
 		// The waypoints in this scenario
 		std::vector<Twaypoint*> destinations;
 
-		// Moves an agent towards its next position
-		void move(Ped::Tagent *agent);
+		// Number of ticks simulated so far
+		long tickCount = 0;
 
-		////////////
-		/// Everything below here won't be relevant until Assignment 3
-		///////////////////////////////////////////////
+		// The work before a tick: adding, removing and reordering agents,
+		// and evicting flow field tiles
+		void prepareTick();
 
-		// Returns the set of neighboring agents for the specified position
-		set<const Ped::Tagent*> getNeighbors(int x, int y, int dist) const;
+		// Whether prepareTick() needs the workers for the next tick, which
+		// then starts a new job of the scheduler
+		bool needsWorkersBeforeTick() const;
+
+		// The work after a tick
+		void finishTick();
+
+		// Number of threads requested with setNumThreads
+		int numThreads = 0;
+
+		int blocksPerThread = 0;
+		std::string tuningCache;
+		Tuning tuning = { SEQ, 0, 0 };
+
+		// Times the candidates for AUTO on a copy of the scenario and
+		// returns the fastest, or the choice cached for the scenario
+		Tuning autotune(const std::vector<Tagent*> &agentsInScenario, const std::vector<Twaypoint*> &destinationsInScenario);
+
+		// Per thread time spent updating agents
+		std::vector<double> threadBusySeconds;
+
+		ThreadPinning pinning;
+
+		// Owns the agents, the waypoints, the routes and all buffers below,
+		// which are released at once with the model
+		Arena arena;
+
+		std::unique_ptr<TaskScheduler> scheduler;
+
+		TickPipeline pipeline;
+		bool heatmapEnabled = false;
+
+		// Adds the stages of the implementation to the pipeline
+		void setupPipeline();
+
+		// The desired stage of SEQ, PTHREAD and OMP over the agents [begin, end),
+		// with the flow fields if there are any
+		void computeDesiredPositions(size_t begin, size_t end);
+
+		bool fastMathEnabled = false;
+		bool fastMathValidation = false;
+		std::vector<long> fastMathMismatches;
+
+		// The mismatches of the current tick, added up by the workers
+		std::atomic<long> tickMismatches{0};
+
+		// Computes the desired position of the agent with the fast math,
+		// and counts it in mismatches if the exact math would not have
+		// given the same, with validation
+		void computeDesiredPositionFast(Tagent *agent, long &mismatches);
+
+		// The agent stages of VECTOR: the SIMD update of the positions, and
+		// copying them back into the agents
+		void computeDesiredPositionsSimd();
+		void moveAgentsSimd();
+
+		// The desired stage of VECTOR with the fast math
+		void computeDesiredPositionsSimdFast();
+
+		// The agents of HYBRID and PSTL as arrays, padded to whole chunks of
+		// HYBRID_CHUNK agents. A chunk of each array fills whole cache lines,
+		// so the threads that update different chunks never share a line.
+		struct AgentArrays {
+			double *x = nullptr;
+			double *y = nullptr;
+			double *desiredX = nullptr;
+			double *desiredY = nullptr;
+			double *destX = nullptr;
+			double *destY = nullptr;
+			double *destR = nullptr;
+		};
+		static const size_t HYBRID_CHUNK = 16;
+		AgentArrays agentArrays;
+		size_t numChunks = 0;
+
+		// Allocates the agent arrays and fills them from the agents
+		void setupAgentArrays();
+
+		// Copies the agents [begin, end) into the arrays, e.g. after
+		// restoring a checkpoint
+		void copyAgentsToArrays(size_t begin, size_t end);
+
+		// The agent stages of HYBRID over the chunks [begin, end)
+		void computeDesiredPositionsHybrid(size_t begin, size_t end);
+		void moveAgentsHybrid(size_t begin, size_t end);
+
+		// The agents of SOCIAL as float arrays, sorted by their cell of the
+		// cell lists, with their index in agents (see ped_social.cpp). The
+		// binning at the beginning of each tick sorts them into the spare
+		// arrays, which are then swapped with them.
+		struct SocialArrays {
+			float *x = nullptr;
+			float *y = nullptr;
+			float *vx = nullptr;
+			float *vy = nullptr;
+			float *destX = nullptr;
+			float *destY = nullptr;
+			float *destR = nullptr;
+			uint32_t *agent = nullptr;
+		};
+		SocialArrays social;
+		SocialArrays spareSocial;
+
+		// The agents in social, which leaves out the removed ones
+		size_t numSocialAgents = 0;
+
+		// The positions at the end of the tick, swapped with those of social
+		float *socialNextX = nullptr;
+		float *socialNextY = nullptr;
+
+		// The cell lists: a grid over the scenario, the first agent of each
+		// cell in social (and the end of the last one), and the cell of
+		// each agent and where it goes while binning
+		struct CellLists {
+			int minX = 0, minY = 0, width = 0, height = 0;
+			std::vector<uint32_t> start;
+			std::vector<uint32_t> of;
+			std::vector<uint32_t> to;
+		};
+		CellLists cells;
+
+		// Sets up the cell lists and the arrays of SOCIAL, filled from the agents
+		void setupSocial();
+
+		// Fills the arrays of SOCIAL from the agents, at rest, e.g. after
+		// restoring a checkpoint of another implementation
+		void copyAgentsToSocial();
+
+		// Adds the agent in slot i at the end of social, at rest
+		void addSocialAgent(size_t i);
+
+		// Copies the destination of the agent at k of social into its arrays
+		void copySocialDestination(size_t k);
+
+		// Adds the agent stages of SOCIAL to the pipeline
+		void addSocialStages();
+
+		// Sorts the arrays of SOCIAL by cell
+		void binSocialAgents();
+
+		// Moves the agents of the row of cells of SOCIAL by the forces on them
+		void computeSocialForces(int row);
+
+		// The indices of the blocks of agents of PSTL, which the parallel
+		// algorithms run over
+		std::vector<size_t> blockIndices;
+		void setupPstlBlocks();
+
+		// The agent stages of PSTL, each a kernel over all agents
+		void computeDesiredPositionsPstl();
+		void moveAgentsPstl();
+
+		// Where each agent was in the scenario, see getAgentIds()
+		std::vector<size_t> agentIds;
+
+		// The number of slots agentStorage (and the arrays of the
+		// implementations) have room for
+		size_t agentCapacity = 0;
+
+		// The array the agents are in, and the one they are copied to when
+		// they are reordered (allocated by the first reorder)
+		Tagent *agentStorage = nullptr;
+		Tagent *spareAgentStorage = nullptr;
+
+		bool reorderingEnabled = false;
+		long reorderCount = 0;
+
+		// The locality right after the last reorder, and the tick at which
+		// it is measured next, see keepAgentsOrdered()
+		double sortedLocality = 0;
+		long lastReorderTick = 0;
+		long nextLocalityCheck = 0;
+
+		// Reorders the agents when their locality decayed, called before each tick
+		void keepAgentsOrdered();
+
+		// The mean distance between agents that are next to each other in memory
+		double measureLocality() const;
+
+		// The occupancy of the cells for the collision avoidance, and the
+		// agents asleep in each cell as a list through AgentActivity. The
+		// agents are also counted per block of LOD_BLOCK x LOD_BLOCK cells,
+		// which the isolated agents update in parallel.
+		static const int LOD_BLOCK = 8;
+		struct OccupancyGrid {
+			int minX = 0, minY = 0, width = 0, height = 0;
+			std::vector<uint32_t> occupancy;
+			std::vector<int32_t> sleepers;
+			int blocksWide = 0, blocksHigh = 0;
+			std::unique_ptr<std::atomic<uint32_t>[]> blockCounts;
+
+			bool contains(int x, int y) const { return x >= minX && x < minX + width && y >= minY && y < minY + height; }
+			size_t cell(int x, int y) const { return (size_t)(y - minY) * width + (x - minX); }
+			size_t block(int x, int y) const { return (size_t)((y - minY) / LOD_BLOCK) * blocksWide + (x - minX) / LOD_BLOCK; }
+
+			// Moves an agent from one cell to another
+			void move(int fromX, int fromY, int toX, int toY);
+		};
+		struct AgentActivity {
+			int blockedTicks = 0;       // ticks the agent stayed where it is
+			size_t routeCursor = 0;     // where on its route it was then
+			bool asleep = false;
+			long wakeTick = 0;
+			int32_t previous = -1;      // the other sleepers of its cell
+			int32_t next = -1;
+			int lodTicks = 0;           // ticks it may still step on its own
+			bool steppedAhead = false;  // it did in the current tick, from
+			int fromX = 0, fromY = 0;
+		};
+		bool collisionsEnabled = false;
+		bool lodEnabled = false;
+		bool lodVerification = false;
+		long lodSteps = 0;
+		long lodViolations = 0;
+		OccupancyGrid grid;
+		std::vector<AgentActivity> activity;
+
+		// The indices of the agents that are awake, ascending, and those
+		// woken up during the current tick
+		std::vector<uint32_t> activeAgents;
+		std::vector<uint32_t> wokenAgents;
+
+		// The sleepers and when they wake up anyway, in that order
+		std::deque<std::pair<uint32_t, long> > sleepQueue;
+
+		// Sets up the grid around the scenario, then resetActiveSet()
+		void setupCollisions();
+
+		// Fills the grid from the positions of the agents, all of them awake
+		void resetActiveSet();
+
+		// Adds the agent stages with collision avoidance to the pipeline
+		void addCollisionStages();
+
+		// Moves the active agents one after the other, puts those to sleep
+		// that are stuck and wakes those next to the freed cells
+		void moveActiveAgents();
+
+		// Moves the agent to the first free cell of its alternatives,
+		// returns false if it stays
+		bool moveWithCollisions(Tagent *agent);
+
+		void sleep(uint32_t i);
+		void wake(uint32_t i);
+
+		// Whether no other agent is close enough to the agent to get in its
+		// way within LOD_HORIZON ticks
+		bool isIsolated(const Tagent *agent) const;
+
+		// Steps an isolated agent to its desired position, called in the
+		// desired stage. Returns false if the agent is left to moveActiveAgents().
+		bool stepIfIsolated(uint32_t i);
+
+		// Checks that the collision avoidance would have made the step of an
+		// isolated agent, called in its turn in moveActiveAgents()
+		void verifyIsolatedStep(uint32_t i);
+
+		bool flowFieldsEnabled = false;
+		size_t flowFieldBudget = DEFAULT_FLOW_FIELD_BUDGET;
+		std::unique_ptr<FlowFields> flowFields;
+		std::vector<Tobstacle> obstacles;
+
+		// The bounding box of the agents, waypoints and obstacles, with a margin
+		void getScenarioBounds(int margin, int &minX, int &minY, int &width, int &height) const;
+
+		// The windows of the distances to the waypoints around the obstacles:
+		// the box around the agents that head for a waypoint and the other
+		// waypoints of their routes, with a margin
+		std::vector<FlowFields::Window> getWaypointWindows(int margin) const;
+
+		// Moves the scenario into the arena: the waypoints, each distinct
+		// route once, and the agents in one array. The agents are copied
+		// by the workers that update them, which places them on the NUMA
+		// nodes of these workers (first touch).
+		void moveIntoArena();
+
+		// The same for a scenario in flat arrays, whose routes are distinct already
+		void placeIntoArena(const ScenarioArrays &scenario);
+
+		// The parts of setup() before and after the scenario is in the
+		// arena; beginSetup() picks the implementation that runs (with the
+		// scenario for AUTO) and starts the workers
+		void beginSetup(IMPLEMENTATION implementation, const std::vector<Tagent*> &agentsInScenario,
+			const std::vector<Twaypoint*> &destinationsInScenario);
+		void finishSetup();
+
+		std::vector<Tsource> sources;
+		std::vector<Tsink> sinks;
+
+		// Per source: the agents emitted so far, the share of the next one
+		// it has accumulated, where it places them and their route
+		struct SourceState {
+			size_t emitted = 0;
+			double credit = 0;
+			std::mt19937_64 random;
+			std::vector<Twaypoint*> route;
+			bool valid = true;
+		};
+		std::vector<SourceState> sourceStates;
+
+		// A spawnAgent() or removeAgent() that waits for the next tick
+		struct PopulationCommand {
+			bool spawn;
+			size_t id;
+			int x, y;
+			std::vector<size_t> route;
+		};
+		std::mutex commandMutex;
+		std::vector<PopulationCommand> commands;
+		std::atomic<bool> commandsQueued{false};
+		std::atomic<size_t> nextAgentId{0};
+
+		// The slots of removed agents
+		std::vector<size_t> freeSlots;
+
+		int compactionInterval = 16;
+		long spawnCount = 0;
+		long removalCount = 0;
+		long rejectedSpawnCount = 0;
+		long compactionCount = 0;
+
+		// Each distinct route once, shared by the agents that take it
+		std::map<std::vector<Twaypoint*>, Twaypoint**> sharedRoutes;
+
+		// The entry in social of each slot, while agents are removed
+		std::vector<uint32_t> socialEntryOf;
+
+		// Sets up the sources, called by setup() once the waypoints are in the arena
+		void setupPopulation();
+
+		// Adds and removes the agents at the beginning of a tick: those in
+		// the sinks, those of the queued commands and those the sources
+		// emit, and compacts the slots every compactionInterval ticks
+		void updatePopulation();
+
+		// Whether updatePopulation() has anything to do
+		bool populationChanges() const;
+
+		// Finds the agents in the sinks, on the workers, ascending
+		std::vector<size_t> findAgentsInSinks();
+
+		// Turns the agent in a slot into a removed one
+		void removeFromSlot(size_t slot);
+
+		// Adds an agent in a free slot or at the end, returns false if it
+		// is rejected (see spawnAgent())
+		bool spawnIntoSlot(size_t id, int x, int y, const std::vector<Twaypoint*> &route);
+
+		// Looks up the waypoints of a route, returns false if one does not exist
+		bool resolveRoute(const std::vector<size_t> &indices, std::vector<Twaypoint*> &route) const;
+
+		// The shared copy of a route
+		Twaypoint** shareRoute(const std::vector<Twaypoint*> &route);
+
+		// Moves the agents and the arrays of the implementation to ones
+		// with room for capacity agents
+		void reserveAgents(size_t capacity);
+
+		// Updates the arrays of the implementation after agents were added
+		// at the end, from oldSize on
+		void agentsAppended(size_t oldSize);
+
+		// Copies the agent in slot i into the arrays of VECTOR
+		void copyAgentToVectorArrays(size_t i);
+
+		// Drops the slots of removed agents, keeping the others in order
+		void compactAgents();
+
+		// Moves the agent of slot order[i] to slot i, for all i, along with
+		// everything that refers to the slots; those left out are dropped
+		void applyAgentOrder(const std::vector<uint32_t> &order);
+
+		// The same for the state of the collision avoidance, with the new
+		// slot of each old one (NONE for those dropped)
+		void remapCollisionAgents(const std::vector<int32_t> &moved, size_t count);
+
+		// Wakes up the sleepers that could move to the cell x/y, which was freed
+		void wakeSleepersAround(int x, int y);
+
+		// Adds the agents of wokenAgents that are awake to activeAgents,
+		// which stays sorted
+		void activateWokenAgents();
+
+		// Writes the last checkpoint in the background
+		std::thread checkpointWriter;
+		bool checkpointWritten = true;
 
 		////////////
 		/// Everything below here won't be relevant until Assignment 4
@@ -101,7 +801,37 @@ namespace Ped{
 		int ** blurred_heatmap;
 
 		void setupHeatmapSeq();
-		void updateHeatmapSeq();
+
+		// Adds the heatmap stages to the pipeline
+		void addHeatmapStages();
+
+		// The heatmap stages over the rows [begin, end) (of the scaled heatmap
+		// for blurHeatmapRows)
+		void fadeHeatmapRows(int begin, int end);
+		void clampHeatmapRows(int begin, int end);
+		void scaleHeatmapRows(int begin, int end);
+		void blurHeatmapRows(int begin, int end);
+	};
+
+	// The options of a model besides its scenario and implementation, to
+	// be filled once (e.g. from the command line) and applied to every
+	// model that should run the same way, see the setters of Model
+	struct ModelOptions {
+		int numThreads = 0;
+		int blocksPerThread = 0;
+		ThreadPinning pinning;
+		Arena::PageMode pageMode = Arena::SMALL_PAGES;
+		std::string tuningCache;
+		bool heatmap = false;
+		bool reorder = false;
+		bool collisions = false;
+		bool lod = false;
+		bool verifyLod = false;
+		bool flowFields = false;
+		size_t flowFieldBudget = Model::DEFAULT_FLOW_FIELD_BUDGET;
+		bool fastMath = false;
+		bool validateFastMath = false;
+		int compactionInterval = 16;
 	};
 }
 #endif
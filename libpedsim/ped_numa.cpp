@@ -0,0 +1,306 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the NUMA topology, thread pinning and page placement queries.
+//
+#include "ped_numa.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <fstream>
+#include <set>
+#include <tuple>
+#include <sstream>
+#include <cstdint>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+namespace {
+	// Parses a list like "0,2,4-7" as used by sysfs, returns false if invalid
+	bool parseList(const std::string &text, std::vector<int> &values) {
+		std::stringstream list(text);
+		std::string item;
+		while (std::getline(list, item, ',')) {
+			if (item.empty() || item == "\n") continue;
+			int first, last;
+			char dash;
+			std::stringstream range(item);
+			if (!(range >> first)) return false;
+			last = first;
+			if (range >> dash) {
+				if (dash != '-' || !(range >> last) || last < first) return false;
+			}
+			for (int v = first; v <= last; v++) {
+				values.push_back(v);
+			}
+		}
+		return true;
+	}
+
+	std::string readLine(const std::string &filename) {
+		std::ifstream file(filename.c_str());
+		std::string line;
+		std::getline(file, line);
+		return line;
+	}
+
+	int readInt(const std::string &filename, int fallback) {
+		std::string line = readLine(filename);
+		return line.empty() ? fallback : atoi(line.c_str());
+	}
+
+	std::string cpuPath(int cpu) {
+		return "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+	}
+
+	struct Topology {
+		std::vector<int> nodeOfCpu;
+		int numNodes = 1;
+
+		Topology() {
+			std::vector<int> nodes;
+			if (!parseList(readLine("/sys/devices/system/node/online"), nodes) || nodes.empty()) {
+				return;
+			}
+			numNodes = nodes.size();
+			for (int node : nodes) {
+				std::vector<int> cpus;
+				parseList(readLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"), cpus);
+				for (int cpu : cpus) {
+					if (cpu >= (int)nodeOfCpu.size()) nodeOfCpu.resize(cpu + 1, 0);
+					nodeOfCpu[cpu] = node;
+				}
+			}
+		}
+	};
+
+	const Topology& topology() {
+		static Topology instance;
+		return instance;
+	}
+
+	// The CPUs this process may run on
+	std::vector<int> allowedCpus() {
+		std::vector<int> cpus;
+#ifdef __linux__
+		cpu_set_t set;
+		if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+			}
+		}
+#endif
+		if (cpus.empty()) {
+			cpus.push_back(0);
+		}
+		return cpus;
+	}
+
+	// Where a CPU sits in the machine, used to sort the CPUs for pinning
+	struct CpuPlace {
+		int cpu;
+		int node;
+		int package;
+		int core;
+		int coreRank; // index of the core among the cores of the same node
+		int smt;      // index among the hardware threads of the same core
+	};
+
+	std::vector<CpuPlace> describeCpus(const std::vector<int> &cpus) {
+		std::vector<CpuPlace> places;
+		for (int cpu : cpus) {
+			CpuPlace p;
+			p.cpu = cpu;
+			p.node = Ped::Numa::getNodeOfCpu(cpu);
+			p.package = readInt(cpuPath(cpu) + "physical_package_id", 0);
+			p.core = readInt(cpuPath(cpu) + "core_id", cpu);
+			std::vector<int> siblings;
+			parseList(readLine(cpuPath(cpu) + "thread_siblings_list"), siblings);
+			p.smt = std::find(siblings.begin(), siblings.end(), cpu) - siblings.begin();
+			if (p.smt >= (int)siblings.size()) p.smt = 0;
+			places.push_back(p);
+		}
+		for (CpuPlace &p : places) {
+			std::set<std::pair<int, int> > cores;
+			for (const CpuPlace &other : places) {
+				if (other.node == p.node && std::make_pair(other.package, other.core) < std::make_pair(p.package, p.core)) {
+					cores.insert(std::make_pair(other.package, other.core));
+				}
+			}
+			p.coreRank = cores.size();
+		}
+		return places;
+	}
+
+#ifdef __linux__
+	// Asks the kernel for the node of each page (move_pages without target nodes)
+	bool countPages(std::vector<void*> &pages, std::vector<size_t> &pagesPerNode, size_t &untouched) {
+		pagesPerNode.assign(Ped::Numa::getNumNodes(), 0);
+		untouched = 0;
+		const size_t CHUNK = 4096;
+		std::vector<int> status(CHUNK);
+		for (size_t first = 0; first < pages.size(); first += CHUNK) {
+			size_t count = std::min(CHUNK, pages.size() - first);
+			if (syscall(__NR_move_pages, 0, count, &pages[first], NULL, &status[0], 0) != 0) {
+				return false;
+			}
+			for (size_t i = 0; i < count; i++) {
+				if (status[i] >= 0) {
+					if (status[i] >= (int)pagesPerNode.size()) pagesPerNode.resize(status[i] + 1, 0);
+					pagesPerNode[status[i]]++;
+				}
+				else {
+					untouched++;
+				}
+			}
+		}
+		return true;
+	}
+#endif
+}
+
+int Ped::Numa::getNumNodes()
+{
+	return topology().numNodes;
+}
+
+int Ped::Numa::getNodeOfCpu(int cpu)
+{
+	const std::vector<int> &nodes = topology().nodeOfCpu;
+	return cpu >= 0 && cpu < (int)nodes.size() ? nodes[cpu] : 0;
+}
+
+bool Ped::Numa::getPagesPerNode(const void *address, size_t bytes, std::vector<size_t> &pagesPerNode, size_t &untouched)
+{
+#ifdef __linux__
+	uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+	uintptr_t begin = (uintptr_t)address & ~(pageSize - 1);
+	uintptr_t end = (uintptr_t)address + bytes;
+	std::vector<void*> pages;
+	for (uintptr_t page = begin; page < end; page += pageSize) {
+		pages.push_back((void*)page);
+	}
+	return countPages(pages, pagesPerNode, untouched);
+#else
+	return false;
+#endif
+}
+
+bool Ped::Numa::getPagesPerNode(const std::vector<const void*> &addresses, std::vector<size_t> &pagesPerNode, size_t &untouched)
+{
+#ifdef __linux__
+	uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+	std::set<uintptr_t> unique;
+	for (const void *address : addresses) {
+		unique.insert((uintptr_t)address & ~(pageSize - 1));
+	}
+	std::vector<void*> pages;
+	for (uintptr_t page : unique) {
+		pages.push_back((void*)page);
+	}
+	return countPages(pages, pagesPerNode, untouched);
+#else
+	return false;
+#endif
+}
+
+std::string Ped::Numa::describePages(const std::vector<size_t> &pagesPerNode, size_t untouched)
+{
+	size_t total = untouched;
+	for (size_t n : pagesPerNode) total += n;
+	if (total == 0) {
+		return "empty";
+	}
+	std::ostringstream text;
+	for (size_t node = 0; node < pagesPerNode.size(); node++) {
+		text << (node ? ", " : "") << "node " << node << ": " << 100 * pagesPerNode[node] / total << "%";
+	}
+	if (untouched) {
+		text << ", untouched: " << 100 * untouched / total << "%";
+	}
+	return text.str();
+}
+
+bool Ped::ThreadPinning::parse(const std::string &specification, ThreadPinning &pinning)
+{
+	pinning = ThreadPinning();
+	if (specification == "none") {
+		return true;
+	}
+
+	std::vector<int> allowed = allowedCpus();
+	if (specification == "compact" || specification == "scatter") {
+		std::vector<CpuPlace> places = describeCpus(allowed);
+		if (specification == "compact") {
+			pinning.policy = COMPACT;
+			std::sort(places.begin(), places.end(), [](const CpuPlace &a, const CpuPlace &b) {
+				return std::make_tuple(a.node, a.package, a.core, a.smt, a.cpu) < std::make_tuple(b.node, b.package, b.core, b.smt, b.cpu);
+			});
+		}
+		else {
+			pinning.policy = SCATTER;
+			std::sort(places.begin(), places.end(), [](const CpuPlace &a, const CpuPlace &b) {
+				return std::make_tuple(a.smt, a.coreRank, a.node, a.cpu) < std::make_tuple(b.smt, b.coreRank, b.node, b.cpu);
+			});
+		}
+		for (const CpuPlace &p : places) {
+			pinning.cpus.push_back(p.cpu);
+		}
+		return true;
+	}
+
+	pinning.policy = LIST;
+	if (!parseList(specification, pinning.cpus) || pinning.cpus.empty()) {
+		return false;
+	}
+	for (int cpu : pinning.cpus) {
+		if (std::find(allowed.begin(), allowed.end(), cpu) == allowed.end()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int Ped::ThreadPinning::getCpu(int thread) const
+{
+	return cpus.empty() ? -1 : cpus[thread % cpus.size()];
+}
+
+void Ped::ThreadPinning::pinCurrentThread(int thread) const
+{
+#ifdef __linux__
+	thread_local int pinnedCpu = -1;
+	int cpu = getCpu(thread);
+	if (cpu < 0 || cpu == pinnedCpu) {
+		return;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == 0) {
+		pinnedCpu = cpu;
+	}
+#endif
+}
+
+std::string Ped::ThreadPinning::describe(int threads) const
+{
+	std::ostringstream text;
+	for (int t = 0; t < threads; t++) {
+		int cpu = getCpu(t);
+		text << "  thread " << t << ": ";
+		if (cpu < 0) {
+			text << "not pinned\n";
+		}
+		else {
+			text << "cpu " << cpu << " (node " << Numa::getNodeOfCpu(cpu) << ")\n";
+		}
+	}
+	return text.str();
+}
@@ -0,0 +1,78 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// NUMA support: the topology of the machine, pinning of the worker
+// threads to cores, and where the pages of a buffer actually are.
+//
+// Linux only; on other systems there is a single node and pinning
+// does nothing.
+//
+
+#ifndef _ped_numa_h_
+#define _ped_numa_h_ 1
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace Ped {
+	namespace Numa {
+		// Number of NUMA nodes of the machine
+		int getNumNodes();
+
+		// NUMA node of a CPU
+		int getNodeOfCpu(int cpu);
+
+		// Counts the pages of a buffer per NUMA node. Pages that were never
+		// touched (and so have no node yet) are counted in untouched. Returns
+		// false if the kernel does not tell (no move_pages).
+		bool getPagesPerNode(const void *address, size_t bytes, std::vector<size_t> &pagesPerNode, size_t &untouched);
+
+		// The same for the pages of a set of objects, each page counted once
+		bool getPagesPerNode(const std::vector<const void*> &addresses, std::vector<size_t> &pagesPerNode, size_t &untouched);
+
+		// Formats the pages per node as "node 0: 50%, node 1: 50%"
+		std::string describePages(const std::vector<size_t> &pagesPerNode, size_t untouched);
+
+		// The range of items [begin, end) of block number block, when the
+		// total is split into numBlocks contiguous blocks of (almost) equal size
+		inline size_t blockBegin(size_t total, int block, int numBlocks) { return total * block / numBlocks; }
+		inline size_t blockEnd(size_t total, int block, int numBlocks) { return total * (block + 1) / numBlocks; }
+	}
+
+	// Where the worker threads run: not pinned at all, compact (thread i
+	// next to thread i + 1, filling a core and a socket before the next),
+	// scatter (consecutive threads on different sockets, one per core
+	// before using the SMT siblings), or an explicit list of CPUs.
+	class ThreadPinning {
+	public:
+		enum Policy { NONE, COMPACT, SCATTER, LIST };
+
+		ThreadPinning() {}
+
+		// Parses "none", "compact", "scatter" or a list of CPUs like
+		// "0,2,4-7". Returns false if the specification is invalid.
+		static bool parse(const std::string &specification, ThreadPinning &pinning);
+
+		bool isEnabled() const { return policy != NONE; }
+		Policy getPolicy() const { return policy; }
+
+		// CPU for the worker thread with the given index, -1 if not pinned
+		int getCpu(int thread) const;
+
+		// Pins the calling thread to the CPU of the given worker thread.
+		// Remembers the CPU per thread, so that repeated calls are cheap.
+		void pinCurrentThread(int thread) const;
+
+		// One line per thread: its CPU and NUMA node
+		std::string describe(int threads) const;
+
+	private:
+		Policy policy = NONE;
+
+		// The CPUs in the order the threads are placed on them
+		std::vector<int> cpus;
+	};
+}
+
+#endif
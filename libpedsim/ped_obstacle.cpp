@@ -0,0 +1,259 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the obstacles of the flow fields. An obstacle blocks the
+// cells whose centers it covers, found row by row with the even-odd
+// rule, and those its edges pass through, so that a wall thinner than a
+// cell still blocks. An agent moves to one of the 8 cells around it that
+// is not blocked; a diagonal move also needs both cells next to it free,
+// so that nobody slips through the corner where two obstacles touch.
+//
+// The distance of a cell to a waypoint is the length of the shortest
+// path from it into the waypoint, with moves that cost 5 along the axes
+// and 7 diagonally (a close integer approximation of 1 : sqrt(2)). It is
+// computed as a wavefront from the cells within the waypoint outwards:
+// with integer costs, a bucket per distance modulo the longest move
+// holds the front (Dial's algorithm), so every cell is settled once,
+// without a priority queue. The waypoints are independent and spread
+// over the workers, one waypoint per block.
+//
+// The distances to a waypoint only cover its window, which the model
+// sets to the cells around the agents that head for it and the other
+// waypoints of their routes. Fields over the whole scenario would cost
+// memory and time in the number of waypoints times its area, which
+// grows quadratically when a scenario is tiled.
+//
+// From a cell the agent takes the move along a shortest path; of those
+// that are equally short, the one closest to the straight line to the
+// waypoint, so that it walks straight where nothing is in the way.
+//
+#include "ped_flowfield.h"
+#include "ped_scheduler.h"
+#include "ped_trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+	const uint32_t UNREACHABLE = std::numeric_limits<uint32_t>::max();
+
+	struct Move {
+		int dx, dy;
+		uint32_t cost;
+		double length;
+	};
+	const Move MOVES[] = {
+		{ 1, 0, 5, 1 }, { -1, 0, 5, 1 }, { 0, 1, 5, 1 }, { 0, -1, 5, 1 },
+		{ 1, 1, 7, M_SQRT2 }, { 1, -1, 7, M_SQRT2 }, { -1, 1, 7, M_SQRT2 }, { -1, -1, 7, M_SQRT2 }
+	};
+
+	// More than the longest move, so that a move never lands in the bucket
+	// that is being processed
+	const uint32_t BUCKETS = 8;
+
+	// Edges are sampled at this fraction of a cell
+	const double EDGE_STEP = 0.25;
+
+	// The cells of a window of the fields, in coordinates relative to it
+	struct WindowView {
+		const uint8_t *blocked;  // of all cells, from the first one of the window on
+		int stride;              // the width of the fields
+		int width, height;
+
+		bool isFree(int cx, int cy) const {
+			return cx >= 0 && cx < width && cy >= 0 && cy < height && !blocked[(size_t)cy * stride + cx];
+		}
+
+		// Whether an agent can move from the cell by the move
+		bool canMove(int cx, int cy, const Move &move) const {
+			return isFree(cx + move.dx, cy + move.dy)
+				&& (move.dx == 0 || move.dy == 0 || (isFree(cx + move.dx, cy) && isFree(cx, cy + move.dy)));
+		}
+	};
+}
+
+void Ped::FlowFields::setObstacles(const std::vector<Tobstacle> &obstacles, const std::vector<Window> &windows, TaskScheduler &scheduler)
+{
+	PED_TRACE_SCOPE("flowfield.obstacles");
+	rasterize(obstacles, scheduler);
+	this->windows.resize(numWaypoints);
+	for (size_t w = 0; w < numWaypoints; w++) {
+		// Within the fields
+		Window &window = this->windows[w];
+		int firstX = std::max(windows[w].minX, minX), lastX = std::min(windows[w].minX + windows[w].width, minX + width) - 1;
+		int firstY = std::max(windows[w].minY, minY), lastY = std::min(windows[w].minY + windows[w].height, minY + height) - 1;
+		window.minX = firstX;
+		window.minY = firstY;
+		window.width = std::max(lastX - firstX + 1, 0);
+		window.height = std::max(lastY - firstY + 1, 0);
+	}
+	distances.resize(numWaypoints);
+	scheduler.parallelFor(0, numWaypoints, 1, [this](size_t begin, size_t end, int) {
+		for (size_t w = begin; w < end; w++) {
+			computeDistances(w);
+		}
+	});
+}
+
+void Ped::FlowFields::rasterize(const std::vector<Tobstacle> &obstacles, TaskScheduler &scheduler)
+{
+	blocked.assign((size_t)width * height, 0);
+
+	// The insides: the cells of a row between pairs of crossings of the
+	// edges with the row
+	scheduler.parallelFor(0, height, 0, [this, &obstacles](size_t begin, size_t end, int) {
+		std::vector<double> crossings;
+		for (size_t row = begin; row < end; row++) {
+			double y = minY + (double)row;
+			for (const Tobstacle &obstacle : obstacles) {
+				size_t n = obstacle.getCornerCount();
+				crossings.clear();
+				for (size_t i = 0; i < n && n >= 3; i++) {
+					double x0 = obstacle.getCornerX(i), y0 = obstacle.getCornerY(i);
+					double x1 = obstacle.getCornerX((i + 1) % n), y1 = obstacle.getCornerY((i + 1) % n);
+					// Half open, so that a corner on the row counts once
+					if ((y0 <= y) != (y1 <= y)) {
+						crossings.push_back(x0 + (y - y0) * (x1 - x0) / (y1 - y0));
+					}
+				}
+				std::sort(crossings.begin(), crossings.end());
+				for (size_t k = 0; k + 1 < crossings.size(); k += 2) {
+					double first = std::max(ceil(crossings[k]), (double)minX);
+					double last = std::min(floor(crossings[k + 1]), (double)(minX + width - 1));
+					for (int x = (int)first; x <= (int)last && first <= last; x++) {
+						blocked[row * width + (x - minX)] = 1;
+					}
+				}
+			}
+		}
+	});
+
+	// The edges, a closed loop but for a wall of two corners
+	for (const Tobstacle &obstacle : obstacles) {
+		size_t n = obstacle.getCornerCount();
+		size_t edges = n == 2 ? 1 : n;
+		for (size_t i = 0; i < edges; i++) {
+			double x0 = obstacle.getCornerX(i), y0 = obstacle.getCornerY(i);
+			double x1 = obstacle.getCornerX((i + 1) % n), y1 = obstacle.getCornerY((i + 1) % n);
+			size_t samples = (size_t)ceil(std::max(fabs(x1 - x0), fabs(y1 - y0)) / EDGE_STEP);
+			for (size_t s = 0; s <= samples; s++) {
+				double t = samples > 0 ? (double)s / samples : 0;
+				size_t cellX = (size_t)((int64_t)round(x0 + t * (x1 - x0)) - minX);
+				size_t cellY = (size_t)((int64_t)round(y0 + t * (y1 - y0)) - minY);
+				if (cellX < (size_t)width && cellY < (size_t)height) {
+					blocked[cellY * width + cellX] = 1;
+				}
+			}
+		}
+	}
+}
+
+void Ped::FlowFields::computeDistances(size_t w)
+{
+	PED_TRACE_SCOPE("flowfield.distances");
+	const Twaypoint &waypoint = waypoints[w];
+	const Window &window = windows[w];
+	WindowView view = { blocked.data() + (int64_t)(window.minY - minY) * width + (window.minX - minX), width, window.width, window.height };
+	std::vector<uint32_t> &distance = distances[w];
+	distance.assign((size_t)window.width * window.height, UNREACHABLE);
+
+	// The free cells within the waypoint, by the same test as the agents
+	std::vector<uint32_t> buckets[BUCKETS];
+	size_t queued = 0;
+	double r = std::max(waypoint.getr(), 0.0);
+	int firstX = (int)std::max(floor(waypoint.getx() - r) - window.minX, 0.0);
+	int lastX = (int)std::min(ceil(waypoint.getx() + r) - window.minX, (double)window.width - 1);
+	int firstY = (int)std::max(floor(waypoint.gety() - r) - window.minY, 0.0);
+	int lastY = (int)std::min(ceil(waypoint.gety() + r) - window.minY, (double)window.height - 1);
+	for (int cy = firstY; cy <= lastY; cy++) {
+		for (int cx = firstX; cx <= lastX; cx++) {
+			double diffX = waypoint.getx() - (cx + window.minX);
+			double diffY = waypoint.gety() - (cy + window.minY);
+			double len = sqrt(diffX * diffX + diffY * diffY);
+			if (len < waypoint.getr() && view.isFree(cx, cy)) {
+				size_t c = (size_t)cy * window.width + cx;
+				distance[c] = 0;
+				buckets[0].push_back((uint32_t)c);
+				queued++;
+			}
+		}
+	}
+
+	for (uint32_t d = 0; queued > 0; d++) {
+		std::vector<uint32_t> &bucket = buckets[d % BUCKETS];
+		for (size_t k = 0; k < bucket.size(); k++) {
+			uint32_t c = bucket[k];
+			if (distance[c] != d) {
+				// Reached on a shorter path since
+				continue;
+			}
+			int cx = (int)(c % window.width), cy = (int)(c / window.width);
+			for (const Move &move : MOVES) {
+				if (!view.canMove(cx, cy, move)) {
+					continue;
+				}
+				size_t next = (size_t)(cy + move.dy) * window.width + (cx + move.dx);
+				if (d + move.cost < distance[next]) {
+					distance[next] = d + move.cost;
+					buckets[(d + move.cost) % BUCKETS].push_back((uint32_t)next);
+					queued++;
+				}
+			}
+		}
+		queued -= bucket.size();
+		bucket.clear();
+	}
+}
+
+uint8_t Ped::FlowFields::followDistances(size_t w, int x, int y) const
+{
+	const Window &window = windows[w];
+	size_t cellX = (size_t)((int64_t)x - window.minX), cellY = (size_t)((int64_t)y - window.minY);
+	if (cellX >= (size_t)window.width || cellY >= (size_t)window.height) {
+		return EXACT;
+	}
+	WindowView view = { blocked.data() + (int64_t)(window.minY - minY) * width + (window.minX - minX), width, window.width, window.height };
+	const uint32_t *distance = distances[w].data();
+	uint32_t here = distance[cellY * window.width + cellX];
+	if (!view.isFree((int)cellX, (int)cellY) || here == UNREACHABLE) {
+		return EXACT;
+	}
+
+	const Twaypoint &waypoint = waypoints[w];
+	double diffX = waypoint.getx() - x;
+	double diffY = waypoint.gety() - y;
+	double len = sqrt(diffX * diffX + diffY * diffY);
+	if (here == 0) {
+		// Arrived; the step towards the center is only taken if it is free
+		int stepX = 0, stepY = 0;
+		if (len > 0) {
+			Move straight = { (int)round(x + diffX / len) - x, (int)round(y + diffY / len) - y, 0, 0 };
+			if (view.canMove((int)cellX, (int)cellY, straight)) {
+				stepX = straight.dx;
+				stepY = straight.dy;
+			}
+		}
+		return (uint8_t)((stepX + 1) * 3 + (stepY + 1)) | ARRIVED;
+	}
+
+	const Move *best = nullptr;
+	uint32_t bestDistance = UNREACHABLE;
+	double bestAlignment = 0;
+	for (const Move &move : MOVES) {
+		if (!view.canMove((int)cellX, (int)cellY, move)) {
+			continue;
+		}
+		uint32_t next = distance[(cellY + move.dy) * window.width + (cellX + move.dx)];
+		if (next == UNREACHABLE) {
+			continue;
+		}
+		double alignment = (move.dx * diffX + move.dy * diffY) / move.length;
+		if (next + move.cost < bestDistance || (next + move.cost == bestDistance && alignment > bestAlignment)) {
+			best = &move;
+			bestDistance = next + move.cost;
+			bestAlignment = alignment;
+		}
+	}
+	return (uint8_t)((best->dx + 1) * 3 + (best->dy + 1));
+}
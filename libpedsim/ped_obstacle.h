@@ -0,0 +1,43 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Tobstacle is an obstacle of a scenario, e.g. a wall or a pillar: a
+// polygon given by its corners in order. One with only two corners is a
+// wall from the one to the other. The agents walk around the cells the
+// obstacles cover (see FlowFields::setObstacles()).
+//
+
+#ifndef _ped_obstacle_h_
+#define _ped_obstacle_h_ 1
+
+#include <cstddef>
+#include <vector>
+
+namespace Ped {
+	class Tobstacle {
+	public:
+		Tobstacle() {}
+
+		// The rectangle from (x, y) to (x + width, y + height)
+		static Tobstacle rectangle(double x, double y, double width, double height) {
+			Tobstacle obstacle;
+			obstacle.addCorner(x, y);
+			obstacle.addCorner(x + width, y);
+			obstacle.addCorner(x + width, y + height);
+			obstacle.addCorner(x, y + height);
+			return obstacle;
+		}
+
+		void addCorner(double x, double y) { corners.push_back(x); corners.push_back(y); }
+
+		size_t getCornerCount() const { return corners.size() / 2; }
+		double getCornerX(size_t i) const { return corners[2 * i]; }
+		double getCornerY(size_t i) const { return corners[2 * i + 1]; }
+
+	private:
+		// x, y per corner
+		std::vector<double> corners;
+	};
+}
+
+#endif
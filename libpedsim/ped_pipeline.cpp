@@ -0,0 +1,314 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the tick pipeline: the graph of tasks, one per block of a
+// stage, and running it on the scheduler.
+//
+#include "ped_pipeline.h"
+#include "ped_numa.h"
+#include "ped_trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+int Ped::TickPipeline::findStage(const char *name) const
+{
+	for (size_t s = 0; s < stages.size(); s++) {
+		if (strcmp(stages[s].name, name) == 0) {
+			return (int)s;
+		}
+	}
+	return -1;
+}
+
+void Ped::TickPipeline::addStage(const Stage &stage)
+{
+	if (findStage(stage.name) >= 0) {
+		fprintf(stderr, "TickPipeline: stage %s added twice\n", stage.name);
+		exit(EXIT_FAILURE);
+	}
+	for (const Input &input : stage.inputs) {
+		if (findStage(input.stage) < 0) {
+			fprintf(stderr, "TickPipeline: input %s of stage %s does not exist\n", input.stage, stage.name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	stages.push_back(stage);
+	built = false;
+}
+
+void Ped::TickPipeline::addStage(const char *name, const SizeFunction &numItems, const BlockFunction &body, const std::vector<Input> &inputs)
+{
+	Stage stage;
+	stage.name = name;
+	stage.numItems = numItems;
+	stage.body = body;
+	stage.inputs = inputs;
+	stage.serial = false;
+	stage.onCaller = false;
+	addStage(stage);
+}
+
+void Ped::TickPipeline::addSerialStage(const char *name, const std::function<void(int worker)> &body, const std::vector<Input> &inputs, bool onCaller)
+{
+	Stage stage;
+	stage.name = name;
+	stage.serialBody = body;
+	stage.inputs = inputs;
+	stage.serial = true;
+	stage.onCaller = onCaller;
+	addStage(stage);
+}
+
+bool Ped::TickPipeline::removeStage(const char *name)
+{
+	int s = findStage(name);
+	if (s < 0) {
+		return false;
+	}
+	stages.erase(stages.begin() + s);
+	built = false;
+
+	// Then the stages that read it, which come later since inputs are
+	// added first
+	for (size_t d = s; d < stages.size();) {
+		bool reads = false;
+		for (const Input &input : stages[d].inputs) {
+			reads = reads || strcmp(input.stage, name) == 0;
+		}
+		if (reads) {
+			removeStage(stages[d].name);
+		}
+		else {
+			d++;
+		}
+	}
+	return true;
+}
+
+bool Ped::TickPipeline::hasStage(const char *name) const
+{
+	return findStage(name) >= 0;
+}
+
+std::vector<const char*> Ped::TickPipeline::getStageNames() const
+{
+	std::vector<const char*> names;
+	for (const Stage &stage : stages) {
+		names.push_back(stage.name);
+	}
+	return names;
+}
+
+void Ped::TickPipeline::setNumBlocks(int blocks)
+{
+	numBlocks = blocks;
+	built = false;
+}
+
+void Ped::TickPipeline::build(int blocks)
+{
+	numTasks = 0;
+	taskStage.clear();
+	for (size_t s = 0; s < stages.size(); s++) {
+		stages[s].firstTask = numTasks;
+		numTasks += blocksOf(stages[s], blocks);
+		taskStage.resize(numTasks, (int)s);
+	}
+
+	successors.assign(numTasks, std::vector<size_t>());
+	numInputs.assign(numTasks, 0);
+	for (const Stage &stage : stages) {
+		for (const Input &input : stage.inputs) {
+			const Stage &from = stages[findStage(input.stage)];
+			size_t fromBlocks = blocksOf(from, blocks);
+			for (size_t b = 0; b < blocksOf(stage, blocks); b++) {
+				// The blocks of the input that block b waits for
+				size_t first = 0, last = fromBlocks - 1;
+				if (!stage.serial && !from.serial && input.dependency != ALL_BLOCKS) {
+					first = b;
+					last = b;
+					if (input.dependency == NEIGHBOR_BLOCKS) {
+						first = b > 0 ? b - 1 : 0;
+						last = b + 1 < fromBlocks ? b + 1 : b;
+					}
+				}
+				for (size_t i = first; i <= last; i++) {
+					successors[from.firstTask + i].push_back(stage.firstTask + b);
+					numInputs[stage.firstTask + b]++;
+				}
+			}
+		}
+	}
+
+	// The task that ends a run waits for those that nothing else waits for,
+	// and thereby for all of them
+	successors.emplace_back();
+	numInputs.push_back(0);
+	roots.clear();
+	for (size_t t = 0; t < numTasks; t++) {
+		if (successors[t].empty()) {
+			successors[t].push_back(numTasks);
+			numInputs[numTasks]++;
+		}
+		if (numInputs[t] == 0) {
+			roots.push_back(t);
+		}
+	}
+
+	waiting.reset(new std::atomic<int>[numTasks + 1]);
+	builtBlocks = blocks;
+	built = true;
+}
+
+void Ped::TickPipeline::run(TaskScheduler &scheduler)
+{
+	run(scheduler, 1, std::function<bool()>());
+}
+
+int Ped::TickPipeline::run(TaskScheduler &scheduler, int runs, const std::function<bool()> &endRun_)
+{
+	int workers = scheduler.getNumWorkers();
+	int blocks = numBlocks > 0 ? numBlocks : 8 * workers;
+	if (!built || builtBlocks != blocks) {
+		build(blocks);
+	}
+	runsLeft = runs;
+	runsDone = 0;
+	endRun = &endRun_;
+	if (phaseListener) {
+		int done = runStages(scheduler, blocks);
+		endRun = nullptr;
+		return done;
+	}
+	startRun();
+
+	// The tasks without inputs start on the worker that owns their block
+	// in the static split, where the first touch put their data
+	std::vector<TaskScheduler::Task> ready;
+	for (size_t t : roots) {
+		ready.push_back(TaskScheduler::Task{ t, ownerOf(t, workers, blocks), !onCaller(t) });
+	}
+
+	scheduler.runTasks(ready, [&](size_t task, size_t, int worker) {
+		runTask(scheduler, task, worker, blocks);
+	});
+	endRun = nullptr;
+	return runsDone;
+}
+
+void Ped::TickPipeline::startRun()
+{
+	for (Stage &stage : stages) {
+		stage.items = stage.serial ? 1 : stage.numItems();
+	}
+	for (size_t t = 0; t <= numTasks; t++) {
+		waiting[t].store(numInputs[t], std::memory_order_relaxed);
+	}
+}
+
+int Ped::TickPipeline::ownerOf(size_t task, int workers, int blocks) const
+{
+	if (onCaller(task)) {
+		return 0;
+	}
+	size_t block = task - stages[taskStage[task]].firstTask;
+	return (int)(block * workers / blocks);
+}
+
+void Ped::TickPipeline::runTask(TaskScheduler &scheduler, size_t task, int worker, int blocks)
+{
+	while (true) {
+		if (task == numTasks) {
+			// Between two runs, on the calling thread: all tasks of the run
+			// are done, the next one starts from its roots right here
+			runsLeft--;
+			runsDone++;
+			bool next = (*endRun ? (*endRun)() : true) && runsLeft > 0;
+			if (!next) {
+				return;
+			}
+			startRun();
+			int workers = scheduler.getNumWorkers();
+			// Backwards, since a spawned task goes to the front of the deque
+			for (size_t k = roots.size() - 1; k > 0; k--) {
+				scheduler.spawn(TaskScheduler::Task{ roots[k], ownerOf(roots[k], workers, blocks), !onCaller(roots[k]) });
+			}
+			task = roots[0];
+			continue;
+		}
+
+		runBody(task, worker, blocks);
+
+		// One of the tasks that are ready now runs right here, which saves
+		// going through the scheduler; the others are spawned
+		bool continues = false;
+		size_t continueWith = 0;
+		for (size_t next : successors[task]) {
+			if (waiting[next].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				bool caller = onCaller(next);
+				if (!continues && (!caller || worker == 0)) {
+					continues = true;
+					continueWith = next;
+				}
+				else {
+					scheduler.spawn(TaskScheduler::Task{ next, caller ? 0 : worker, !caller });
+				}
+			}
+		}
+		if (!continues) {
+			return;
+		}
+		task = continueWith;
+	}
+}
+
+void Ped::TickPipeline::runBody(size_t task, int worker, int blocks)
+{
+	const Stage &stage = stages[taskStage[task]];
+	PED_TRACE_SCOPE(stage.name);
+	if (stage.serial) {
+		stage.serialBody(worker);
+	}
+	else {
+		size_t block = task - stage.firstTask;
+		size_t begin = Numa::blockBegin(stage.items, block, blocks);
+		size_t end = Numa::blockEnd(stage.items, block, blocks);
+		if (begin < end) {
+			stage.body(begin, end, worker);
+		}
+	}
+}
+
+int Ped::TickPipeline::runStages(TaskScheduler &scheduler, int blocks)
+{
+	// Inputs are added before the stages that read them, so running the
+	// stages in order, each to its end, keeps all dependencies
+	int workers = scheduler.getNumWorkers();
+	while (runsLeft > 0) {
+		startRun();
+		for (const Stage &stage : stages) {
+			phaseListener->phaseBegin(stage.name);
+			if (stage.onCaller) {
+				runBody(stage.firstTask, 0, blocks);
+			}
+			else {
+				std::vector<TaskScheduler::Task> ready;
+				for (size_t t = stage.firstTask; t < stage.firstTask + blocksOf(stage, blocks); t++) {
+					ready.push_back(TaskScheduler::Task{ t, ownerOf(t, workers, blocks), true });
+				}
+				scheduler.runTasks(ready, [&](size_t task, size_t, int worker) {
+					runBody(task, worker, blocks);
+				});
+			}
+			phaseListener->phaseEnd(stage.name);
+		}
+		runsLeft--;
+		runsDone++;
+		if (*endRun && !(*endRun)()) {
+			break;
+		}
+	}
+	return runsDone;
+}
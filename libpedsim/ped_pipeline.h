@@ -0,0 +1,166 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// TickPipeline describes a tick as a graph of stages, e.g. computing the
+// desired positions, moving the agents, the stages of the heatmap and
+// packing a frame for the export. A stage runs over a range of items
+// (agents, heatmap rows, ...) split into blocks, the same number of
+// blocks for every stage, and each block of a stage waits only for the
+// blocks of earlier stages it reads: the same block, its neighbors, or
+// all of them. The blocks run on the work stealing scheduler as soon as
+// their inputs are done, so that e.g. the heatmap of the first rows is
+// blurred while the last rows are still scaled, and the export packs the
+// agents that have moved while the heatmap is still being updated.
+//
+// Stages are added and removed by name, so that a simulation can add
+// its own (see ExportSimulation) without changing the model.
+//
+// Several runs can go on within one job of the scheduler: a last task
+// waits for all blocks of a run and starts the blocks of the next one,
+// so that the workers never leave the job between two ticks (no barrier
+// on the calling thread), see Model::tick(int). While that task runs on
+// the calling thread, the workers spin shortly and then sleep until it
+// spawns the next blocks; only a short one saves their wakeup.
+//
+// With a phase listener set, the stages run one after the other instead,
+// each as a whole between phaseBegin() and phaseEnd() of its name, so
+// that e.g. performance counters can be attributed to single stages.
+//
+
+#ifndef _ped_pipeline_h_
+#define _ped_pipeline_h_ 1
+
+#include "ped_scheduler.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace Ped {
+	class TickPipeline {
+	public:
+		// Which blocks of an input stage a block of a stage waits for
+		enum Dependency {
+			SAME_BLOCK,      // block b waits for block b
+			NEIGHBOR_BLOCKS, // blocks b - 1, b and b + 1, for stages that read a few items beyond their block
+			ALL_BLOCKS       // all blocks
+		};
+
+		struct Input {
+			const char *stage;
+			Dependency dependency;
+		};
+
+		// Gets notified before the first and after the last block of each
+		// stage, on the thread that calls run()
+		class PhaseListener {
+		public:
+			virtual ~PhaseListener() {}
+			virtual void phaseBegin(const char *phase) = 0;
+			virtual void phaseEnd(const char *phase) = 0;
+		};
+
+		// Runs the items [begin, end) of a stage on the given worker
+		typedef TaskScheduler::BlockFunction BlockFunction;
+
+		// Number of items of a stage, asked for at the start of every run
+		typedef std::function<size_t()> SizeFunction;
+
+		TickPipeline() {}
+
+		TickPipeline(const TickPipeline&) = delete;
+		TickPipeline& operator=(const TickPipeline&) = delete;
+
+		// Adds a stage that runs body over numItems() items in blocks, once
+		// the inputs (which must have been added before) are done. The name
+		// must be a string literal, it is used for tracing.
+		void addStage(const char *name, const SizeFunction &numItems, const BlockFunction &body,
+			const std::vector<Input> &inputs = std::vector<Input>());
+
+		// Adds a stage that runs as a single task; every stage it is an input
+		// of waits for it as a whole. With onCaller, it runs on the thread
+		// that calls run(), e.g. to start OpenMP parallel regions from there.
+		void addSerialStage(const char *name, const std::function<void(int worker)> &body,
+			const std::vector<Input> &inputs = std::vector<Input>(), bool onCaller = false);
+
+		// Removes a stage and, since they could no longer run, all stages
+		// that have it as an input. Returns false if there is no such stage.
+		bool removeStage(const char *name);
+
+		bool hasStage(const char *name) const;
+
+		// The names of the stages, in the order they were added
+		std::vector<const char*> getStageNames() const;
+
+		// Sets the listener of the stages (nullptr for none); while one is
+		// set, the stages no longer overlap
+		void setPhaseListener(PhaseListener *listener) { phaseListener = listener; }
+
+		// Number of blocks of every stage that is not serial (0: 8 per worker)
+		void setNumBlocks(int blocks);
+
+		// Runs all stages once and returns when they are done
+		void run(TaskScheduler &scheduler);
+
+		// Runs all stages up to runs times within one job of the scheduler.
+		// After every run, endRun() is called on the calling thread while the
+		// workers spin and then sleep until the next one starts; it must not
+		// use the scheduler, and returns false to stop there. Returns the
+		// number of runs.
+		int run(TaskScheduler &scheduler, int runs, const std::function<bool()> &endRun);
+
+	private:
+		struct Stage {
+			const char *name;
+			SizeFunction numItems;
+			BlockFunction body;
+			std::function<void(int)> serialBody;
+			std::vector<Input> inputs;
+			bool serial;
+			bool onCaller;
+
+			// Filled in by build() and run()
+			size_t firstTask;
+			size_t items;
+		};
+
+		std::vector<Stage> stages;
+		int numBlocks = 0;
+		PhaseListener *phaseListener = nullptr;
+
+		// The graph of tasks, one per block of a stage, rebuilt after the
+		// stages or the number of blocks change
+		bool built = false;
+		int builtBlocks = 0;
+		size_t numTasks = 0;
+		std::vector<int> taskStage;
+		std::vector<std::vector<size_t> > successors;
+		std::vector<int> numInputs;
+
+		// The tasks without inputs, which start a run, and the task numTasks
+		// that ends it, after the tasks without successors
+		std::vector<size_t> roots;
+
+		// Inputs each task still waits for in the current run
+		std::unique_ptr<std::atomic<int>[]> waiting;
+
+		// Of the current run(), only touched by the task that ends a run
+		int runsLeft = 0;
+		int runsDone = 0;
+		const std::function<bool()> *endRun = nullptr;
+
+		int findStage(const char *name) const;
+		void addStage(const Stage &stage);
+		size_t blocksOf(const Stage &stage, int blocks) const { return stage.serial ? 1 : blocks; }
+		void build(int blocks);
+		void startRun();
+		bool onCaller(size_t task) const { return task == numTasks || stages[taskStage[task]].onCaller; }
+		int ownerOf(size_t task, int workers, int blocks) const;
+		void runTask(TaskScheduler &scheduler, size_t task, int worker, int blocks);
+		void runBody(size_t task, int worker, int blocks);
+		int runStages(TaskScheduler &scheduler, int blocks);
+	};
+}
+
+#endif
@@ -0,0 +1,461 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the agents that come and go while the scenario runs: the
+// sources and sinks of the scenario, and spawnAgent() and removeAgent().
+// All of them take effect at the beginning of a tick, before any stage
+// runs, so that the implementations only ever see a population that
+// stays the same during a tick.
+//
+// A removed agent leaves a tombstone behind: its slot keeps an agent
+// without a route far off the grid, which no implementation has to know
+// about. Its id is NO_AGENT, and the implementations that keep agents on
+// a grid of their own (the collision avoidance) or in arrays that
+// interact (SOCIAL) drop it there. The arrays of VECTOR, HYBRID and PSTL
+// keep the slot, with a destination the agent never reaches. Spawned
+// agents reuse these slots first, and go to the end otherwise, which
+// grows the arrays by doubling. Every compactionInterval ticks the slots
+// that are still free are dropped, by the same copy that reorders the
+// agents (see ped_reorder.cpp), so that the kernels do not keep stepping
+// over them.
+//
+#include "ped_model.h"
+#include "ped_waypoint.h"
+#include "ped_trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+namespace {
+	// Where the tombstones are, off any grid and heatmap
+	const int PARKED = -(1 << 20);
+
+	// Cells a source tries before it waits for the next tick
+	const int PLACEMENT_ATTEMPTS = 8;
+
+	// The first capacity when agents are added to an empty scenario
+	const size_t MIN_CAPACITY = 64;
+
+	// A copy of the first count elements of array, in an array of capacity
+	template <typename T>
+	T* grow(Ped::Arena &arena, const T *array, size_t count, size_t capacity) {
+		T *grown = arena.allocateArray<T>(capacity, Ped::Arena::SIMD);
+		if (array && count > 0) {
+			memcpy(grown, array, count * sizeof(T));
+		}
+		return grown;
+	}
+}
+
+const size_t Ped::Model::NO_AGENT;
+
+bool Ped::Model::hasDynamicPopulation() const
+{
+	return !sources.empty() || !sinks.empty() || !freeSlots.empty() || getAgentIdCount() != agentIds.size();
+}
+
+size_t Ped::Model::spawnAgent(int x, int y, const std::vector<size_t> &route)
+{
+	std::lock_guard<std::mutex> lock(commandMutex);
+	size_t id = nextAgentId.fetch_add(1, std::memory_order_relaxed);
+	commands.push_back(PopulationCommand{ true, id, x, y, route });
+	commandsQueued.store(true, std::memory_order_release);
+	return id;
+}
+
+void Ped::Model::removeAgent(size_t id)
+{
+	std::lock_guard<std::mutex> lock(commandMutex);
+	commands.push_back(PopulationCommand{ false, id, 0, 0, {} });
+	commandsQueued.store(true, std::memory_order_release);
+}
+
+void Ped::Model::setupPopulation()
+{
+	nextAgentId.store(agents.size(), std::memory_order_relaxed);
+	sourceStates.clear();
+	sourceStates.resize(sources.size());
+	for (size_t s = 0; s < sources.size(); s++) {
+		SourceState &state = sourceStates[s];
+		state.random.seed(s + 1);
+		if (!resolveRoute(sources[s].getRoute(), state.route)) {
+			std::cerr << "Source " << s << " has a waypoint that does not exist, it emits no agents" << std::endl;
+			state.valid = false;
+		}
+		else if (implementation == VECTOR && state.route.empty()) {
+			std::cerr << "Source " << s << " has no route, which VECTOR needs, it emits no agents" << std::endl;
+			state.valid = false;
+		}
+	}
+}
+
+bool Ped::Model::resolveRoute(const std::vector<size_t> &indices, std::vector<Twaypoint*> &route) const
+{
+	route.clear();
+	for (size_t w : indices) {
+		if (w >= destinations.size()) {
+			return false;
+		}
+		route.push_back(destinations[w]);
+	}
+	return true;
+}
+
+Ped::Twaypoint** Ped::Model::shareRoute(const std::vector<Twaypoint*> &route)
+{
+	Twaypoint **&shared = sharedRoutes[route];
+	if (!shared) {
+		shared = arena.allocateArray<Twaypoint*>(route.size(), Arena::ROUTES, sizeof(Twaypoint*));
+		std::copy(route.begin(), route.end(), shared);
+	}
+	return shared;
+}
+
+bool Ped::Model::populationChanges() const
+{
+	return !sources.empty() || !sinks.empty() || !freeSlots.empty() || commandsQueued.load(std::memory_order_acquire);
+}
+
+void Ped::Model::updatePopulation()
+{
+	if (!populationChanges()) {
+		return;
+	}
+	PED_TRACE_SCOPE("population");
+	size_t oldSize = agents.size();
+
+	for (size_t slot : findAgentsInSinks()) {
+		removeFromSlot(slot);
+	}
+
+	// The commands in the order they were queued
+	std::vector<PopulationCommand> queued;
+	{
+		std::lock_guard<std::mutex> lock(commandMutex);
+		queued.swap(commands);
+		commandsQueued.store(false, std::memory_order_relaxed);
+	}
+	std::vector<size_t> slotOf;
+	std::vector<Twaypoint*> route;
+	for (const PopulationCommand &command : queued) {
+		if (slotOf.empty()) {
+			slotOf.assign(getAgentIdCount(), NO_AGENT);
+			for (size_t i = 0; i < agents.size(); i++) {
+				if (agentIds[i] != NO_AGENT) {
+					slotOf[agentIds[i]] = i;
+				}
+			}
+		}
+		if (command.spawn) {
+			// The slot spawnIntoSlot() takes
+			size_t slot = freeSlots.empty() ? agents.size() : freeSlots.back();
+			if (!resolveRoute(command.route, route) || !spawnIntoSlot(command.id, command.x, command.y, route)) {
+				rejectedSpawnCount++;
+				continue;
+			}
+			slotOf[command.id] = slot;
+		}
+		else if (command.id < slotOf.size() && slotOf[command.id] != NO_AGENT) {
+			removeFromSlot(slotOf[command.id]);
+			slotOf[command.id] = NO_AGENT;
+		}
+	}
+
+	// The sources, each with its own random placement
+	for (size_t s = 0; s < sources.size(); s++) {
+		const Tsource &source = sources[s];
+		SourceState &state = sourceStates[s];
+		if (!state.valid) {
+			continue;
+		}
+		state.credit += source.getRate();
+		std::uniform_real_distribution<double> uniform(0, 1);
+		while (state.credit >= 1 && (source.getLimit() == 0 || state.emitted < source.getLimit())) {
+			// A free cell of the area, with the collision avoidance
+			int x = 0, y = 0;
+			bool placed = false;
+			for (int attempt = 0; attempt < PLACEMENT_ATTEMPTS && !placed; attempt++) {
+				x = (int)(source.getx() + uniform(state.random) * source.getdx() - source.getdx() / 2);
+				y = (int)(source.gety() + uniform(state.random) * source.getdy() - source.getdy() / 2);
+				placed = !collisionsEnabled || (grid.contains(x, y) && grid.occupancy[grid.cell(x, y)] == 0);
+			}
+			if (!placed) {
+				// The area is crowded, the agents wait without piling up
+				state.credit = std::min(state.credit, std::max(1.0, source.getRate()));
+				break;
+			}
+			spawnIntoSlot(nextAgentId.fetch_add(1, std::memory_order_relaxed), x, y, state.route);
+			state.credit--;
+			state.emitted++;
+		}
+	}
+
+	if (agents.size() > oldSize) {
+		agentsAppended(oldSize);
+	}
+	if (collisionsEnabled) {
+		activateWokenAgents();
+		activeAgents.erase(std::remove_if(activeAgents.begin(), activeAgents.end(),
+			[this](uint32_t i) { return agentIds[i] == NO_AGENT; }), activeAgents.end());
+	}
+	socialEntryOf.clear();
+
+	if (!freeSlots.empty() && tickCount % compactionInterval == 0) {
+		compactAgents();
+	}
+}
+
+std::vector<size_t> Ped::Model::findAgentsInSinks()
+{
+	if (sinks.empty()) {
+		return std::vector<size_t>();
+	}
+	int workers = scheduler->getNumWorkers();
+	std::vector<std::vector<size_t> > found(workers);
+	size_t n = agents.size();
+	scheduler->runOnEachWorker([&](int worker) {
+		size_t end = Numa::blockEnd(n, worker, workers);
+		for (size_t i = Numa::blockBegin(n, worker, workers); i < end; i++) {
+			if (agentIds[i] == NO_AGENT) {
+				continue;
+			}
+			for (const Tsink &sink : sinks) {
+				double dx = agents[i]->getX() - sink.getx(), dy = agents[i]->getY() - sink.gety();
+				if (dx * dx + dy * dy < sink.getr() * sink.getr()) {
+					found[worker].push_back(i);
+					break;
+				}
+			}
+		}
+	});
+	std::vector<size_t> slots;
+	for (const std::vector<size_t> &f : found) {
+		slots.insert(slots.end(), f.begin(), f.end());
+	}
+	return slots;
+}
+
+void Ped::Model::removeFromSlot(size_t slot)
+{
+	Tagent *agent = agents[slot];
+	if (collisionsEnabled) {
+		// Off the grid, which frees its cell for the sleepers around it
+		int x = agent->getX(), y = agent->getY();
+		if (activity[slot].asleep) {
+			wake((uint32_t)slot);
+		}
+		grid.occupancy[grid.cell(x, y)]--;
+		grid.blockCounts[grid.block(x, y)].fetch_sub(1, std::memory_order_relaxed);
+		if (grid.occupancy[grid.cell(x, y)] == 0) {
+			wakeSleepersAround(x, y);
+		}
+		activity[slot] = AgentActivity();
+	}
+	if (social.agent) {
+		// The last entry takes the place of the removed one
+		if (socialEntryOf.empty()) {
+			socialEntryOf.assign(agents.size(), UINT32_MAX);
+			for (size_t k = 0; k < numSocialAgents; k++) {
+				socialEntryOf[social.agent[k]] = (uint32_t)k;
+			}
+		}
+		SocialArrays &s = social;
+		size_t k = socialEntryOf[slot], last = --numSocialAgents;
+		s.x[k] = s.x[last];
+		s.y[k] = s.y[last];
+		s.vx[k] = s.vx[last];
+		s.vy[k] = s.vy[last];
+		s.destX[k] = s.destX[last];
+		s.destY[k] = s.destY[last];
+		s.destR[k] = s.destR[last];
+		s.agent[k] = s.agent[last];
+		socialEntryOf[s.agent[k]] = (uint32_t)k;
+		socialEntryOf[slot] = UINT32_MAX;
+	}
+
+	new (agent) Tagent(PARKED, PARKED);
+	agentIds[slot] = NO_AGENT;
+	if (xPos && slot < numAgents - numAgents % 4) {
+		copyAgentToVectorArrays(slot);
+	}
+	if (agentArrays.x) {
+		copyAgentsToArrays(slot, slot + 1);
+	}
+	freeSlots.push_back(slot);
+	removalCount++;
+}
+
+bool Ped::Model::spawnIntoSlot(size_t id, int x, int y, const std::vector<Twaypoint*> &route)
+{
+	if (collisionsEnabled && (!grid.contains(x, y) || grid.occupancy[grid.cell(x, y)] != 0)) {
+		return false;
+	}
+	if (implementation == VECTOR && route.empty()) {
+		return false;
+	}
+
+	size_t slot;
+	bool reused = !freeSlots.empty();
+	if (reused) {
+		slot = freeSlots.back();
+		freeSlots.pop_back();
+	}
+	else {
+		if (agents.size() == agentCapacity) {
+			reserveAgents(std::max(2 * agentCapacity, MIN_CAPACITY));
+		}
+		slot = agents.size();
+		agents.push_back(&agentStorage[slot]);
+		agentIds.push_back(NO_AGENT);
+	}
+
+	Tagent *agent = new (agents[slot]) Tagent(x, y);
+	for (Twaypoint *waypoint : route) {
+		agent->addWaypoint(waypoint);
+	}
+	agent->shareRoute(shareRoute(route));
+	agentIds[slot] = id;
+
+	// Appended agents go into the arrays with agentsAppended()
+	if (reused && xPos && slot < numAgents - numAgents % 4) {
+		copyAgentToVectorArrays(slot);
+	}
+	if (reused && agentArrays.x) {
+		copyAgentsToArrays(slot, slot + 1);
+	}
+	if (social.agent) {
+		addSocialAgent(slot);
+		if (!socialEntryOf.empty()) {
+			socialEntryOf.resize(agents.size(), UINT32_MAX);
+			socialEntryOf[slot] = (uint32_t)(numSocialAgents - 1);
+		}
+	}
+	if (collisionsEnabled) {
+		grid.occupancy[grid.cell(x, y)]++;
+		grid.blockCounts[grid.block(x, y)].fetch_add(1, std::memory_order_relaxed);
+		if (activity.size() <= slot) {
+			activity.resize(slot + 1);
+		}
+		activity[slot] = AgentActivity();
+		activity[slot].routeCursor = agent->getRouteCursor();
+		wokenAgents.push_back((uint32_t)slot);
+	}
+	spawnCount++;
+	return true;
+}
+
+void Ped::Model::reserveAgents(size_t capacity)
+{
+	// The agents, copied as in moveIntoArena()
+	Tagent *storage = arena.allocateArray<Tagent>(capacity, Arena::AGENTS);
+	size_t n = agents.size();
+	int workers = scheduler->getNumWorkers();
+	scheduler->runOnEachWorker([&](int worker) {
+		size_t end = Numa::blockEnd(n, worker, workers);
+		for (size_t i = Numa::blockBegin(n, worker, workers); i < end; i++) {
+			agents[i] = new (&storage[i]) Tagent(*agents[i]);
+		}
+	});
+	agentStorage = storage;
+	spareAgentStorage = nullptr;
+	agents.reserve(capacity);
+	agentIds.reserve(capacity);
+
+	// The old arrays stay in the arena, which only frees them all at once
+	if (implementation == VECTOR) {
+		xPos = grow(arena, xPos, numAgents, capacity);
+		yPos = grow(arena, yPos, numAgents, capacity);
+		xDestPos = grow(arena, xDestPos, numAgents, capacity);
+		yDestPos = grow(arena, yDestPos, numAgents, capacity);
+		destR = grow(arena, destR, numAgents, capacity);
+	}
+	if (implementation == HYBRID || implementation == PSTL) {
+		size_t padded = (capacity + HYBRID_CHUNK - 1) / HYBRID_CHUNK * HYBRID_CHUNK;
+		double **arrays[] = { &agentArrays.x, &agentArrays.y, &agentArrays.desiredX, &agentArrays.desiredY,
+			&agentArrays.destX, &agentArrays.destY, &agentArrays.destR };
+		for (double **array : arrays) {
+			*array = grow(arena, *array, numChunks * HYBRID_CHUNK, padded);
+		}
+	}
+	if (implementation == SOCIAL) {
+		SocialArrays &s = social;
+		s.x = grow(arena, s.x, numSocialAgents, capacity);
+		s.y = grow(arena, s.y, numSocialAgents, capacity);
+		s.vx = grow(arena, s.vx, numSocialAgents, capacity);
+		s.vy = grow(arena, s.vy, numSocialAgents, capacity);
+		s.destX = grow(arena, s.destX, numSocialAgents, capacity);
+		s.destY = grow(arena, s.destY, numSocialAgents, capacity);
+		s.destR = grow(arena, s.destR, numSocialAgents, capacity);
+		s.agent = grow(arena, s.agent, numSocialAgents, capacity);
+		// Those only used during a tick need no copy
+		SocialArrays &spare = spareSocial;
+		float **floats[] = { &spare.x, &spare.y, &spare.vx, &spare.vy, &spare.destX, &spare.destY, &spare.destR,
+			&socialNextX, &socialNextY };
+		for (float **array : floats) {
+			*array = arena.allocateArray<float>(capacity, Arena::SIMD);
+		}
+		spare.agent = arena.allocateArray<uint32_t>(capacity, Arena::SIMD);
+		cells.of.resize(capacity);
+		cells.to.resize(capacity);
+	}
+	agentCapacity = capacity;
+}
+
+void Ped::Model::agentsAppended(size_t oldSize)
+{
+	size_t n = agents.size();
+	if (xPos) {
+		// The agents that the kernel updates from now on, including those
+		// of the old last numAgents % 4
+		size_t oldBody = numAgents - numAgents % 4;
+		numAgents = n;
+		for (size_t i = oldBody; i < numAgents - numAgents % 4; i++) {
+			copyAgentToVectorArrays(i);
+		}
+	}
+	if (agentArrays.x) {
+		// Up to the end of the last chunk, whose padding may be new too
+		numChunks = (n + HYBRID_CHUNK - 1) / HYBRID_CHUNK;
+		copyAgentsToArrays(oldSize, numChunks * HYBRID_CHUNK);
+		if (implementation == PSTL) {
+			setupPstlBlocks();
+		}
+	}
+}
+
+void Ped::Model::copyAgentToVectorArrays(size_t i)
+{
+	Tagent *agent = agents[i];
+	xPos[i] = agent->getX();
+	yPos[i] = agent->getY();
+	if (agentIds[i] == NO_AGENT) {
+		// Walks away from the grid and never arrives
+		xDestPos[i] = PARKED;
+		yDestPos[i] = 4.0f * PARKED;
+		destR[i] = 0;
+		return;
+	}
+	if (!agent->getDestination()) {
+		agent->destInit();
+	}
+	xDestPos[i] = agent->getDestX();
+	yDestPos[i] = agent->getDestY();
+	destR[i] = agent->getRadius();
+}
+
+void Ped::Model::compactAgents()
+{
+	PED_TRACE_SCOPE("population.compact");
+	std::vector<uint32_t> order;
+	order.reserve(agents.size() - freeSlots.size());
+	for (size_t i = 0; i < agents.size(); i++) {
+		if (agentIds[i] != NO_AGENT) {
+			order.push_back((uint32_t)i);
+		}
+	}
+	applyAgentOrder(order);
+	freeSlots.clear();
+	compactionCount++;
+}
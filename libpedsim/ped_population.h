@@ -0,0 +1,55 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Tsource and Tsink change the population of a scenario while it runs
+// (see Model::setSources()): a source emits agents onto random cells of
+// its area at a rate, and a sink removes the agents that step into it.
+//
+
+#ifndef _ped_population_h_
+#define _ped_population_h_ 1
+
+#include <cstddef>
+#include <vector>
+
+namespace Ped {
+	class Tsource {
+	public:
+		// The area is dx x dy cells around (x, y), like that of <agent>.
+		// rate is in agents per tick, also below one (e.g. 0.25 is one agent
+		// every four ticks); limit is how many it emits in total, 0 for no
+		// limit. The route is given by the indices of its waypoints among
+		// the waypoints of the scenario.
+		Tsource(double x, double y, double dx, double dy, double rate, size_t limit, const std::vector<size_t> &route)
+			: x(x), y(y), dx(dx), dy(dy), rate(rate), limit(limit), route(route) {}
+
+		double getx() const { return x; }
+		double gety() const { return y; }
+		double getdx() const { return dx; }
+		double getdy() const { return dy; }
+		double getRate() const { return rate; }
+		size_t getLimit() const { return limit; }
+		const std::vector<size_t>& getRoute() const { return route; }
+
+	private:
+		double x, y, dx, dy;
+		double rate;
+		size_t limit;
+		std::vector<size_t> route;
+	};
+
+	class Tsink {
+	public:
+		// Removes the agents within r of (x, y), as close as they must come to a waypoint
+		Tsink(double x, double y, double r) : x(x), y(y), r(r) {}
+
+		double getx() const { return x; }
+		double gety() const { return y; }
+		double getr() const { return r; }
+
+	private:
+		double x, y, r;
+	};
+}
+
+#endif
@@ -0,0 +1,126 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the agent stages of PSTL with the C++17 parallel algorithms.
+// They are written like CUDA kernels: each stage runs a kernel per agent
+// over the agent arrays, with the index of the agent as the thread index,
+// and a kernel only touches the elements of its agent. The agents are
+// grouped into blocks like the thread blocks of CUDA, and with
+// std::execution::par_unseq the standard library spreads the blocks over
+// its threads (TBB for libstdc++), as many as setNumThreads() allows.
+// Where the standard library has no execution policies (libc++ on
+// macOS), the same algorithms run sequentially.
+//
+#include "ped_model.h"
+#include "ped_trace.h"
+
+#include <algorithm>
+#include <cmath>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<execution>)
+#include <execution>
+#endif
+#endif
+
+#ifdef __cpp_lib_execution
+#define PAR_UNSEQ std::execution::par_unseq,
+#if defined(__has_include) && __has_include(<tbb/global_control.h>)
+#include <tbb/global_control.h>
+#define PED_TBB_LIMIT 1
+#endif
+#else
+#define PAR_UNSEQ
+#endif
+
+namespace {
+	// Agents per block, like the threads of a CUDA thread block. The
+	// algorithms run over the blocks, which keeps their overhead per agent
+	// small where the library is built without optimization.
+	const size_t BLOCK_SIZE = 256;
+
+	// Copying the kernels leaves the upper halves of the AVX registers
+	// dirty, which slows down round() (see ped_scheduler.cpp)
+	inline void clearUpperAvx() {
+#ifdef __AVX__
+		_mm256_zeroupper();
+#endif
+	}
+
+	// Runs body with the parallel algorithms on at most threads threads
+	// (0: all of them)
+	template <typename Body>
+	void withThreads(int threads, const Body &body) {
+#ifdef PED_TBB_LIMIT
+		if (threads > 0) {
+			tbb::global_control limit(tbb::global_control::max_allowed_parallelism, threads);
+			body();
+			return;
+		}
+#endif
+		(void)threads;
+		body();
+	}
+}
+
+void Ped::Model::setupPstlBlocks()
+{
+	blockIndices.resize((agents.size() + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	for (size_t b = 0; b < blockIndices.size(); b++) {
+		blockIndices[b] = b;
+	}
+}
+
+void Ped::Model::computeDesiredPositionsPstl()
+{
+	PED_TRACE_SCOPE("tick.pstl");
+	AgentArrays a = agentArrays;
+	Ped::Tagent *const *agentData = agents.data();
+	size_t n = agents.size();
+
+	// The kernel of one agent, i is its global thread index
+	auto kernel = [this, a, agentData](size_t i) {
+		double diffX = a.destX[i] - a.x[i];
+		double diffY = a.destY[i] - a.y[i];
+		double len = std::sqrt(diffX * diffX + diffY * diffY);
+		if (len < a.destR[i]) {
+			// Arrived (or no destination): the agent switches to its next
+			// waypoint itself
+			agentData[i]->computeNextDesiredPosition();
+			copyAgentsToArrays(i, i + 1);
+		}
+		else {
+			a.desiredX[i] = std::round(a.x[i] + diffX / len);
+			a.desiredY[i] = std::round(a.y[i] + diffY / len);
+		}
+	};
+	withThreads(numThreads, [&]() {
+		std::for_each(PAR_UNSEQ blockIndices.begin(), blockIndices.end(), [kernel, n](size_t block) {
+			clearUpperAvx();
+			size_t end = std::min((block + 1) * BLOCK_SIZE, n);
+			for (size_t i = block * BLOCK_SIZE; i < end; i++) {
+				kernel(i);
+			}
+		});
+	});
+}
+
+void Ped::Model::moveAgentsPstl()
+{
+	AgentArrays a = agentArrays;
+	Ped::Tagent *const *agentData = agents.data();
+	size_t n = agents.size();
+	withThreads(numThreads, [&]() {
+		std::for_each(PAR_UNSEQ blockIndices.begin(), blockIndices.end(), [a, agentData, n](size_t block) {
+			size_t end = std::min((block + 1) * BLOCK_SIZE, n);
+			for (size_t i = block * BLOCK_SIZE; i < end; i++) {
+				agentData[i]->setDesiredPosition((int)a.desiredX[i], (int)a.desiredY[i]);
+				agentData[i]->moveToDesiredPosition();
+				a.x[i] = a.desiredX[i];
+				a.y[i] = a.desiredY[i];
+			}
+		});
+	});
+}
@@ -0,0 +1,273 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements reordering the agents along a Morton (Z-order) curve, so
+// that agents that are close in space are also close in memory: the
+// heatmap scatter then writes to a few rows at a time, and the agents a
+// block of a stage touches share cache lines and pages.
+//
+// The agents walk, so the order decays. Every few ticks the locality is
+// measured (the mean distance between agents that are next to each other
+// in memory), and once it is LOCALITY_DECAY times the one right after the
+// last sort, the agents are sorted again. The next measurement is
+// scheduled from how fast the locality decayed so far, so scenarios where
+// the agents mix quickly are checked (and sorted) more often than ones
+// where they walk in formation.
+//
+// The keys are sorted with a parallel LSD radix sort on the scheduler.
+// The agents are then copied in the new order into a second array, by the
+// workers that update them next, and the arrays of VECTOR, HYBRID and
+// PSTL are permuted along. agentIds keeps track of where each agent was
+// in the scenario, for the export and checkpoints. The same copy drops
+// the slots of removed agents when they are compacted (see
+// ped_population.cpp).
+//
+#include "ped_model.h"
+#include "ped_trace.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+namespace {
+	// Agents are sorted again once the locality is this many times worse
+	// than right after the last sort
+	const double LOCALITY_DECAY = 1.5;
+
+	// Bounds of the ticks between two measurements of the locality
+	const long MIN_CHECK_INTERVAL = 1;
+	const long MAX_CHECK_INTERVAL = 64;
+
+	// Bits of the key sorted per pass of the radix sort
+	const int RADIX_BITS = 8;
+	const size_t RADIX = (size_t)1 << RADIX_BITS;
+
+	// Spreads the bits of v to the even bits of the result
+	uint64_t spreadBits(uint32_t v) {
+		uint64_t x = v;
+		x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+		x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+		x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+		x = (x | (x << 2)) & 0x3333333333333333ull;
+		x = (x | (x << 1)) & 0x5555555555555555ull;
+		return x;
+	}
+
+	uint64_t mortonKey(uint32_t x, uint32_t y) {
+		return spreadBits(x) | (spreadBits(y) << 1);
+	}
+
+	// Sorts the keys and order along with them, stably, by the lowest
+	// keyBits bits. In each pass every worker counts the digits in its
+	// share of the keys, which gives each worker its own range of the
+	// output per digit, and then moves its share there in order.
+	void radixSort(Ped::TaskScheduler &scheduler, std::vector<uint64_t> &keys, std::vector<uint32_t> &order, int keyBits)
+	{
+		size_t n = keys.size();
+		int workers = scheduler.getNumWorkers();
+		std::vector<uint64_t> sortedKeys(n);
+		std::vector<uint32_t> sortedOrder(n);
+		std::vector<size_t> offsets(workers * RADIX);
+		for (int shift = 0; shift < keyBits; shift += RADIX_BITS) {
+			scheduler.runOnEachWorker([&](int worker) {
+				size_t *count = &offsets[worker * RADIX];
+				std::fill(count, count + RADIX, 0);
+				size_t end = Ped::Numa::blockEnd(n, worker, workers);
+				for (size_t i = Ped::Numa::blockBegin(n, worker, workers); i < end; i++) {
+					count[(keys[i] >> shift) & (RADIX - 1)]++;
+				}
+			});
+
+			// Where each worker's keys of each digit go: by digit, then by worker
+			size_t sum = 0;
+			for (size_t digit = 0; digit < RADIX; digit++) {
+				for (int w = 0; w < workers; w++) {
+					size_t count = offsets[w * RADIX + digit];
+					offsets[w * RADIX + digit] = sum;
+					sum += count;
+				}
+			}
+
+			scheduler.runOnEachWorker([&](int worker) {
+				size_t *offset = &offsets[worker * RADIX];
+				size_t end = Ped::Numa::blockEnd(n, worker, workers);
+				for (size_t i = Ped::Numa::blockBegin(n, worker, workers); i < end; i++) {
+					size_t to = offset[(keys[i] >> shift) & (RADIX - 1)]++;
+					sortedKeys[to] = keys[i];
+					sortedOrder[to] = order[i];
+				}
+			});
+			keys.swap(sortedKeys);
+			order.swap(sortedOrder);
+		}
+	}
+
+	// array[i] = array[order[i]] for all i, of the first n elements
+	template <typename T>
+	void permute(T *array, size_t n, const std::vector<uint32_t> &order) {
+		std::vector<T> original(array, array + n);
+		for (size_t i = 0; i < order.size(); i++) {
+			array[i] = original[order[i]];
+		}
+	}
+}
+
+double Ped::Model::measureLocality() const
+{
+	if (agents.size() < 2) {
+		return 0;
+	}
+	double sum = 0;
+	for (size_t i = 1; i < agents.size(); i++) {
+		sum += abs(agents[i]->getX() - agents[i - 1]->getX()) + abs(agents[i]->getY() - agents[i - 1]->getY());
+	}
+	return sum / (agents.size() - 1);
+}
+
+void Ped::Model::keepAgentsOrdered()
+{
+	if (reorderCount == 0) {
+		// The order of the scenario says nothing about where the agents are
+		reorderAgents();
+		return;
+	}
+	if (tickCount < nextLocalityCheck) {
+		return;
+	}
+
+	double locality = measureLocality();
+	double baseline = std::max(sortedLocality, 1.0);
+	if (locality >= LOCALITY_DECAY * baseline) {
+		reorderAgents();
+		return;
+	}
+
+	// Assuming the decay goes on at the same rate, half of the ticks until
+	// it reaches LOCALITY_DECAY
+	long ticksSinceSort = std::max(tickCount - lastReorderTick, 1L);
+	double decayPerTick = (locality / baseline - 1) / ticksSinceSort;
+	long interval = MAX_CHECK_INTERVAL;
+	if (decayPerTick > 0) {
+		interval = (long)std::min((double)MAX_CHECK_INTERVAL, (LOCALITY_DECAY - locality / baseline) / decayPerTick / 2);
+	}
+	nextLocalityCheck = tickCount + std::max(interval, MIN_CHECK_INTERVAL);
+}
+
+void Ped::Model::reorderAgents()
+{
+	PED_TRACE_SCOPE("reorder");
+	if (!freeSlots.empty()) {
+		// The slots of removed agents would be sorted along
+		compactAgents();
+	}
+	size_t n = agents.size();
+	if (n < 2) {
+		return;
+	}
+
+	// The last numAgents % 4 agents of VECTOR update themselves, unlike
+	// the others, so they stay where they are
+	size_t sorted = xPos ? numAgents - numAgents % 4 : n;
+	if (sorted < 2) {
+		return;
+	}
+
+	// The keys, relative to the bounding box of the agents
+	int minX = agents[0]->getX(), minY = agents[0]->getY(), maxX = minX, maxY = minY;
+	for (size_t i = 0; i < sorted; i++) {
+		minX = std::min(minX, agents[i]->getX());
+		maxX = std::max(maxX, agents[i]->getX());
+		minY = std::min(minY, agents[i]->getY());
+		maxY = std::max(maxY, agents[i]->getY());
+	}
+	uint32_t extent = (uint32_t)std::max(maxX - minX, maxY - minY);
+	int bits = 0;
+	while (bits < 32 && (extent >> bits) != 0) {
+		bits++;
+	}
+	std::vector<uint64_t> keys(sorted);
+	std::vector<uint32_t> order(sorted);
+	for (size_t i = 0; i < sorted; i++) {
+		keys[i] = mortonKey(agents[i]->getX() - minX, agents[i]->getY() - minY);
+		order[i] = (uint32_t)i;
+	}
+	radixSort(*scheduler, keys, order, 2 * bits);
+	for (size_t i = sorted; i < n; i++) {
+		order.push_back((uint32_t)i);
+	}
+
+	applyAgentOrder(order);
+
+	reorderCount++;
+	lastReorderTick = tickCount;
+	nextLocalityCheck = tickCount + MIN_CHECK_INTERVAL;
+	sortedLocality = measureLocality();
+}
+
+void Ped::Model::applyAgentOrder(const std::vector<uint32_t> &order)
+{
+	size_t n = agents.size(), m = order.size();
+
+	// The agents, copied in the same split as in moveIntoArena()
+	if (!spareAgentStorage) {
+		spareAgentStorage = arena.allocateArray<Tagent>(agentCapacity, Arena::AGENTS);
+	}
+	std::vector<Tagent*> sortedAgents(m);
+	std::vector<size_t> sortedIds(m);
+	int workers = scheduler->getNumWorkers();
+	scheduler->runOnEachWorker([&](int worker) {
+		size_t end = Numa::blockEnd(m, worker, workers);
+		for (size_t i = Numa::blockBegin(m, worker, workers); i < end; i++) {
+			sortedAgents[i] = new (&spareAgentStorage[i]) Tagent(*agents[order[i]]);
+			sortedIds[i] = agentIds[order[i]];
+		}
+	});
+	agents.swap(sortedAgents);
+	agentIds.swap(sortedIds);
+	std::swap(agentStorage, spareAgentStorage);
+
+	if (xPos) {
+		size_t simdAgents = numAgents - numAgents % 4;
+		float *arrays[] = { xPos, yPos, xDestPos, yDestPos, destR };
+		for (float *array : arrays) {
+			permute(array, numAgents, order);
+		}
+		// Agents of the last numAgents % 4, which updated themselves and
+		// whose arrays are stale, may now be updated by the kernel
+		numAgents = m;
+		for (size_t i = 0; i < numAgents - numAgents % 4; i++) {
+			if (order[i] >= simdAgents) {
+				copyAgentToVectorArrays(i);
+			}
+		}
+	}
+	if (agentArrays.x) {
+		// The arrays of HYBRID and PSTL only mirror the agents
+		numChunks = (m + HYBRID_CHUNK - 1) / HYBRID_CHUNK;
+		scheduler->runOnEachWorker([&](int worker) {
+			copyAgentsToArrays(HYBRID_CHUNK * Numa::blockBegin(numChunks, worker, workers),
+				HYBRID_CHUNK * Numa::blockEnd(numChunks, worker, workers));
+		});
+		if (implementation == PSTL) {
+			setupPstlBlocks();
+		}
+	}
+	if (social.agent) {
+		// The arrays of SOCIAL stay sorted by cell, only the agents they
+		// refer to moved
+		std::vector<uint32_t> moved(n);
+		for (size_t i = 0; i < m; i++) {
+			moved[order[i]] = (uint32_t)i;
+		}
+		for (size_t k = 0; k < numSocialAgents; k++) {
+			social.agent[k] = moved[social.agent[k]];
+		}
+	}
+	if (collisionsEnabled) {
+		std::vector<int32_t> moved(n, -1);
+		for (size_t i = 0; i < m; i++) {
+			moved[order[i]] = (int32_t)i;
+		}
+		remapCollisionAgents(moved, m);
+	}
+}
@@ -0,0 +1,325 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the work stealing scheduler.
+//
+#include "ped_scheduler.h"
+
+#include <chrono>
+#include <immintrin.h>
+
+namespace {
+	double now() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// How long an idle worker spins before it sleeps: long enough to catch
+	// the next parallelFor() of the same tick, or the next task of a job,
+	// without a wakeup
+	const double SPIN_SECONDS = 50e-6;
+
+	const size_t BLOCKS_PER_WORKER = 8;
+
+	// libpedsim is built with -march=native but without optimization, where
+	// GCC copies structs of 32 bytes and more (std::function, ...) with AVX
+	// registers and never clears their upper halves. Until they are cleared,
+	// SSE code such as round() of libm runs many times slower, so this is
+	// called before every block.
+	inline void clearUpperAvx() {
+#ifdef __AVX__
+		_mm256_zeroupper();
+#endif
+	}
+}
+
+Ped::TaskScheduler::TaskScheduler(int numWorkers, const ThreadPinning &pinning_) :
+	pinning(pinning_), stats(numWorkers < 1 ? 1 : numWorkers), remainingBlocks(0), finishedWorkers(0),
+	stealableBlocks(0), parkedWorkers(0), generation(0), stopping(false)
+{
+	for (int w = 0; w < (int)stats.size(); w++) {
+		workers.emplace_back(new Worker());
+		workers.back()->random = 2654435761u * (w + 1);
+	}
+	for (int w = 1; w < (int)workers.size(); w++) {
+		workers[w]->thread = std::thread(&TaskScheduler::workerLoop, this, w);
+	}
+}
+
+Ped::TaskScheduler::~TaskScheduler()
+{
+	{
+		std::lock_guard<std::mutex> guard(wakeLock);
+		stopping = true;
+		generation++;
+	}
+	wake.notify_all();
+	for (int w = 1; w < (int)workers.size(); w++) {
+		workers[w]->thread.join();
+	}
+}
+
+void Ped::TaskScheduler::workerLoop(int worker)
+{
+	pinning.pinCurrentThread(worker);
+	long seen = 0;
+	while (true) {
+		double spinUntil = now() + SPIN_SECONDS;
+		while (generation.load(std::memory_order_acquire) == seen && now() < spinUntil) {
+			std::this_thread::yield();
+		}
+		if (generation.load(std::memory_order_acquire) == seen) {
+			std::unique_lock<std::mutex> guard(wakeLock);
+			wake.wait(guard, [&]() { return generation.load() != seen; });
+		}
+		if (stopping) {
+			return;
+		}
+		seen = generation.load(std::memory_order_acquire);
+		runJob(worker);
+		finishedWorkers.fetch_add(1, std::memory_order_release);
+	}
+}
+
+void Ped::TaskScheduler::runJob(int worker)
+{
+	if (eachBody) {
+		double start = now();
+		clearUpperAvx();
+		(*eachBody)(worker);
+		stats[worker].busySeconds += now() - start;
+	}
+	else {
+		runBlocks(worker);
+	}
+}
+
+bool Ped::TaskScheduler::takeOwn(int worker, Block &block)
+{
+	Worker &w = *workers[worker];
+	std::lock_guard<std::mutex> guard(w.lock);
+	bool pinned = !w.pinnedBlocks.empty();
+	std::deque<Block> &own = pinned ? w.pinnedBlocks : w.blocks;
+	if (own.empty()) {
+		return false;
+	}
+	block = own.front();
+	own.pop_front();
+	(pinned ? w.numPinned : stealableBlocks).fetch_sub(1);
+	return true;
+}
+
+bool Ped::TaskScheduler::steal(int worker, Block &block)
+{
+	Worker &self = *workers[worker];
+	int others = (int)workers.size() - 1;
+	for (int attempt = 0; attempt < others; attempt++) {
+		self.random = self.random * 1103515245u + 12345u;
+		int victim = (worker + 1 + (self.random >> 16) % others) % workers.size();
+		Worker &v = *workers[victim];
+		std::lock_guard<std::mutex> guard(v.lock);
+		if (!v.blocks.empty()) {
+			// The far end: the owner works from the front
+			block = v.blocks.back();
+			v.blocks.pop_back();
+			stealableBlocks.fetch_sub(1);
+			stats[worker].steals++;
+			return true;
+		}
+	}
+	return false;
+}
+
+void Ped::TaskScheduler::runBlocks(int worker)
+{
+	double start = now(), busy = 0, idleSince = 0;
+	long blocks = 0;
+	while (remainingBlocks.load(std::memory_order_acquire) > 0) {
+		Block block;
+		if (takeOwn(worker, block) || steal(worker, block)) {
+			double blockStart = now();
+			clearUpperAvx();
+			(*body)(block.begin, block.end, worker);
+			busy += now() - blockStart;
+			blocks++;
+			idleSince = 0;
+			if (remainingBlocks.fetch_sub(1) == 1) {
+				unparkWorkers();
+			}
+		}
+		else if (idleSince == 0 || now() - idleSince < SPIN_SECONDS) {
+			// The last blocks are being run by others, or the tasks still
+			// to come wait for them
+			if (idleSince == 0) idleSince = now();
+			std::this_thread::yield();
+		}
+		else {
+			park(worker);
+			idleSince = 0;
+		}
+	}
+	WorkerStats &s = stats[worker];
+	s.blocks += blocks;
+	s.busySeconds += busy;
+	s.idleSeconds += now() - start - busy;
+}
+
+void Ped::TaskScheduler::pushFront(int worker, const Block &block, bool stealable)
+{
+	Worker &w = *workers[worker];
+	{
+		std::lock_guard<std::mutex> guard(w.lock);
+		(stealable ? w.blocks : w.pinnedBlocks).push_front(block);
+		(stealable ? stealableBlocks : w.numPinned).fetch_add(1);
+	}
+	unparkWorkers();
+}
+
+void Ped::TaskScheduler::park(int worker)
+{
+	// Only what this worker may run ends the wait: stealable blocks, its
+	// pinned ones, or the end of the job
+	std::unique_lock<std::mutex> guard(parkLock);
+	parkedWorkers++;
+	unpark.wait(guard, [&]() {
+		return remainingBlocks.load() == 0 || stealableBlocks.load() > 0 || workers[worker]->numPinned.load() > 0;
+	});
+	parkedWorkers--;
+}
+
+void Ped::TaskScheduler::unparkWorkers()
+{
+	// The counts are updated before parkedWorkers is read, and a worker
+	// counts itself as parked before it checks them, so one of the two
+	// sees the other
+	if (parkedWorkers.load() > 0) {
+		{
+			std::lock_guard<std::mutex> guard(parkLock);
+		}
+		unpark.notify_all();
+	}
+}
+
+void Ped::TaskScheduler::startJob()
+{
+	finishedWorkers.store(0, std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> guard(wakeLock);
+		generation++;
+	}
+	wake.notify_all();
+}
+
+void Ped::TaskScheduler::waitForWorkers(int worker)
+{
+	// The workers must be done with the job before it goes out of scope
+	double start = now();
+	while (finishedWorkers.load(std::memory_order_acquire) < (int)workers.size() - 1) {
+		std::this_thread::yield();
+	}
+	stats[worker].idleSeconds += now() - start;
+}
+
+void Ped::TaskScheduler::parallelFor(size_t begin, size_t end, size_t grain, const BlockFunction &blockBody)
+{
+	if (end <= begin) {
+		return;
+	}
+	size_t total = end - begin;
+	int numWorkers = (int)workers.size();
+	if (grain == 0) {
+		grain = total / (numWorkers * BLOCKS_PER_WORKER);
+		if (grain == 0) grain = 1;
+	}
+
+	// Each worker's share of the range, the same as the static split
+	size_t numBlocks = 0;
+	for (int w = 0; w < numWorkers; w++) {
+		size_t shareEnd = begin + Numa::blockEnd(total, w, numWorkers);
+		for (size_t b = begin + Numa::blockBegin(total, w, numWorkers); b < shareEnd; b += grain) {
+			workers[w]->blocks.push_back(Block{ b, b + grain < shareEnd ? b + grain : shareEnd });
+			numBlocks++;
+		}
+	}
+	stealableBlocks.fetch_add(numBlocks);
+
+	body = &blockBody;
+	remainingBlocks.store(numBlocks, std::memory_order_release);
+	if (numWorkers > 1) {
+		startJob();
+	}
+	runBlocks(0);
+	if (numWorkers > 1) {
+		waitForWorkers(0);
+	}
+	body = nullptr;
+}
+
+void Ped::TaskScheduler::runTasks(const std::vector<Task> &ready, const BlockFunction &taskBody)
+{
+	if (ready.empty()) {
+		return;
+	}
+	// In order, like the blocks of parallelFor(); the workers are idle
+	for (const Task &task : ready) {
+		Worker &w = *workers[task.worker];
+		(task.stealable ? w.blocks : w.pinnedBlocks).push_back(Block{ task.id, task.id + 1 });
+		(task.stealable ? stealableBlocks : w.numPinned).fetch_add(1);
+	}
+
+	body = &taskBody;
+	remainingBlocks.store(ready.size(), std::memory_order_release);
+	if (workers.size() > 1) {
+		startJob();
+	}
+	runBlocks(0);
+	if (workers.size() > 1) {
+		waitForWorkers(0);
+	}
+	body = nullptr;
+}
+
+void Ped::TaskScheduler::spawn(const Task &task)
+{
+	// Counted before the spawning task is done, so that the count cannot
+	// drop to zero in between
+	remainingBlocks.fetch_add(1, std::memory_order_acq_rel);
+	// To the front: the worker runs it next, while its inputs are in the cache
+	pushFront(task.worker, Block{ task.id, task.id + 1 }, task.stealable);
+}
+
+void Ped::TaskScheduler::runOnEachWorker(const std::function<void(int worker)> &each)
+{
+	eachBody = &each;
+	if (workers.size() > 1) {
+		startJob();
+	}
+	runJob(0);
+	if (workers.size() > 1) {
+		waitForWorkers(0);
+	}
+	eachBody = nullptr;
+}
+
+void Ped::TaskScheduler::resetStats()
+{
+	stats.assign(workers.size(), WorkerStats());
+}
+
+long Ped::TaskScheduler::getTotalSteals() const
+{
+	long steals = 0;
+	for (const WorkerStats &s : stats) {
+		steals += s.steals;
+	}
+	return steals;
+}
+
+double Ped::TaskScheduler::getIdleFraction() const
+{
+	double busy = 0, idle = 0;
+	for (const WorkerStats &s : stats) {
+		busy += s.busySeconds;
+		idle += s.idleSeconds;
+	}
+	return busy + idle > 0 ? idle / (busy + idle) : 0;
+}
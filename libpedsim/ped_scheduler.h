@@ -0,0 +1,148 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// TaskScheduler runs blocks of work on a fixed set of worker threads
+// with work stealing. A parallelFor() splits a range (of agents, rows,
+// ...) into blocks and gives each worker a contiguous share of them,
+// the same split as the static schedule, so that the data a worker
+// touches stays on its NUMA node. Each worker runs its own blocks in
+// order and, once it runs out, steals blocks from the far end of a
+// randomly chosen other worker. Ranges where some items cost much more
+// than others (dense regions, waypoint switches) are thereby balanced.
+//
+// runTasks() runs a graph of tasks instead (see TickPipeline): a task
+// that becomes ready is spawn()ed by the task it waited for, onto the
+// front of that worker's deque, so that it runs next while the data is
+// still in the cache, unless another worker steals it.
+//
+// The calling thread is worker 0; the other workers are threads that
+// live as long as the scheduler, spin shortly after each parallelFor()
+// and then sleep until the next one. Within a job, a worker that finds
+// nothing to run also spins shortly and then sleeps until a block it may
+// run is queued or the job ends, so that it leaves the CPU to e.g. the
+// OpenMP threads of a task pinned to the caller or the threads of the
+// parallel STL. parallelFor() and runTasks() must not be called from
+// within a block or task.
+//
+
+#ifndef _ped_scheduler_h_
+#define _ped_scheduler_h_ 1
+
+#include "ped_numa.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Ped {
+	class TaskScheduler {
+	public:
+		// Runs the items [begin, end) on the given worker
+		typedef std::function<void(size_t begin, size_t end, int worker)> BlockFunction;
+
+		// A task of runTasks(), to run on the given worker. Tasks that are
+		// not stealable only ever run there, e.g. ones that start OpenMP
+		// parallel regions and must run on the calling thread.
+		struct Task {
+			size_t id;
+			int worker;
+			bool stealable;
+		};
+
+		struct WorkerStats {
+			long blocks = 0;         // blocks run by the worker
+			long steals = 0;         // blocks it took from other workers
+			double busySeconds = 0;  // time spent running blocks
+			double idleSeconds = 0;  // time spent in a parallelFor() without a block to run
+		};
+
+		// Starts numWorkers - 1 threads, pinned to the CPUs of workers 1, 2, ...
+		TaskScheduler(int numWorkers, const ThreadPinning &pinning = ThreadPinning());
+		~TaskScheduler();
+
+		TaskScheduler(const TaskScheduler&) = delete;
+		TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+		int getNumWorkers() const { return (int)workers.size(); }
+
+		// Runs body on blocks of at most grain items covering [begin, end)
+		// and returns when all are done. A grain of 0 picks one that gives
+		// each worker about 8 blocks.
+		void parallelFor(size_t begin, size_t end, size_t grain, const BlockFunction &body);
+
+		// Runs tasks, body(id, id + 1, worker) each: the ready ones and those
+		// that running tasks spawn(). Returns when all of them have run.
+		void runTasks(const std::vector<Task> &ready, const BlockFunction &body);
+
+		// Adds a task to the current runTasks(), called from a running task
+		void spawn(const Task &task);
+
+		// Runs body once on every worker, without stealing, e.g. to first
+		// touch memory on the worker that uses it later
+		void runOnEachWorker(const std::function<void(int worker)> &body);
+
+		// Counters since the scheduler was created or reset
+		const std::vector<WorkerStats>& getStats() const { return stats; }
+		void resetStats();
+
+		// Totals over all workers
+		long getTotalSteals() const;
+		double getIdleFraction() const; // idle / (busy + idle)
+
+	private:
+		struct Block {
+			size_t begin;
+			size_t end;
+		};
+
+		struct Worker {
+			std::mutex lock;
+			std::deque<Block> blocks;
+			std::deque<Block> pinnedBlocks; // not stealable
+			unsigned int random; // state for picking victims
+			std::atomic<size_t> numPinned{0}; // in pinnedBlocks
+			std::thread thread;
+		};
+
+		ThreadPinning pinning;
+		std::vector<std::unique_ptr<Worker> > workers;
+		std::vector<WorkerStats> stats;
+
+		// The current job: either blocks of body, or eachBody on each worker
+		const BlockFunction *body = nullptr;
+		const std::function<void(int)> *eachBody = nullptr;
+		std::atomic<size_t> remainingBlocks; // queued or running
+		std::atomic<int> finishedWorkers;
+
+		// Stealable blocks that are queued, and the workers asleep in a job
+		// until there are some (or pinned ones of their own)
+		std::atomic<size_t> stealableBlocks;
+		std::atomic<int> parkedWorkers;
+		std::mutex parkLock;
+		std::condition_variable unpark;
+
+		// Incremented for every job, the workers wait for it to change
+		std::atomic<long> generation;
+		std::atomic<bool> stopping;
+		std::mutex wakeLock;
+		std::condition_variable wake;
+
+		void workerLoop(int worker);
+		void runJob(int worker);
+		void runBlocks(int worker);
+		bool takeOwn(int worker, Block &block);
+		bool steal(int worker, Block &block);
+		void pushFront(int worker, const Block &block, bool stealable);
+		void park(int worker);
+		void unparkWorkers();
+		void startJob();
+		void waitForWorkers(int worker);
+	};
+}
+
+#endif
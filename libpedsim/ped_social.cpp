@@ -0,0 +1,473 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements SOCIAL: the agents move continuously, by a social force
+// model, instead of one cell per tick. Each tick an agent accelerates
+// towards its preferred velocity (SPEED cells per tick towards its
+// destination, around the obstacles along the flow fields) and is pushed
+// away by the agents and blocked cells within RANGE. The repulsion
+// A * (1 - d / RANGE)^2 falls to zero at RANGE, unlike the exponential of
+// the original model, so that only the agents of the 3 x 3 cells of the
+// cell lists around an agent matter and no exp() is needed in the SIMD
+// kernel.
+//
+// The agents are float arrays, sorted by their cell at the beginning of
+// each tick (a stable counting sort, so the order barely changes from
+// tick to tick): the agents of three cells next to each other in a row
+// are contiguous, and the forces from them are summed up LANES at a time.
+// The rows of cells are spread over the OpenMP threads. The new positions
+// go to separate arrays, as the neighbors still read the old ones.
+//
+// The agents themselves only get the positions rounded to cells, which
+// the export and the heatmap read as with the other implementations.
+// They also keep their route: an agent that comes within the radius of
+// its destination moves on to the next one, as in getNextDestination().
+// An agent never ends up on a blocked cell: a move that would round to
+// one is cut back to the axis that is free, or cancelled.
+//
+#include "ped_model.h"
+#include "ped_trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <immintrin.h>
+#include <omp.h>
+
+// Without optimization the helpers would be calls that pass the lanes
+// through memory
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+namespace {
+	// The side of a cell of the cell lists, at least RANGE
+	const float CELL = 2.0f;
+
+	// The preferred speed, in cells per tick, the speed limit and the
+	// ticks it takes to adapt the velocity to the preferred one
+	const float SPEED = 1.0f;
+	const float MAX_SPEED = 1.0f;
+	const float RELAXATION = 2.0f;
+
+	// The strength and range of the repulsion between agents and from the
+	// blocked cells
+	const float STRENGTH = 2.0f;
+	const float RANGE = 1.5f;
+	const float WALL_STRENGTH = 1.0f;
+	const float WALL_RANGE = 1.0f;
+
+	// Cells around the scenario that the cell lists span in addition
+	const int MARGIN = 16;
+
+	// Rows of cells per chunk of the dynamic schedule
+	const int ROWS_PER_CHUNK = 4;
+
+	// The largest offset of the agents from their cells at the start, so
+	// that agents on the same cell or on a straight line are not pushed
+	// exactly along the line
+	const float JITTER = 0.1f;
+
+#if defined(__AVX512F__)
+	typedef __m512 Lanes;
+	const int LANES = 16;
+
+	ALWAYS_INLINE Lanes load(const float *p) { return _mm512_loadu_ps(p); }
+	ALWAYS_INLINE Lanes broadcast(float v) { return _mm512_set1_ps(v); }
+	ALWAYS_INLINE Lanes add(Lanes a, Lanes b) { return _mm512_add_ps(a, b); }
+	ALWAYS_INLINE Lanes sub(Lanes a, Lanes b) { return _mm512_sub_ps(a, b); }
+	ALWAYS_INLINE Lanes mul(Lanes a, Lanes b) { return _mm512_mul_ps(a, b); }
+	ALWAYS_INLINE Lanes divide(Lanes a, Lanes b) { return _mm512_div_ps(a, b); }
+	ALWAYS_INLINE Lanes root(Lanes a) { return _mm512_sqrt_ps(a); }
+
+	// v in the lanes where a < b, 0 in the others
+	ALWAYS_INLINE Lanes keepIfLess(Lanes a, Lanes b, Lanes v) { return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ), v); }
+	ALWAYS_INLINE float total(Lanes v) { return _mm512_reduce_add_ps(v); }
+
+	// The first count < LANES values at p, the others filler
+	ALWAYS_INLINE Lanes loadFirst(const float *p, int count, float filler) {
+		return _mm512_mask_loadu_ps(_mm512_set1_ps(filler), (__mmask16)((1u << count) - 1), p);
+	}
+#elif defined(__AVX__)
+	typedef __m256 Lanes;
+	const int LANES = 8;
+
+	ALWAYS_INLINE Lanes load(const float *p) { return _mm256_loadu_ps(p); }
+	ALWAYS_INLINE Lanes broadcast(float v) { return _mm256_set1_ps(v); }
+	ALWAYS_INLINE Lanes add(Lanes a, Lanes b) { return _mm256_add_ps(a, b); }
+	ALWAYS_INLINE Lanes sub(Lanes a, Lanes b) { return _mm256_sub_ps(a, b); }
+	ALWAYS_INLINE Lanes mul(Lanes a, Lanes b) { return _mm256_mul_ps(a, b); }
+	ALWAYS_INLINE Lanes divide(Lanes a, Lanes b) { return _mm256_div_ps(a, b); }
+	ALWAYS_INLINE Lanes root(Lanes a) { return _mm256_sqrt_ps(a); }
+	ALWAYS_INLINE Lanes keepIfLess(Lanes a, Lanes b, Lanes v) { return _mm256_and_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ), v); }
+	ALWAYS_INLINE float total(Lanes v) {
+		__m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+		sum = _mm_hadd_ps(sum, sum);
+		return _mm_cvtss_f32(_mm_hadd_ps(sum, sum));
+	}
+	ALWAYS_INLINE Lanes loadFirst(const float *p, int count, float filler) {
+		static const int32_t masks[16] = { -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0 };
+		__m256i mask = _mm256_loadu_si256((const __m256i*)&masks[8 - count]);
+		return _mm256_blendv_ps(_mm256_set1_ps(filler), _mm256_maskload_ps(p, mask), _mm256_castsi256_ps(mask));
+	}
+#elif defined(__SSE4_1__)
+	typedef __m128 Lanes;
+	const int LANES = 4;
+
+	ALWAYS_INLINE Lanes load(const float *p) { return _mm_loadu_ps(p); }
+	ALWAYS_INLINE Lanes broadcast(float v) { return _mm_set1_ps(v); }
+	ALWAYS_INLINE Lanes add(Lanes a, Lanes b) { return _mm_add_ps(a, b); }
+	ALWAYS_INLINE Lanes sub(Lanes a, Lanes b) { return _mm_sub_ps(a, b); }
+	ALWAYS_INLINE Lanes mul(Lanes a, Lanes b) { return _mm_mul_ps(a, b); }
+	ALWAYS_INLINE Lanes divide(Lanes a, Lanes b) { return _mm_div_ps(a, b); }
+	ALWAYS_INLINE Lanes root(Lanes a) { return _mm_sqrt_ps(a); }
+	ALWAYS_INLINE Lanes keepIfLess(Lanes a, Lanes b, Lanes v) { return _mm_and_ps(_mm_cmplt_ps(a, b), v); }
+	ALWAYS_INLINE float total(Lanes v) {
+		Lanes sum = _mm_hadd_ps(v, v);
+		return _mm_cvtss_f32(_mm_hadd_ps(sum, sum));
+	}
+#else
+	typedef float Lanes;
+	const int LANES = 1;
+
+	ALWAYS_INLINE Lanes load(const float *p) { return *p; }
+	ALWAYS_INLINE Lanes broadcast(float v) { return v; }
+	ALWAYS_INLINE Lanes add(Lanes a, Lanes b) { return a + b; }
+	ALWAYS_INLINE Lanes sub(Lanes a, Lanes b) { return a - b; }
+	ALWAYS_INLINE Lanes mul(Lanes a, Lanes b) { return a * b; }
+	ALWAYS_INLINE Lanes divide(Lanes a, Lanes b) { return a / b; }
+	ALWAYS_INLINE Lanes root(Lanes a) { return std::sqrt(a); }
+	ALWAYS_INLINE Lanes keepIfLess(Lanes a, Lanes b, Lanes v) { return a < b ? v : 0; }
+	ALWAYS_INLINE float total(Lanes v) { return v; }
+#endif
+
+#if !defined(__AVX__)
+	ALWAYS_INLINE Lanes loadFirst(const float *p, int count, float filler) {
+		alignas(64) float values[LANES];
+		for (int k = 0; k < LANES; k++) {
+			values[k] = k < count ? p[k] : filler;
+		}
+		return load(values);
+	}
+#endif
+
+	// Where the lanes beyond the agents are, too far away to push anyone
+	const float FAR_AWAY = 1e18f;
+
+	// See ped_hybrid.cpp
+	ALWAYS_INLINE void clearUpperAvx() {
+#ifdef __AVX__
+		_mm256_zeroupper();
+#endif
+	}
+
+	// The cell a position is rounded to, halves up
+	ALWAYS_INLINE int toCell(float v) { return (int)floorf(v + 0.5f); }
+
+	// The repulsion of strength at distance d (with d2 = d * d) within range,
+	// per unit of the offset (dx, dy)
+	ALWAYS_INLINE float repulsion(float d2, float strength, float range) {
+		if (d2 <= 0 || d2 >= range * range) {
+			return 0;
+		}
+		float d = std::sqrt(d2);
+		float t = 1 - d / range;
+		return strength * t * t / d;
+	}
+
+	// Adds the repulsion of the agents [begin, end) to (fx, fy), for an
+	// agent at (px, py). The agent itself, at distance 0, adds nothing. The
+	// agents of three cells rarely fill many lanes, the last batch is
+	// filled up with agents FAR_AWAY.
+	ALWAYS_INLINE void addRepulsion(const float *x, const float *y, size_t begin, size_t end, float px, float py, float &fx, float &fy) {
+		if (begin == end) {
+			return;
+		}
+		Lanes ownX = broadcast(px), ownY = broadcast(py);
+		Lanes zero = broadcast(0), one = broadcast(1), strength = broadcast(STRENGTH);
+		Lanes range2 = broadcast(RANGE * RANGE), inverseRange = broadcast(1 / RANGE);
+		Lanes sumX = zero, sumY = zero;
+		for (size_t j = begin; j < end; j += LANES) {
+			Lanes otherX, otherY;
+			if (j + LANES <= end) {
+				otherX = load(&x[j]);
+				otherY = load(&y[j]);
+			}
+			else {
+				otherX = loadFirst(&x[j], (int)(end - j), FAR_AWAY);
+				otherY = loadFirst(&y[j], (int)(end - j), FAR_AWAY);
+			}
+			Lanes dx = sub(ownX, otherX);
+			Lanes dy = sub(ownY, otherY);
+			Lanes d2 = add(mul(dx, dx), mul(dy, dy));
+			Lanes d = root(d2);
+			Lanes t = sub(one, mul(d, inverseRange));
+			// Not a number at distance 0, which the masks drop
+			Lanes w = divide(mul(strength, mul(t, t)), d);
+			w = keepIfLess(zero, d2, keepIfLess(d2, range2, w));
+			sumX = add(sumX, mul(w, dx));
+			sumY = add(sumY, mul(w, dy));
+		}
+		fx += total(sumX);
+		fy += total(sumY);
+		clearUpperAvx();
+	}
+
+	// An offset of up to JITTER that depends on i alone
+	ALWAYS_INLINE float jitter(uint32_t i) {
+		uint32_t hash = i * 2654435761u;
+		return ((hash >> 8) / 16777216.0f - 0.5f) * 2 * JITTER;
+	}
+}
+
+void Ped::Model::setupSocial()
+{
+	int minX, minY, width, height;
+	getScenarioBounds(MARGIN, minX, minY, width, height);
+	cells.minX = minX;
+	cells.minY = minY;
+	cells.width = (int)ceil(width / CELL);
+	cells.height = (int)ceil(height / CELL);
+	cells.start.assign((size_t)cells.width * cells.height + 1, 0);
+
+	size_t n = agentCapacity;
+	if (n == 0) {
+		return;
+	}
+	for (SocialArrays *arrays : { &social, &spareSocial }) {
+		float **floats[] = { &arrays->x, &arrays->y, &arrays->vx, &arrays->vy, &arrays->destX, &arrays->destY, &arrays->destR };
+		for (float **array : floats) {
+			*array = arena.allocateArray<float>(n, Arena::SIMD);
+		}
+		arrays->agent = arena.allocateArray<uint32_t>(n, Arena::SIMD);
+	}
+	socialNextX = arena.allocateArray<float>(n, Arena::SIMD);
+	socialNextY = arena.allocateArray<float>(n, Arena::SIMD);
+	cells.of.resize(n);
+	cells.to.resize(n);
+	copyAgentsToSocial();
+}
+
+void Ped::Model::copyAgentsToSocial()
+{
+	numSocialAgents = 0;
+	for (size_t i = 0; i < agents.size(); i++) {
+		if (agentIds[i] != NO_AGENT) {
+			addSocialAgent(i);
+		}
+	}
+}
+
+void Ped::Model::addSocialAgent(size_t i)
+{
+	SocialArrays &s = social;
+	size_t k = numSocialAgents++;
+	s.agent[k] = (uint32_t)i;
+	s.x[k] = agents[i]->getX() + jitter(2 * (uint32_t)agentIds[i]);
+	s.y[k] = agents[i]->getY() + jitter(2 * (uint32_t)agentIds[i] + 1);
+	s.vx[k] = s.vy[k] = 0;
+	copySocialDestination(k);
+}
+
+void Ped::Model::copySocialDestination(size_t k)
+{
+	SocialArrays &s = social;
+	const Twaypoint *destination = agents[s.agent[k]]->getDestination();
+	if (destination) {
+		s.destX[k] = destination->getx();
+		s.destY[k] = destination->gety();
+		s.destR[k] = destination->getr();
+	}
+	else {
+		// Counts as arrived, so that the agent looks for its next destination
+		s.destX[k] = s.destY[k] = 0;
+		s.destR[k] = INFINITY;
+	}
+}
+
+void Ped::Model::addSocialStages()
+{
+	pipeline.addSerialStage("desired", [this](int) {
+		binSocialAgents();
+		PED_TRACE_SCOPE("tick.social");
+		int threads = getNumThreads();
+		int rows = cells.height;
+		#pragma omp parallel num_threads(threads)
+		{
+			int thread = omp_get_thread_num();
+			pinning.pinCurrentThread(thread);
+			double start = omp_get_wtime();
+			#pragma omp for schedule(dynamic, ROWS_PER_CHUNK) nowait
+			for (int row = 0; row < rows; row++) {
+				computeSocialForces(row);
+			}
+			threadBusySeconds[thread] += omp_get_wtime() - start;
+		}
+		std::swap(social.x, socialNextX);
+		std::swap(social.y, socialNextY);
+	}, {}, true);
+
+	pipeline.addSerialStage("move", [this](int) {
+		int threads = getNumThreads();
+		long n = (long)numSocialAgents;
+		const SocialArrays &s = social;
+		Ped::Tagent *const *agentData = agents.data();
+		#pragma omp parallel for num_threads(threads) schedule(static)
+		for (long k = 0; k < n; k++) {
+			Ped::Tagent *agent = agentData[s.agent[k]];
+			int x = toCell(s.x[k]), y = toCell(s.y[k]);
+			agent->setDesiredPosition(x, y);
+			agent->moveToDesiredPosition();
+		}
+	}, { { "desired", TickPipeline::ALL_BLOCKS } }, true);
+}
+
+void Ped::Model::binSocialAgents()
+{
+	PED_TRACE_SCOPE("tick.social.bin");
+	long n = (long)numSocialAgents;
+	int threads = getNumThreads();
+	const SocialArrays &s = social;
+	uint32_t *of = cells.of.data();
+	#pragma omp parallel for num_threads(threads) schedule(static)
+	for (long k = 0; k < n; k++) {
+		// Agents outside of the cells go to the closest one, next to the
+		// cells of all agents within RANGE of them
+		int cx = std::min(std::max((int)floorf((s.x[k] - cells.minX) / CELL), 0), cells.width - 1);
+		int cy = std::min(std::max((int)floorf((s.y[k] - cells.minY) / CELL), 0), cells.height - 1);
+		of[k] = (uint32_t)cy * cells.width + cx;
+	}
+
+	// Where each agent goes, in order within its cell
+	std::vector<uint32_t> &start = cells.start;
+	std::fill(start.begin(), start.end(), 0);
+	for (long k = 0; k < n; k++) {
+		start[of[k] + 1]++;
+	}
+	for (size_t c = 1; c < start.size(); c++) {
+		start[c] += start[c - 1];
+	}
+	uint32_t *to = cells.to.data();
+	for (long k = 0; k < n; k++) {
+		to[k] = start[of[k]]++;
+	}
+	// Back to the first agent of each cell
+	for (size_t c = start.size() - 1; c > 0; c--) {
+		start[c] = start[c - 1];
+	}
+	start[0] = 0;
+
+	SocialArrays &d = spareSocial;
+	#pragma omp parallel for num_threads(threads) schedule(static)
+	for (long k = 0; k < n; k++) {
+		uint32_t t = to[k];
+		d.x[t] = s.x[k];
+		d.y[t] = s.y[k];
+		d.vx[t] = s.vx[k];
+		d.vy[t] = s.vy[k];
+		d.destX[t] = s.destX[k];
+		d.destY[t] = s.destY[k];
+		d.destR[t] = s.destR[k];
+		d.agent[t] = s.agent[k];
+	}
+	std::swap(social, spareSocial);
+}
+
+void Ped::Model::computeSocialForces(int row)
+{
+	SocialArrays &s = social;
+	const uint32_t *start = cells.start.data();
+	FlowFields *fields = flowFields && flowFields->hasObstacles() ? flowFields.get() : nullptr;
+	int firstRow = std::max(row - 1, 0), lastRow = std::min(row + 1, cells.height - 1);
+	for (int cx = 0; cx < cells.width; cx++) {
+		size_t cell = (size_t)row * cells.width + cx;
+		int firstColumn = std::max(cx - 1, 0), lastColumn = std::min(cx + 1, cells.width - 1);
+		for (size_t k = start[cell]; k < start[cell + 1]; k++) {
+			float px = s.x[k], py = s.y[k];
+
+			// Arrival, as in getNextDestination()
+			float diffX = s.destX[k] - px, diffY = s.destY[k] - py;
+			float distance = std::sqrt(diffX * diffX + diffY * diffY);
+			if (distance < s.destR[k]) {
+				Ped::Tagent *agent = agents[s.agent[k]];
+				size_t length = agent->getWaypoints().size();
+				if (length > 0) {
+					agent->setRouteCursor((agent->getRouteCursor() + 1) % (length + 1));
+				}
+				copySocialDestination(k);
+				diffX = s.destX[k] - px;
+				diffY = s.destY[k] - py;
+				distance = std::sqrt(diffX * diffX + diffY * diffY);
+			}
+
+			// The preferred direction: straight to the destination, or along
+			// the flow fields around the obstacles
+			float ex = 0, ey = 0;
+			if (std::isfinite(s.destR[k]) && distance > 0) {
+				ex = diffX / distance;
+				ey = diffY / distance;
+				if (fields) {
+					uint8_t step = fields->lookup(agents[s.agent[k]]->getDestination(), toCell(px), toCell(py));
+					int stepX = FlowFields::stepX(step), stepY = FlowFields::stepY(step);
+					if (step != FlowFields::EXACT && !(step & FlowFields::ARRIVED) && (stepX != 0 || stepY != 0)) {
+						float length = std::sqrt((float)(stepX * stepX + stepY * stepY));
+						ex = stepX / length;
+						ey = stepY / length;
+					}
+				}
+			}
+			float vx = s.vx[k], vy = s.vy[k];
+			float fx = (SPEED * ex - vx) / RELAXATION;
+			float fy = (SPEED * ey - vy) / RELAXATION;
+
+			// The agents of the 3 x 3 cells around, a row of three at a time
+			for (int r = firstRow; r <= lastRow; r++) {
+				size_t rowStart = (size_t)r * cells.width;
+				addRepulsion(s.x, s.y, start[rowStart + firstColumn], start[rowStart + lastColumn + 1], px, py, fx, fy);
+			}
+
+			// The blocked cells around, from their closest point
+			int cellX = toCell(px), cellY = toCell(py);
+			if (fields) {
+				for (int y = cellY - 1; y <= cellY + 1; y++) {
+					for (int x = cellX - 1; x <= cellX + 1; x++) {
+						if (!fields->isBlocked(x, y)) {
+							continue;
+						}
+						float dx = px - std::min(std::max(px, x - 0.5f), x + 0.5f);
+						float dy = py - std::min(std::max(py, y - 0.5f), y + 0.5f);
+						float w = repulsion(dx * dx + dy * dy, WALL_STRENGTH, WALL_RANGE);
+						fx += w * dx;
+						fy += w * dy;
+					}
+				}
+			}
+
+			vx += fx;
+			vy += fy;
+			float speed = std::sqrt(vx * vx + vy * vy);
+			if (speed > MAX_SPEED) {
+				vx *= MAX_SPEED / speed;
+				vy *= MAX_SPEED / speed;
+			}
+			float nx = px + vx, ny = py + vy;
+			if (fields && fields->isBlocked(toCell(nx), toCell(ny))) {
+				// Slide along the obstacle if one axis is free
+				if (!fields->isBlocked(toCell(nx), cellY)) {
+					ny = py;
+					vy = 0;
+				}
+				else if (!fields->isBlocked(cellX, toCell(ny))) {
+					nx = px;
+					vx = 0;
+				}
+				else {
+					nx = px;
+					ny = py;
+					vx = vy = 0;
+				}
+			}
+			s.vx[k] = vx;
+			s.vy[k] = vy;
+			socialNextX[k] = nx;
+			socialNextY[k] = ny;
+		}
+	}
+}
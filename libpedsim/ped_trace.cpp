@@ -0,0 +1,117 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Implements the per-thread trace buffers and the Chrome trace export.
+//
+#include "ped_trace.h"
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+
+namespace {
+	// Events per thread; older events are overwritten
+	const size_t RING_SIZE = 1 << 16;
+
+	struct Event {
+		const char *name;
+		uint64_t start;
+		uint64_t end;
+	};
+
+	// A ring buffer belongs to one thread at a time. Threads that exit hand
+	// their buffer back, so threads started over and over (e.g. the writer
+	// of the export on every tick) reuse a few buffers instead of allocating new ones, and show up as
+	// a few stable lanes in the trace.
+	struct Ring {
+		int lane;
+		bool inUse;
+		size_t next;
+		std::vector<Event> events;
+	};
+
+	std::mutex ringsMutex;
+	std::vector<std::unique_ptr<Ring> > rings;
+
+	// Pairs of counter and wall clock values, to convert counter ticks to time
+	const uint64_t counterOrigin = Ped::Trace::now();
+	const std::chrono::steady_clock::time_point clockOrigin = std::chrono::steady_clock::now();
+
+	Ring* acquireRing() {
+		std::lock_guard<std::mutex> lock(ringsMutex);
+		for (auto &ring : rings) {
+			if (!ring->inUse) {
+				ring->inUse = true;
+				return ring.get();
+			}
+		}
+		rings.emplace_back(new Ring { (int)rings.size(), true, 0, std::vector<Event>(RING_SIZE) });
+		return rings.back().get();
+	}
+
+	struct RingHolder {
+		Ring *ring = nullptr;
+		~RingHolder() {
+			if (ring) {
+				std::lock_guard<std::mutex> lock(ringsMutex);
+				ring->inUse = false;
+			}
+		}
+	};
+
+	thread_local RingHolder holder;
+}
+
+void Ped::Trace::record(const char *name, uint64_t start, uint64_t end)
+{
+	Ring *ring = holder.ring;
+	if (!ring) {
+		ring = holder.ring = acquireRing();
+	}
+	Event &e = ring->events[ring->next++ & (RING_SIZE - 1)];
+	e.name = name;
+	e.start = start;
+	e.end = end;
+}
+
+bool Ped::Trace::isCompiledIn()
+{
+#ifdef PED_TRACE
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool Ped::Trace::exportChromeTrace(const std::string &filename)
+{
+	std::ofstream file(filename.c_str());
+	if (!file) {
+		return false;
+	}
+
+	uint64_t counterNow = now();
+	double elapsedUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - clockOrigin).count();
+	double ticksPerUs = elapsedUs > 0 ? (counterNow - counterOrigin) / elapsedUs : 1;
+
+	std::lock_guard<std::mutex> lock(ringsMutex);
+	file << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+	bool first = true;
+	for (auto &ring : rings) {
+		file << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << ring->lane
+			<< ", \"args\": {\"name\": \"thread " << ring->lane << "\"}}";
+		first = false;
+
+		size_t count = ring->next < RING_SIZE ? ring->next : RING_SIZE;
+		for (size_t i = ring->next - count; i < ring->next; i++) {
+			const Event &e = ring->events[i & (RING_SIZE - 1)];
+			file << ",\n{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << ring->lane
+				<< ", \"ts\": " << (e.start - counterOrigin) / ticksPerUs
+				<< ", \"dur\": " << (e.end - e.start) / ticksPerUs << "}";
+		}
+	}
+	file << "\n]}\n";
+	return (bool)file;
+}
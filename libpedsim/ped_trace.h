@@ -0,0 +1,68 @@
+//
+// Created for Low Level Parallel Programming 2025
+//
+// Low overhead tracing of the hot paths. PED_TRACE_SCOPE("name") measures
+// the time until the end of the enclosing scope with the time stamp
+// counter and stores it in a ring buffer of the calling thread, so
+// recording needs neither locks nor system calls. All events can be
+// exported as Chrome trace JSON and inspected per thread in
+// chrome://tracing or https://ui.perfetto.dev.
+//
+// Tracing is compiled out unless PED_TRACE is defined (make TRACE=1),
+// so the scopes cost nothing in normal builds.
+//
+
+#ifndef _ped_trace_h_
+#define _ped_trace_h_ 1
+
+#include <string>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+namespace Ped {
+	namespace Trace {
+		// Current value of the time stamp counter
+		inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+			return __rdtsc();
+#else
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+		}
+
+		// Stores an event in the ring buffer of the calling thread. The name
+		// must be a string literal (only the pointer is stored).
+		void record(const char *name, uint64_t start, uint64_t end);
+
+		// Writes all recorded events as Chrome trace JSON
+		bool exportChromeTrace(const std::string &filename);
+
+		// Whether the library was built with tracing
+		bool isCompiledIn();
+	}
+
+	class TraceScope {
+	public:
+		TraceScope(const char *name_) : name(name_), start(Trace::now()) {}
+		~TraceScope() { Trace::record(name, start, Trace::now()); }
+	private:
+		const char *name;
+		uint64_t start;
+	};
+}
+
+#define PED_TRACE_CONCAT_(a, b) a##b
+#define PED_TRACE_CONCAT(a, b) PED_TRACE_CONCAT_(a, b)
+
+#ifdef PED_TRACE
+#define PED_TRACE_SCOPE(name) Ped::TraceScope PED_TRACE_CONCAT(traceScope, __LINE__)(name)
+#else
+#define PED_TRACE_SCOPE(name)
+#endif
+
+#endif